@@ -6,6 +6,8 @@
 
 #include "aoo_types.h"
 
+#include <math.h>
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -104,6 +106,84 @@ AOO_API void aoo_initialize(void);
 // terminate AoO library - call only once!
 AOO_API void aoo_terminate(void);
 
+/*//////////////////// memory ////////////////////////*/
+
+typedef void * (*aoo_allocfn)(
+        size_t,         // number of bytes
+        void *          // context
+);
+
+typedef void (*aoo_freefn)(
+        void *,         // pointer
+        size_t,         // number of bytes
+        void *          // context
+);
+
+typedef struct aoo_allocator
+{
+    aoo_allocfn alloc;
+    aoo_freefn free;
+    void *context;
+} aoo_allocator;
+
+// set a custom allocator for all library objects (NULL: default allocator).
+// must be called before aoo_initialize() and before creating any AoO objects!
+AOO_API int32_t aoo_set_allocator(const aoo_allocator *alloc);
+
+// allocate/free memory with the library allocator (e.g. for codec plugins)
+AOO_API void * aoo_allocate(size_t size);
+
+AOO_API void aoo_deallocate(void *ptr, size_t size);
+
+// real-time mode flags
+#define AOO_RT_MLOCK 0x01 // lock the memory pool into physical memory
+
+typedef struct aoo_rt_settings
+{
+    int32_t nchannels;  // max. number of channels per stream
+    int32_t blocksize;  // max. blocksize
+    int32_t samplerate; // max. samplerate
+    int32_t buffersize; // max. buffer size in ms (source, sink or resend buffer)
+    int32_t nstreams;   // max. number of streams (sources + sinks + sink sources)
+    int32_t flags;
+} aoo_rt_settings;
+
+// Enable real-time mode (NULL: disable).
+// ---
+// A memory pool is preallocated from the given maxima and all library
+// allocations are served from it, so that creating or reconfiguring
+// sources/sinks never calls into the system allocator.
+// If the pool is exhausted, we fall back to the regular allocator.
+// Must be called after aoo_set_allocator() and before creating any AoO objects!
+AOO_API int32_t aoo_set_rt_mode(const aoo_rt_settings *settings);
+
+// allocation debug hook
+typedef void (*aoo_allochook)(
+        size_t,         // number of bytes
+        int32_t,        // 0: allocate, 1: free
+        void *          // context
+);
+
+// Set a debug hook which is called for every allocation/deallocation
+// on a thread which is currently inside aoo_source_process() or
+// aoo_sink_process() (NULL: remove hook). Use this to verify that
+// the audio callback doesn't allocate memory.
+// NOTE: only allocations through the AoO allocator are reported, not
+// operator new or malloc(); aoo_loopback interposes the heap instead.
+AOO_API void aoo_set_alloc_hook(aoo_allochook fn, void *context);
+
+// pipeline tracing
+// ---
+// If the library is built with AOO_TRACE=1, the source and sink record
+// the time spent in each stage of the audio pipeline (process, encode,
+// send, receive, decode) into per-thread lock-free ring buffers.
+// Write the recorded events as Chrome trace JSON (for chrome://tracing
+// or Perfetto). Returns 0 if tracing is not enabled or on error.
+AOO_API int32_t aoo_trace_dump(const char *path);
+
+// discard all events recorded so far
+AOO_API void aoo_trace_clear(void);
+
 /*//////////////////// OSC ////////////////////////////*/
 
 #define AOO_MSG_SOURCE "/src"
@@ -126,6 +206,8 @@ AOO_API void aoo_terminate(void);
 #define AOO_MSG_COMPACT_DATA_LEN 2
 #define AOO_MSG_CODEC_CHANGE "/codecchange"
 #define AOO_MSG_CODEC_CHANGE_LEN 12
+#define AOO_MSG_SHM "/shm"
+#define AOO_MSG_SHM_LEN 4
 
 // id: the source or sink ID
 // returns: the offset to the remaining address pattern
@@ -358,9 +440,126 @@ typedef enum aoo_option
     // For sources, send an optional userformat blob along with the format messages
     // ---
     // Could be used for any purpose (channel layouts, labels, etc)
-    aoo_opt_userformat
+    aoo_opt_userformat,
+    // Sink output bus of a source (int32_t)
+    // ---
+    // The bus which a source is summed into when calling
+    // aoo_sink_process_buses(). Sources with the same bus
+    // form a group and are mixed together. The default is 0.
+    aoo_opt_bus,
+    // Sink gain of a source (float)
+    // ---
+    // Changes are smoothed over one process block.
+    // The default is 1.0.
+    aoo_opt_gain,
+    // Sink mixing matrix of a source (aoo_mix_matrix)
+    // ---
+    // Maps the source channels to the sink channels, relative
+    // to the channel onset. Source channels beyond 'ninputs'
+    // are ignored. Changes are smoothed over one process block.
+    // Pass a matrix with 0 inputs to go back to the default
+    // one-to-one mapping.
+    aoo_opt_mix_matrix,
+    // Source local transport (int32_t)
+    // ---
+    // If enabled, the source offers a shared memory ring to its sinks.
+    // Sinks on the same machine map the ring and receive the encoded
+    // blocks directly, bypassing the network; format, invite and
+    // ping messages still use the regular protocol.
+    // If the ring is full, blocks are sent over the network.
+    // NOTE: the sink reads the ring in aoo_sink_send(), so a host which
+    // receives from such a source must call it after every audio block.
+    // The default is 0 (off).
+    aoo_opt_local_transport,
+    // Stream statistics (aoo_stream_stats)
+    // ---
+    // This is a read-only option for sink::get_sourceoption()
+    // and source::get_sinkoption(), see aoo_stream_stats.
+    aoo_opt_stream_stats,
+    // Clock source (aoo_clock)
+    // ---
+    // The clock used for all internal time stamps which are not
+    // derived from the time tags passed to process(), i.e. the ping
+    // round trip times and the arrival jitter statistics.
+    // Together with a virtual time in process(), this makes it possible
+    // to run a session faster than real time and reproducibly, e.g.
+    // for offline rendering or tests. Pass a NULL function to go back
+    // to the system time (the default).
+    aoo_opt_clock,
+    // Capture file (const char *)
+    // ---
+    // Record all datagrams passed to handle_message(), together with
+    // their reception time (see aoo_opt_clock), to the given file.
+    // The datagrams are stored as they are, without decoding. Sinks also
+    // record the calls to process(), so a capture can be replayed exactly
+    // (e.g. to reproduce a glitch) or converted to pcapng, see
+    // tools/aoo_replay.cpp. The file is memory-mapped and only appended to.
+    // Pass NULL to stop recording. Currently POSIX only.
+    aoo_opt_capture
 } aoo_option;
 
+typedef struct aoo_mix_matrix
+{
+    int32_t ninputs;    // number of source channels
+    int32_t noutputs;   // number of sink channels
+    const float *gains; // noutputs * ninputs (gains[out * ninputs + in])
+} aoo_mix_matrix;
+
+// Clock function (see aoo_opt_clock); returns the current NTP time.
+// Can be called from any thread.
+typedef uint64_t (*aoo_clockfn)(void *user);
+
+typedef struct aoo_clock
+{
+    aoo_clockfn fn; // NULL: system time (see aoo_osctime_get)
+    void *user;
+} aoo_clock;
+
+// Histograms have logarithmic bins: bin 0 counts all values below
+// AOO_STATS_RESOLUTION, bin n counts values in the range
+// [AOO_STATS_RESOLUTION * 2^(n-1), AOO_STATS_RESOLUTION * 2^n),
+// the last bin also counts all larger values.
+#define AOO_STATS_NUMBINS 16
+#define AOO_STATS_RESOLUTION 0.0000625 // seconds
+
+// Stream statistics (see aoo_opt_stream_stats)
+// ---
+// The statistics are collected with lock-free counters and can be
+// queried from any non-realtime thread. Counters and histograms
+// accumulate over the lifetime of the stream; the min/max values
+// are reset after every query.
+typedef struct aoo_stream_stats
+{
+    // messages and bytes sent to resp. received from the peer;
+    // blocks sent through the local transport count as one packet.
+    uint64_t packets_in;
+    uint64_t bytes_in;
+    uint64_t packets_out;
+    uint64_t bytes_out;
+    // number of frames requested by the sink
+    uint64_t resend_requests;
+    // number of frames resent by the source resp. received by the sink
+    uint64_t resend_responses;
+    // jitter buffer fill ratio (0.0 - 1.0); for sources this is
+    // the send buffer, which is shared by all sinks.
+    float buffer_fill_min;
+    float buffer_fill_max;
+    // current resampling ratio
+    double resample_ratio;
+    // most recent time DLL error in seconds
+    double dll_error;
+    // time per block for encoding (source) resp. decoding (sink)
+    double codec_time_avg;
+    double codec_time_max;
+    // sink: deviation of the block inter-arrival time from the nominal
+    // block period. (always empty for sources)
+    uint32_t jitter[AOO_STATS_NUMBINS];
+    // sink: one-way latency (from the ping time stamps, so both machines
+    // need synchronized clocks) plus the jitter buffer latency.
+    // source: ping round trip time.
+    uint32_t latency[AOO_STATS_NUMBINS];
+} aoo_stream_stats;
+
 #define AOO_ARG(x) &x, sizeof(x)
 #define AOO_ARG_NULL 0, 0
 
@@ -515,6 +714,15 @@ static inline int32_t aoo_source_get_redundancy(aoo_source *src, int32_t *n) {
     return aoo_source_get_option(src, aoo_opt_redundancy, AOO_ARG(*n));
 }
 
+static inline int32_t aoo_source_set_clock(aoo_source *src, aoo_clockfn fn, void *user) {
+    aoo_clock c = { fn, user };
+    return aoo_source_set_option(src, aoo_opt_clock, AOO_ARG(c));
+}
+
+static inline int32_t aoo_source_set_capture(aoo_source *src, const char *path) {
+    return aoo_source_set_option(src, aoo_opt_capture, AOO_ARG(path));
+}
+
 static inline int32_t aoo_source_set_sink_channelonset(aoo_source *src, void *endpoint, int32_t id, int32_t onset) {
     return aoo_source_set_sinkoption(src, endpoint, id, aoo_opt_channelonset, AOO_ARG(onset));
 }
@@ -523,6 +731,10 @@ static inline int32_t aoo_source_get_sink_channelonset(aoo_source *src, void *en
     return aoo_source_get_sinkoption(src, endpoint, id, aoo_opt_channelonset, AOO_ARG(*onset));
 }
 
+static inline int32_t aoo_source_get_sink_stats(aoo_source *src, void *endpoint, int32_t id, aoo_stream_stats *stats) {
+    return aoo_source_get_sinkoption(src, endpoint, id, aoo_opt_stream_stats, AOO_ARG(*stats));
+}
+
 /*//////////////////// AoO sink /////////////////////*/
 
 #ifdef __cplusplus
@@ -558,12 +770,29 @@ AOO_API int32_t aoo_sink_handle_message(aoo_sink *sink, const char *data, int32_
                                         void *src, aoo_replyfn fn);
 
 // send outgoing messages - will call the reply function (threadsafe, but not reentrant)
+// also receives blocks from sources which use the local transport
+// (see aoo_opt_local_transport); in this case it must be called
+// after every aoo_sink_process(), otherwise there will be dropouts.
 AOO_API int32_t aoo_sink_send(aoo_sink *sink);
 
 // process audio (threadsafe, but not reentrant)
 AOO_API int32_t aoo_sink_process(aoo_sink *sink, aoo_sample **data,
                                  int32_t nsamples, uint64_t t);
 
+typedef struct aoo_sink_bus
+{
+    aoo_sample **data;  // array of channel data (non-interleaved)
+    int32_t nchannels;
+} aoo_sink_bus;
+
+// process audio into several output buses (threadsafe, but not reentrant)
+// Every source is summed directly into the bus selected with aoo_opt_bus,
+// starting at its channel onset. Sources with an out-of-range bus are dropped.
+// All bus channels are overwritten, so unused buses contain silence.
+// returns: 1 if any source has been processed, otherwise 0
+AOO_API int32_t aoo_sink_process_buses(aoo_sink *sink, aoo_sink_bus *buses,
+                                       int32_t nbuses, int32_t nsamples, uint64_t t);
+
 // get number of pending events (always thread safe)
 AOO_API int32_t aoo_sink_events_available(aoo_sink *sink);
 
@@ -645,6 +874,15 @@ static inline int32_t aoo_sink_get_resend_maxnumframes(aoo_sink *sink, int32_t *
     return aoo_sink_get_option(sink, aoo_opt_resend_maxnumframes, AOO_ARG(*n));
 }
 
+static inline int32_t aoo_sink_set_clock(aoo_sink *sink, aoo_clockfn fn, void *user) {
+    aoo_clock c = { fn, user };
+    return aoo_sink_set_option(sink, aoo_opt_clock, AOO_ARG(c));
+}
+
+static inline int32_t aoo_sink_set_capture(aoo_sink *sink, const char *path) {
+    return aoo_sink_set_option(sink, aoo_opt_capture, AOO_ARG(path));
+}
+
 static inline int32_t aoo_sink_reset_source(aoo_sink *sink, void *endpoint, int32_t id) {
     return aoo_sink_set_sourceoption(sink, endpoint, id, aoo_opt_reset, AOO_ARG_NULL);
 }
@@ -653,6 +891,46 @@ static inline int32_t aoo_sink_get_source_format(aoo_sink *sink, void *endpoint,
     return aoo_sink_get_sourceoption(sink, endpoint, id, aoo_opt_format, AOO_ARG(*f));
 }
 
+static inline int32_t aoo_sink_set_source_bus(aoo_sink *sink, void *endpoint, int32_t id, int32_t bus) {
+    return aoo_sink_set_sourceoption(sink, endpoint, id, aoo_opt_bus, AOO_ARG(bus));
+}
+
+static inline int32_t aoo_sink_get_source_bus(aoo_sink *sink, void *endpoint, int32_t id, int32_t *bus) {
+    return aoo_sink_get_sourceoption(sink, endpoint, id, aoo_opt_bus, AOO_ARG(*bus));
+}
+
+static inline int32_t aoo_sink_set_source_gain(aoo_sink *sink, void *endpoint, int32_t id, float gain) {
+    return aoo_sink_set_sourceoption(sink, endpoint, id, aoo_opt_gain, AOO_ARG(gain));
+}
+
+static inline int32_t aoo_sink_get_source_gain(aoo_sink *sink, void *endpoint, int32_t id, float *gain) {
+    return aoo_sink_get_sourceoption(sink, endpoint, id, aoo_opt_gain, AOO_ARG(*gain));
+}
+
+static inline int32_t aoo_sink_get_source_stats(aoo_sink *sink, void *endpoint, int32_t id, aoo_stream_stats *stats) {
+    return aoo_sink_get_sourceoption(sink, endpoint, id, aoo_opt_stream_stats, AOO_ARG(*stats));
+}
+
+static inline int32_t aoo_sink_set_source_matrix(aoo_sink *sink, void *endpoint, int32_t id,
+                                                 const aoo_mix_matrix *m) {
+    return aoo_sink_set_sourceoption(sink, endpoint, id, aoo_opt_mix_matrix, (void *)m, sizeof(aoo_mix_matrix));
+}
+
+// equal-power panning of a mono source between two adjacent sink channels (-1 .. 1)
+static inline int32_t aoo_sink_set_source_pan(aoo_sink *sink, void *endpoint, int32_t id, float pan) {
+    float gains[2];
+    float a;
+    aoo_mix_matrix m;
+    pan = pan < -1.f ? -1.f : pan > 1.f ? 1.f : pan;
+    a = (pan + 1.f) * 0.785398163f; // 0 .. pi/2
+    gains[0] = cosf(a);
+    gains[1] = sinf(a);
+    m.ninputs = 1;
+    m.noutputs = 2;
+    m.gains = gains;
+    return aoo_sink_set_source_matrix(sink, endpoint, id, &m);
+}
+
 /*//////////////////// Codec API //////////////////////////*/
 
 #define AOO_CODEC_MAXSETTINGSIZE 256
@@ -687,6 +965,8 @@ typedef int32_t (*aoo_codec_encode)(
         int32_t             // max. size of output buffer
 );
 
+// NULL input: conceal a missing block; returns 0 if the
+// codec can't do that (the output is silence).
 typedef int32_t (*aoo_codec_decode)(
         void *,         // the decoder instance
         const char *,   // input bytes
@@ -243,6 +243,10 @@ public:
     // process audio (threadsafe, but not reentrant)
     virtual int32_t process(aoo_sample **data, int32_t nsamples, uint64_t t) = 0;
 
+    // process audio into several output buses (threadsafe, but not reentrant)
+    virtual int32_t process_buses(aoo_sink_bus *buses, int32_t nbuses,
+                                  int32_t nsamples, uint64_t t) = 0;
+
     // get number of pending events (always thread safe)
     virtual int32_t events_available() = 0;
 
@@ -335,6 +339,26 @@ public:
         return get_sourceoption(endpoint, id, aoo_opt_format, AOO_ARG(f));
     }
 
+    int32_t set_source_bus(void *endpoint, int32_t id, int32_t bus){
+        return set_sourceoption(endpoint, id, aoo_opt_bus, AOO_ARG(bus));
+    }
+
+    int32_t get_source_bus(void *endpoint, int32_t id, int32_t& bus){
+        return get_sourceoption(endpoint, id, aoo_opt_bus, AOO_ARG(bus));
+    }
+
+    int32_t set_source_gain(void *endpoint, int32_t id, float gain){
+        return set_sourceoption(endpoint, id, aoo_opt_gain, AOO_ARG(gain));
+    }
+
+    int32_t get_source_gain(void *endpoint, int32_t id, float& gain){
+        return get_sourceoption(endpoint, id, aoo_opt_gain, AOO_ARG(gain));
+    }
+
+    int32_t set_source_matrix(void *endpoint, int32_t id, const aoo_mix_matrix& m){
+        return set_sourceoption(endpoint, id, aoo_opt_mix_matrix, (void *)&m, sizeof(m));
+    }
+
     virtual int32_t request_source_codec_change(void *endpoint, int32_t id, aoo_format & f) = 0;
     
     virtual int32_t set_sourceoption(void *endpoint, int32_t id,
@@ -77,6 +77,18 @@ extern "C"
 #define AOONET_MSG_LEAVE "/leave"
 #define AOONET_MSG_LEAVE_LEN 6
 
+#define AOONET_MSG_RELAY "/relay"
+#define AOONET_MSG_RELAY_LEN 6
+
+#define AOONET_MSG_CLUSTER "/cluster"
+#define AOONET_MSG_CLUSTER_LEN 8
+
+#define AOONET_MSG_DELIVER "/deliver"
+#define AOONET_MSG_DELIVER_LEN 8
+
+#define AOONET_MSG_HELLO "/hello"
+#define AOONET_MSG_HELLO_LEN 6
+
 typedef enum aoonet_type
 {
     AOO_TYPE_SERVER = 1000,
@@ -186,6 +198,26 @@ AOO_API int32_t aoonet_server_run(aoonet_server *server);
 // quit the AOO server from another thread
 AOO_API int32_t aoonet_server_quit(aoonet_server *server);
 
+// set the number of I/O threads; must be called before aoonet_server_run().
+// 0 or 1: everything runs on the thread which calls aoonet_server_run().
+// n > 1: client connections are distributed across n worker threads,
+// the calling thread only accepts new connections.
+AOO_API int32_t aoonet_server_set_num_threads(aoonet_server *server, int32_t n);
+
+// add a node to the server cluster; must be called before aoonet_server_run().
+// 'host' and 'port' are the address where clients can reach the node.
+// All nodes must be given the same node list (including themselves,
+// marked with 'self'). Users and groups are assigned to nodes by consistent
+// hashing: clients are redirected to the node which owns their user name
+// at login, and group requests are forwarded to the node which owns the group.
+AOO_API int32_t aoonet_server_add_node(aoonet_server *server, const char *host,
+                                       int port, int32_t self);
+
+// set the shared secret of the server cluster; must be called before aoonet_server_run().
+// Nodes authenticate themselves with the secret, so all nodes must use the same one.
+// Cluster messages from unauthenticated connections are ignored.
+AOO_API int32_t aoonet_server_set_cluster_secret(aoonet_server *server, const char *secret);
+
 // get number of pending events (always thread safe)
 AOO_API int32_t aoonet_server_events_available(aoonet_server *server);
 
@@ -235,18 +267,59 @@ AOO_API int32_t aoonet_client_group_join(aoonet_client *client, const char *grou
 // join/create an AOO public group
 AOO_API int32_t aoonet_client_group_join_public(aoonet_client *client, const char *group, const char *pwd);
 
+// join an AOO group in partial mesh mode: the server only introduces us to
+// the members we subscribe to (see aoonet_client_peer_subscribe())
+// and to those who subscribe to us, instead of every group member.
+// This keeps the number of peer connections (and keepalive traffic)
+// independent of the group size.
+AOO_API int32_t aoonet_client_group_join_partial(aoonet_client *client, const char *group, const char *pwd);
+
 // leave an AOO group
 AOO_API int32_t aoonet_client_group_leave(aoonet_client *client, const char *group);
 
+// subscribe to a group member (partial mesh mode). The peer is connected
+// (AOONET_CLIENT_PEER_JOIN_EVENT) as soon as both of us are in the group;
+// 'user' doesn't have to be a member yet.
+AOO_API int32_t aoonet_client_peer_subscribe(aoonet_client *client,
+                                             const char *group, const char *user);
+
+// unsubscribe from a group member. The peer is disconnected
+// (AOONET_CLIENT_PEER_LEAVE_EVENT) unless it still wants to talk to us.
+AOO_API int32_t aoonet_client_peer_unsubscribe(aoonet_client *client,
+                                               const char *group, const char *user);
+
+// subscribe to the streams which 'user' sends through the server (relay mode).
+// Instead of sending a stream to every peer, the user only sends it once to
+// the server (see aoonet_client_get_relay_address()) and the server forwards it
+// to all subscribers. The streams arrive at our sink with the given ID;
+// they appear to come from the server with a server-assigned source ID.
+// Likewise, the publisher sees our sink with a server-assigned sink ID.
+// Both users must be members of 'group'.
+AOO_API int32_t aoonet_client_relay_subscribe(aoonet_client *client, const char *group,
+                                              const char *user, int32_t sink);
+
+// unsubscribe from a relayed user
+AOO_API int32_t aoonet_client_relay_unsubscribe(aoonet_client *client, const char *group,
+                                                const char *user, int32_t sink);
+
+// get the UDP address of the server as a 'sockaddr' (for aoo_source_add_sink()).
+// returns the address length or 0 if not connected.
+AOO_API int32_t aoonet_client_get_relay_address(aoonet_client *client,
+                                                void *addr, int32_t size);
+
 // leave an AOO group
 AOO_API int32_t aoonet_client_group_watch_public(aoonet_client *client, bool watch);
 
 // handle messages from peers (threadsafe, but not reentrant)
 // 'addr' should be sockaddr *
+// NOTE: must not be called from several threads at the same time,
+// usually it is only called by the network receive thread.
 AOO_API int32_t aoonet_client_handle_message(aoonet_client *client,
                                              const char *data, int32_t n, void *addr);
 
 // send outgoing messages to peers (threadsafe, but not reentrant)
+// NOTE: must not be called from several threads at the same time,
+// usually it is only called by the network send thread.
 AOO_API int32_t aoonet_client_send(aoonet_client *client);
 
 // get number of pending events (always thread safe)
@@ -54,6 +54,15 @@ public:
     // quit the AOO server from another thread
     virtual int32_t quit() = 0;
 
+    // set the number of I/O threads (before calling run())
+    virtual int32_t set_num_threads(int32_t n) = 0;
+
+    // add a node to the server cluster (before calling run())
+    virtual int32_t add_node(const char *host, int port, bool self) = 0;
+
+    // set the shared secret of the server cluster (before calling run())
+    virtual int32_t set_cluster_secret(const char *secret) = 0;
+
     // get number of pending events (always thread safe)
     virtual int32_t events_available() = 0;
 
@@ -115,7 +124,9 @@ public:
     virtual int32_t disconnect() = 0;
 
     // join an AOO group
-    virtual int32_t group_join(const char *group, const char *pwd, bool is_public=false) = 0;
+    // (in partial mesh mode, we only connect to the members we subscribe to)
+    virtual int32_t group_join(const char *group, const char *pwd,
+                               bool is_public=false, bool partial=false) = 0;
 
     // leave an AOO group
     virtual int32_t group_leave(const char *group) = 0;
@@ -123,11 +134,28 @@ public:
     // register interest in public groups
     virtual int32_t group_watch_public(bool watch) = 0;
 
+    // subscribe to a group member (partial mesh mode)
+    virtual int32_t peer_subscribe(const char *group, const char *user) = 0;
+
+    // unsubscribe from a group member (partial mesh mode)
+    virtual int32_t peer_unsubscribe(const char *group, const char *user) = 0;
+
+    // subscribe to the relayed streams of a group member
+    virtual int32_t relay_subscribe(const char *group, const char *user, int32_t sink) = 0;
+
+    // unsubscribe from the relayed streams of a group member
+    virtual int32_t relay_unsubscribe(const char *group, const char *user, int32_t sink) = 0;
+
+    // get the server UDP address for relaying streams
+    virtual int32_t get_relay_address(void *addr, int32_t size) = 0;
+
     // handle messages from peers (threadsafe, but not reentrant)
     // 'addr' should be sockaddr *
+    // NOTE: must not be called from several threads at the same time.
     virtual int32_t handle_message(const char *data, int32_t n, void *addr) = 0;
 
     // send outgoing messages to peers (threadsafe, but not reentrant)
+    // NOTE: must not be called from several threads at the same time.
     virtual int32_t send() = 0;
 
     // get number of pending events (always thread safe)
@@ -0,0 +1,105 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// AOONODE is a ready-made UDP network engine for AoO sources, sinks
+// and clients. It owns a single UDP socket, receives and dispatches
+// incoming messages on a network thread (by type and ID) and calls the
+// send() methods of all registered objects on a dedicated send thread.
+//
+// On Linux, the receive thread uses epoll() and receives packets in
+// batches with recvmmsg() into a preallocated buffer pool.
+// Other platforms use poll() resp. WaitForMultipleObjects().
+//
+// Applications which don't want to deal with sockets and threads
+// can use it instead of writing their own networking code.
+
+#pragma once
+
+#include "aoo.h"
+#include "aoo_net.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+// max. number of packets per receive call
+#ifndef AOONODE_RECV_BATCH
+#define AOONODE_RECV_BATCH 32
+#endif
+
+// endpoints which haven't been used for this many seconds are removed
+// from the lookup table (see aoonode_endpoint)
+#ifndef AOONODE_ENDPOINT_TIMEOUT
+#define AOONODE_ENDPOINT_TIMEOUT 60
+#endif
+
+// max. time (in ms) between two calls to aoonet_client_send() while
+// a client is set; must not be larger than the client's request interval.
+#ifndef AOONODE_CLIENT_INTERVAL
+#define AOONODE_CLIENT_INTERVAL 10
+#endif
+
+/*///////////////////////// AOO node /////////////////////////*/
+
+#ifdef __cplusplus
+namespace aoo {
+    class inode;
+}
+using aoonode = aoo::inode;
+#else
+typedef struct aoonode aoonode;
+#endif
+
+// create a new AOO node, bound to the given UDP port
+// (0 = let the OS choose a free port); starts the network threads.
+AOO_API aoonode * aoonode_new(int port, int32_t *err);
+
+// destroy the AOO node; stops the network threads.
+// NOTE: all registered objects must still be alive!
+AOO_API void aoonode_free(aoonode *node);
+
+// get the UDP port
+AOO_API int aoonode_port(aoonode *node);
+
+// register a source for incoming messages (always threadsafe)
+AOO_API int32_t aoonode_add_source(aoonode *node, aoo_source *src, int32_t id);
+
+// unregister a source (always threadsafe)
+// afterwards the node won't access the source anymore.
+AOO_API int32_t aoonode_remove_source(aoonode *node, aoo_source *src);
+
+// register a sink for incoming messages (always threadsafe)
+AOO_API int32_t aoonode_add_sink(aoonode *node, aoo_sink *sink, int32_t id);
+
+// unregister a sink (always threadsafe)
+// afterwards the node won't access the sink anymore.
+AOO_API int32_t aoonode_remove_sink(aoonode *node, aoo_sink *sink);
+
+// set the AOO client for peer and server messages (NULL = remove).
+// the client must be created with the node and aoonode_sendto():
+// aoonet_client_new(node, aoonode_sendto, aoonode_port(node))
+// the node calls aoonet_client_send() at least every
+// AOONODE_CLIENT_INTERVAL ms, so the client doesn't need aoonode_notify().
+AOO_API int32_t aoonode_set_client(aoonode *node, aoonet_client *client);
+
+// wake up the send thread (RT-safe).
+// call this after aoo_source_process() or aoo_sink_process().
+AOO_API void aoonode_notify(aoonode *node);
+
+// get an endpoint for the given socket address (threadsafe).
+// endpoints stay valid until the node is destroyed and always refer
+// to the same address.
+AOO_API void * aoonode_endpoint(aoonode *node, const void *address, int32_t addrlen);
+
+// reply function for node endpoints (see aoo_replyfn),
+// e.g. aoo_source_add_sink(src, aoonode_endpoint(...), id, aoonode_reply)
+AOO_API int32_t aoonode_reply(void *endpoint, const char *data, int32_t size);
+
+// send function for AOO clients (see aoo_sendfn)
+AOO_API int32_t aoonode_sendto(void *node, const char *data, int32_t size, void *address);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
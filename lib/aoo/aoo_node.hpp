@@ -0,0 +1,76 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "aoo_node.h"
+
+#include <memory>
+
+namespace aoo {
+
+// NOTE: like the other AoO interfaces, aoo::inode doesn't define
+// a virtual destructor and has to be destroyed with destroy().
+// See aoo.hpp for more information.
+
+/*//////////////////////// AoO node ///////////////////////*/
+
+class inode {
+public:
+    class deleter {
+    public:
+        void operator()(inode *x){
+            destroy(x);
+        }
+    };
+    // smart pointer for AoO node instance
+    using pointer = std::unique_ptr<inode, deleter>;
+
+    // create a new AoO node instance
+    static inode * create(int port, int32_t *err);
+
+    // destroy the AoO node instance
+    static void destroy(inode *node);
+
+    // get the UDP port
+    virtual int port() const = 0;
+
+    // register a source (always threadsafe)
+    // NOTE: if you change the source ID, you have to register it again.
+    virtual int32_t add_source(isource *src, int32_t id) = 0;
+
+    // unregister a source (always threadsafe)
+    virtual int32_t remove_source(isource *src) = 0;
+
+    // register a sink (always threadsafe)
+    // NOTE: if you change the sink ID, you have to register it again.
+    virtual int32_t add_sink(isink *sink, int32_t id) = 0;
+
+    // unregister a sink (always threadsafe)
+    virtual int32_t remove_sink(isink *sink) = 0;
+
+    // set the AOO client (always threadsafe)
+    virtual int32_t set_client(net::iclient *client) = 0;
+
+    // wake up the send thread (RT-safe)
+    virtual void notify() = 0;
+
+    // get an endpoint for a socket address (always threadsafe)
+    virtual void * get_endpoint(const void *address, int32_t addrlen) = 0;
+
+    // send a packet to a socket address (always threadsafe)
+    virtual int32_t sendto(const char *data, int32_t size, const void *address) = 0;
+protected:
+    ~inode(){} // non-virtual!
+};
+
+inline inode * inode::create(int port, int32_t *err){
+    return aoonode_new(port, err);
+}
+
+inline void inode::destroy(inode *node){
+    aoonode_free(node);
+}
+
+} // aoo
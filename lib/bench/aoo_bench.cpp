@@ -0,0 +1,434 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Microbenchmarks for the hot data structures and codec paths of the library.
+//
+// Each benchmark is run repeatedly until it has taken at least the minimum
+// time; the result is the average time per operation. Run it before and
+// after a change to catch performance regressions.
+//
+// The implementation variants in common.cpp can be selected with
+// -DBLOCK_ACK_LIST_HASHTABLE=0/1, -DBLOCK_ACK_LIST_SORTED=0/1,
+// -DBLOCK_QUEUE_BINARY_SEARCH=0/1 and -DHISTORY_BUFFER_BINARY_SEARCH=0/1,
+// so you can build several binaries and compare them.
+//
+// build (from this directory):
+//   c++ -std=c++14 -O2 -DNDEBUG -DAOO_STATIC -DLOGLEVEL=0 -I.. -I../src -I../../deps
+//       aoo_bench.cpp ../src/common.cpp ../src/source.cpp ../src/sink.cpp
+//       ../src/codec_pcm.cpp ../src/memory.cpp ../src/sync.cpp ../src/time.cpp
+//       ../src/shm.cpp ../src/trace.cpp ../src/capture.cpp ../../deps/oscpack/osc/*.cpp
+//       -o aoo_bench -lpthread -lrt
+//   (add -DUSE_CODEC_OPUS=1 ../src/codec_opus.cpp -lopus for the Opus benchmarks)
+//
+// usage:
+//   aoo_bench [filter] [mintime]
+//
+// 'filter' only runs the benchmarks whose name contains the given string;
+// 'mintime' is the minimum run time per benchmark in seconds (default: 0.2)
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_pcm.h"
+#if USE_CODEC_OPUS
+#include "aoo/aoo_opus.h"
+#endif
+
+#include "common.hpp"
+#include "lockfree.hpp"
+#include "source.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <vector>
+#include <string>
+
+#define BENCH_BLOCKSIZE 64
+#define BENCH_CHANNELS 2
+#define BENCH_SAMPLERATE 48000
+
+namespace {
+
+const char *g_filter = nullptr;
+double g_mintime = 0.2;
+
+// prevent the compiler from optimizing away results
+volatile int64_t g_sink = 0;
+
+inline void consume(int64_t x){
+    g_sink = g_sink + x;
+}
+
+// 'fn' runs 'n' operations
+void run(const char *name, const std::function<void(int64_t)>& fn){
+    if (g_filter && !strstr(name, g_filter)){
+        return;
+    }
+    using clock = std::chrono::steady_clock;
+    // warm up
+    fn(1);
+    int64_t n = 1;
+    for (;;){
+        auto t1 = clock::now();
+        fn(n);
+        auto t2 = clock::now();
+        double elapsed = std::chrono::duration<double>(t2 - t1).count();
+        if (elapsed >= g_mintime){
+            double ns = elapsed * 1e9 / (double)n;
+            printf("%-40s %12.1f ns/op %14.0f op/s\n", name, ns, 1e9 / ns);
+            fflush(stdout);
+            return;
+        }
+        // estimate the number of operations for the minimum time
+        if (elapsed > 0){
+            auto estimate = (int64_t)(n * g_mintime * 1.2 / elapsed);
+            n = std::max<int64_t>(n * 2, std::min<int64_t>(estimate, n * 100));
+        } else {
+            n *= 100;
+        }
+    }
+}
+
+// a sequence of block numbers where packets arrive out of order:
+// every block is displaced by up to 'maxdist' positions.
+std::vector<int32_t> make_reordered(int32_t n, int32_t maxdist){
+    std::vector<int32_t> seqs(n);
+    for (int32_t i = 0; i < n; ++i){
+        seqs[i] = i;
+    }
+    if (maxdist > 0){
+        std::mt19937 mt(1);
+        for (int32_t i = 0; i + maxdist < n; i += maxdist){
+            std::shuffle(seqs.begin() + i, seqs.begin() + i + maxdist + 1, mt);
+        }
+    }
+    return seqs;
+}
+
+void make_signal(std::vector<aoo_sample>& buf){
+    for (size_t i = 0; i < buf.size(); ++i){
+        buf[i] = 0.5 * sin((double)i * 0.01);
+    }
+}
+
+/*//////////////////////// lockfree::queue ////////////////////////*/
+
+void bench_lockfree_queue(){
+    run("lockfree::queue write/read", [](int64_t n){
+        aoo::lockfree::queue<int32_t> q;
+        q.resize(1024, 1);
+        for (int64_t i = 0; i < n; ++i){
+            q.write((int32_t)i);
+            int32_t x;
+            q.read(x);
+            consume(x);
+        }
+    });
+
+    run("lockfree::queue block write/read", [](int64_t n){
+        const int32_t blocksize = BENCH_BLOCKSIZE * BENCH_CHANNELS;
+        aoo::lockfree::queue<aoo_sample> q;
+        q.resize(blocksize * 8, blocksize);
+        std::vector<aoo_sample> in(blocksize, 0.5), out(blocksize);
+        for (int64_t i = 0; i < n; ++i){
+            if (q.write_available()){
+                std::copy(in.begin(), in.end(), q.write_data());
+                q.write_commit();
+            }
+            if (q.read_available()){
+                auto data = q.read_data();
+                std::copy(data, data + blocksize, out.begin());
+                q.read_commit();
+            }
+        }
+        consume((int64_t)out[0]);
+    });
+}
+
+/*//////////////////////// block_queue ////////////////////////*/
+
+void bench_block_queue(){
+    const int32_t numblocks = 4096;
+    const int32_t queuesize = 32;
+
+    auto doit = [&](const char *name, int32_t maxdist){
+        auto seqs = make_reordered(numblocks, maxdist);
+        run(name, [&](int64_t n){
+            aoo::block_queue q;
+            q.resize(queuesize);
+            for (int64_t i = 0; i < n; ++i){
+                auto seq = seqs[i % numblocks] + (int32_t)(i / numblocks) * numblocks;
+                if ((i % numblocks) == 0){
+                    q.clear(); // start a new round
+                }
+                auto b = q.find(seq);
+                if (!b){
+                    b = q.insert(seq, BENCH_SAMPLERATE, 0, 256, 1);
+                }
+                consume(b->sequence);
+            }
+        });
+    };
+    doit("block_queue insert/find in order", 0);
+    doit("block_queue insert/find reorder 4", 4);
+    doit("block_queue insert/find reorder 16", 16);
+
+    run("block_queue find (full)", [&](int64_t n){
+        aoo::block_queue q;
+        q.resize(queuesize);
+        for (int32_t i = 0; i < queuesize; ++i){
+            q.insert(i, BENCH_SAMPLERATE, 0, 256, 1);
+        }
+        for (int64_t i = 0; i < n; ++i){
+            auto b = q.find((int32_t)((i * 7) % queuesize));
+            consume(b != nullptr);
+        }
+    });
+}
+
+/*//////////////////////// block_ack_list ////////////////////////*/
+
+void bench_block_ack_list(){
+    // simulate the resend logic: request a range of missing blocks,
+    // look them up repeatedly, then drop them when they have arrived.
+    auto doit = [&](const char *name, int32_t nmissing){
+        run(name, [&](int64_t n){
+            aoo::block_ack_list acks;
+            acks.set_limit(16);
+            int32_t seq = 0;
+            for (int64_t i = 0; i < n; i += nmissing){
+                for (int32_t j = 0; j < nmissing; ++j){
+                    acks.get(seq + j);
+                }
+                for (int32_t j = 0; j < nmissing; ++j){
+                    consume(acks.find(seq + j) != nullptr);
+                }
+                for (int32_t j = 0; j < nmissing; j += 2){
+                    acks.remove(seq + j);
+                }
+                seq += nmissing;
+                acks.remove_before(seq);
+            }
+        });
+    };
+    doit("block_ack_list get/find/remove 4", 4);
+    doit("block_ack_list get/find/remove 64", 64);
+}
+
+/*//////////////////////// history_buffer ////////////////////////*/
+
+void bench_history_buffer(){
+    const int32_t capacity = 256;
+    const int32_t nbytes = BENCH_BLOCKSIZE * BENCH_CHANNELS * sizeof(float);
+    std::vector<char> data(nbytes, 1);
+
+    run("history_buffer push", [&](int64_t n){
+        aoo::history_buffer h;
+        h.resize(capacity);
+        for (int64_t i = 0; i < n; ++i){
+            h.push((int32_t)i, BENCH_SAMPLERATE, data.data(), nbytes, 1, nbytes);
+        }
+    });
+
+    run("history_buffer find", [&](int64_t n){
+        aoo::history_buffer h;
+        h.resize(capacity);
+        // wrap around once, so that both sorted ranges are used
+        int32_t count = capacity + capacity / 2;
+        for (int32_t i = 0; i < count; ++i){
+            h.push(i, BENCH_SAMPLERATE, data.data(), nbytes, 1, nbytes);
+        }
+        std::mt19937 mt(1);
+        std::uniform_int_distribution<int32_t> dist(count - capacity + 1, count - 1);
+        for (int64_t i = 0; i < n; ++i){
+            auto b = h.find(dist(mt));
+            consume(b != nullptr);
+        }
+    });
+}
+
+/*//////////////////////// dynamic_resampler ////////////////////////*/
+
+void bench_dynamic_resampler(){
+    const int32_t nsamples = BENCH_BLOCKSIZE * BENCH_CHANNELS;
+    std::vector<aoo_sample> in(nsamples), out(nsamples);
+    make_signal(in);
+
+    // one operation = writing and reading one block
+    auto doit = [&](const char *name, double srfrom, double srto){
+        run(name, [&](int64_t n){
+            aoo::dynamic_resampler r;
+            r.setup(BENCH_BLOCKSIZE, BENCH_BLOCKSIZE, srfrom, srto, BENCH_CHANNELS);
+            r.update(srfrom, srto);
+            for (int64_t i = 0; i < n; ++i){
+                if (r.write_available() >= nsamples){
+                    r.write(in.data(), nsamples);
+                }
+                while (r.read_available() >= nsamples){
+                    r.read(out.data(), nsamples);
+                }
+            }
+            consume((int64_t)out[0]);
+        });
+    };
+    // ratio == 1: non-interpolating (memcpy) path
+    doit("dynamic_resampler copy", BENCH_SAMPLERATE, BENCH_SAMPLERATE);
+    // ratio != 1: interpolating path
+    doit("dynamic_resampler interpolate", 44100, BENCH_SAMPLERATE);
+    doit("dynamic_resampler drift", BENCH_SAMPLERATE, BENCH_SAMPLERATE * 1.0001);
+}
+
+/*//////////////////////// codecs ////////////////////////*/
+
+// one operation = encoding or decoding one block
+void bench_codec(const char *prefix, aoo_format& fmt){
+    auto c = aoo::find_codec(fmt.codec);
+    if (!c){
+        printf("codec '%s' not available\n", fmt.codec);
+        return;
+    }
+    auto enc = c->create_encoder();
+    auto dec = c->create_decoder();
+    if (!enc->set_format(fmt) || !dec->set_format(fmt)){
+        printf("%s: couldn't set format\n", prefix);
+        return;
+    }
+    const int32_t nsamples = fmt.blocksize * fmt.nchannels;
+    std::vector<aoo_sample> in(nsamples), out(nsamples);
+    make_signal(in);
+    char buf[AOO_MAXPACKETSIZE * 4];
+    auto size = enc->encode(in.data(), nsamples, buf, sizeof(buf));
+    if (size <= 0){
+        printf("%s: couldn't encode\n", prefix);
+        return;
+    }
+
+    std::string name = std::string(prefix) + " encode";
+    run(name.c_str(), [&](int64_t n){
+        for (int64_t i = 0; i < n; ++i){
+            consume(enc->encode(in.data(), nsamples, buf, sizeof(buf)));
+        }
+    });
+
+    name = std::string(prefix) + " decode";
+    run(name.c_str(), [&](int64_t n){
+        for (int64_t i = 0; i < n; ++i){
+            consume(dec->decode(buf, size, out.data(), nsamples));
+        }
+    });
+}
+
+void bench_codecs(){
+    const int32_t bitdepths[] = { AOO_PCM_INT16, AOO_PCM_INT24,
+                                  AOO_PCM_FLOAT32, AOO_PCM_FLOAT64 };
+    const char *names[] = { "pcm int16", "pcm int24", "pcm float32", "pcm float64" };
+    for (int i = 0; i < 4; ++i){
+        aoo_format_pcm fmt;
+        fmt.header.codec = AOO_CODEC_PCM;
+        fmt.header.nchannels = BENCH_CHANNELS;
+        fmt.header.samplerate = BENCH_SAMPLERATE;
+        fmt.header.blocksize = BENCH_BLOCKSIZE;
+        fmt.bitdepth = bitdepths[i];
+        bench_codec(names[i], fmt.header);
+    }
+#if USE_CODEC_OPUS
+    aoo_format_opus fmt;
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.header.codec = AOO_CODEC_OPUS;
+    fmt.header.nchannels = BENCH_CHANNELS;
+    fmt.header.samplerate = BENCH_SAMPLERATE;
+    fmt.header.blocksize = 480; // 10 ms
+    bench_codec("opus", fmt.header);
+#endif
+}
+
+/*//////////////////////// OSC ////////////////////////*/
+
+int32_t null_reply(void *user, const char *data, int32_t n){
+    consume(n);
+    return n;
+}
+
+void bench_osc(){
+    run("aoo_parse_pattern sink", [](int64_t n){
+        const char msg[] = AOO_MSG_DOMAIN AOO_MSG_SINK "/1234" AOO_MSG_DATA;
+        for (int64_t i = 0; i < n; ++i){
+            int32_t type, id;
+            consume(aoo_parse_pattern(msg, sizeof(msg), &type, &id));
+        }
+    });
+
+    run("aoo_parse_pattern wildcard", [](int64_t n){
+        const char msg[] = AOO_MSG_DOMAIN AOO_MSG_SOURCE AOO_MSG_WILDCARD AOO_MSG_DATA;
+        for (int64_t i = 0; i < n; ++i){
+            int32_t type, id;
+            consume(aoo_parse_pattern(msg, sizeof(msg), &type, &id));
+        }
+    });
+
+    char data[BENCH_BLOCKSIZE * BENCH_CHANNELS * sizeof(float)];
+    memset(data, 0, sizeof(data));
+    aoo::data_packet d;
+    d.samplerate = BENCH_SAMPLERATE;
+    d.channel = 0;
+    d.totalsize = sizeof(data);
+    d.nframes = 1;
+    d.framenum = 0;
+    d.data = data;
+    d.size = sizeof(data);
+
+    run("endpoint::send_data", [&](int64_t n){
+        aoo::endpoint ep(nullptr, null_reply, 1234);
+        for (int64_t i = 0; i < n; ++i){
+            d.sequence = (int32_t)i;
+            consume(ep.send_data(5678, 1, d));
+        }
+    });
+
+    run("endpoint::send_data_compact", [&](int64_t n){
+        aoo::endpoint ep(nullptr, null_reply, 1234);
+        for (int64_t i = 0; i < n; ++i){
+            d.sequence = (int32_t)i;
+            consume(ep.send_data_compact(5678, 1, d));
+        }
+    });
+}
+
+} // namespace
+
+int main(int argc, const char **argv){
+    if (argc > 1){
+        g_filter = argv[1];
+    }
+    if (argc > 2){
+        g_mintime = atof(argv[2]);
+        if (g_mintime <= 0){
+            fprintf(stderr, "bad minimum time\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    aoo_initialize();
+
+    printf("BLOCK_ACK_LIST_HASHTABLE=%d BLOCK_ACK_LIST_SORTED=%d "
+           "BLOCK_QUEUE_BINARY_SEARCH=%d HISTORY_BUFFER_BINARY_SEARCH=%d\n\n",
+           BLOCK_ACK_LIST_HASHTABLE, BLOCK_ACK_LIST_SORTED,
+           BLOCK_QUEUE_BINARY_SEARCH, HISTORY_BUFFER_BINARY_SEARCH);
+
+    bench_lockfree_queue();
+    bench_block_queue();
+    bench_block_ack_list();
+    bench_history_buffer();
+    bench_dynamic_resampler();
+    bench_codecs();
+    bench_osc();
+
+    aoo_terminate();
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,757 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// End-to-end loopback test with a simulated network.
+//
+// Connects N sources to M sinks in a single process. All messages go
+// through a network emulator with configurable delay, jitter, packet loss
+// (optionally in bursts), reordering, duplication and bandwidth limit.
+// Everything runs on a single thread and is driven by a virtual clock
+// (including the internal time stamps, see aoo_opt_clock), so a session
+// runs as fast as the CPU allows and is reproducible (see 'seed').
+//
+// Every source sends a mono sample counter (PCM float32, so it is
+// transmitted losslessly); source k ends up on channel k of every sink.
+// This makes it possible to detect glitches (= discontinuities and
+// dropouts) and to measure the actual end-to-end latency.
+//
+// The results are meant for tuning the buffer and resend settings for a
+// given network and for checking that changes don't make the streaming
+// less robust.
+//
+// build (from this directory):
+//   c++ -std=c++14 -O2 -DNDEBUG -DAOO_STATIC -DLOGLEVEL=0 -I.. -I../src -I../../deps
+//       aoo_loopback.cpp ../src/common.cpp ../src/source.cpp ../src/sink.cpp
+//       ../src/codec_pcm.cpp ../src/memory.cpp ../src/sync.cpp ../src/time.cpp
+//       ../src/shm.cpp ../src/trace.cpp ../src/capture.cpp ../../deps/oscpack/osc/*.cpp
+//       -o aoo_loopback -lpthread -lrt
+//
+// usage:
+//   aoo_loopback [name=value]...
+//
+// e.g. aoo_loopback sources=4 delay=20 jitter=5 loss=2 burst=3 buffersize=80
+// With 'switch', the sources change their format periodically, which
+// checks that a format switch doesn't interrupt the stream.
+// Run 'aoo_loopback help' for the list of parameters.
+// The exit code is 2 if there have been any glitches (after the warmup phase)
+// and 3 if aoo_source_process() or aoo_sink_process() have allocated memory
+// (the heap is interposed with glibc, otherwise only aoo_set_alloc_hook()
+// is used; see 'rtcheck').
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_pcm.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/*//////////////////////// real-time check ////////////////////////*/
+
+// Every heap operation on a thread which is inside aoo_source_process()
+// or aoo_sink_process() is counted, including operator new, std::string,
+// etc., so we don't rely on the library reporting its own allocations.
+
+static thread_local bool g_in_process = false;
+static uint64_t g_rt_allocs = 0; // only touched by the audio thread
+
+static inline void check_rt_alloc(){
+    if (g_in_process){
+        g_rt_allocs++;
+    }
+}
+
+#ifdef __GLIBC__
+extern "C" {
+
+void *__libc_malloc(size_t);
+void *__libc_calloc(size_t, size_t);
+void *__libc_realloc(void *, size_t);
+void *__libc_memalign(size_t, size_t);
+void __libc_free(void *);
+
+void *malloc(size_t size){
+    check_rt_alloc();
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+    check_rt_alloc();
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size){
+    check_rt_alloc();
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size){
+    check_rt_alloc();
+    return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size){
+    check_rt_alloc();
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size){
+    check_rt_alloc();
+    *ptr = __libc_memalign(align, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr){
+    if (ptr){
+        check_rt_alloc();
+    }
+    __libc_free(ptr);
+}
+
+} // extern "C"
+#endif // __GLIBC__
+
+namespace {
+
+/*//////////////////////// settings ////////////////////////*/
+
+struct param {
+    const char *name;
+    double value;
+    const char *help;
+};
+
+param g_params[] = {
+    // session
+    { "sources", 1, "number of sources" },
+    { "sinks", 1, "number of sinks" },
+    { "samplerate", 48000, "sample rate" },
+    { "blocksize", 64, "audio block size" },
+    { "duration", 10, "session duration in seconds (virtual time)" },
+    { "warmup", 1, "seconds to ignore at the beginning" },
+    // stream settings
+    { "buffersize", 50, "sink buffer size in ms" },
+    { "packetsize", 512, "max. UDP packet size" },
+    { "resend_limit", 16, "max. number of resend attempts (0: off)" },
+    { "resend_interval", 10, "resend interval in ms" },
+    { "resend_buffersize", 1000, "source resend buffer size in ms" },
+    { "redundancy", 1, "number of times each frame is sent" },
+    { "local", 0, "send the audio data through the local transport (shared memory)" },
+    { "switch", 0, "switch the format (PCM float32 <-> int24) every N seconds (0: off)" },
+    // network emulation (applies to both directions)
+    { "delay", 10, "one-way delay in ms" },
+    { "jitter", 0, "standard deviation of the delay in ms" },
+    { "loss", 0, "packet loss in percent" },
+    { "burst", 1, "average loss burst length in packets" },
+    { "reorder", 0, "percentage of packets that are held back" },
+    { "reorder_delay", 5, "extra delay of held back packets in ms" },
+    { "duplicate", 0, "percentage of duplicated packets" },
+    { "bandwidth", 0, "link capacity in kbit/s (0: unlimited)" },
+    { "queue", 100, "max. queuing delay of a bandwidth limited link in ms" },
+    { "seed", 1, "random seed" },
+    // checks
+    { "rtcheck", 1, "fail if aoo_source_process() or aoo_sink_process() touch the heap" }
+};
+
+double get_param(const char *name){
+    for (auto& p : g_params){
+        if (!strcmp(p.name, name)){
+            return p.value;
+        }
+    }
+    fprintf(stderr, "bug: unknown parameter %s\n", name);
+    exit(EXIT_FAILURE);
+}
+
+bool set_param(const char *arg){
+    auto eq = strchr(arg, '=');
+    if (eq){
+        for (auto& p : g_params){
+            if (!strncmp(p.name, arg, eq - arg) && strlen(p.name) == (size_t)(eq - arg)){
+                p.value = atof(eq + 1);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void print_usage(){
+    printf("usage: aoo_loopback [name=value]...\n\n");
+    for (auto& p : g_params){
+        printf("  %-18s %-50s (%g)\n", p.name, p.help, p.value);
+    }
+}
+
+/*//////////////////////// network emulator ////////////////////////*/
+
+struct link;
+
+struct packet {
+    double time; // delivery time
+    uint64_t order; // keeps packets with the same time in order
+    link *dest;
+    std::vector<char> data;
+};
+
+struct packet_compare {
+    bool operator()(const packet *a, const packet *b) const {
+        return a->time > b->time || (a->time == b->time && a->order > b->order);
+    }
+};
+
+// a unidirectional link between two objects; a pointer to the *reverse*
+// link is passed as the endpoint to aoo_*_handle_message(), so that
+// replies go back through the emulator.
+struct link {
+    enum {
+        to_sink,
+        to_source
+    } direction;
+    int32_t index; // index of the destination object
+    link *reverse;
+    // loss state (Gilbert model)
+    bool bad = false;
+    // bandwidth limit
+    double busy_until = 0;
+    // statistics
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t lost = 0;
+    uint64_t dropped = 0; // queue overflow
+};
+
+class network {
+public:
+    network(uint32_t seed)
+        : mt_(seed){
+        delay_ = get_param("delay") * 0.001;
+        jitter_ = get_param("jitter") * 0.001;
+        reorder_ = get_param("reorder") * 0.01;
+        reorder_delay_ = get_param("reorder_delay") * 0.001;
+        duplicate_ = get_param("duplicate") * 0.01;
+        bandwidth_ = get_param("bandwidth") * 1000.0;
+        maxqueue_ = get_param("queue") * 0.001;
+        // the Gilbert model has a 'good' and a 'bad' (= lossy) state.
+        // we get the state transition probabilities from the average
+        // loss and the average burst length.
+        auto loss = std::min<double>(get_param("loss") * 0.01, 0.99);
+        auto burst = std::max<double>(get_param("burst"), 1.0);
+        p_leave_bad_ = 1.0 / burst;
+        p_enter_bad_ = loss * p_leave_bad_ / (1.0 - loss);
+    }
+
+    ~network(){
+        while (!queue_.empty()){
+            delete queue_.top();
+            queue_.pop();
+        }
+    }
+
+    void set_time(double t){ time_ = t; }
+
+    void send(link *l, const char *data, int32_t n){
+        l->packets++;
+        l->bytes += n;
+        // loss
+        auto p = l->bad ? p_leave_bad_ : p_enter_bad_;
+        if (uniform() < p){
+            l->bad = !l->bad;
+        }
+        if (l->bad){
+            l->lost++;
+            return;
+        }
+        // bandwidth limit: packets are serialized and might have to wait
+        auto start = time_;
+        if (bandwidth_ > 0){
+            start = std::max<double>(time_, l->busy_until);
+            if (start - time_ > maxqueue_){
+                l->dropped++;
+                return;
+            }
+            l->busy_until = start + n * 8.0 / bandwidth_;
+            start = l->busy_until;
+        }
+        enqueue(l, start, data, n);
+        if (duplicate_ > 0 && uniform() < duplicate_){
+            enqueue(l, start, data, n);
+        }
+    }
+
+    // returns nullptr if there is no packet due
+    std::unique_ptr<packet> receive(){
+        if (!queue_.empty() && queue_.top()->time <= time_){
+            std::unique_ptr<packet> p(queue_.top());
+            queue_.pop();
+            return p;
+        }
+        return nullptr;
+    }
+private:
+    void enqueue(link *l, double start, const char *data, int32_t n){
+        auto t = start + delay_;
+        if (jitter_ > 0){
+            t += std::max<double>(0, normal_(mt_) * jitter_);
+        }
+        if (reorder_ > 0 && uniform() < reorder_){
+            t += reorder_delay_;
+        }
+        auto p = new packet;
+        p->time = t;
+        p->order = order_++;
+        p->dest = l;
+        p->data.assign(data, data + n);
+        queue_.push(p);
+    }
+
+    double uniform(){
+        return uniform_(mt_);
+    }
+
+    std::mt19937 mt_;
+    std::uniform_real_distribution<double> uniform_{0.0, 1.0};
+    std::normal_distribution<double> normal_{0.0, 1.0};
+    std::priority_queue<packet *, std::vector<packet *>, packet_compare> queue_;
+    double time_ = 0;
+    uint64_t order_ = 0;
+    double delay_;
+    double jitter_;
+    double reorder_;
+    double reorder_delay_;
+    double duplicate_;
+    double bandwidth_; // bits per second
+    double maxqueue_;
+    double p_enter_bad_;
+    double p_leave_bad_;
+};
+
+network *g_network = nullptr;
+
+// the virtual time (NTP), see aoo_opt_clock
+uint64_t g_time = 0;
+
+uint64_t virtual_clock(void *user){
+    return g_time;
+}
+
+int32_t network_reply(void *user, const char *data, int32_t n){
+    g_network->send((link *)user, data, n);
+    return n;
+}
+
+/*//////////////////////// signal analysis ////////////////////////*/
+
+// the test signal is a sample counter, scaled to [0, 1).
+// float32 can represent integers up to 2^24 exactly.
+#define COUNTER_RANGE (1 << 20)
+
+inline aoo_sample counter_to_sample(int64_t n){
+    return (aoo_sample)((n % (COUNTER_RANGE - 1)) + 1) / (aoo_sample)COUNTER_RANGE;
+}
+
+inline int64_t sample_to_counter(aoo_sample s){
+    return (int64_t)floor(s * COUNTER_RANGE + 0.5) - 1;
+}
+
+// analyzes one sink channel
+struct analyzer {
+    bool started = false;
+    bool measuring = false;
+    bool glitch = false;
+    int64_t last = -1;
+    uint64_t glitches = 0;
+    uint64_t dropouts = 0; // samples
+    uint64_t nsamples = 0;
+    double latency_sum = 0;
+    int64_t latency_min = INT64_MAX;
+    int64_t latency_max = 0;
+
+    // 'now' is the counter value of the first sample of the current block.
+    // A glitch is a run of samples which are either silent or don't
+    // continue the counter (e.g. because of a skipped block or a fade).
+    void process(const aoo_sample *data, int32_t n, int64_t now, bool measure){
+        if (measure && !measuring){
+            // count a glitch which began during the warmup phase
+            if (glitch){
+                glitches++;
+            }
+            measuring = true;
+        }
+        for (int i = 0; i < n; ++i){
+            if (data[i] == 0){
+                if (started && measure){
+                    dropouts++;
+                    if (!glitch){
+                        glitches++;
+                    }
+                }
+                glitch = started;
+                continue;
+            }
+            auto counter = sample_to_counter(data[i]);
+            // account for the counter wrap around
+            bool ok = counter == (last + 1) % (COUNTER_RANGE - 1);
+            if (started && !ok && !glitch && measure){
+                glitches++;
+            }
+            glitch = started && !ok;
+            started = true;
+            last = counter;
+            // only measure the latency on valid samples
+            if (ok && measure){
+                auto latency = ((now + i) % (COUNTER_RANGE - 1)) - counter;
+                if (latency < 0){
+                    latency += COUNTER_RANGE - 1;
+                }
+                latency_sum += latency;
+                latency_min = std::min(latency_min, latency);
+                latency_max = std::max(latency_max, latency);
+                nsamples++;
+            }
+        }
+    }
+};
+
+/*//////////////////////// main ////////////////////////*/
+
+int32_t count_events(void *user, const aoo_event **events, int32_t n){
+    auto lost = (uint64_t *)user; // nullptr: ignore
+    for (int i = 0; i < n; ++i){
+        if (lost && events[i]->type == AOO_BLOCK_LOST_EVENT){
+            *lost += ((const aoo_block_lost_event *)events[i])->count;
+        }
+    }
+    return 1;
+}
+
+int32_t ignore_events(void *user, const aoo_event **events, int32_t n){
+    return 1;
+}
+
+// in case the heap is not interposed (or the library uses a custom allocator)
+void rt_alloc_hook(size_t size, int32_t free, void *context){
+    g_rt_allocs++;
+}
+
+// marks the audio thread while it is inside a process() function
+struct process_scope {
+    process_scope(){ g_in_process = g_rtcheck; }
+    ~process_scope(){ g_in_process = false; }
+
+    static bool g_rtcheck;
+};
+
+bool process_scope::g_rtcheck = false;
+
+void set_int_option(aoo_source *src, int32_t opt, int32_t value){
+    aoo_source_set_option(src, opt, AOO_ARG(value));
+}
+
+void set_int_option(aoo_sink *sink, int32_t opt, int32_t value){
+    aoo_sink_set_option(sink, opt, AOO_ARG(value));
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]){
+    for (int i = 1; i < argc; ++i){
+        if (!set_param(argv[i])){
+            print_usage();
+            return strcmp(argv[i], "help") ? EXIT_FAILURE : EXIT_SUCCESS;
+        }
+    }
+
+    const int numsources = get_param("sources");
+    const int numsinks = get_param("sinks");
+    const int samplerate = get_param("samplerate");
+    const int blocksize = get_param("blocksize");
+    const double duration = get_param("duration");
+    const double warmup = get_param("warmup");
+    if (numsources < 1 || numsinks < 1 || samplerate <= 0 || blocksize <= 0){
+        fprintf(stderr, "bad parameters\n");
+        return EXIT_FAILURE;
+    }
+
+    aoo_initialize();
+
+    process_scope::g_rtcheck = get_param("rtcheck") != 0;
+#ifndef __GLIBC__
+    if (process_scope::g_rtcheck){
+        aoo_set_alloc_hook(rt_alloc_hook, nullptr);
+    }
+#endif
+
+    network net(get_param("seed"));
+    g_network = &net;
+
+    // links[i * numsinks + j]: source i -> sink j
+    std::vector<link> tosink(numsources * numsinks);
+    std::vector<link> tosource(numsources * numsinks);
+    for (int i = 0; i < numsources; ++i){
+        for (int j = 0; j < numsinks; ++j){
+            auto& a = tosink[i * numsinks + j];
+            auto& b = tosource[i * numsinks + j];
+            a.direction = link::to_sink;
+            a.index = j;
+            a.reverse = &b;
+            b.direction = link::to_source;
+            b.index = i;
+            b.reverse = &a;
+        }
+    }
+
+    // create sources
+    std::vector<aoo_source *> sources;
+    for (int i = 0; i < numsources; ++i){
+        auto src = aoo_source_new(i + 1);
+        aoo_source_setup(src, samplerate, blocksize, 1);
+
+        aoo_format_pcm fmt;
+        fmt.header.codec = AOO_CODEC_PCM;
+        fmt.header.nchannels = 1;
+        fmt.header.samplerate = samplerate;
+        fmt.header.blocksize = blocksize;
+        fmt.bitdepth = AOO_PCM_FLOAT32;
+        aoo_source_set_format(src, &fmt.header);
+
+        // with the local transport, only the audio data bypasses the emulator
+        set_int_option(src, aoo_opt_local_transport, get_param("local"));
+        set_int_option(src, aoo_opt_packetsize, get_param("packetsize"));
+        set_int_option(src, aoo_opt_resend_buffersize, get_param("resend_buffersize"));
+        set_int_option(src, aoo_opt_redundancy, get_param("redundancy"));
+
+        for (int j = 0; j < numsinks; ++j){
+            auto ep = &tosink[i * numsinks + j];
+            aoo_source_add_sink(src, ep, j + 1, network_reply);
+            // source i -> sink channel i
+            int32_t onset = i;
+            aoo_source_set_sinkoption(src, ep, j + 1, aoo_opt_channelonset, AOO_ARG(onset));
+        }
+        aoo_source_set_clock(src, virtual_clock, nullptr);
+        aoo_source_start(src);
+        sources.push_back(src);
+    }
+
+    // create sinks
+    std::vector<aoo_sink *> sinks;
+    for (int j = 0; j < numsinks; ++j){
+        auto sink = aoo_sink_new(j + 1);
+        aoo_sink_setup(sink, samplerate, blocksize, numsources);
+        set_int_option(sink, aoo_opt_buffersize, get_param("buffersize"));
+        set_int_option(sink, aoo_opt_packetsize, get_param("packetsize"));
+        set_int_option(sink, aoo_opt_resend_limit, get_param("resend_limit"));
+        set_int_option(sink, aoo_opt_resend_interval, get_param("resend_interval"));
+        aoo_sink_set_clock(sink, virtual_clock, nullptr);
+        sinks.push_back(sink);
+    }
+
+    std::vector<aoo_sample> inbuf(blocksize);
+    std::vector<aoo_sample> outbuf(blocksize * numsources);
+    std::vector<aoo_sample *> outchannels(numsources);
+    for (int i = 0; i < numsources; ++i){
+        outchannels[i] = &outbuf[i * blocksize];
+    }
+    std::vector<analyzer> analyzers(numsources * numsinks);
+    uint64_t lostblocks = 0;
+
+    // CPU time
+    using clock = std::chrono::steady_clock;
+    clock::duration source_time{0};
+    clock::duration sink_time{0};
+
+    // virtual time; the audio clock is perfectly stable and the time tags
+    // start at the current system time. Sources and sinks use the same
+    // time for their internal time stamps (see aoo_opt_clock).
+    const double start = aoo_osctime_toseconds(aoo_osctime_get());
+    const int64_t numblocks = duration * samplerate / blocksize;
+    const int64_t warmupblocks = warmup * samplerate / blocksize;
+    // format switches; int24 still transmits the counter losslessly,
+    // so the switch must not cause a glitch.
+    const int64_t switchblocks = get_param("switch") * samplerate / blocksize;
+    int64_t counter = 0;
+
+    for (int64_t block = 0; block < numblocks; ++block, counter += blocksize){
+        double now = (double)counter / (double)samplerate;
+        auto tt = aoo_osctime_fromseconds(start + now);
+        g_time = tt;
+        bool measure = block >= warmupblocks;
+        net.set_time(now);
+
+        if (switchblocks > 0 && block > 0 && (block % switchblocks) == 0){
+            aoo_format_pcm fmt;
+            fmt.header.codec = AOO_CODEC_PCM;
+            fmt.header.nchannels = 1;
+            fmt.header.samplerate = samplerate;
+            fmt.header.blocksize = blocksize;
+            fmt.bitdepth = ((block / switchblocks) % 2) ? AOO_PCM_INT24 : AOO_PCM_FLOAT32;
+            for (auto src : sources){
+                aoo_source_set_format(src, &fmt.header);
+            }
+        }
+
+        // sources
+        auto t1 = clock::now();
+        for (int i = 0; i < blocksize; ++i){
+            inbuf[i] = counter_to_sample(counter + i);
+        }
+        const aoo_sample *in = inbuf.data();
+        for (auto src : sources){
+            {
+                process_scope scope;
+                aoo_source_process(src, &in, blocksize, tt);
+            }
+            aoo_source_send(src);
+            aoo_source_handle_events(src, ignore_events, nullptr);
+        }
+        auto t2 = clock::now();
+
+        // deliver packets
+        while (auto p = net.receive()){
+            auto l = p->dest;
+            auto n = (int32_t)p->data.size();
+            if (l->direction == link::to_sink){
+                auto t3 = clock::now();
+                aoo_sink_handle_message(sinks[l->index], p->data.data(), n,
+                                        l->reverse, network_reply);
+                sink_time += clock::now() - t3;
+            } else {
+                auto t3 = clock::now();
+                aoo_source_handle_message(sources[l->index], p->data.data(), n,
+                                          l->reverse, network_reply);
+                source_time += clock::now() - t3;
+            }
+        }
+
+        // sinks
+        auto t4 = clock::now();
+        for (int j = 0; j < numsinks; ++j){
+            std::fill(outbuf.begin(), outbuf.end(), 0);
+            {
+                process_scope scope;
+                aoo_sink_process(sinks[j], outchannels.data(), blocksize, tt);
+            }
+            aoo_sink_send(sinks[j]);
+            aoo_sink_handle_events(sinks[j], count_events,
+                                   measure ? &lostblocks : nullptr);
+            for (int i = 0; i < numsources; ++i){
+                analyzers[i * numsinks + j].process(outchannels[i], blocksize,
+                                                    counter, measure);
+            }
+        }
+        auto t5 = clock::now();
+
+        source_time += t2 - t1;
+        sink_time += t5 - t4;
+    }
+
+    // results
+    auto us = [](clock::duration d){
+        return std::chrono::duration<double>(d).count() * 1e6;
+    };
+    auto ms = [&](double samples){
+        return samples * 1000.0 / samplerate;
+    };
+
+    printf("%d source(s), %d sink(s), %d Hz, blocksize %d, %g s\n",
+           numsources, numsinks, samplerate, blocksize, duration);
+    printf("delay %g ms, jitter %g ms, loss %g%% (burst %g), reorder %g%%, "
+           "duplicate %g%%, bandwidth %g kbit/s\n",
+           get_param("delay"), get_param("jitter"), get_param("loss"),
+           get_param("burst"), get_param("reorder"), get_param("duplicate"),
+           get_param("bandwidth"));
+    printf("buffersize %g ms, resend limit %g, interval %g ms, redundancy %g\n\n",
+           get_param("buffersize"), get_param("resend_limit"),
+           get_param("resend_interval"), get_param("redundancy"));
+
+    uint64_t glitches = 0, dropouts = 0, nsamples = 0;
+    double latency_sum = 0;
+    int64_t latency_min = INT64_MAX, latency_max = 0;
+    for (auto& a : analyzers){
+        glitches += a.glitches;
+        dropouts += a.dropouts;
+        nsamples += a.nsamples;
+        latency_sum += a.latency_sum;
+        latency_min = std::min(latency_min, a.latency_min);
+        latency_max = std::max(latency_max, a.latency_max);
+        if (!a.started){
+            printf("WARNING: a stream never started!\n");
+        }
+    }
+    printf("glitches:        %llu (%.3f%% dropouts), %llu lost blocks\n",
+           (unsigned long long)glitches,
+           (nsamples + dropouts) ? 100.0 * dropouts / (nsamples + dropouts) : 0.0,
+           (unsigned long long)lostblocks);
+    if (nsamples > 0){
+        printf("latency:         avg %.2f ms, min %.2f ms, max %.2f ms\n",
+               ms(latency_sum / nsamples), ms(latency_min), ms(latency_max));
+    }
+
+    // traffic
+    uint64_t packets[2] = { 0 }, bytes[2] = { 0 }, lost[2] = { 0 }, dropped[2] = { 0 };
+    for (int k = 0; k < 2; ++k){
+        auto& links = k == 0 ? tosink : tosource;
+        for (auto& l : links){
+            packets[k] += l.packets;
+            bytes[k] += l.bytes;
+            lost[k] += l.lost;
+            dropped[k] += l.dropped;
+        }
+    }
+    for (int k = 0; k < 2; ++k){
+        printf("%-16s %llu packets, %.1f kbit/s per link, %llu lost, %llu dropped\n",
+               k == 0 ? "source -> sink:" : "sink -> source:",
+               (unsigned long long)packets[k],
+               bytes[k] * 8.0 / 1000.0 / duration / (numsources * numsinks),
+               (unsigned long long)lost[k], (unsigned long long)dropped[k]);
+    }
+
+    uint64_t requests = 0, responses = 0;
+    for (int j = 0; j < numsinks; ++j){
+        for (int i = 0; i < numsources; ++i){
+            aoo_stream_stats stats;
+            if (aoo_sink_get_source_stats(sinks[j], &tosource[i * numsinks + j],
+                                          i + 1, &stats) > 0){
+                requests += stats.resend_requests;
+                responses += stats.resend_responses;
+            }
+        }
+    }
+    printf("resend:          %llu frames requested, %llu frames received\n",
+           (unsigned long long)requests, (unsigned long long)responses);
+
+    printf("CPU per block:   source %.2f us, sink %.2f us\n",
+           us(source_time) / (numblocks * numsources),
+           us(sink_time) / (numblocks * numsinks));
+
+    if (process_scope::g_rtcheck){
+        printf("RT heap calls:   %llu\n", (unsigned long long)g_rt_allocs);
+    }
+
+    for (auto src : sources){
+        aoo_source_free(src);
+    }
+    for (auto sink : sinks){
+        aoo_sink_free(sink);
+    }
+    g_network = nullptr;
+
+    aoo_terminate();
+
+    if (g_rt_allocs > 0){
+        fprintf(stderr, "ERROR: the process functions have touched the heap!\n");
+        return 3;
+    }
+    return glitches == 0 ? EXIT_SUCCESS : 2;
+}
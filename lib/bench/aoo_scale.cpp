@@ -0,0 +1,481 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Scaling benchmark (Linux only, because of the RSS measurement).
+//
+// Measures the cost per stream for two topologies:
+//   fan-in:  N sources -> 1 sink (source k is received on sink channel k)
+//   fan-out: 1 source -> N sinks
+// for N = 1, 2, 4, ... up to the given maximum.
+//
+// Every configuration runs in real time with an audio thread, which calls
+// aoo_source_process() and aoo_sink_process(), and a network thread, which
+// calls the send and handle_message functions. Packets are passed directly
+// between the objects (in-process transport), so we only measure the cost
+// of the library itself.
+//
+// For each N we report:
+// - audio thread time per block (all process() calls) and per stream
+// - network thread time per block and per stream
+// - CPU load of both threads relative to the block period
+// - library heap memory (from a counting allocator) and RSS per stream
+// - glitches (dropouts or discontinuities of the transmitted sample counter),
+//   the percentage of missing samples and audio overruns (blocks which took
+//   longer than the block period)
+// Every configuration is run several times; the times are the median of
+// all runs, 'spread' is the relative range of the audio thread time and
+// glitches and overruns are given as min-max.
+// Finally, it prints the smallest N from which on every run glitched.
+//
+// build (from this directory):
+//   c++ -std=c++14 -O2 -DNDEBUG -DAOO_STATIC -DLOGLEVEL=0 -I.. -I../src -I../../deps
+//       aoo_scale.cpp ../src/common.cpp ../src/source.cpp ../src/sink.cpp
+//       ../src/codec_pcm.cpp ../src/memory.cpp ../src/sync.cpp ../src/time.cpp
+//       ../src/shm.cpp ../src/trace.cpp ../src/capture.cpp ../../deps/oscpack/osc/*.cpp
+//       -o aoo_scale -lpthread -lrt
+//
+// usage:
+//   aoo_scale [maxstreams] [seconds] [blocksize] [samplerate] [buffersize] [local] [runs]
+//
+// 'seconds' is the duration of each run (default: 3); the first second
+// is ignored for the glitch detection. After that, every silent or
+// discontinuous output sample counts as a dropout, so streams which never
+// start are detected as well. 'buffersize' is the sink buffer size in ms
+// (default: 50). If 'local' is 1, the audio data is sent through the local
+// transport (shared memory) instead (default: 0). 'runs' is the number of
+// runs per configuration (default: 3).
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_pcm.h"
+
+#include <unistd.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+/*//////////////////////// memory ////////////////////////*/
+
+std::atomic<int64_t> g_heap{0};
+
+void * counting_alloc(size_t n, void *context){
+    g_heap += n;
+    return malloc(n);
+}
+
+void counting_free(void *ptr, size_t n, void *context){
+    g_heap -= n;
+    free(ptr);
+}
+
+// resident set size in bytes
+int64_t get_rss(){
+    int64_t size = 0, resident = 0;
+    auto fp = fopen("/proc/self/statm", "r");
+    if (fp){
+        if (fscanf(fp, "%lld %lld", (long long *)&size, (long long *)&resident) != 2){
+            resident = 0;
+        }
+        fclose(fp);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+/*//////////////////////// transport ////////////////////////*/
+
+struct endpoint {
+    enum {
+        source,
+        sink
+    } type;
+    int32_t index; // index of the destination object
+    endpoint *reverse;
+};
+
+struct packet {
+    endpoint *dest;
+    std::vector<char> data;
+};
+
+// only used on the network thread
+std::vector<packet> g_packets;
+
+int32_t transport_reply(void *user, const char *data, int32_t n){
+    g_packets.push_back(packet { (endpoint *)user, std::vector<char>(data, data + n) });
+    return n;
+}
+
+/*//////////////////////// glitch detection ////////////////////////*/
+
+// the test signal is a sample counter, scaled to [0, 1).
+#define COUNTER_RANGE (1 << 20)
+
+inline aoo_sample counter_to_sample(int64_t n){
+    return (aoo_sample)((n % (COUNTER_RANGE - 1)) + 1) / (aoo_sample)COUNTER_RANGE;
+}
+
+// counts runs of samples which are silent or don't continue the counter.
+// During the warmup phase we only follow the counter; afterwards every
+// bad sample is a dropout, even if the stream hasn't started yet.
+struct analyzer {
+    int64_t last = -1;
+    bool glitch = false;
+    uint64_t glitches = 0;
+    uint64_t dropped = 0; // number of bad samples
+
+    void process(const aoo_sample *data, int32_t n, bool measure){
+        for (int i = 0; i < n; ++i){
+            int64_t counter = data[i] != 0 ?
+                (int64_t)floor(data[i] * COUNTER_RANGE + 0.5) - 1 : -1;
+            bool ok = counter >= 0 &&
+                (last < 0 || counter == (last + 1) % (COUNTER_RANGE - 1));
+            if (!ok && measure){
+                if (!glitch){
+                    glitches++;
+                }
+                dropped++;
+            }
+            glitch = !ok && measure;
+            if (counter >= 0){
+                last = counter;
+            }
+        }
+    }
+};
+
+/*//////////////////////// benchmark ////////////////////////*/
+
+struct settings {
+    int samplerate;
+    int blocksize;
+    int buffersize;
+    double duration;
+    int local; // use the local transport
+    int runs; // runs per configuration
+};
+
+struct result {
+    double audio_time; // seconds per block
+    double network_time; // seconds per block
+    int64_t heap;
+    int64_t rss;
+    uint64_t glitches;
+    double dropped; // fraction of missing samples
+    uint64_t overruns; // blocks where processing took longer than the block period
+};
+
+result run(int numsources, int numsinks, const settings& s){
+    using clock = std::chrono::steady_clock;
+
+    auto rss_before = get_rss();
+    auto heap_before = g_heap.load();
+
+    // fan-in: every source goes to its own sink channel
+    const int nchannels = numsinks == 1 ? numsources : 1;
+
+    std::vector<endpoint> tosink(numsources * numsinks);
+    std::vector<endpoint> tosource(numsources * numsinks);
+    for (int i = 0; i < numsources; ++i){
+        for (int j = 0; j < numsinks; ++j){
+            auto& a = tosink[i * numsinks + j];
+            auto& b = tosource[i * numsinks + j];
+            a = endpoint { endpoint::sink, j, &b };
+            b = endpoint { endpoint::source, i, &a };
+        }
+    }
+
+    std::vector<aoo_source *> sources;
+    for (int i = 0; i < numsources; ++i){
+        auto src = aoo_source_new(i + 1);
+        aoo_source_setup(src, s.samplerate, s.blocksize, 1);
+
+        aoo_format_pcm fmt;
+        fmt.header.codec = AOO_CODEC_PCM;
+        fmt.header.nchannels = 1;
+        fmt.header.samplerate = s.samplerate;
+        fmt.header.blocksize = s.blocksize;
+        fmt.bitdepth = AOO_PCM_FLOAT32;
+        aoo_source_set_format(src, &fmt.header);
+
+        int32_t local = s.local;
+        aoo_source_set_option(src, aoo_opt_local_transport, AOO_ARG(local));
+        // all objects share the same clock, so there is no drift to compensate.
+        // (Otherwise scheduling jitter would make the DLL resample the signal.)
+        int32_t resample = 0;
+        aoo_source_set_option(src, aoo_opt_dynamic_resampling, AOO_ARG(resample));
+
+        for (int j = 0; j < numsinks; ++j){
+            auto ep = &tosink[i * numsinks + j];
+            aoo_source_add_sink(src, ep, j + 1, transport_reply);
+            if (nchannels > 1){
+                aoo_source_set_sink_channelonset(src, ep, j + 1, i);
+            }
+        }
+        aoo_source_start(src);
+        sources.push_back(src);
+    }
+
+    std::vector<aoo_sink *> sinks;
+    for (int j = 0; j < numsinks; ++j){
+        auto sink = aoo_sink_new(j + 1);
+        aoo_sink_setup(sink, s.samplerate, s.blocksize, nchannels);
+        aoo_sink_set_buffersize(sink, s.buffersize);
+        int32_t resample = 0;
+        aoo_sink_set_option(sink, aoo_opt_dynamic_resampling, AOO_ARG(resample));
+        sinks.push_back(sink);
+    }
+
+    // network thread
+    std::atomic<bool> running{true};
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool pending = false;
+    clock::duration network_time{0};
+
+    std::thread network([&](){
+        while (running.load()){
+            {
+                // wake up after every audio block, but also periodically
+                // (for pings and resend requests)
+                std::unique_lock<std::mutex> lock(mutex);
+                cond.wait_for(lock, std::chrono::milliseconds(1), [&]{ return pending; });
+                pending = false;
+            }
+            auto t1 = clock::now();
+            for (auto src : sources){
+                aoo_source_send(src);
+            }
+            for (auto sink : sinks){
+                aoo_sink_send(sink);
+            }
+            // deliver packets; this might generate replies
+            while (!g_packets.empty()){
+                auto packets = std::move(g_packets);
+                g_packets.clear();
+                for (auto& p : packets){
+                    auto n = (int32_t)p.data.size();
+                    if (p.dest->type == endpoint::sink){
+                        aoo_sink_handle_message(sinks[p.dest->index], p.data.data(), n,
+                                                p.dest->reverse, transport_reply);
+                    } else {
+                        aoo_source_handle_message(sources[p.dest->index], p.data.data(), n,
+                                                  p.dest->reverse, transport_reply);
+                    }
+                }
+            }
+            network_time += clock::now() - t1;
+        }
+    });
+
+    // audio thread (= this thread)
+    std::vector<aoo_sample> inbuf(s.blocksize);
+    std::vector<aoo_sample> outbuf(s.blocksize * nchannels);
+    std::vector<aoo_sample *> outchannels(nchannels);
+    for (int k = 0; k < nchannels; ++k){
+        outchannels[k] = &outbuf[k * s.blocksize];
+    }
+    std::vector<analyzer> analyzers(numsinks * nchannels);
+
+    const auto period = std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>((double)s.blocksize / s.samplerate));
+    const int64_t numblocks = s.duration * s.samplerate / s.blocksize;
+    const int64_t warmupblocks = std::min<double>(1.0, s.duration * 0.5)
+            * s.samplerate / s.blocksize;
+    clock::duration audio_time{0};
+    uint64_t overruns = 0;
+    int64_t counter = 0;
+
+    auto deadline = clock::now();
+    for (int64_t block = 0; block < numblocks; ++block, counter += s.blocksize){
+        bool measure = block >= warmupblocks;
+        auto tt = aoo_osctime_get();
+
+        for (int i = 0; i < s.blocksize; ++i){
+            inbuf[i] = counter_to_sample(counter + i);
+        }
+        const aoo_sample *in = inbuf.data();
+
+        auto t1 = clock::now();
+        for (auto src : sources){
+            aoo_source_process(src, &in, s.blocksize, tt);
+        }
+        for (int j = 0; j < numsinks; ++j){
+            std::fill(outbuf.begin(), outbuf.end(), 0);
+            aoo_sink_process(sinks[j], outchannels.data(), s.blocksize, tt);
+            for (int k = 0; k < nchannels; ++k){
+                analyzers[j * nchannels + k].process(outchannels[k], s.blocksize, measure);
+            }
+        }
+        auto t2 = clock::now();
+        if (measure){
+            audio_time += t2 - t1;
+            if (t2 - t1 > period){
+                overruns++;
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            pending = true;
+        }
+        cond.notify_one();
+
+        deadline += period;
+        auto now = clock::now();
+        if (now > deadline){
+            // we're late; start again from the current time
+            deadline = now;
+        } else {
+            std::this_thread::sleep_until(deadline);
+        }
+    }
+
+    running = false;
+    cond.notify_one();
+    network.join();
+    g_packets.clear();
+
+    result r;
+    auto nmeasured = numblocks - warmupblocks;
+    r.audio_time = std::chrono::duration<double>(audio_time).count() / nmeasured;
+    // the network time also includes the warmup phase
+    r.network_time = std::chrono::duration<double>(network_time).count() / numblocks;
+    r.heap = g_heap.load() - heap_before;
+    r.rss = get_rss() - rss_before;
+    r.glitches = 0;
+    uint64_t dropped = 0;
+    for (auto& a : analyzers){
+        r.glitches += a.glitches;
+        dropped += a.dropped;
+    }
+    r.dropped = (double)dropped / (nmeasured * s.blocksize * analyzers.size());
+    r.overruns = overruns;
+
+    for (auto src : sources){
+        aoo_source_free(src);
+    }
+    for (auto sink : sinks){
+        aoo_sink_free(sink);
+    }
+
+    return r;
+}
+
+template<typename T, typename U>
+T median(const std::vector<result>& results, T U::*field){
+    std::vector<T> v;
+    for (auto& r : results){
+        v.push_back(r.*field);
+    }
+    std::sort(v.begin(), v.end());
+    return v[v.size() / 2];
+}
+
+template<typename T, typename U>
+std::pair<T, T> minmax(const std::vector<result>& results, T U::*field){
+    auto cmp = [&](const result& a, const result& b){ return a.*field < b.*field; };
+    auto mm = std::minmax_element(results.begin(), results.end(), cmp);
+    return std::make_pair((*mm.first).*field, (*mm.second).*field);
+}
+
+void run_topology(const char *name, bool fanin, int maxstreams, const settings& s){
+    auto period = (double)s.blocksize / s.samplerate;
+
+    printf("%s\n", name);
+    printf("%7s %12s %7s %12s %12s %12s %8s %10s %10s %11s %8s %11s\n",
+           "streams", "audio/blk", "spread", "audio/strm", "net/blk", "net/strm",
+           "load", "heap/strm", "rss/strm", "glitches", "dropped", "overruns");
+
+    // the smallest N from which on all runs glitched; isolated glitches
+    // can also be caused by scheduling jitter (e.g. on a single core machine).
+    int glitchpoint = 0;
+    for (int n = 1; n <= maxstreams; n *= 2){
+        std::vector<result> results;
+        for (int i = 0; i < s.runs; ++i){
+            results.push_back(fanin ? run(n, 1, s) : run(1, n, s));
+        }
+        auto audio_time = median(results, &result::audio_time);
+        auto network_time = median(results, &result::network_time);
+        auto audio_range = minmax(results, &result::audio_time);
+        auto glitches = minmax(results, &result::glitches);
+        auto dropped = minmax(results, &result::dropped);
+        auto overruns = minmax(results, &result::overruns);
+        char glitchbuf[32], overrunbuf[32];
+        snprintf(glitchbuf, sizeof(glitchbuf), "%llu-%llu",
+                 (unsigned long long)glitches.first, (unsigned long long)glitches.second);
+        snprintf(overrunbuf, sizeof(overrunbuf), "%llu-%llu",
+                 (unsigned long long)overruns.first, (unsigned long long)overruns.second);
+
+        printf("%7d %10.1fus %6.1f%% %10.2fus %10.1fus %10.2fus %7.1f%% %8.1fkB %8.1fkB %11s %7.2f%% %11s\n",
+               n, audio_time * 1e6,
+               audio_time > 0 ? (audio_range.second - audio_range.first) / audio_time * 100.0 : 0.0,
+               audio_time * 1e6 / n, network_time * 1e6, network_time * 1e6 / n,
+               (audio_time + network_time) / period * 100.0,
+               median(results, &result::heap) / 1024.0 / n,
+               median(results, &result::rss) / 1024.0 / n,
+               glitchbuf, dropped.second * 100.0, overrunbuf);
+        fflush(stdout);
+        bool always = std::all_of(results.begin(), results.end(), [](const result& r){
+            return r.glitches > 0 || r.overruns > 0;
+        });
+        if (always){
+            if (!glitchpoint){
+                glitchpoint = n;
+            }
+        } else {
+            glitchpoint = 0;
+        }
+    }
+    if (glitchpoint){
+        printf("=> glitches begin at %d streams\n\n", glitchpoint);
+    } else {
+        printf("=> no sustained glitches up to %d streams\n\n", maxstreams);
+    }
+}
+
+} // namespace
+
+int main(int argc, const char *argv[]){
+    int maxstreams = argc > 1 ? atoi(argv[1]) : 512;
+    settings s;
+    s.duration = argc > 2 ? atof(argv[2]) : 3;
+    s.blocksize = argc > 3 ? atoi(argv[3]) : 64;
+    s.samplerate = argc > 4 ? atoi(argv[4]) : 48000;
+    s.buffersize = argc > 5 ? atoi(argv[5]) : 50;
+    s.local = argc > 6 ? atoi(argv[6]) : 0;
+    s.runs = argc > 7 ? atoi(argv[7]) : 3;
+    if (maxstreams < 1 || s.duration <= 0 || s.blocksize <= 0 || s.samplerate <= 0
+            || s.runs < 1){
+        fprintf(stderr, "usage: %s [maxstreams] [seconds] [blocksize] "
+                "[samplerate] [buffersize] [local] [runs]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // must be set before aoo_initialize()!
+    aoo_allocator alloc = { counting_alloc, counting_free, nullptr };
+    aoo_set_allocator(&alloc);
+
+    aoo_initialize();
+
+    printf("%d Hz, blocksize %d (%.2f ms), sink buffer %d ms, %d x %g s per run%s\n\n",
+           s.samplerate, s.blocksize, s.blocksize * 1000.0 / s.samplerate,
+           s.buffersize, s.runs, s.duration, s.local ? ", local transport" : "");
+
+    run_topology("fan-in (N sources -> 1 sink)", true, maxstreams, s);
+    run_topology("fan-out (1 source -> N sinks)", false, maxstreams, s);
+
+    aoo_terminate();
+
+    return EXIT_SUCCESS;
+}
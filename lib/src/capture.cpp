@@ -0,0 +1,232 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "capture.hpp"
+
+#include "aoo/aoo_utils.hpp"
+
+#if AOO_CAPTURE
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cerrno>
+#include <new>
+#include <algorithm>
+
+#define AOO_CAPTURE_MAGIC 0x616f6f63 // "aooc"
+#define AOO_CAPTURE_VERSION 1
+#define AOO_CAPTURE_ALIGN 8
+
+namespace aoo {
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "capture_header needs lock-free 64-bit atomics"
+#endif
+
+static inline uint64_t capture_align(uint64_t n){
+    return (n + AOO_CAPTURE_ALIGN - 1) & ~(uint64_t)(AOO_CAPTURE_ALIGN - 1);
+}
+
+static const uint64_t capture_header_size = capture_align(sizeof(capture_header));
+
+/*///////////////////////// capture_writer /////////////////////////*/
+
+std::unique_ptr<capture_writer> capture_writer::create(const char *path,
+                                                       const capture_header& info){
+    int fd = ::open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    if (fd < 0){
+        LOG_ERROR("capture: couldn't create " << path << " (" << errno << ")");
+        return nullptr;
+    }
+    // the file is sparse, so this doesn't actually allocate any disk space.
+    auto mapsize = capture_header_size + AOO_CAPTURE_MAXSIZE;
+    if (ftruncate(fd, mapsize) < 0){
+        LOG_ERROR("capture: couldn't resize " << path << " (" << errno << ")");
+        close(fd);
+        return nullptr;
+    }
+    auto ptr = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED){
+        LOG_ERROR("capture: couldn't map " << path << " (" << errno << ")");
+        close(fd);
+        return nullptr;
+    }
+
+    auto h = new (ptr) capture_header();
+    h->magic = AOO_CAPTURE_MAGIC;
+    h->version = AOO_CAPTURE_VERSION;
+    h->type = info.type;
+    h->id = info.id;
+    h->samplerate = info.samplerate;
+    h->blocksize = info.blocksize;
+    h->nchannels = info.nchannels;
+    h->buffersize = info.buffersize;
+    h->start = info.start;
+    h->size.store(0);
+    h->count.store(0);
+
+    std::unique_ptr<capture_writer> writer(new capture_writer());
+    writer->header_ = h;
+    writer->data_ = (char *)ptr + capture_header_size;
+    writer->capacity_ = AOO_CAPTURE_MAXSIZE;
+    writer->fd_ = fd;
+    writer->endpoints_.reserve(AOO_CAPTURE_MAXENDPOINTS);
+    writer->prefault(0);
+
+    LOG_VERBOSE("capture: recording to " << path);
+
+    return writer;
+}
+
+capture_writer::~capture_writer(){
+    auto size = header_->size.load();
+    munmap(header_, capture_header_size + capacity_);
+    // cut off the unused part
+    if (ftruncate(fd_, capture_header_size + size) < 0){
+        LOG_WARNING("capture: couldn't truncate file (" << errno << ")");
+    }
+    close(fd_);
+}
+
+// allocate and touch the next chunk of the (sparse) file
+// before we actually need it.
+void capture_writer::prefault(uint64_t size){
+    if (size + AOO_CAPTURE_PREFAULT / 2 < prefaulted_ || prefaulted_ >= capacity_){
+        return;
+    }
+    auto n = std::min<uint64_t>(AOO_CAPTURE_PREFAULT, capacity_ - prefaulted_);
+#ifdef __linux__
+    posix_fallocate(fd_, capture_header_size + prefaulted_, n);
+#endif
+    // the file is zeroed anyway
+    auto pagesize = (uint64_t)sysconf(_SC_PAGESIZE);
+    for (uint64_t i = 0; i < n; i += pagesize){
+        ((volatile char *)data_)[prefaulted_ + i] = 0;
+    }
+    prefaulted_ += n;
+}
+
+// get space for a record with 'n' bytes of payload;
+// returns nullptr if the file is full.
+char * capture_writer::reserve(int32_t n){
+    auto size = header_->size.load(std::memory_order_relaxed);
+    if (size + capture_align(sizeof(capture_record) + n) > capacity_){
+        if (!full_){
+            LOG_WARNING("capture: file is full");
+            full_ = true;
+        }
+        return nullptr;
+    }
+    prefault(size + capture_align(sizeof(capture_record) + n));
+    return data_ + size;
+}
+
+void capture_writer::write(const char *data, int32_t n, void *endpoint, time_tag t){
+    auto ptr = reserve(n);
+    if (!ptr){
+        return;
+    }
+    // the number of peers is small, so a linear search is fine
+    uint32_t index = 0;
+    while (index < endpoints_.size() && endpoints_[index] != endpoint){
+        index++;
+    }
+    if (index == endpoints_.size()){
+        endpoints_.push_back(endpoint);
+    }
+
+    capture_record r;
+    r.time = t.to_uint64();
+    r.endpoint = index;
+    r.size = n;
+    memcpy(ptr, &r, sizeof(r));
+    memcpy(ptr + sizeof(r), data, n);
+    header_->count.fetch_add(1, std::memory_order_relaxed);
+    header_->size.fetch_add(capture_align(sizeof(r) + n), std::memory_order_release);
+}
+
+void capture_writer::write_process(int32_t nsampframes, uint64_t t){
+    auto ptr = reserve(0);
+    if (!ptr){
+        return;
+    }
+    capture_record r;
+    r.time = t;
+    r.endpoint = AOO_CAPTURE_PROCESS;
+    r.size = nsampframes;
+    memcpy(ptr, &r, sizeof(r));
+    header_->count.fetch_add(1, std::memory_order_relaxed);
+    header_->size.fetch_add(capture_align(sizeof(r)), std::memory_order_release);
+}
+
+/*///////////////////////// capture_reader /////////////////////////*/
+
+std::unique_ptr<capture_reader> capture_reader::open(const char *path){
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0){
+        LOG_ERROR("capture: couldn't open " << path << " (" << errno << ")");
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (uint64_t)st.st_size < capture_header_size){
+        LOG_ERROR("capture: " << path << " is not a capture file");
+        close(fd);
+        return nullptr;
+    }
+    auto mapsize = (size_t)st.st_size;
+    auto ptr = mmap(nullptr, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED){
+        LOG_ERROR("capture: couldn't map " << path << " (" << errno << ")");
+        return nullptr;
+    }
+
+    auto h = (const capture_header *)ptr;
+    if (h->magic != AOO_CAPTURE_MAGIC || h->version != AOO_CAPTURE_VERSION){
+        LOG_ERROR("capture: " << path << " is not a capture file or has the wrong version");
+        munmap(ptr, mapsize);
+        return nullptr;
+    }
+
+    std::unique_ptr<capture_reader> reader(new capture_reader());
+    reader->header_ = h;
+    reader->data_ = (const char *)ptr + capture_header_size;
+    // the file might still be written to (or the writer has crashed)
+    reader->size_ = std::min<uint64_t>(h->size.load(std::memory_order_acquire),
+                                       mapsize - capture_header_size);
+    reader->mapsize_ = mapsize;
+
+    return reader;
+}
+
+capture_reader::~capture_reader(){
+    munmap((void *)header_, mapsize_);
+}
+
+const char * capture_reader::read(capture_record& record){
+    if (pos_ + sizeof(capture_record) > size_){
+        return nullptr;
+    }
+    memcpy(&record, data_ + pos_, sizeof(record));
+    auto data = data_ + pos_ + sizeof(record);
+    if (record.is_process()){
+        pos_ += capture_align(sizeof(record));
+        return data; // no payload
+    }
+    if (record.size < 0 || pos_ + sizeof(record) + record.size > size_){
+        LOG_ERROR("capture: bad record size " << record.size);
+        pos_ = size_;
+        return nullptr;
+    }
+    pos_ += capture_align(sizeof(record) + record.size);
+    return data;
+}
+
+} // aoo
+
+#endif // AOO_CAPTURE
@@ -0,0 +1,153 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "aoo/aoo.h"
+
+#include "time.hpp"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// capture of received datagrams (see aoo_opt_capture); currently POSIX only.
+#ifndef AOO_CAPTURE
+# ifdef _WIN32
+#  define AOO_CAPTURE 0
+# else
+#  define AOO_CAPTURE 1
+# endif
+#endif
+
+// maximum size of a capture file in bytes; the file is created sparse
+// and truncated to the actual size when the capture is closed.
+#ifndef AOO_CAPTURE_MAXSIZE
+#define AOO_CAPTURE_MAXSIZE ((uint64_t)1 << 30)
+#endif
+
+// the file is allocated and prefaulted in chunks of this size,
+// so that we don't get a page fault on every write.
+#ifndef AOO_CAPTURE_PREFAULT
+#define AOO_CAPTURE_PREFAULT ((uint64_t)1 << 20)
+#endif
+
+// max. number of pending process() records (see sink::process())
+#ifndef AOO_CAPTURE_QUEUESIZE
+#define AOO_CAPTURE_QUEUESIZE 1024
+#endif
+
+// initial size of the endpoint table
+#ifndef AOO_CAPTURE_MAXENDPOINTS
+#define AOO_CAPTURE_MAXENDPOINTS 64
+#endif
+
+namespace aoo {
+
+/*///////////////////////// capture file /////////////////////////*/
+
+// A capture file consists of a capture_header, followed by records.
+// Every record is a capture_record, followed by the datagram,
+// padded to 8 bytes. All values are in host byte order.
+// The header is updated after every record, so a capture stays
+// readable even if the process crashes.
+// Sinks also record their process() calls, so that a replay can
+// reproduce the exact order of network and audio thread operations.
+
+struct capture_header {
+    uint32_t magic;
+    uint32_t version;
+    int32_t type;       // AOO_TYPE_SINK or AOO_TYPE_SOURCE
+    int32_t id;         // object ID
+    int32_t samplerate; // object settings (0: not setup yet)
+    int32_t blocksize;
+    int32_t nchannels;
+    int32_t buffersize; // sink buffer size in ms (0 for sources)
+    uint64_t start;     // NTP time of the start of the capture
+    std::atomic<uint64_t> size; // number of bytes after the header
+    std::atomic<uint64_t> count; // number of records
+};
+
+// endpoint of a process() record
+#define AOO_CAPTURE_PROCESS 0xffffffff
+
+struct capture_record {
+    // NTP time of reception (see aoo_opt_clock)
+    // resp. the time tag passed to process().
+    uint64_t time;
+    // sender; numbered in the order of first appearance.
+    // AOO_CAPTURE_PROCESS: call to process()
+    uint32_t endpoint;
+    // datagram size in bytes resp. number of sample frames
+    // passed to process() (there is no payload).
+    int32_t size;
+
+    bool is_process() const { return endpoint == AOO_CAPTURE_PROCESS; }
+};
+
+/*///////////////////////// capture_writer /////////////////////////*/
+
+// Appends datagrams to a memory-mapped capture file.
+// write() doesn't block on I/O, but it might cause page faults
+// and allocate memory, so it must not be called on the audio thread;
+// process() calls are recorded with a capture_queue instead.
+// It is not thread-safe, the owner has to synchronize the calls.
+// When the file is full, datagrams are dropped.
+
+class capture_writer {
+public:
+    static std::unique_ptr<capture_writer> create(const char *path,
+                                                  const capture_header& info);
+    ~capture_writer();
+    capture_writer(const capture_writer&) = delete;
+    capture_writer& operator=(const capture_writer&) = delete;
+
+    void write(const char *data, int32_t n, void *endpoint, time_tag t);
+
+    void write_process(int32_t nsampframes, uint64_t t);
+private:
+    capture_writer() = default;
+
+    char * reserve(int32_t n);
+
+    void prefault(uint64_t size);
+
+    capture_header *header_ = nullptr;
+    char *data_ = nullptr;
+    uint64_t capacity_ = 0;
+    uint64_t prefaulted_ = 0;
+    int fd_ = -1;
+    bool full_ = false;
+    std::vector<void *> endpoints_;
+};
+
+/*///////////////////////// capture_reader /////////////////////////*/
+
+class capture_reader {
+public:
+    // returns nullptr on failure
+    static std::unique_ptr<capture_reader> open(const char *path);
+    ~capture_reader();
+    capture_reader(const capture_reader&) = delete;
+    capture_reader& operator=(const capture_reader&) = delete;
+
+    const capture_header& header() const { return *header_; }
+
+    // get the next record and its payload;
+    // returns nullptr at the end of the capture.
+    const char * read(capture_record& record);
+
+    void rewind() { pos_ = 0; }
+private:
+    capture_reader() = default;
+
+    const capture_header *header_ = nullptr;
+    const char *data_ = nullptr;
+    uint64_t size_ = 0;
+    uint64_t pos_ = 0;
+    size_t mapsize_ = 0;
+};
+
+} // aoo
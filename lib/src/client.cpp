@@ -39,6 +39,18 @@
 #define AOONET_MSG_SERVER_GROUP_PUBLIC \
     AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_GROUP AOONET_MSG_PUBLIC
 
+#define AOONET_MSG_SERVER_PEER_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_PEER AOONET_MSG_ADD
+
+#define AOONET_MSG_SERVER_PEER_DEL \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_PEER AOONET_MSG_DEL
+
+#define AOONET_MSG_SERVER_RELAY_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_RELAY AOONET_MSG_ADD
+
+#define AOONET_MSG_SERVER_RELAY_DEL \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_RELAY AOONET_MSG_DEL
+
 
 #define AOONET_MSG_GROUP_JOIN \
     AOONET_MSG_GROUP AOONET_MSG_JOIN
@@ -61,6 +73,18 @@
 #define AOONET_MSG_GROUP_PUBLIC \
     AOONET_MSG_GROUP AOONET_MSG_PUBLIC
 
+#define AOONET_MSG_PEER_ADD \
+    AOONET_MSG_PEER AOONET_MSG_ADD
+
+#define AOONET_MSG_PEER_DEL \
+    AOONET_MSG_PEER AOONET_MSG_DEL
+
+#define AOONET_MSG_RELAY_ADD \
+    AOONET_MSG_RELAY AOONET_MSG_ADD
+
+#define AOONET_MSG_RELAY_DEL \
+    AOONET_MSG_RELAY AOONET_MSG_DEL
+
 
 
 namespace aoo {
@@ -175,6 +199,17 @@ aoo::net::client::client(void *udpsocket, aoo_sendfn fn, int port)
     std::default_random_engine reng(randdev());
     std::uniform_int_distribution<int64_t> uniform_dist(1); // minimum of 1, max of maxint
     token_ = uniform_dist(reng);
+
+    // the ping messages never change, so we only build them once
+    osc::OutboundPacketStream keepalive(keepalive_msg_, sizeof(keepalive_msg_));
+    keepalive << osc::BeginMessage(AOONET_MSG_PEER_PING) << osc::EndMessage;
+    keepalive_size_ = (int32_t) keepalive.Size();
+
+    osc::OutboundPacketStream handshake(handshake_msg_, sizeof(handshake_msg_));
+    handshake << osc::BeginMessage(AOONET_MSG_PEER_PING) << token_ << osc::EndMessage;
+    handshake_size_ = (int32_t) handshake.Size();
+
+    peerlist_.publish(std::make_unique<peer_list>());
 }
 
 void aoonet_client_free(aoonet_client *client){
@@ -312,8 +347,13 @@ int32_t aoonet_client_group_join_public(aoonet_client *client, const char *group
     return client->group_join(group, pwd, true);
 }
 
-int32_t aoo::net::client::group_join(const char *group, const char *pwd, bool is_public){
-    push_command(std::make_unique<group_join_cmd>(group, encrypt(pwd), is_public));
+int32_t aoonet_client_group_join_partial(aoonet_client *client, const char *group, const char *pwd){
+    return client->group_join(group, pwd, false, true);
+}
+
+int32_t aoo::net::client::group_join(const char *group, const char *pwd,
+                                     bool is_public, bool partial){
+    push_command(std::make_unique<group_join_cmd>(group, encrypt(pwd), is_public, partial));
 
     signal();
 
@@ -344,6 +384,76 @@ int32_t aoo::net::client::group_watch_public(bool watch) {
     return 1;
 }
 
+int32_t aoonet_client_peer_subscribe(aoonet_client *client,
+                                     const char *group, const char *user){
+    return client->peer_subscribe(group, user);
+}
+
+int32_t aoo::net::client::peer_subscribe(const char *group, const char *user){
+    push_command(std::make_unique<peer_subscribe_cmd>(group, user, true));
+
+    signal();
+
+    return 1;
+}
+
+int32_t aoonet_client_peer_unsubscribe(aoonet_client *client,
+                                       const char *group, const char *user){
+    return client->peer_unsubscribe(group, user);
+}
+
+int32_t aoo::net::client::peer_unsubscribe(const char *group, const char *user){
+    push_command(std::make_unique<peer_subscribe_cmd>(group, user, false));
+
+    signal();
+
+    return 1;
+}
+
+int32_t aoonet_client_relay_subscribe(aoonet_client *client, const char *group,
+                                      const char *user, int32_t sink){
+    return client->relay_subscribe(group, user, sink);
+}
+
+int32_t aoo::net::client::relay_subscribe(const char *group, const char *user, int32_t sink){
+    push_command(std::make_unique<relay_cmd>(group, user, sink, true));
+
+    signal();
+
+    return 1;
+}
+
+int32_t aoonet_client_relay_unsubscribe(aoonet_client *client, const char *group,
+                                        const char *user, int32_t sink){
+    return client->relay_unsubscribe(group, user, sink);
+}
+
+int32_t aoo::net::client::relay_unsubscribe(const char *group, const char *user, int32_t sink){
+    push_command(std::make_unique<relay_cmd>(group, user, sink, false));
+
+    signal();
+
+    return 1;
+}
+
+int32_t aoonet_client_get_relay_address(aoonet_client *client,
+                                        void *addr, int32_t size){
+    return client->get_relay_address(addr, size);
+}
+
+int32_t aoo::net::client::get_relay_address(void *addr, int32_t size){
+    // the server receives UDP messages on the same port as TCP connections
+    if (state_.load() != client_state::connected){
+        return 0;
+    }
+    if (size < (int32_t)remote_addr_.length){
+        LOG_ERROR("aoo_client: relay address buffer too small");
+        return 0;
+    }
+    memcpy(addr, &remote_addr_.address, remote_addr_.length);
+    return remote_addr_.length;
+}
+
 int32_t aoonet_client_handle_message(aoonet_client *client, const char *data,
                                      int32_t n, void *addr)
 {
@@ -351,6 +461,9 @@ int32_t aoonet_client_handle_message(aoonet_client *client, const char *data,
 }
 
 int32_t aoo::net::client::handle_message(const char *data, int32_t n, void *addr){
+#ifndef NDEBUG
+    entry_guard guard(handle_message_entries_, "handle_message()");
+#endif
     if (static_cast<struct sockaddr *>(addr)->sa_family != AF_INET){
         return 0;
     }
@@ -385,25 +498,32 @@ int32_t aoo::net::client::handle_message(const char *data, int32_t n, void *addr
                 return 0;
             }
             bool success = false;
+            bool changed = false;
             {
-                shared_lock lock(peerlock_);
-                // NOTE: we have to loop over *all* peers because there can
-                // be more than 1 peer on a given IP endpoint, because a single
-                // user can join multiple groups.
-                // LATER make this more efficient, e.g. by associating IP endpoints
-                // with peers instead of having them all in a single vector.
+                lockfree::rcu_ptr<peer_list, 2>::reader list(peerlist_, 0);
+                // NOTE: there can be more than 1 peer on a given IP endpoint,
+                // because a single user can join multiple groups.
+                auto range = list->index.equal_range(address);
+                for (auto it = range.first; it != range.second; ++it){
+                    auto p = it->second;
+                    if (p->match(address)){
+                        p->handle_message(msg, onset, address);
+                        success = true;
+                    }
+                }
 
                 auto pattern = msg.AddressPattern() + onset;
                 int64_t token = 0;
-                if (!strcmp(pattern, AOONET_MSG_PING) && msg.ArgumentCount() > 0){
+                if (!success && !strcmp(pattern, AOONET_MSG_PING) && msg.ArgumentCount() > 0){
                     token = msg.ArgumentsBegin()->AsInt64();
                 }
-                        
-                for (auto& p : peers_){
-                    if (p->match(address)){
-                        p->handle_message(msg, onset, address);
-                        success = true;
-                    } else if (!p->has_real_address() && token > 0 && p->match_token(token)) {
+
+                // only during the handshake: look for a matching token
+                for (auto& p : list->peers){
+                    if (token <= 0){
+                        break;
+                    }
+                    if (!p->has_real_address() && p->match_token(token)) {
                         // this message doesn't match one of the addresses given by the server for this peer
                         // but it DOES match the random token for the peer, which means we might be dealing
                         // with a symmetric NAT for that peer. so we will assign the address here as the *real* address
@@ -415,9 +535,15 @@ int32_t aoo::net::client::handle_message(const char *data, int32_t n, void *addr
                         p->set_public_address(address);
                         p->handle_message(msg, onset, address);
                         success = true;
+                        changed = true;
                     }
                 }
             }
+            if (changed){
+                // the peer has a new address
+                unique_lock lock(peerlock_); // writer lock!
+                update_peer_list();
+            }
             // NOTE: during the handshake process it is expected that
             // we receive UDP messages which we have to ignore:
             // a) pings from a peer which we haven't had the chance to add yet
@@ -440,6 +566,9 @@ int32_t aoonet_client_send(aoonet_client *client){
 }
 
 int32_t aoo::net::client::send(){
+#ifndef NDEBUG
+    entry_guard guard(send_entries_, "send()");
+#endif
     auto state = state_.load();
     if (state != client_state::disconnected){
         time_tag now = time_tag::now();
@@ -486,9 +615,17 @@ int32_t aoo::net::client::send(){
         }
 
         // update peers
-        shared_lock lock(peerlock_);
-        for (auto& p : peers_){
-            p->send(now);
+        lockfree::rcu_ptr<peer_list, 2>::reader list(peerlist_, 1);
+        ping_batch_.clear();
+        for (auto& p : list->peers){
+            p->send(now, ping_batch_);
+        }
+        // send the precomputed ping messages in one go
+        for (auto addr : ping_batch_.keepalive){
+            send_message_udp(keepalive_msg_, keepalive_size_, *addr);
+        }
+        for (auto addr : ping_batch_.handshake){
+            send_message_udp(handshake_msg_, handshake_size_, *addr);
         }
     }
     return 1;
@@ -572,6 +709,7 @@ void client::do_disconnect(command_reason reason, int error){
     {
         unique_lock lock(peerlock_);
         peers_.clear();
+        update_peer_list();
     }
 
     // event
@@ -682,11 +820,12 @@ void client::do_login(){
     send_server_message_tcp(msg.Data(), (int32_t) msg.Size());
 }
 
-void client::do_group_join(const std::string &group, const std::string &pwd, bool is_public){
+void client::do_group_join(const std::string &group, const std::string &pwd,
+                           bool is_public, bool partial){
     char buf[AOO_MAXPACKETSIZE];
     osc::OutboundPacketStream msg(buf, sizeof(buf));
     msg << osc::BeginMessage(AOONET_MSG_SERVER_GROUP_JOIN)
-        << group.c_str() << pwd.c_str() << is_public << osc::EndMessage;
+        << group.c_str() << pwd.c_str() << is_public << partial << osc::EndMessage;
 
     send_server_message_tcp(msg.Data(), (int32_t) msg.Size());
 }
@@ -700,6 +839,28 @@ void client::do_group_leave(const std::string &group){
     send_server_message_tcp(msg.Data(), (int32_t) msg.Size());
 }
 
+void client::do_peer_subscribe(const std::string &group, const std::string &user,
+                               bool subscribe){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(subscribe ? AOONET_MSG_SERVER_PEER_ADD
+                                       : AOONET_MSG_SERVER_PEER_DEL)
+        << group.c_str() << user.c_str() << osc::EndMessage;
+
+    send_server_message_tcp(msg.Data(), (int32_t) msg.Size());
+}
+
+void client::do_relay_subscribe(const std::string &group, const std::string &user,
+                                int32_t sink, bool subscribe){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(subscribe ? AOONET_MSG_SERVER_RELAY_ADD
+                                       : AOONET_MSG_SERVER_RELAY_DEL)
+        << group.c_str() << user.c_str() << sink << osc::EndMessage;
+
+    send_server_message_tcp(msg.Data(), (int32_t) msg.Size());
+}
+
 void client::do_group_watch_public(bool watch){
     char buf[AOO_MAXPACKETSIZE];
     osc::OutboundPacketStream msg(buf, sizeof(buf));
@@ -997,6 +1158,14 @@ void client::handle_server_message_tcp(const osc::ReceivedMessage& msg){
             handle_public_group_add(msg);
         } else if (!strcmp(pattern, AOONET_MSG_GROUP_PUBLIC_DEL)){
             handle_public_group_del(msg);
+        } else if (!strcmp(pattern, AOONET_MSG_PEER_ADD)){
+            handle_peer_subscribe_reply(msg, true);
+        } else if (!strcmp(pattern, AOONET_MSG_PEER_DEL)){
+            handle_peer_subscribe_reply(msg, false);
+        } else if (!strcmp(pattern, AOONET_MSG_RELAY_ADD)){
+            handle_relay_reply(msg, true);
+        } else if (!strcmp(pattern, AOONET_MSG_RELAY_DEL)){
+            handle_relay_reply(msg, false);
         } else if (!strcmp(pattern, AOONET_MSG_PEER_JOIN)){
             handle_peer_add(msg);
         } else if (!strcmp(pattern, AOONET_MSG_PEER_LEAVE)){
@@ -1022,6 +1191,16 @@ void client::handle_login(const osc::ReceivedMessage& msg){
             auto e = std::make_unique<event>(
                 AOONET_CLIENT_CONNECT_EVENT, 1);
             push_event(std::move(e));
+        } else if (msg.ArgumentCount() > 3){
+            // redirected to another server of the cluster
+            it++; // skip error message
+            std::string host = (it++)->AsString();
+            int32_t port = (it++)->AsInt32();
+            LOG_VERBOSE("aoo_client: redirected to " << host << ":" << port);
+            // reconnect after we've finished reading from the socket
+            push_command(std::make_unique<disconnect_cmd>(command_reason::none));
+            push_command(std::make_unique<connect_cmd>(host, port));
+            signal();
         } else {
             std::string errmsg;
             if (msg.ArgumentCount() > 1){
@@ -1078,6 +1257,7 @@ void client::handle_group_leave(const osc::ReceivedMessage& msg){
         auto result = std::remove_if(peers_.begin(), peers_.end(),
                                      [&](auto& p){ return p->group() == group; });
         peers_.erase(result, peers_.end());
+        update_peer_list();
 
         auto e = std::make_unique<group_event>(
             AOONET_CLIENT_GROUP_LEAVE_EVENT, group.c_str(), 1);
@@ -1098,6 +1278,42 @@ void client::handle_group_leave(const osc::ReceivedMessage& msg){
     }
 }
 
+// /peer/add|del <group> <user> <status> [<errmsg>]
+void client::handle_peer_subscribe_reply(const osc::ReceivedMessage& msg, bool subscribe){
+    auto it = msg.ArgumentsBegin();
+    std::string group = (it++)->AsString();
+    std::string user = (it++)->AsString();
+    int32_t status = (it++)->AsInt32();
+    if (status > 0){
+        // the server sends /peer/join resp. /peer/leave if necessary
+        LOG_VERBOSE("aoo_client: successfully " << (subscribe ? "subscribed to " : "unsubscribed from ")
+                    << user << " (" << group << ")");
+    } else {
+        std::string errmsg = msg.ArgumentCount() > 3 ?
+                    (it++)->AsString() : "unknown error";
+        LOG_WARNING("aoo_client: couldn't " << (subscribe ? "subscribe to " : "unsubscribe from ")
+                    << user << " (" << group << "): " << errmsg);
+    }
+}
+
+// /relay/add|del <group> <user> <sink> <status> [<errmsg>]
+void client::handle_relay_reply(const osc::ReceivedMessage& msg, bool subscribe){
+    auto it = msg.ArgumentsBegin();
+    std::string group = (it++)->AsString();
+    std::string user = (it++)->AsString();
+    int32_t sink = (it++)->AsInt32();
+    int32_t status = (it++)->AsInt32();
+    if (status > 0){
+        LOG_VERBOSE("aoo_client: successfully " << (subscribe ? "subscribed to " : "unsubscribed from ")
+                    << user << " (" << group << ") for sink " << sink);
+    } else {
+        std::string errmsg = msg.ArgumentCount() > 4 ?
+                    (it++)->AsString() : "unknown error";
+        LOG_WARNING("aoo_client: couldn't " << (subscribe ? "subscribe to " : "unsubscribe from ")
+                    << user << " (" << group << ") for sink " << sink << ": " << errmsg);
+    }
+}
+
 void client::handle_public_group_add(const osc::ReceivedMessage& msg){
     auto it = msg.ArgumentsBegin();
     std::string group = (it++)->AsString();
@@ -1144,6 +1360,7 @@ void client::handle_peer_add(const osc::ReceivedMessage& msg){
     }
     peers_.push_back(std::make_unique<peer>(*this, group, user,
                                             public_addr, local_addr, token));
+    update_peer_list();
 
     // push prejoin event, real join event will be sent after handshake and real address is discovered
     
@@ -1174,6 +1391,7 @@ void client::handle_peer_remove(const osc::ReceivedMessage& msg){
     ip_address addr = (*result)->address();
 
     peers_.erase(result);
+    update_peer_list();
 
     auto e = std::make_unique<peer_event>(
                 AOONET_CLIENT_PEER_LEAVE_EVENT,
@@ -1183,6 +1401,17 @@ void client::handle_peer_remove(const osc::ReceivedMessage& msg){
     LOG_VERBOSE("aoo_client: peer " << group << "|" << user << " left");
 }
 
+void client::update_peer_list(){
+    auto list = std::make_unique<peer_list>();
+    list->peers = peers_;
+    for (auto& p : peers_){
+        p->add_addresses(list->index);
+    }
+    // peers which have been removed stay alive until
+    // the old list isn't used anymore.
+    peerlist_.publish(std::move(list));
+}
+
 void client::handle_server_message_udp(const osc::ReceivedMessage &msg, int onset){
     auto pattern = msg.AddressPattern() + onset;
     try {
@@ -1323,7 +1552,7 @@ std::ostream& operator << (std::ostream& os, const peer& p)
     return os;
 }
 
-void peer::send(time_tag now){
+void peer::send(time_tag now, ping_batch& batch){
     auto elapsed_time = time_tag::duration(start_time_, now);
     auto delta = elapsed_time - last_pingtime_;
 
@@ -1331,11 +1560,7 @@ void peer::send(time_tag now){
     if (real_addr){
         // send regular ping if it is time, or if we have never sent one (handles race condition on initial peer join)
         if (delta >= client_->ping_interval() || last_pingtime_ <= 0){
-            char buf[64];
-            osc::OutboundPacketStream msg(buf, sizeof(buf));
-            msg << osc::BeginMessage(AOONET_MSG_PEER_PING) << osc::EndMessage;
-
-            client_->send_message_udp(msg.Data(), (int32_t) msg.Size(), *real_addr);
+            batch.keepalive.push_back(real_addr);
             LOG_DEBUG("send regular ping to " << *this);
 
             last_pingtime_ = elapsed_time;
@@ -1361,12 +1586,8 @@ void peer::send(time_tag now){
         // send handshakes in fast succession to *both* addresses
         // until we get a reply from one of them (see handle_message())
         if (delta >= client_->request_interval()){
-            char buf[80];
-            osc::OutboundPacketStream msg(buf, sizeof(buf));
-            msg << osc::BeginMessage(AOONET_MSG_PEER_PING) << client_->get_token() << osc::EndMessage;
-
-            client_->send_message_udp(msg.Data(), (int32_t) msg.Size(), local_address_);
-            client_->send_message_udp(msg.Data(), (int32_t) msg.Size(), public_address_);
+            batch.handshake.push_back(&local_address_);
+            batch.handshake.push_back(&public_address_);
 
             LOG_DEBUG("send ping to " << *this);
 
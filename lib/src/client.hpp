@@ -16,6 +16,11 @@
 #include "oscpack/osc/OscOutboundPacketStream.h"
 #include "oscpack/osc/OscReceivedElements.h"
 
+#include <unordered_map>
+#include <atomic>
+#include <cassert>
+#include <vector>
+
 #define AOO_NET_CLIENT_PING_INTERVAL 10000
 #define AOO_NET_CLIENT_REQUEST_INTERVAL 100
 #define AOO_NET_CLIENT_REQUEST_TIMEOUT 5000
@@ -25,6 +30,17 @@ namespace net {
 
 class client;
 
+// peer addresses which are due for a ping, collected in client::send()
+struct ping_batch {
+    std::vector<const ip_address *> keepalive;
+    std::vector<const ip_address *> handshake;
+
+    void clear() {
+        keepalive.clear();
+        handshake.clear();
+    }
+};
+
 class peer {
 public:
     peer(client& client, const std::string& group, const std::string& user,
@@ -58,7 +74,17 @@ public:
         }
     }
 
-    void send(time_tag now);
+    // check if we have to send a keepalive or handshake ping
+    void send(time_tag now, ping_batch& batch);
+
+    // add all addresses of the peer to the address index
+    template<typename T>
+    void add_addresses(T& index) {
+        index.emplace(public_address_, this);
+        if (!(local_address_ == public_address_)){
+            index.emplace(local_address_, this);
+        }
+    }
 
     void handle_message(const osc::ReceivedMessage& msg, int onset,
                         const ip_address& addr);
@@ -92,14 +118,14 @@ enum class command_reason {
     error
 };
 
-class client final : public iclient {
+class client final : public iclient, public memory_object {
 public:
-    struct icommand {
+    struct icommand : memory_object {
         virtual ~icommand(){}
         virtual void perform(client&) = 0;
     };
 
-    struct ievent {
+    struct ievent : memory_object {
         virtual ~ievent(){}
 
         union {
@@ -122,12 +148,22 @@ public:
 
     int32_t disconnect() override;
 
-    int32_t group_join(const char *group, const char *pwd, bool is_public) override;
+    int32_t group_join(const char *group, const char *pwd,
+                       bool is_public, bool partial) override;
 
     int32_t group_leave(const char *group) override;
 
     int32_t group_watch_public(bool watch) override;
 
+    int32_t peer_subscribe(const char *group, const char *user) override;
+
+    int32_t peer_unsubscribe(const char *group, const char *user) override;
+
+    int32_t relay_subscribe(const char *group, const char *user, int32_t sink) override;
+
+    int32_t relay_unsubscribe(const char *group, const char *user, int32_t sink) override;
+
+    int32_t get_relay_address(void *addr, int32_t size) override;
 
     int32_t handle_message(const char *data, int32_t n, void *addr) override;
 
@@ -145,12 +181,19 @@ public:
 
     void do_login();
 
-    void do_group_join(const std::string& group, const std::string& pwd, bool is_public);
+    void do_group_join(const std::string& group, const std::string& pwd,
+                       bool is_public, bool partial);
 
     void do_group_leave(const std::string& group);
 
     void do_group_watch_public(bool watch);
 
+    void do_peer_subscribe(const std::string& group, const std::string& user,
+                           bool subscribe);
+
+    void do_relay_subscribe(const std::string& group, const std::string& user,
+                            int32_t sink, bool subscribe);
+
     double ping_interval() const { return ping_interval_.load(); }
 
     double request_interval() const { return request_interval_.load(); }
@@ -175,8 +218,41 @@ private:
     SLIP recvbuffer_;
     shared_mutex clientlock_;
     // peers
-    std::vector<std::shared_ptr<peer>> peers_;
-    aoo::shared_mutex peerlock_;
+    std::vector<std::shared_ptr<peer>> peers_; // only touched by writers
+    aoo::shared_mutex peerlock_; // writer lock
+    // Immutable snapshot of the peer list with an address index, so that
+    // handle_message() and send() can find peers without taking a lock.
+    struct peer_list {
+        std::vector<std::shared_ptr<peer>> peers;
+        std::unordered_multimap<ip_address, peer *, ip_address::hash> index;
+    };
+    // reader slots: 0 = handle_message(), 1 = send()
+    // NOTE: every slot may only be used by one thread at a time,
+    // so these methods must not be called concurrently (see aoo_net.h).
+    lockfree::rcu_ptr<peer_list, 2> peerlist_;
+#ifndef NDEBUG
+    // detect concurrent calls in debug builds
+    struct entry_guard {
+        entry_guard(std::atomic<int32_t>& count, const char *what)
+            : count_(count){
+            if (count_.fetch_add(1) != 0){
+                LOG_ERROR("aoo_client: " << what << " called concurrently!");
+                assert(false);
+            }
+        }
+        ~entry_guard(){ count_.fetch_sub(1); }
+        std::atomic<int32_t>& count_;
+    };
+    std::atomic<int32_t> handle_message_entries_{0};
+    std::atomic<int32_t> send_entries_{0};
+#endif
+    void update_peer_list(); // call with writer lock!
+    // precomputed ping messages
+    char keepalive_msg_[64];
+    int32_t keepalive_size_ = 0;
+    char handshake_msg_[64];
+    int32_t handshake_size_ = 0;
+    ping_batch ping_batch_; // only used in send()
     // user
     std::string username_;
     std::string password_;
@@ -236,6 +312,10 @@ private:
 
     void handle_group_leave(const osc::ReceivedMessage& msg);
 
+    void handle_peer_subscribe_reply(const osc::ReceivedMessage& msg, bool subscribe);
+
+    void handle_relay_reply(const osc::ReceivedMessage& msg, bool subscribe);
+
     void handle_public_group_add(const osc::ReceivedMessage& msg);
 
     void handle_public_group_del(const osc::ReceivedMessage& msg);
@@ -306,15 +386,17 @@ private:
 
     struct group_join_cmd : icommand
     {
-        group_join_cmd(const std::string& _group, const std::string& _pwd, bool _is_public=false)
-            : group(_group), password(_pwd), is_public(_is_public){}
+        group_join_cmd(const std::string& _group, const std::string& _pwd,
+                       bool _is_public=false, bool _partial=false)
+            : group(_group), password(_pwd), is_public(_is_public), partial(_partial){}
 
         void perform(client &obj) override {
-            obj.do_group_join(group, password, is_public);
+            obj.do_group_join(group, password, is_public, partial);
         }
         std::string group;
         std::string password;
         bool is_public;
+        bool partial;
     };
 
     struct group_leave_cmd : icommand
@@ -338,6 +420,35 @@ private:
         }
         bool watch;
     };
+
+    struct peer_subscribe_cmd : icommand
+    {
+        peer_subscribe_cmd(const std::string& _group, const std::string& _user,
+                           bool _subscribe)
+            : group(_group), user(_user), subscribe(_subscribe){}
+
+        void perform(client &obj) override {
+            obj.do_peer_subscribe(group, user, subscribe);
+        }
+        std::string group;
+        std::string user;
+        bool subscribe;
+    };
+
+    struct relay_cmd : icommand
+    {
+        relay_cmd(const std::string& _group, const std::string& _user,
+                  int32_t _sink, bool _subscribe)
+            : group(_group), user(_user), sink(_sink), subscribe(_subscribe){}
+
+        void perform(client &obj) override {
+            obj.do_relay_subscribe(group, user, sink, subscribe);
+        }
+        std::string group;
+        std::string user;
+        int32_t sink;
+        bool subscribe;
+    };
 };
 
 } // net
@@ -0,0 +1,296 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "cluster.hpp"
+#include "SLIP.hpp"
+
+#include "aoo/aoo_net.h"
+#include "aoo/aoo_utils.hpp"
+
+#include "oscpack/osc/OscOutboundPacketStream.h"
+#include "md5/md5.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+// don't raise SIGPIPE if the other node has closed the connection
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
+// reconnect interval in seconds
+#define AOO_CLUSTER_RECONNECT_INTERVAL 1
+
+namespace aoo {
+namespace net {
+
+/*////////////////////// hash_ring //////////////////////*/
+
+// 64-bit FNV-1a
+uint64_t hash_ring::hash(const char *data, size_t size){
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i){
+        h ^= (uint8_t)data[i];
+        h *= 1099511628211ULL;
+    }
+    // FNV-1a doesn't mix the high bits very well for short keys
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+void hash_ring::add_node(int32_t node, const std::string& name){
+    for (int i = 0; i < AOO_CLUSTER_VNODES; ++i){
+        auto key = name + "#" + std::to_string(i);
+        points_.push_back(point { hash(key.data(), key.size()), node });
+    }
+    std::sort(points_.begin(), points_.end(), [](auto& a, auto& b){
+        return a.hash < b.hash;
+    });
+}
+
+int32_t hash_ring::find(const std::string& key) const {
+    if (points_.empty()){
+        return -1;
+    }
+    auto h = hash(key.data(), key.size());
+    // first point clockwise
+    auto it = std::lower_bound(points_.begin(), points_.end(), h,
+                               [](auto& p, uint64_t h){ return p.hash < h; });
+    if (it == points_.end()){
+        it = points_.begin(); // wrap around
+    }
+    return it->node;
+}
+
+/*////////////////////// cluster_digest //////////////////////*/
+
+std::string cluster_digest(const std::string& secret, int64_t nonce){
+    auto input = secret + ":" + std::to_string(nonce);
+    uint8_t result[16];
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, (uint8_t *)input.data(), input.size());
+    MD5_Final(result, &ctx);
+
+    char output[33];
+    for (int i = 0; i < 16; ++i){
+        snprintf(&output[i * 2], 3, "%02X", result[i]);
+    }
+    return output;
+}
+
+bool cluster_check_digest(const std::string& secret, int64_t nonce,
+                          const char *digest){
+    // never accept an empty secret
+    if (secret.empty()){
+        return false;
+    }
+    auto expected = cluster_digest(secret, nonce);
+    if (strlen(digest) != expected.size()){
+        return false;
+    }
+    // constant time comparison
+    uint8_t diff = 0;
+    for (size_t i = 0; i < expected.size(); ++i){
+        diff |= (uint8_t)(expected[i] ^ digest[i]);
+    }
+    return diff == 0;
+}
+
+/*////////////////////// node_link //////////////////////*/
+
+node_link::node_link(const std::string& host, int port, const std::string& secret)
+    : host_(host), port_(port), secret_(secret)
+{
+    thread_ = std::thread(&node_link::run, this);
+}
+
+node_link::~node_link(){
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        quit_ = true;
+    }
+    condition_.notify_one();
+    thread_.join();
+    if (socket_ >= 0){
+        socket_close(socket_);
+    }
+}
+
+void node_link::set_secret(const std::string& secret){
+    std::lock_guard<std::mutex> lock(mutex_);
+    secret_ = secret;
+}
+
+void node_link::send(const char *data, int32_t size){
+    // worst case: every byte is escaped
+    SLIP slip;
+    slip.setup(size * 2 + 2);
+    slip.write_packet((const uint8_t *)data, size);
+    std::vector<uint8_t> packet(slip.read_available());
+    slip.read_bytes(packet.data(), (int32_t)packet.size());
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_size_ += packet.size();
+    queue_.push_back(std::move(packet));
+    // drop the oldest packets if the other node is unreachable
+    while (queue_size_ > AOO_CLUSTER_MAXQUEUE && queue_.size() > 1){
+        queue_size_ -= queue_.front().size();
+        queue_.pop_front();
+        num_dropped_++;
+    }
+    condition_.notify_one();
+}
+
+bool node_link::connect(){
+    socket_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (socket_ < 0){
+        LOG_ERROR("aoo_server: couldn't create cluster socket ("
+                  << socket_errno() << ")");
+        return false;
+    }
+
+    struct hostent *he = gethostbyname(host_.c_str());
+    if (!he){
+        LOG_ERROR("aoo_server: couldn't resolve cluster node " << host_);
+        socket_close(socket_);
+        socket_ = -1;
+        return false;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port_);
+    memcpy(&sa.sin_addr, he->h_addr_list[0], he->h_length);
+    ip_address addr((struct sockaddr *)&sa, sizeof(sa));
+
+    int val = 1;
+    if (setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val)) < 0){
+        LOG_WARNING("aoo_server: couldn't set TCP_NODELAY");
+        // ignore
+    }
+
+    // the socket stays in blocking mode
+    if (socket_connect(socket_, addr, 5) < 0){
+        LOG_WARNING("aoo_server: couldn't connect to cluster node "
+                    << host_ << ":" << port_ << " (" << socket_errno() << ")");
+        socket_close(socket_);
+        socket_ = -1;
+        return false;
+    }
+    LOG_VERBOSE("aoo_server: connected to cluster node " << host_ << ":" << port_);
+
+    // authenticate before sending anything else
+    if (!send_hello()){
+        LOG_WARNING("aoo_server: couldn't authenticate with cluster node "
+                    << host_ << ":" << port_ << " (" << socket_errno() << ")");
+        socket_close(socket_);
+        socket_ = -1;
+        return false;
+    }
+    return true;
+}
+
+// send all bytes; returns false on failure
+bool node_link::send_bytes(const uint8_t *data, int32_t size){
+    int32_t offset = 0;
+    while (offset < size){
+        auto result = ::send(socket_, (const char *)data + offset,
+                             size - offset, SEND_FLAGS);
+        if (result > 0){
+            offset += result;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool node_link::send_hello(){
+    std::string secret;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        secret = secret_;
+    }
+    std::random_device rd;
+    int64_t nonce = ((int64_t)rd() << 32) | rd();
+
+    char buf[256];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_HELLO)
+        << osc::int64(nonce) << cluster_digest(secret, nonce).c_str()
+        << osc::EndMessage;
+
+    SLIP slip;
+    slip.setup(msg.Size() * 2 + 2);
+    slip.write_packet((const uint8_t *)msg.Data(), (int32_t)msg.Size());
+    std::vector<uint8_t> packet(slip.read_available());
+    slip.read_bytes(packet.data(), (int32_t)packet.size());
+
+    return send_bytes(packet.data(), (int32_t)packet.size());
+}
+
+void node_link::run(){
+    std::vector<uint8_t> data;
+    while (true){
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            condition_.wait(lock, [&](){ return quit_ || !queue_.empty(); });
+            if (quit_){
+                return;
+            }
+            if (num_dropped_ > 0){
+                LOG_WARNING("aoo_server: dropped " << num_dropped_
+                            << " messages for cluster node " << host_ << ":" << port_);
+                num_dropped_ = 0;
+            }
+            for (auto& packet : queue_){
+                data.insert(data.end(), packet.begin(), packet.end());
+            }
+            queue_.clear();
+            queue_size_ = 0;
+        }
+        // send all pending data; on failure, reconnect and continue.
+        // A partially sent packet is lost because the other side
+        // discards incomplete SLIP frames on the new connection.
+        int32_t offset = 0;
+        while (offset < (int32_t)data.size()){
+            if (socket_ < 0 && !connect()){
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition_.wait_for(lock, std::chrono::seconds(AOO_CLUSTER_RECONNECT_INTERVAL),
+                                    [&](){ return quit_; });
+                if (quit_){
+                    return;
+                }
+                // the other node is unreachable: give up on the pending data
+                // if the queue overflows in the meantime.
+                if (queue_size_ + data.size() - offset > AOO_CLUSTER_MAXQUEUE){
+                    LOG_WARNING("aoo_server: dropped pending data for cluster node "
+                                << host_ << ":" << port_);
+                    break;
+                }
+                continue;
+            }
+            auto result = ::send(socket_, (const char *)data.data() + offset,
+                                 data.size() - offset, SEND_FLAGS);
+            if (result > 0){
+                offset += result;
+            } else {
+                LOG_WARNING("aoo_server: lost connection to cluster node "
+                            << host_ << ":" << port_ << " (" << socket_errno() << ")");
+                socket_close(socket_);
+                socket_ = -1;
+            }
+        }
+        data.clear();
+    }
+}
+
+} // net
+} // aoo
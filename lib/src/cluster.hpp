@@ -0,0 +1,111 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "net_utils.hpp"
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// number of points per node on the hash ring
+#ifndef AOO_CLUSTER_VNODES
+ #define AOO_CLUSTER_VNODES 64
+#endif
+
+// max. number of bytes queued for another node; if the node is
+// unreachable for too long, the oldest messages are dropped.
+#ifndef AOO_CLUSTER_MAXQUEUE
+ #define AOO_CLUSTER_MAXQUEUE (1 << 22)
+#endif
+
+namespace aoo {
+namespace net {
+
+/*////////////////////// hash_ring //////////////////////*/
+
+// A consistent hash ring which assigns keys (user and group names)
+// to cluster nodes. Each node is placed on the ring several times
+// (virtual nodes), so that keys are spread evenly and adding/removing
+// a node only moves the keys of its neighbours.
+// NOTE: all nodes must agree on the result, so we can't use std::hash.
+
+class hash_ring {
+public:
+    void add_node(int32_t node, const std::string& name);
+
+    // returns the node index or -1 if the ring is empty
+    int32_t find(const std::string& key) const;
+
+    bool empty() const { return points_.empty(); }
+
+    static uint64_t hash(const char *data, size_t size);
+private:
+    struct point {
+        uint64_t hash;
+        int32_t node;
+    };
+    std::vector<point> points_; // sorted by hash
+};
+
+/*////////////////////// cluster_digest //////////////////////*/
+
+// Cluster nodes authenticate themselves with a shared secret:
+// after connecting, a node sends '/aoo/server/cluster/hello <nonce> <digest>'
+// where 'digest' is the (hex) MD5 hash of the secret and the nonce.
+// Cluster messages are only accepted on authenticated connections.
+// NOTE: this doesn't protect against eavesdropping or replay attacks,
+// so the nodes should talk over a private network.
+
+std::string cluster_digest(const std::string& secret, int64_t nonce);
+
+bool cluster_check_digest(const std::string& secret, int64_t nonce,
+                          const char *digest);
+
+/*////////////////////// node_link //////////////////////*/
+
+// An outgoing TCP connection to another cluster node.
+// Messages are SLIP-encoded (like client messages), queued and sent by
+// a dedicated thread, so that senders never block on the network.
+// The link is (re)connected on demand.
+
+class node_link {
+public:
+    node_link(const std::string& host, int port, const std::string& secret);
+    ~node_link();
+
+    void set_secret(const std::string& secret);
+
+    // send an OSC packet (thread-safe)
+    void send(const char *data, int32_t size);
+private:
+    std::string host_;
+    int port_;
+    int socket_ = -1;
+    std::string secret_;
+    // SLIP-encoded packets
+    std::deque<std::vector<uint8_t>> queue_;
+    size_t queue_size_ = 0; // total number of bytes
+    int32_t num_dropped_ = 0;
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool quit_ = false;
+    std::thread thread_;
+
+    void run();
+
+    bool connect();
+
+    bool send_bytes(const uint8_t *data, int32_t size);
+
+    bool send_hello();
+};
+
+} // net
+} // aoo
@@ -8,6 +8,7 @@
 #include <cassert>
 #include <cstring>
 #include <memory>
+#include <new>
 
 namespace {
 
@@ -116,21 +117,33 @@ int32_t codec_getformat(void *x, aoo_format_storage *f)
 
 /*/////////////////////////// encoder //////////////////////*/
 
+// the Opus state is allocated with the AoO allocator,
+// so we use opus_multistream_encoder_init() instead of
+// opus_multistream_encoder_create()
+
 struct encoder : codec {
     ~encoder(){
+        destroy();
+    }
+    void destroy(){
         if (state){
-            opus_multistream_encoder_destroy(state);
+            aoo_deallocate(state, statesize);
+            state = nullptr;
+            statesize = 0;
         }
     }
     OpusMSEncoder *state = nullptr;
+    int32_t statesize = 0;
 };
 
 void *encoder_new(){
-    return new encoder;
+    auto obj = aoo_allocate(sizeof(encoder));
+    return new (obj) encoder;
 }
 
 void encoder_free(void *enc){
-    delete (encoder *)enc;
+    static_cast<encoder *>(enc)->~encoder();
+    aoo_deallocate(enc, sizeof(encoder));
 }
 
 int32_t encoder_encode(void *enc,
@@ -160,10 +173,7 @@ int32_t encoder_setformat(void *enc, aoo_format *f){
 
     validate_format(*fmt);
 
-    int error = 0;
-    if (c->state){
-        opus_multistream_encoder_destroy(c->state);
-    }
+    c->destroy();
     // setup channel mapping
     // only use decoupled streams (what's the point of coupled streams?)
     auto nchannels = fmt->header.nchannels;
@@ -173,9 +183,15 @@ int32_t encoder_setformat(void *enc, aoo_format *f){
     }
     memset(mapping + nchannels, 255, 256 - nchannels);
     // create state
-    c->state = opus_multistream_encoder_create(fmt->header.samplerate,
-                                       nchannels, nchannels, 0, mapping,
-                                       fmt->application_type, &error);
+    c->statesize = opus_multistream_encoder_get_size(nchannels, 0);
+    c->state = (OpusMSEncoder *)aoo_allocate(c->statesize);
+    if (!c->state){
+        LOG_ERROR("Opus: couldn't allocate encoder state");
+        return 0;
+    }
+    int error = opus_multistream_encoder_init(c->state, fmt->header.samplerate,
+                                              nchannels, nchannels, 0, mapping,
+                                              fmt->application_type);
     if (error == OPUS_OK){
         assert(c->state != nullptr);
         // apply settings
@@ -196,7 +212,8 @@ int32_t encoder_setformat(void *enc, aoo_format *f){
         opus_multistream_encoder_ctl(c->state, OPUS_SET_SIGNAL(fmt->signal_type));
         opus_multistream_encoder_ctl(c->state, OPUS_GET_SIGNAL(&fmt->signal_type));
     } else {
-        LOG_ERROR("Opus: opus_encoder_create() failed with error code " << error);
+        LOG_ERROR("Opus: opus_encoder_init() failed with error code " << error);
+        c->destroy();
         return 0;
     }
 
@@ -287,19 +304,27 @@ int32_t encoder_reset(void *enc) {
 
 struct decoder : codec {
     ~decoder(){
+        destroy();
+    }
+    void destroy(){
         if (state){
-            opus_multistream_decoder_destroy(state);
+            aoo_deallocate(state, statesize);
+            state = nullptr;
+            statesize = 0;
         }
     }
     OpusMSDecoder * state = nullptr;
+    int32_t statesize = 0;
 };
 
 void *decoder_new(){
-    return new decoder;
+    auto obj = aoo_allocate(sizeof(decoder));
+    return new (obj) decoder;
 }
 
 void decoder_free(void *dec){
-    delete (decoder *)dec;
+    static_cast<decoder *>(dec)->~decoder();
+    aoo_deallocate(dec, sizeof(decoder));
 }
 
 int32_t decoder_decode(void *dec,
@@ -322,10 +347,7 @@ int32_t decoder_decode(void *dec,
 }
 
 bool decoder_dosetformat(decoder *c, aoo_format_opus& f){
-    if (c->state){
-        opus_multistream_decoder_destroy(c->state);
-    }
-    int error = 0;
+    c->destroy();
     // setup channel mapping
     // only use decoupled streams (what's the point of coupled streams?)
 
@@ -342,9 +364,14 @@ bool decoder_dosetformat(decoder *c, aoo_format_opus& f){
     }
     memset(mapping + nchannels, 255, 256 - nchannels);
     // create state
-    c->state = opus_multistream_decoder_create(f.header.samplerate,
-                                       nchannels, nchannels, 0, mapping,
-                                       &error);
+    c->statesize = opus_multistream_decoder_get_size(nchannels, 0);
+    c->state = (OpusMSDecoder *)aoo_allocate(c->statesize);
+    if (!c->state){
+        LOG_ERROR("Opus: couldn't allocate decoder state");
+        return false;
+    }
+    int error = opus_multistream_decoder_init(c->state, f.header.samplerate,
+                                              nchannels, nchannels, 0, mapping);
     if (error == OPUS_OK){
         assert(c->state != nullptr);
         // these are actually encoder settings and do anything on the decoder
@@ -365,7 +392,8 @@ bool decoder_dosetformat(decoder *c, aoo_format_opus& f){
         print_settings(f);
         return true;
     } else {
-        LOG_ERROR("Opus: opus_decoder_create() failed with error code " << error);
+        LOG_ERROR("Opus: opus_decoder_init() failed with error code " << error);
+        c->destroy();
         return false;
     }
 }
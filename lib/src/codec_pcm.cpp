@@ -7,6 +7,7 @@
 
 #include <cassert>
 #include <cstring>
+#include <new>
 
 namespace {
 
@@ -226,11 +227,13 @@ int32_t codec_getformat(void *x, aoo_format_storage *f)
 }
 
 void *encoder_new(){
-    return new codec;
+    auto obj = aoo_allocate(sizeof(codec));
+    return new (obj) codec;
 }
 
 void encoder_free(void *enc){
-    delete (codec *)enc;
+    static_cast<codec *>(enc)->~codec();
+    aoo_deallocate(enc, sizeof(codec));
 }
 
 int32_t encoder_encode(void *enc,
@@ -296,11 +299,13 @@ int32_t encoder_writeformat(void *enc, aoo_format *fmt,
 }
 
 void *decoder_new(){
-    return new codec;
+    auto obj = aoo_allocate(sizeof(codec));
+    return new (obj) codec;
 }
 
 void decoder_free(void *dec){
-    delete (codec *)dec;
+    static_cast<codec *>(dec)->~codec();
+    aoo_deallocate(dec, sizeof(codec));
 }
 
 int32_t decoder_decode(void *dec,
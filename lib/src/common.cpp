@@ -8,11 +8,22 @@
 #include "aoo/aoo_opus.h"
 #endif
 #include "common.hpp"
+#include "trace.hpp"
 
 #include <unordered_map>
 #include <algorithm>
 #include <cassert>
 #include <cstring>
+#include <cmath>
+#include <chrono>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+  #define AOO_USE_SSE 1
+  #include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #define AOO_USE_NEON 1
+  #include <arm_neon.h>
+#endif
 
 /*/////////////// version ////////////////////*/
 
@@ -458,9 +469,14 @@ int32_t block_ack_list::remove_before(int32_t seq){
 }
 
 void block_ack_list::rehash(){
-    auto newsize = data_.size() << 1; // double the size
+    // only double the size if the table is actually filled with live items;
+    // otherwise just get rid of the deleted buckets. Without this check,
+    // the table would grow without bounds when items are continuously
+    // added and removed (which is the typical usage pattern).
+    auto newsize = (size_ > (int32_t)(data_.size() >> 2)) ?
+                data_.size() << 1 : data_.size();
     auto mask = newsize - 1;
-    std::vector<block_ack> temp(newsize);
+    aoo::vector<block_ack> temp(newsize);
     // use this chance to find oldest item
     oldest_ = INT32_MAX;
     // we skip all deleted items; 'size_' stays the same
@@ -498,7 +514,7 @@ std::ostream& operator<<(std::ostream& os, const block_ack_list& b){
 
 block_ack_list::block_ack_list(){}
 
-void block_ack_list::setup(int32_t limit){
+void block_ack_list::set_limit(int32_t limit){
     limit_ = limit;
 }
 
@@ -593,7 +609,7 @@ int32_t block_ack_list::remove_before(int32_t seq){
 }
 
 #if BLOCK_ACK_LIST_SORTED
-std::vector<block_ack>::iterator block_ack_list::lower_bound(int32_t seq){
+aoo::vector<block_ack>::iterator block_ack_list::lower_bound(int32_t seq){
     return std::lower_bound(data_.begin(), data_.end(), seq, [](auto& a, auto& b){
         return a.sequence < b;
     });
@@ -631,7 +647,7 @@ void history_buffer::resize(int32_t n){
 
 block * history_buffer::find(int32_t seq){
     if (seq >= oldest_){
-    #if 0
+    #if !HISTORY_BUFFER_BINARY_SEARCH
         // linear search
         for (auto& block : buffer_){
             if (block.sequence == seq){
@@ -719,7 +735,7 @@ block* block_queue::insert(int32_t seq, double sr, int32_t chn,
     if (empty() || seq > back().sequence){
         it = end();
     } else {
-    #if 0
+    #if !BLOCK_QUEUE_BINARY_SEARCH
         // linear search
         it = begin();
         for (; it != end(); ++it){
@@ -777,7 +793,7 @@ block* block_queue::find(int32_t seq){
     } else if (back().sequence == seq){
         return &back();
     }
-#if 0
+#if !BLOCK_QUEUE_BINARY_SEARCH
     // linear search
     for (int32_t i = 0; i < size_; ++i){
         if (blocks_[i].sequence == seq){
@@ -961,6 +977,187 @@ void dynamic_resampler::read(aoo_sample *data, int32_t n){
     }
 }
 
+/*//////////////////////// mixing //////////////////////*/
+
+template<typename T>
+static void do_mix_accumulate(T *out, const T *in, int32_t n,
+                              float gain, float step){
+    for (int i = 0; i < n; ++i){
+        out[i] += in[i] * gain;
+        gain += step;
+    }
+}
+
+#if AOO_USE_SSE || AOO_USE_NEON
+// process 4 samples at once, the rest is done by the generic version.
+static void do_mix_accumulate(float *out, const float *in, int32_t n,
+                              float gain, float step){
+    int32_t n4 = n & ~3;
+#if AOO_USE_SSE
+    auto g = _mm_setr_ps(gain, gain + step, gain + 2 * step, gain + 3 * step);
+    auto incr = _mm_set1_ps(4 * step);
+    for (int i = 0; i < n4; i += 4){
+        auto x = _mm_loadu_ps(in + i);
+        auto y = _mm_loadu_ps(out + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(y, _mm_mul_ps(x, g)));
+        g = _mm_add_ps(g, incr);
+    }
+#else
+    float init[4] = { gain, gain + step, gain + 2 * step, gain + 3 * step };
+    auto g = vld1q_f32(init);
+    auto incr = vdupq_n_f32(4 * step);
+    for (int i = 0; i < n4; i += 4){
+        auto x = vld1q_f32(in + i);
+        auto y = vld1q_f32(out + i);
+        vst1q_f32(out + i, vmlaq_f32(y, x, g));
+        g = vaddq_f32(g, incr);
+    }
+#endif
+    do_mix_accumulate<float>(out + n4, in + n4, n - n4, gain + n4 * step, step);
+}
+#endif
+
+void mix_accumulate(aoo_sample *out, const aoo_sample *in, int32_t n,
+                    float gain, float step){
+    do_mix_accumulate(out, in, n, gain, step);
+}
+
+/*//////////////////////// clock_source //////////////////////*/
+
+time_tag clock_source::now() const {
+    auto c = get();
+    if (c.fn){
+        return c.fn(c.user);
+    } else {
+        return time_tag::now();
+    }
+}
+
+double clock_source::seconds() const {
+    auto c = get();
+    if (c.fn){
+        return time_tag(c.fn(c.user)).to_double();
+    } else {
+        return stream_stats::clock();
+    }
+}
+
+/*//////////////////////// stream_stats //////////////////////*/
+
+double stream_stats::clock(){
+    using namespace std::chrono;
+    return duration<double>(steady_clock::now().time_since_epoch()).count();
+}
+
+void stream_stats::add_buffer_fill(float ratio){
+    if (ratio < fill_min_.load(std::memory_order_relaxed)){
+        fill_min_.store(ratio, std::memory_order_relaxed);
+    }
+    if (ratio > fill_max_.load(std::memory_order_relaxed)){
+        fill_max_.store(ratio, std::memory_order_relaxed);
+    }
+}
+
+void stream_stats::add_codec_time(double t){
+    // single writer (the send resp. network thread)
+    codec_time_.store(codec_time_.load(std::memory_order_relaxed) + t,
+                      std::memory_order_relaxed);
+    codec_count_.fetch_add(1, std::memory_order_relaxed);
+    if (t > codec_time_max_.load(std::memory_order_relaxed)){
+        codec_time_max_.store(t, std::memory_order_relaxed);
+    }
+}
+
+void stream_stats::add_histogram(histogram& h, double t){
+    // bin n covers [R * 2^(n-1), R * 2^n), see AOO_STATS_RESOLUTION
+    int bin = 0;
+    auto x = t / AOO_STATS_RESOLUTION;
+    if (x >= 1.0){
+        frexp(x, &bin);
+        if (bin >= AOO_STATS_NUMBINS){
+            bin = AOO_STATS_NUMBINS - 1;
+        }
+    }
+    h[bin].fetch_add(1, std::memory_order_relaxed);
+}
+
+void stream_stats::get(aoo_stream_stats& stats, bool reset){
+    stats.packets_in = packets_in_.load(std::memory_order_relaxed);
+    stats.bytes_in = bytes_in_.load(std::memory_order_relaxed);
+    stats.packets_out = packets_out_.load(std::memory_order_relaxed);
+    stats.bytes_out = bytes_out_.load(std::memory_order_relaxed);
+    stats.resend_requests = resend_requests_.load(std::memory_order_relaxed);
+    stats.resend_responses = resend_responses_.load(std::memory_order_relaxed);
+    minmax m;
+    if (reset){
+        m = take_minmax();
+    } else {
+        m.fill_min = fill_min_.load(std::memory_order_relaxed);
+        m.fill_max = fill_max_.load(std::memory_order_relaxed);
+        m.codec_time_max = codec_time_max_.load(std::memory_order_relaxed);
+    }
+    auto fmin = m.fill_min;
+    auto fmax = m.fill_max;
+    if (fmin > fmax){
+        fmin = fmax = 0; // no values
+    }
+    stats.buffer_fill_min = fmin;
+    stats.buffer_fill_max = fmax;
+    stats.resample_ratio = resample_ratio_.load(std::memory_order_relaxed);
+    stats.dll_error = dll_error_.load(std::memory_order_relaxed);
+    auto count = codec_count_.load(std::memory_order_relaxed);
+    stats.codec_time_avg = count > 0 ?
+        codec_time_.load(std::memory_order_relaxed) / count : 0;
+    stats.codec_time_max = m.codec_time_max;
+    for (int i = 0; i < AOO_STATS_NUMBINS; ++i){
+        stats.jitter[i] = jitter_[i].load(std::memory_order_relaxed);
+        stats.latency[i] = latency_[i].load(std::memory_order_relaxed);
+    }
+}
+
+stream_stats::minmax stream_stats::take_minmax(){
+    minmax m;
+    m.fill_min = fill_min_.exchange(1, std::memory_order_relaxed);
+    m.fill_max = fill_max_.exchange(0, std::memory_order_relaxed);
+    m.codec_time_max = codec_time_max_.exchange(0, std::memory_order_relaxed);
+    return m;
+}
+
+void stream_stats::merge_minmax(const minmax& m){
+    // min > max: no values
+    if (m.fill_min <= m.fill_max){
+        auto fmin = fill_min_.load(std::memory_order_relaxed);
+        while (m.fill_min < fmin &&
+               !fill_min_.compare_exchange_weak(fmin, m.fill_min, std::memory_order_relaxed)) ;
+        auto fmax = fill_max_.load(std::memory_order_relaxed);
+        while (m.fill_max > fmax &&
+               !fill_max_.compare_exchange_weak(fmax, m.fill_max, std::memory_order_relaxed)) ;
+    }
+    auto tmax = codec_time_max_.load(std::memory_order_relaxed);
+    while (m.codec_time_max > tmax &&
+           !codec_time_max_.compare_exchange_weak(tmax, m.codec_time_max, std::memory_order_relaxed)) ;
+}
+
+void stream_stats::reset(){
+    packets_in_ = 0;
+    bytes_in_ = 0;
+    packets_out_ = 0;
+    bytes_out_ = 0;
+    resend_requests_ = 0;
+    resend_responses_ = 0;
+    fill_min_ = 1;
+    fill_max_ = 0;
+    resample_ratio_ = 1;
+    dll_error_ = 0;
+    codec_time_ = 0;
+    codec_time_max_ = 0;
+    codec_count_ = 0;
+    for (int i = 0; i < AOO_STATS_NUMBINS; ++i){
+        jitter_[i] = 0;
+        latency_[i] = 0;
+    }
+}
+
 /*//////////////////////// timer //////////////////////*/
 
 timer::timer(const timer& other){
@@ -1090,6 +1287,10 @@ void aoo_initialize(){
         // register codecs
         aoo_codec_pcm_setup(aoo_register_codec);
 
+    #if AOO_TRACE
+        aoo::trace_init();
+    #endif
+
     #if USE_CODEC_OPUS
         aoo_codec_opus_setup(aoo_register_codec);
     #endif
@@ -8,6 +8,7 @@
 
 #include "time.hpp"
 #include "sync.hpp"
+#include "memory.hpp"
 
 #include <vector>
 #include <array>
@@ -30,8 +31,9 @@ public:
     void write(const aoo_sample* data, int32_t n);
     int32_t read_available();
     void read(aoo_sample* data, int32_t n);
+    double ratio() const { return ratio_; }
 private:
-    std::vector<aoo_sample> buffer_;
+    aoo::vector<aoo_sample> buffer_;
     int32_t nchannels_ = 0;
     double rdpos_ = 0;
     int32_t wrpos_ = 0;
@@ -39,7 +41,11 @@ private:
     double ratio_ = 1.0;
 };
 
-class base_codec {
+// accumulate with a linear gain ramp: out[i] += in[i] * (gain + i * step)
+void mix_accumulate(aoo_sample *out, const aoo_sample *in, int32_t n,
+                    float gain, float step);
+
+class base_codec : public memory_object {
 public:
     base_codec(const aoo_codec *codec, void *obj)
         : codec_(codec), obj_(obj){}
@@ -159,7 +165,7 @@ public:
     double samplerate = 0;
     int32_t channel = 0;
 protected:
-    std::vector<char> buffer_;
+    aoo::vector<char> buffer_;
     uint64_t frames_ = 0; // bitfield (later expand)
     int32_t numframes_ = 0;
     int32_t framesize_ = 0;
@@ -187,7 +193,7 @@ public:
 
     friend std::ostream& operator<<(std::ostream& os, const block_queue& b);
 private:
-    std::vector<block> blocks_;
+    aoo::vector<block> blocks_;
     int32_t size_ = 0;
 };
 
@@ -207,8 +213,21 @@ private:
     double timestamp_;
 };
 
+// NOTE: the implementation variants can be selected at compile time,
+// e.g. for comparing them in the benchmark (see bench/aoo_bench.cpp)
+#ifndef BLOCK_ACK_LIST_HASHTABLE
 #define BLOCK_ACK_LIST_HASHTABLE 1
+#endif
+#ifndef BLOCK_ACK_LIST_SORTED
 #define BLOCK_ACK_LIST_SORTED 1
+#endif
+// binary vs. linear search
+#ifndef BLOCK_QUEUE_BINARY_SEARCH
+#define BLOCK_QUEUE_BINARY_SEARCH 1
+#endif
+#ifndef HISTORY_BUFFER_BINARY_SEARCH
+#define HISTORY_BUFFER_BINARY_SEARCH 1
+#endif
 
 class block_ack_list {
 public:
@@ -227,7 +246,7 @@ public:
 private:
 #if !BLOCK_ACK_LIST_HASHTABLE
 #if BLOCK_ACK_LIST_SORTED
-    std::vector<block_ack>::iterator lower_bound(int32_t seq);
+    aoo::vector<block_ack>::iterator lower_bound(int32_t seq);
 #endif
 #else
     void rehash();
@@ -239,7 +258,7 @@ private:
     int32_t oldest_;
 #endif
     int32_t limit_ = 0;
-    std::vector<block_ack> data_;
+    aoo::vector<block_ack> data_;
 };
 
 class history_buffer {
@@ -252,11 +271,115 @@ public:
              const char *data, int32_t nbytes,
              int32_t nframes, int32_t framesize);
 private:
-    std::vector<block> buffer_;
+    aoo::vector<block> buffer_;
     int32_t oldest_ = 0;
     int32_t head_ = 0;
 };
 
+/*//////////////////////// clock_source //////////////////////*/
+
+// The clock of a source or sink (see aoo_opt_clock).
+// The user clock function is called without holding the lock.
+class clock_source {
+public:
+    void set(const aoo_clock& c){
+        scoped_lock<spinlock> lock(lock_);
+        clock_ = c;
+    }
+    aoo_clock get() const {
+        scoped_lock<spinlock> lock(lock_);
+        return clock_;
+    }
+    // current NTP time
+    time_tag now() const;
+    // monotonic time in seconds (for measuring durations)
+    double seconds() const;
+private:
+    mutable spinlock lock_;
+    aoo_clock clock_ { nullptr, nullptr };
+};
+
+/*//////////////////////// stream_stats //////////////////////*/
+
+// Per-stream statistics (see aoo_stream_stats).
+// All values are accumulated with relaxed atomics, so collecting
+// them is wait-free and get() can be called from any thread.
+// Min/max values have a single writer; a concurrent reset might
+// lose an update, which is fine for statistics.
+class stream_stats {
+public:
+    // monotonic time in seconds (for measuring durations)
+    static double clock();
+
+    void add_packet_in(int32_t size){
+        packets_in_.fetch_add(1, std::memory_order_relaxed);
+        bytes_in_.fetch_add(size, std::memory_order_relaxed);
+    }
+    void add_packet_out(int32_t size){
+        packets_out_.fetch_add(1, std::memory_order_relaxed);
+        bytes_out_.fetch_add(size, std::memory_order_relaxed);
+    }
+    void add_resend_requests(int32_t n){
+        resend_requests_.fetch_add(n, std::memory_order_relaxed);
+    }
+    void add_resend_responses(int32_t n){
+        resend_responses_.fetch_add(n, std::memory_order_relaxed);
+    }
+    void add_buffer_fill(float ratio);
+    void set_resample_ratio(double ratio){
+        resample_ratio_.store(ratio, std::memory_order_relaxed);
+    }
+    void set_dll_error(double error){
+        dll_error_.store(error, std::memory_order_relaxed);
+    }
+    void add_codec_time(double t);
+    void add_jitter(double t){
+        add_histogram(jitter_, t);
+    }
+    void add_latency(double t){
+        add_histogram(latency_, t);
+    }
+
+    // NOTE: the min/max values are reset, unless 'reset' is false.
+    void get(aoo_stream_stats& stats, bool reset = true);
+
+    void reset();
+
+    // min/max values of statistics which are shared by several streams;
+    // every stream merges them into its own statistics, so that each
+    // query only resets the values of the given stream.
+    struct minmax {
+        float fill_min;
+        float fill_max;
+        double codec_time_max;
+    };
+    // get and reset the min/max values
+    minmax take_minmax();
+
+    // can be called from several threads
+    void merge_minmax(const minmax& m);
+private:
+    using histogram = std::array<std::atomic<uint32_t>, AOO_STATS_NUMBINS>;
+
+    static void add_histogram(histogram& h, double t);
+
+    std::atomic<uint64_t> packets_in_{0};
+    std::atomic<uint64_t> bytes_in_{0};
+    std::atomic<uint64_t> packets_out_{0};
+    std::atomic<uint64_t> bytes_out_{0};
+    std::atomic<uint64_t> resend_requests_{0};
+    std::atomic<uint64_t> resend_responses_{0};
+    std::atomic<float> fill_min_{1};
+    std::atomic<float> fill_max_{0};
+    std::atomic<double> resample_ratio_{1};
+    std::atomic<double> dll_error_{0};
+    std::atomic<double> codec_time_{0};
+    std::atomic<double> codec_time_max_{0};
+    std::atomic<uint64_t> codec_count_{0};
+    histogram jitter_{};
+    histogram latency_{};
+};
+
 /*//////////////////////// timer //////////////////////*/
 
 class timer {
@@ -4,9 +4,13 @@
 
 #pragma once
 
+#include "sync.hpp"
+#include "memory.hpp"
+
 #include <stdint.h>
 #include <atomic>
 #include <vector>
+#include <memory>
 #include <cassert>
 
 namespace aoo {
@@ -114,7 +118,7 @@ class queue {
     int32_t rdhead_{0};
     int32_t wrhead_{0};
     int32_t stride_{0};
-    std::vector<T> data_;
+    aoo::vector<T> data_;
 };
 
 /*///////////////////////// list ////////////////////////*/
@@ -125,7 +129,7 @@ class queue {
 template<typename T>
 class list {
 public:
-    struct node {
+    struct node : memory_object {
         node* next_;
         T data_;
         template<typename... U>
@@ -233,5 +237,189 @@ private:
     std::atomic<int32_t> size_{0};
 };
 
+/*///////////////////////// mpsc_queue ////////////////////////*/
+
+// an unbounded lock-free queue for several writers and a single reader.
+// Writers push onto a lock-free stack; the reader takes the whole stack
+// at once and restores the original order. Since the reader never pops
+// single nodes, there is no ABA problem.
+// push() allocates memory, so it must not be called on the audio thread.
+
+template<typename T>
+class mpsc_queue {
+public:
+    mpsc_queue() = default;
+    mpsc_queue(const mpsc_queue&) = delete;
+    mpsc_queue& operator=(const mpsc_queue&) = delete;
+
+    ~mpsc_queue(){
+        consume_all([](T&){});
+    }
+
+    template<typename... U>
+    void push(U&&... args){
+        auto n = new node(std::forward<U>(args)...);
+        auto head = head_.load(std::memory_order_relaxed);
+        do {
+            n->next_ = head;
+        } while (!head_.compare_exchange_weak(head, n,
+                    std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    bool empty() const {
+        return head_.load(std::memory_order_relaxed) == nullptr;
+    }
+
+    // call fn on all items (in FIFO order) and remove them.
+    // returns the number of items.
+    template<typename Fn>
+    int32_t consume_all(Fn&& fn){
+        auto n = head_.exchange(nullptr, std::memory_order_acquire);
+        // reverse
+        node *list = nullptr;
+        while (n){
+            auto next = n->next_;
+            n->next_ = list;
+            list = n;
+            n = next;
+        }
+        int32_t count = 0;
+        while (list){
+            auto next = list->next_;
+            fn(list->data_);
+            delete list;
+            list = next;
+            count++;
+        }
+        return count;
+    }
+private:
+    struct node : memory_object {
+        node* next_;
+        T data_;
+        template<typename... U>
+        node(U&&... args)
+            : next_(nullptr), data_(std::forward<U>(args)...) {}
+    };
+
+    std::atomic<node *> head_{nullptr};
+};
+
+/*///////////////////////// rcu_ptr ////////////////////////*/
+
+// an atomic pointer to an object which can be replaced by a writer
+// without ever blocking the readers.
+// Readers announce the object they are using in a hazard slot
+// (one slot per reader thread). Replaced objects are retired and
+// only freed by collect() when no slot refers to them anymore.
+// publish() and collect() allocate/free memory, so they must
+// not be called on the audio thread. Writers must be serialized
+// by the caller.
+
+template<typename T, int N = 1>
+class rcu_ptr {
+public:
+    class reader {
+    public:
+        reader(rcu_ptr& p, int slot = 0)
+            : owner_(&p), slot_(slot), ptr_(p.acquire(slot)){}
+        reader(const reader&) = delete;
+        reader& operator=(const reader&) = delete;
+        ~reader() { owner_->release(slot_); }
+        T* get() const { return ptr_; }
+        T* operator->() const { return ptr_; }
+        T& operator*() const { return *ptr_; }
+        explicit operator bool() const { return ptr_ != nullptr; }
+    private:
+        rcu_ptr *owner_;
+        int slot_;
+        T *ptr_;
+    };
+
+    rcu_ptr(){
+        for (auto& h : hazard_){
+            h.store(nullptr);
+        }
+    }
+    rcu_ptr(const rcu_ptr&) = delete;
+    rcu_ptr& operator=(const rcu_ptr&) = delete;
+    ~rcu_ptr(){
+        delete ptr_.load();
+        for (auto& p : retired_){
+            delete p;
+        }
+    }
+
+    // readers: only retries if the object has been replaced
+    // between loading the pointer and publishing the hazard.
+    T * acquire(int slot = 0){
+        assert(slot >= 0 && slot < N);
+        auto p = ptr_.load();
+        while (true){
+            hazard_[slot].store(p);
+            auto q = ptr_.load();
+            if (q == p){
+                return p;
+            }
+            p = q;
+        }
+    }
+
+    void release(int slot = 0){
+        assert(slot >= 0 && slot < N);
+        hazard_[slot].store(nullptr, std::memory_order_release);
+    }
+
+    // writers (or threads which otherwise exclude publish()) can
+    // access the current object without a hazard slot.
+    T * get() const {
+        return ptr_.load(std::memory_order_acquire);
+    }
+
+    void publish(std::unique_ptr<T> p){
+        retire(exchange(std::move(p)));
+    }
+
+    // publish() in two steps, so that writers which have to serialize
+    // the swap can retire the old object outside of their own lock.
+    T * exchange(std::unique_ptr<T> p){
+        return ptr_.exchange(p.release());
+    }
+
+    void retire(T *old){
+        if (old){
+            scoped_lock<spinlock> lock(lock_);
+            retired_.push_back(old);
+        }
+        collect();
+    }
+
+    void collect(){
+        scoped_lock<spinlock> lock(lock_);
+        for (auto it = retired_.begin(); it != retired_.end(); ){
+            if (in_use(*it)){
+                ++it;
+            } else {
+                delete *it;
+                it = retired_.erase(it);
+            }
+        }
+    }
+private:
+    bool in_use(const T *p) const {
+        for (auto& h : hazard_){
+            if (h.load() == p){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::atomic<T *> ptr_{nullptr};
+    std::atomic<T *> hazard_[N];
+    aoo::vector<T *> retired_;
+    spinlock lock_;
+};
+
 } // lockfree
 } // aoo
@@ -0,0 +1,304 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_utils.hpp"
+
+#include "memory.hpp"
+#include "sync.hpp"
+
+#include <stdlib.h>
+#include <cstring>
+#include <atomic>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace aoo {
+
+/*//////////////////// memory pool ////////////////////////*/
+
+// A simple segregated free list allocator: memory is taken from a single
+// preallocated block and freed blocks are kept in a list per size class.
+// Size classes are powers of two, so we waste at most half of each block,
+// but allocation and deallocation are O(1) and never call into the system.
+
+#define AOO_MEMPOOL_MINSIZE 16
+#define AOO_MEMPOOL_NUMCLASSES 27 // max. block size: 1 GB
+
+// NOTE: the pool is never released on program exit because objects
+// with static storage duration might still hold memory from it.
+
+class memory_pool {
+public:
+    bool init(size_t size, bool lock, const aoo_allocator& alloc);
+
+    void release();
+
+    bool active() const { return data_ != nullptr; }
+
+    bool in_use() const { return count_.load() > 0; }
+
+    void * allocate(size_t size);
+
+    bool deallocate(void *ptr, size_t size);
+private:
+    struct free_block {
+        free_block *next;
+    };
+
+    static int size_class(size_t size){
+        int index = 0;
+        size_t blocksize = AOO_MEMPOOL_MINSIZE;
+        while (blocksize < size){
+            blocksize <<= 1;
+            index++;
+        }
+        return index;
+    }
+
+    static size_t block_size(int index){
+        return (size_t)AOO_MEMPOOL_MINSIZE << index;
+    }
+
+    aoo_allocator alloc_;
+    char *mem_ = nullptr; // raw memory
+    char *data_ = nullptr; // aligned
+    size_t size_ = 0;
+    size_t memsize_ = 0;
+    size_t offset_ = 0;
+    bool locked_ = false;
+    free_block *freelist_[AOO_MEMPOOL_NUMCLASSES] = { nullptr };
+    std::atomic<int32_t> count_{0};
+    spinlock lock_;
+};
+
+bool memory_pool::init(size_t size, bool lock, const aoo_allocator& alloc){
+    release();
+
+    alloc_ = alloc;
+    // make sure that all blocks are aligned to the min. block size
+    memsize_ = size + AOO_MEMPOOL_MINSIZE;
+    mem_ = (char *)alloc_.alloc(memsize_, alloc_.context);
+    if (!mem_){
+        LOG_ERROR("aoo: couldn't allocate memory pool of " << size << " bytes");
+        return false;
+    }
+    auto misalign = (uintptr_t)mem_ & (AOO_MEMPOOL_MINSIZE - 1);
+    data_ = misalign ? mem_ + (AOO_MEMPOOL_MINSIZE - misalign) : mem_;
+    size_ = size;
+    offset_ = 0;
+    // touch all pages, so we don't get page faults later
+    memset(data_, 0, size_);
+
+    if (lock){
+    #ifdef _WIN32
+        locked_ = VirtualLock(mem_, memsize_) != 0;
+    #else
+        locked_ = mlock(mem_, memsize_) == 0;
+    #endif
+        if (!locked_){
+            LOG_WARNING("aoo: couldn't lock memory pool - check the memory limits");
+        }
+    }
+
+    LOG_VERBOSE("aoo: allocated memory pool of " << size << " bytes"
+                << (locked_ ? " (locked)" : ""));
+    return true;
+}
+
+void memory_pool::release(){
+    if (mem_){
+        if (locked_){
+        #ifdef _WIN32
+            VirtualUnlock(mem_, memsize_);
+        #else
+            munlock(mem_, memsize_);
+        #endif
+            locked_ = false;
+        }
+        alloc_.free(mem_, memsize_, alloc_.context);
+        mem_ = data_ = nullptr;
+        size_ = memsize_ = offset_ = 0;
+        for (auto& list : freelist_){
+            list = nullptr;
+        }
+        count_ = 0;
+    }
+}
+
+void * memory_pool::allocate(size_t size){
+    auto index = size_class(size);
+    if (index >= AOO_MEMPOOL_NUMCLASSES){
+        return nullptr;
+    }
+    scoped_lock<spinlock> lock(lock_);
+    // first try the free list
+    auto block = freelist_[index];
+    if (block){
+        freelist_[index] = block->next;
+        count_++;
+        return block;
+    }
+    // then take a new block
+    auto blocksize = block_size(index);
+    if (offset_ + blocksize <= size_){
+        auto result = data_ + offset_;
+        offset_ += blocksize;
+        count_++;
+        return result;
+    }
+    return nullptr;
+}
+
+bool memory_pool::deallocate(void *ptr, size_t size){
+    auto p = (char *)ptr;
+    if (p < data_ || p >= (data_ + size_)){
+        return false; // not from our pool
+    }
+    auto index = size_class(size);
+    auto block = (free_block *)ptr;
+    scoped_lock<spinlock> lock(lock_);
+    block->next = freelist_[index];
+    freelist_[index] = block;
+    count_--;
+    return true;
+}
+
+/*//////////////////// allocation ////////////////////////*/
+
+static void * default_alloc(size_t size, void *){
+    return malloc(size);
+}
+
+static void default_free(void *ptr, size_t, void *){
+    free(ptr);
+}
+
+static aoo_allocator g_allocator { default_alloc, default_free, nullptr };
+
+static memory_pool g_pool;
+
+static std::atomic<bool> g_pool_exhausted{false};
+
+static std::atomic<aoo_allochook> g_allochook{nullptr};
+static void *g_allochook_context = nullptr;
+
+static thread_local int32_t g_rt_depth = 0;
+
+static void report_allocation(size_t size, bool dealloc){
+    auto fn = g_allochook.load(std::memory_order_acquire);
+    if (fn){
+        fn(size, dealloc, g_allochook_context);
+    }
+}
+
+void * allocate(size_t size){
+    if (g_rt_depth > 0){
+        report_allocation(size, false);
+    }
+    if (g_pool.active()){
+        auto result = g_pool.allocate(size);
+        if (result){
+            return result;
+        }
+        // fall back to the regular allocator
+        if (!g_pool_exhausted.exchange(true)){
+            LOG_WARNING("aoo: memory pool exhausted - increase the real-time settings");
+        }
+    }
+    return g_allocator.alloc(size, g_allocator.context);
+}
+
+void deallocate(void *ptr, size_t size){
+    if (!ptr){
+        return;
+    }
+    if (g_rt_depth > 0){
+        report_allocation(size, true);
+    }
+    if (g_pool.active() && g_pool.deallocate(ptr, size)){
+        return;
+    }
+    g_allocator.free(ptr, size, g_allocator.context);
+}
+
+/*//////////////////// real-time scope ////////////////////////*/
+
+rt_scope::rt_scope(){
+    g_rt_depth++;
+}
+
+rt_scope::~rt_scope(){
+    g_rt_depth--;
+}
+
+} // aoo
+
+int32_t aoo_set_allocator(const aoo_allocator *alloc){
+    if (aoo::g_pool.active()){
+        LOG_ERROR("aoo: can't set allocator in real-time mode");
+        return 0;
+    }
+    if (alloc){
+        if (!alloc->alloc || !alloc->free){
+            LOG_ERROR("aoo: bad allocator");
+            return 0;
+        }
+        aoo::g_allocator = *alloc;
+    } else {
+        aoo::g_allocator = { aoo::default_alloc, aoo::default_free, nullptr };
+    }
+    return 1;
+}
+
+void * aoo_allocate(size_t size){
+    return aoo::allocate(size);
+}
+
+void aoo_deallocate(void *ptr, size_t size){
+    aoo::deallocate(ptr, size);
+}
+
+int32_t aoo_set_rt_mode(const aoo_rt_settings *s){
+    if (aoo::g_pool.in_use()){
+        LOG_ERROR("aoo: can't change real-time mode while objects are alive");
+        return 0;
+    }
+    if (!s){
+        aoo::g_pool.release();
+        return 1;
+    }
+    if (s->nchannels <= 0 || s->blocksize <= 0 || s->samplerate <= 0
+            || s->buffersize < 0 || s->nstreams <= 0){
+        LOG_ERROR("aoo: bad real-time settings");
+        return 0;
+    }
+    // max. number of sample frames in any buffer
+    size_t nframes = (size_t)s->samplerate * s->buffersize / 1000 + s->blocksize;
+    // audio queue + resampler (aoo_sample) and block/history buffers
+    // (encoded data can take up to 8 bytes per sample, e.g. 64-bit PCM).
+    size_t streamsize = nframes * s->nchannels * (sizeof(aoo_sample) * 2 + sizeof(double) * 2);
+    // codec state, send buffers, queues, etc.
+    streamsize += 64 * 1024;
+    // x2 for rounding to the size classes and x2 because the old and
+    // new stream state exist at the same time during reconfiguration.
+    size_t poolsize = streamsize * s->nstreams * 4;
+    // global objects (codecs, network buffers, events, etc.)
+    poolsize += 1024 * 1024;
+
+    aoo::g_pool_exhausted = false;
+
+    return aoo::g_pool.init(poolsize, s->flags & AOO_RT_MLOCK, aoo::g_allocator);
+}
+
+void aoo_set_alloc_hook(aoo_allochook fn, void *context){
+    // set the context first!
+    aoo::g_allochook = nullptr;
+    aoo::g_allochook_context = context;
+    aoo::g_allochook.store(fn, std::memory_order_release);
+}
@@ -0,0 +1,98 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include <new>
+
+namespace aoo {
+
+/*//////////////////// allocation ////////////////////////*/
+
+// All library memory goes through these functions, so it can be served
+// by a user provided allocator (aoo_set_allocator) or by the preallocated
+// memory pool in real-time mode (aoo_set_rt_mode).
+
+void * allocate(size_t size);
+
+void deallocate(void *ptr, size_t size);
+
+// STL compatible allocator
+
+template<typename T>
+class allocator {
+public:
+    using value_type = T;
+
+    allocator() noexcept = default;
+
+    template<typename U>
+    allocator(const allocator<U>&) noexcept {}
+
+    template<typename U>
+    struct rebind {
+        typedef allocator<U> other;
+    };
+
+    T* allocate(size_t n) {
+        auto result = aoo::allocate(sizeof(T) * n);
+        if (!result){
+            throw std::bad_alloc();
+        }
+        return (T *)result;
+    }
+
+    void deallocate(T* p, size_t n) noexcept {
+        aoo::deallocate(p, sizeof(T) * n);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const allocator<T>&, const allocator<U>&) noexcept {
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const allocator<T>&, const allocator<U>&) noexcept {
+    return false;
+}
+
+template<typename T>
+using vector = std::vector<T, allocator<T>>;
+
+// base class for objects which are created with new/delete.
+// The sized delete also works with polymorphic classes
+// (if the destructor is virtual).
+
+struct memory_object {
+    static void * operator new(size_t size){
+        auto result = aoo::allocate(size);
+        if (!result){
+            throw std::bad_alloc();
+        }
+        return result;
+    }
+
+    static void operator delete(void *ptr, size_t size){
+        aoo::deallocate(ptr, size);
+    }
+};
+
+/*//////////////////// real-time scope ////////////////////////*/
+
+// Marks the current thread as real-time (e.g. inside process()).
+// Every allocation/deallocation within this scope is reported
+// to the debug hook (see aoo_set_alloc_hook).
+
+class rt_scope {
+public:
+    rt_scope();
+    ~rt_scope();
+    rt_scope(const rt_scope&) = delete;
+    rt_scope& operator=(const rt_scope&) = delete;
+};
+
+} // aoo
@@ -22,6 +22,7 @@ typedef int socklen_t;
 
 #include <cstring>
 #include <string>
+#include <functional>
 
 namespace aoo {
 namespace net {
@@ -101,6 +102,19 @@ struct ip_address {
         }
     }
 
+    // hash function for unordered containers (consistent with operator==)
+    struct hash {
+        size_t operator()(const ip_address& addr) const {
+            if (addr.address.ss_family == AF_INET){
+                auto sa = (const struct sockaddr_in *)&addr.address;
+                uint64_t key = ((uint64_t)sa->sin_addr.s_addr << 16) | sa->sin_port;
+                return std::hash<uint64_t>()(key);
+            } else {
+                return 0;
+            }
+        }
+    };
+
     struct sockaddr_storage address;
     socklen_t length;
 };
@@ -0,0 +1,574 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "node.hpp"
+
+#include "aoo/aoo_utils.hpp"
+
+#include <chrono>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#ifdef _WIN32
+#define AOO_WOULDBLOCK(e) ((e) == WSAEWOULDBLOCK)
+#else
+#define AOO_WOULDBLOCK(e) ((e) == EWOULDBLOCK || (e) == EAGAIN)
+#endif
+
+/*//////////////////// AoO node /////////////////////*/
+
+aoonode * aoonode_new(int port, int32_t *err){
+    // make 'any' address
+    sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = INADDR_ANY;
+    sa.sin_port = htons(port);
+
+    // create and bind UDP socket
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0){
+        *err = aoo::net::socket_errno();
+        LOG_ERROR("aoo_node: couldn't create UDP socket (" << *err << ")");
+        return nullptr;
+    }
+
+    // set non-blocking
+    // (this is not necessary on Windows, because WSAEventSelect will do it automatically)
+#ifndef _WIN32
+    if (aoo::net::socket_set_nonblocking(sock, 1) < 0){
+        *err = aoo::net::socket_errno();
+        LOG_ERROR("aoo_node: couldn't set socket to non-blocking (" << *err << ")");
+        aoo::net::socket_close(sock);
+        return nullptr;
+    }
+#endif
+
+    if (bind(sock, (sockaddr *)&sa, sizeof(sa)) < 0){
+        *err = aoo::net::socket_errno();
+        LOG_ERROR("aoo_node: couldn't bind UDP socket (" << *err << ")");
+        aoo::net::socket_close(sock);
+        return nullptr;
+    }
+
+    // get the actual port (in case we passed 0)
+    socklen_t len = sizeof(sa);
+    if (getsockname(sock, (sockaddr *)&sa, &len) < 0){
+        *err = aoo::net::socket_errno();
+        LOG_ERROR("aoo_node: couldn't get socket name (" << *err << ")");
+        aoo::net::socket_close(sock);
+        return nullptr;
+    }
+
+    return new aoo::node(sock, ntohs(sa.sin_port));
+}
+
+void aoonode_free(aoonode *node){
+    // cast to correct type because base class
+    // has no virtual destructor!
+    delete static_cast<aoo::node *>(node);
+}
+
+int aoonode_port(aoonode *node){
+    return node->port();
+}
+
+int32_t aoonode_add_source(aoonode *node, aoo_source *src, int32_t id){
+    return node->add_source(src, id);
+}
+
+int32_t aoonode_remove_source(aoonode *node, aoo_source *src){
+    return node->remove_source(src);
+}
+
+int32_t aoonode_add_sink(aoonode *node, aoo_sink *sink, int32_t id){
+    return node->add_sink(sink, id);
+}
+
+int32_t aoonode_remove_sink(aoonode *node, aoo_sink *sink){
+    return node->remove_sink(sink);
+}
+
+int32_t aoonode_set_client(aoonode *node, aoonet_client *client){
+    return node->set_client(client);
+}
+
+void aoonode_notify(aoonode *node){
+    node->notify();
+}
+
+void * aoonode_endpoint(aoonode *node, const void *address, int32_t addrlen){
+    return node->get_endpoint(address, addrlen);
+}
+
+int32_t aoonode_reply(void *endpoint, const char *data, int32_t size){
+    return aoo::node_endpoint::send(endpoint, data, size);
+}
+
+int32_t aoonode_sendto(void *node, const char *data, int32_t size, void *address){
+    return static_cast<aoonode *>(node)->sendto(data, size, address);
+}
+
+namespace aoo {
+
+/*//////////////////// wakeup_event /////////////////////*/
+
+wakeup_event::wakeup_event(){
+#if defined(_WIN32)
+    handle_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+    fd_[0] = fd_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd_[0] < 0){
+        LOG_ERROR("aoo_node: couldn't create eventfd (" << errno << ")");
+    }
+#else
+    if (pipe(fd_) != 0){
+        LOG_ERROR("aoo_node: couldn't create pipe (" << errno << ")");
+    } else {
+        // signal() must never block
+        fcntl(fd_[0], F_SETFL, O_NONBLOCK);
+        fcntl(fd_[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+}
+
+wakeup_event::~wakeup_event(){
+#if defined(_WIN32)
+    CloseHandle(handle_);
+#elif defined(__linux__)
+    close(fd_[0]);
+#else
+    close(fd_[0]);
+    close(fd_[1]);
+#endif
+}
+
+void wakeup_event::signal(){
+#if defined(_WIN32)
+    SetEvent(handle_);
+#elif defined(__linux__)
+    uint64_t one = 1;
+    write(fd_[1], &one, sizeof(one));
+#else
+    // if the pipe is full, there's a pending wakeup anyway
+    write(fd_[1], "\0", 1);
+#endif
+}
+
+void wakeup_event::wait(int timeout){
+#ifdef _WIN32
+    WaitForSingleObject(handle_, timeout < 0 ? INFINITE : timeout);
+#else
+    struct pollfd p;
+    p.fd = fd_[0];
+    p.events = POLLIN;
+    p.revents = 0;
+    if (poll(&p, 1, timeout) > 0){
+        clear();
+    }
+#endif
+}
+
+void wakeup_event::clear(){
+#if defined(_WIN32)
+    // auto-reset
+#elif defined(__linux__)
+    uint64_t count;
+    read(fd_[0], &count, sizeof(count));
+#else
+    char buf[64];
+    while (read(fd_[0], buf, sizeof(buf)) > 0) ;
+#endif
+}
+
+/*//////////////////// node_endpoint /////////////////////*/
+
+int32_t node_endpoint::send(void *x, const char *data, int32_t size){
+    auto e = static_cast<node_endpoint *>(x);
+    e->last_used.store(e->owner.now(), std::memory_order_relaxed);
+    return e->owner.send_packet(data, size, e->address);
+}
+
+/*//////////////////// node /////////////////////*/
+
+node::node(int socket, int port)
+    : socket_(socket), port_(port)
+{
+    // preallocate the receive buffers, so that we never
+    // touch the heap while receiving.
+    packets_.reset(new packet[AOONODE_RECV_BATCH]);
+#if AOO_NODE_EPOLL
+    msgvec_.reset(new struct mmsghdr[AOONODE_RECV_BATCH]);
+    iovec_.reset(new struct iovec[AOONODE_RECV_BATCH]);
+    for (int i = 0; i < AOONODE_RECV_BATCH; ++i){
+        iovec_[i].iov_base = packets_[i].data;
+        iovec_[i].iov_len = AOO_MAXPACKETSIZE;
+        memset(&msgvec_[i], 0, sizeof(msgvec_[i]));
+        msgvec_[i].msg_hdr.msg_name = &packets_[i].address.address;
+        msgvec_[i].msg_hdr.msg_iov = &iovec_[i];
+        msgvec_[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd_ < 0){
+        LOG_ERROR("aoo_node: couldn't create epoll instance (" << errno << ")");
+    } else {
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = socket_;
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, socket_, &ev);
+        ev.data.fd = quit_event_.fd();
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, quit_event_.fd(), &ev);
+    }
+#endif
+#ifdef _WIN32
+    sockevent_ = WSACreateEvent();
+    WSAEventSelect(socket_, sockevent_, FD_READ);
+#endif
+
+    receive_thread_ = std::thread(&node::receive_loop, this);
+    send_thread_ = std::thread(&node::send_loop, this);
+
+    LOG_VERBOSE("aoo_node: listening on port " << port_);
+}
+
+node::~node(){
+    quit_.store(true);
+    quit_event_.signal();
+    send_event_.signal();
+    receive_thread_.join();
+    send_thread_.join();
+
+#if AOO_NODE_EPOLL
+    if (epollfd_ >= 0){
+        close(epollfd_);
+    }
+#endif
+#ifdef _WIN32
+    WSACloseEvent(sockevent_);
+#endif
+    net::socket_close(socket_);
+}
+
+int32_t node::add_source(isource *src, int32_t id){
+    unique_lock lock(objects_mutex_);
+    for (auto& it : sources_){
+        if (it.second == src){
+            LOG_WARNING("aoo_node: source already added");
+            return 0;
+        }
+    }
+    sources_.emplace(id, src);
+    return 1;
+}
+
+int32_t node::remove_source(isource *src){
+    unique_lock lock(objects_mutex_);
+    for (auto it = sources_.begin(); it != sources_.end(); ++it){
+        if (it->second == src){
+            sources_.erase(it);
+            return 1;
+        }
+    }
+    LOG_WARNING("aoo_node: source not found");
+    return 0;
+}
+
+int32_t node::add_sink(isink *sink, int32_t id){
+    unique_lock lock(objects_mutex_);
+    for (auto& it : sinks_){
+        if (it.second == sink){
+            LOG_WARNING("aoo_node: sink already added");
+            return 0;
+        }
+    }
+    sinks_.emplace(id, sink);
+    return 1;
+}
+
+int32_t node::remove_sink(isink *sink){
+    unique_lock lock(objects_mutex_);
+    for (auto it = sinks_.begin(); it != sinks_.end(); ++it){
+        if (it->second == sink){
+            sinks_.erase(it);
+            return 1;
+        }
+    }
+    LOG_WARNING("aoo_node: sink not found");
+    return 0;
+}
+
+int32_t node::set_client(net::iclient *client){
+    unique_lock lock(objects_mutex_);
+    client_ = client;
+    have_client_.store(client != nullptr);
+    // wake up the send thread, so it starts with the timeout
+    send_event_.signal();
+    return 1;
+}
+
+void node::notify(){
+    send_event_.signal();
+}
+
+void * node::get_endpoint(const void *address, int32_t addrlen){
+    net::ip_address addr((const struct sockaddr *)address, addrlen);
+    update_clock();
+    return find_endpoint(addr);
+}
+
+int32_t node::sendto(const char *data, int32_t size, const void *address){
+    auto sa = (const struct sockaddr *)address;
+    // we only support IPv4 for now
+    net::ip_address addr(sa, sizeof(sockaddr_in));
+    return send_packet(data, size, addr);
+}
+
+int32_t node::send_packet(const char *data, int32_t size, const net::ip_address& addr){
+    return ::sendto(socket_, data, size, 0,
+                    (const struct sockaddr *)&addr.address, addr.length);
+}
+
+double node::update_clock(){
+    using namespace std::chrono;
+    auto now = duration<double>(steady_clock::now().time_since_epoch()).count();
+    now_.store(now, std::memory_order_relaxed);
+    return now;
+}
+
+node_endpoint * node::find_endpoint(const net::ip_address& addr){
+    auto now = this->now();
+    {
+        shared_lock lock(endpoint_mutex_);
+        auto it = endpoints_.find(addr);
+        if (it != endpoints_.end()){
+            it->second->last_used.store(now, std::memory_order_relaxed);
+            return it->second.get();
+        }
+    }
+    unique_lock lock(endpoint_mutex_);
+    if ((now - last_expire_) >= AOONODE_ENDPOINT_TIMEOUT * 0.5){
+        expire_endpoints(now);
+        last_expire_ = now;
+    }
+    // check again, another thread might have added it in the meantime
+    auto& e = endpoints_[addr];
+    if (e){
+        e->last_used.store(now, std::memory_order_relaxed);
+        return e.get();
+    }
+    // Sources and sinks identify their peers by the endpoint pointer,
+    // so a retired endpoint for the same address must be revived.
+    // Endpoints are never reused for another address!
+    for (auto it = retired_endpoints_.begin(); it != retired_endpoints_.end(); ++it){
+        if ((*it)->address == addr){
+            e = std::move(*it);
+            retired_endpoints_.erase(it);
+            e->last_used.store(now, std::memory_order_relaxed);
+            LOG_DEBUG("aoo_node: revive endpoint " << addr.name() << ":" << addr.port());
+            return e.get();
+        }
+    }
+    e = std::make_unique<node_endpoint>(*this, addr, now);
+    LOG_DEBUG("aoo_node: new endpoint " << addr.name() << ":" << addr.port());
+    return e.get();
+}
+
+// called with the endpoint mutex locked (exclusively)
+void node::expire_endpoints(double now){
+    for (auto it = endpoints_.begin(); it != endpoints_.end(); ){
+        auto& e = it->second;
+        if ((now - e->last_used.load(std::memory_order_relaxed))
+                >= AOONODE_ENDPOINT_TIMEOUT)
+        {
+            LOG_DEBUG("aoo_node: retire endpoint " << e->address.name()
+                      << ":" << e->address.port());
+            retired_endpoints_.push_back(std::move(e));
+            it = endpoints_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void node::receive_loop(){
+    while (!quit_.load()){
+        if (!wait_for_packets()){
+            break;
+        }
+        // drain the socket
+        int32_t count;
+        while ((count = receive_packets()) > 0){
+            update_clock();
+            for (int i = 0; i < count; ++i){
+                auto& p = packets_[i];
+                dispatch_packet(p.data, p.size, p.address);
+            }
+            // wake up the send thread once per batch
+            send_event_.signal();
+            if (count < AOONODE_RECV_BATCH){
+                break;
+            }
+        }
+    }
+}
+
+// returns false on quit
+bool node::wait_for_packets(){
+#if defined(_WIN32)
+    HANDLE events[2] = { sockevent_, quit_event_.handle() };
+    auto result = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+    WSAResetEvent(sockevent_);
+    return result == WAIT_OBJECT_0 && !quit_.load();
+#elif AOO_NODE_EPOLL
+    struct epoll_event events[2];
+    int n = epoll_wait(epollfd_, events, 2, -1);
+    if (n < 0){
+        int err = errno;
+        if (err == EINTR){
+            return true;
+        }
+        LOG_ERROR("aoo_node: epoll_wait failed (" << err << ")");
+        return false;
+    }
+    return !quit_.load();
+#else
+    struct pollfd fds[2];
+    fds[0].fd = socket_;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = quit_event_.fd();
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    if (poll(fds, 2, -1) < 0){
+        int err = errno;
+        if (err == EINTR){
+            return true;
+        }
+        LOG_ERROR("aoo_node: poll failed (" << err << ")");
+        return false;
+    }
+    return !quit_.load();
+#endif
+}
+
+// receive up to AOONODE_RECV_BATCH packets without blocking.
+// returns the number of packets
+int32_t node::receive_packets(){
+#if AOO_NODE_EPOLL
+    for (int i = 0; i < AOONODE_RECV_BATCH; ++i){
+        msgvec_[i].msg_hdr.msg_namelen = sizeof(sockaddr_storage);
+    }
+    int n = recvmmsg(socket_, msgvec_.get(), AOONODE_RECV_BATCH, 0, nullptr);
+    if (n < 0){
+        int err = errno;
+        if (!AOO_WOULDBLOCK(err) && err != EINTR){
+            LOG_ERROR("aoo_node: recv failed (" << err << ")");
+        }
+        return 0;
+    }
+    for (int i = 0; i < n; ++i){
+        packets_[i].size = msgvec_[i].msg_len;
+        packets_[i].address.length = msgvec_[i].msg_hdr.msg_namelen;
+    }
+    return n;
+#else
+    int n = 0;
+    while (n < AOONODE_RECV_BATCH){
+        auto& p = packets_[n];
+        p.address.length = sizeof(sockaddr_storage);
+        int result = recvfrom(socket_, p.data, AOO_MAXPACKETSIZE, 0,
+                              (struct sockaddr *)&p.address.address,
+                              &p.address.length);
+        if (result < 0){
+            int err = net::socket_errno();
+        #ifdef _WIN32
+            // ignore ICMP "port unreachable" messages
+            if (err == WSAECONNRESET){
+                continue;
+            }
+        #endif
+            if (!AOO_WOULDBLOCK(err)){
+                LOG_ERROR("aoo_node: recv failed (" << err << ")");
+            }
+            break;
+        }
+        p.size = result;
+        n++;
+    }
+    return n;
+#endif
+}
+
+void node::dispatch_packet(const char *data, int32_t size,
+                           const net::ip_address& addr)
+{
+    int32_t type, id;
+    if (aoo_parse_pattern(data, size, &type, &id) > 0){
+        auto e = find_endpoint(addr);
+
+        shared_lock lock(objects_mutex_);
+        if (type == AOO_TYPE_SOURCE){
+            if (id == AOO_ID_WILDCARD){
+                for (auto& it : sources_){
+                    it.second->handle_message(data, size, e, node_endpoint::send);
+                }
+            } else {
+                auto range = sources_.equal_range(id);
+                for (auto it = range.first; it != range.second; ++it){
+                    it->second->handle_message(data, size, e, node_endpoint::send);
+                }
+            }
+        } else if (type == AOO_TYPE_SINK){
+            // compact data messages don't have a sink ID;
+            // the sinks filter them by the stream salt.
+            if (id == AOO_ID_WILDCARD || id == AOO_ID_NONE){
+                for (auto& it : sinks_){
+                    it.second->handle_message(data, size, e, node_endpoint::send);
+                }
+            } else {
+                auto range = sinks_.equal_range(id);
+                for (auto it = range.first; it != range.second; ++it){
+                    it->second->handle_message(data, size, e, node_endpoint::send);
+                }
+            }
+        } else {
+            LOG_WARNING("aoo_node: unknown message type " << type);
+        }
+    } else if (aoonet_parse_pattern(data, size, &type) > 0){
+        shared_lock lock(objects_mutex_);
+        if (client_ && (type == AOO_TYPE_CLIENT || type == AOO_TYPE_PEER)){
+            client_->handle_message(data, size, (void *)&addr.address);
+        }
+    } else {
+        LOG_DEBUG("aoo_node: not an AoO message");
+    }
+}
+
+void node::send_loop(){
+    while (!quit_.load()){
+        // the client sends handshakes, server pings and peer keepalives
+        // on its own schedule, so we have to wake up periodically.
+        send_event_.wait(have_client_.load() ? AOONODE_CLIENT_INTERVAL : -1);
+        if (quit_.load()){
+            break;
+        }
+        update_clock();
+        shared_lock lock(objects_mutex_);
+        // send() returns 0 when there's nothing left to send
+        for (auto& it : sources_){
+            while (it.second->send()) ;
+        }
+        for (auto& it : sinks_){
+            while (it.second->send()) ;
+        }
+        if (client_){
+            client_->send();
+        }
+    }
+}
+
+} // aoo
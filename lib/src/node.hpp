@@ -0,0 +1,170 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "aoo/aoo.hpp"
+#include "aoo/aoo_net.hpp"
+#include "aoo/aoo_node.hpp"
+
+#include "net_utils.hpp"
+#include "sync.hpp"
+
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+
+// use epoll() + recvmmsg() on Linux, poll() + recvfrom() is the portable fallback.
+#ifndef AOO_NODE_EPOLL
+# ifdef __linux__
+#  define AOO_NODE_EPOLL 1
+# else
+#  define AOO_NODE_EPOLL 0
+# endif
+#endif
+
+#if AOO_NODE_EPOLL
+#include <sys/epoll.h>
+#endif
+
+namespace aoo {
+
+/*///////////////////////// wakeup_event /////////////////////////*/
+
+// A thread wakeup primitive which can also be waited on together
+// with a socket: eventfd on Linux, a (non-blocking) pipe on other
+// POSIX systems and an auto-reset event on Windows.
+// signal() never blocks and is RT-safe.
+
+class wakeup_event {
+public:
+    wakeup_event();
+    ~wakeup_event();
+    wakeup_event(const wakeup_event&) = delete;
+    wakeup_event& operator=(const wakeup_event&) = delete;
+
+    void signal();
+    // block until signalled or until the timeout (in ms) has expired;
+    // a negative timeout waits forever.
+    void wait(int timeout = -1);
+    // reset after the event has been polled
+    void clear();
+#ifdef _WIN32
+    HANDLE handle() const { return handle_; }
+#else
+    int fd() const { return fd_[0]; }
+#endif
+private:
+#ifdef _WIN32
+    HANDLE handle_;
+#else
+    int fd_[2];
+#endif
+};
+
+/*///////////////////////// node /////////////////////////*/
+
+class node;
+
+// A remote socket address; the address of the endpoint
+// object is passed as the 'endpoint' argument to handle_message().
+struct node_endpoint {
+    node_endpoint(node& n, const net::ip_address& addr, double t)
+        : owner(n), address(addr), last_used(t) {}
+
+    static int32_t send(void *x, const char *data, int32_t size);
+
+    node& owner;
+    const net::ip_address address;
+    // time of the last packet sent or received
+    std::atomic<double> last_used;
+};
+
+class node final : public inode {
+public:
+    node(int socket, int port);
+    ~node();
+
+    int port() const override { return port_; }
+
+    int32_t add_source(isource *src, int32_t id) override;
+
+    int32_t remove_source(isource *src) override;
+
+    int32_t add_sink(isink *sink, int32_t id) override;
+
+    int32_t remove_sink(isink *sink) override;
+
+    int32_t set_client(net::iclient *client) override;
+
+    void notify() override;
+
+    void * get_endpoint(const void *address, int32_t addrlen) override;
+
+    int32_t sendto(const char *data, int32_t size, const void *address) override;
+
+    int32_t send_packet(const char *data, int32_t size, const net::ip_address& addr);
+
+    double now() const { return now_.load(std::memory_order_relaxed); }
+private:
+    int socket_;
+    int port_;
+    std::atomic<bool> quit_{false};
+    // objects (key = ID)
+    std::unordered_multimap<int32_t, isource *> sources_;
+    std::unordered_multimap<int32_t, isink *> sinks_;
+    net::iclient *client_ = nullptr;
+    std::atomic<bool> have_client_{false};
+    shared_mutex objects_mutex_;
+    // Idle endpoints are moved to the retired list, so the pointers
+    // stay valid; they are only freed together with the node.
+    std::unordered_map<net::ip_address, std::unique_ptr<node_endpoint>,
+                       net::ip_address::hash> endpoints_;
+    std::vector<std::unique_ptr<node_endpoint>> retired_endpoints_;
+    double last_expire_ = 0;
+    shared_mutex endpoint_mutex_;
+    // coarse clock for endpoint expiry; updated once per batch
+    std::atomic<double> now_{0};
+    // receive buffers; allocated once and reused for every batch
+    struct packet {
+        net::ip_address address;
+        int32_t size;
+        char data[AOO_MAXPACKETSIZE];
+    };
+    std::unique_ptr<packet[]> packets_;
+#if AOO_NODE_EPOLL
+    std::unique_ptr<struct mmsghdr[]> msgvec_;
+    std::unique_ptr<struct iovec[]> iovec_;
+    int epollfd_ = -1;
+#endif
+#ifdef _WIN32
+    HANDLE sockevent_;
+#endif
+    // threads
+    wakeup_event quit_event_;
+    wakeup_event send_event_;
+    std::thread receive_thread_;
+    std::thread send_thread_;
+
+    void receive_loop();
+
+    bool wait_for_packets();
+
+    int32_t receive_packets();
+
+    void dispatch_packet(const char *data, int32_t size,
+                         const net::ip_address& addr);
+
+    void send_loop();
+
+    double update_clock();
+
+    node_endpoint * find_endpoint(const net::ip_address& addr);
+
+    void expire_endpoints(double now);
+};
+
+} // aoo
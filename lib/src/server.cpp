@@ -8,6 +8,13 @@
 #include <algorithm>
 #include <random>
 
+// don't raise SIGPIPE if the client has already closed the connection
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
 #define AOONET_MSG_CLIENT_PING \
     AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PING
 
@@ -39,6 +46,33 @@
 #define AOONET_MSG_CLIENT_PEER_LEAVE \
     AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PEER AOONET_MSG_LEAVE
 
+#define AOONET_MSG_CLIENT_PEER_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PEER AOONET_MSG_ADD
+
+#define AOONET_MSG_CLIENT_PEER_DEL \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PEER AOONET_MSG_DEL
+
+#define AOONET_MSG_CLIENT_RELAY_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_RELAY AOONET_MSG_ADD
+
+#define AOONET_MSG_CLIENT_RELAY_DEL \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_RELAY AOONET_MSG_DEL
+
+#define AOONET_MSG_SERVER_CLUSTER_JOIN \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_JOIN
+
+#define AOONET_MSG_SERVER_CLUSTER_LEAVE \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_LEAVE
+
+#define AOONET_MSG_SERVER_CLUSTER_PEER_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_PEER AOONET_MSG_ADD
+
+#define AOONET_MSG_SERVER_CLUSTER_PEER_DEL \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_PEER AOONET_MSG_DEL
+
+#define AOONET_MSG_SERVER_CLUSTER_DELIVER \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_CLUSTER AOONET_MSG_DELIVER
+
 #define AOONET_MSG_GROUP_JOIN \
     AOONET_MSG_GROUP AOONET_MSG_JOIN
 
@@ -48,6 +82,26 @@
 #define AOONET_MSG_GROUP_PUBLIC \
     AOONET_MSG_GROUP AOONET_MSG_PUBLIC
 
+#define AOONET_MSG_PEER_ADD \
+    AOONET_MSG_PEER AOONET_MSG_ADD
+
+#define AOONET_MSG_PEER_DEL \
+    AOONET_MSG_PEER AOONET_MSG_DEL
+
+#define AOONET_MSG_RELAY_ADD \
+    AOONET_MSG_RELAY AOONET_MSG_ADD
+
+#define AOONET_MSG_RELAY_DEL \
+    AOONET_MSG_RELAY AOONET_MSG_DEL
+
+// send relay messages with a single sendmmsg() call
+#if defined(__linux__) && !defined(AOO_SERVER_SENDMMSG)
+#define AOO_SERVER_SENDMMSG 1
+#endif
+
+// max. size of a rewritten relay message header
+#define AOO_RELAY_HEADERSIZE 128
+
 
 namespace aoo {
 namespace net {
@@ -147,7 +201,9 @@ aoonet_server * aoonet_server_new(int port, int32_t *err) {
     }
 
     // listen
-    if (listen(tcpsocket, 32) < 0){
+    // NOTE: use the max. backlog, otherwise a burst of connection
+    // requests would be dropped before we get a chance to accept them.
+    if (listen(tcpsocket, SOMAXCONN) < 0){
         *err = aoo::net::socket_errno();
         LOG_ERROR("aoo_server: listen() failed (" << *err << ")");
         aoo::net::socket_close(tcpsocket);
@@ -158,20 +214,148 @@ aoonet_server * aoonet_server_new(int port, int32_t *err) {
     return new aoo::net::server(tcpsocket, udpsocket);
 }
 
+/*//////////////////// relay batch /////////////////////*/
+
+// A relayed message consists of a new header (address pattern, type tags and
+// relay ID) and the rest of the original packet, which is sent directly from
+// the receive buffer, so the audio data itself is never copied.
+// Received packets stay in their buffer until the batch has been sent.
+
+struct aoo::net::server::relay_batch {
+    struct message {
+        ip_address address;
+        char header[AOO_RELAY_HEADERSIZE];
+        int32_t headersize;
+        const char *payload;
+        int32_t payloadsize;
+    };
+
+    char buffers[AOO_SERVER_RELAY_BUFFERS][AOO_MAXPACKETSIZE];
+    int32_t numbuffers = 0;
+    message messages[AOO_SERVER_RELAY_BATCH];
+    int32_t nummessages = 0;
+
+    // the current receive buffer
+    char * buffer() { return buffers[numbuffers]; }
+
+    // keep the current receive buffer; returns false if all buffers are in use
+    bool keep_buffer() { return ++numbuffers < AOO_SERVER_RELAY_BUFFERS; }
+
+    bool full() const { return nummessages == AOO_SERVER_RELAY_BATCH; }
+
+    message& add() { return messages[nummessages++]; }
+
+    // send all pending messages
+    void send(int sock);
+
+    // send all pending messages and release the receive buffers
+    void flush(int sock){
+        send(sock);
+        numbuffers = 0;
+    }
+};
+
+static bool relay_send_error(int err){
+#ifdef _WIN32
+    if (err == WSAEWOULDBLOCK)
+#else
+    if (err == EWOULDBLOCK)
+#endif
+    {
+        LOG_VERBOSE("aoo_server: relay send() would block");
+        return false;
+    } else {
+        // TODO handle error
+        LOG_ERROR("aoo_server: relay send() failed (" << err << ")");
+        return true; // try next message
+    }
+}
+
+void aoo::net::server::relay_batch::send(int sock){
+    if (!nummessages){
+        return;
+    }
+#if AOO_SERVER_SENDMMSG
+    struct mmsghdr msgs[AOO_SERVER_RELAY_BATCH];
+    struct iovec iov[AOO_SERVER_RELAY_BATCH][2];
+    for (int i = 0; i < nummessages; ++i){
+        auto& m = messages[i];
+        iov[i][0].iov_base = m.header;
+        iov[i][0].iov_len = m.headersize;
+        iov[i][1].iov_base = (void *)m.payload;
+        iov[i][1].iov_len = m.payloadsize;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &m.address.address;
+        msgs[i].msg_hdr.msg_namelen = m.address.length;
+        msgs[i].msg_hdr.msg_iov = iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+    int sent = 0;
+    while (sent < nummessages){
+        auto result = sendmmsg(sock, msgs + sent, nummessages - sent, 0);
+        if (result > 0){
+            sent += result;
+        } else if (relay_send_error(socket_errno())){
+            sent++; // skip message
+        } else {
+            break;
+        }
+    }
+#elif defined(_WIN32)
+    for (int i = 0; i < nummessages; ++i){
+        auto& m = messages[i];
+        WSABUF bufs[2];
+        bufs[0].buf = m.header;
+        bufs[0].len = m.headersize;
+        bufs[1].buf = (CHAR *)m.payload;
+        bufs[1].len = m.payloadsize;
+        DWORD nbytes;
+        if (WSASendTo(sock, bufs, 2, &nbytes, 0,
+                      (const struct sockaddr *)&m.address.address,
+                      m.address.length, NULL, NULL) != 0)
+        {
+            if (!relay_send_error(socket_errno())){
+                break;
+            }
+        }
+    }
+#else
+    for (int i = 0; i < nummessages; ++i){
+        auto& m = messages[i];
+        struct iovec iov[2];
+        iov[0].iov_base = m.header;
+        iov[0].iov_len = m.headersize;
+        iov[1].iov_base = (void *)m.payload;
+        iov[1].iov_len = m.payloadsize;
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &m.address.address;
+        msg.msg_namelen = m.address.length;
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 2;
+        if (sendmsg(sock, &msg, 0) < 0){
+            if (!relay_send_error(socket_errno())){
+                break;
+            }
+        }
+    }
+#endif
+    nummessages = 0;
+}
+
 aoo::net::server::server(int tcpsocket, int udpsocket)
-    : tcpsocket_(tcpsocket), udpsocket_(udpsocket)
+    : tcpsocket_(tcpsocket), udpsocket_(udpsocket),
+      relay_batch_(std::make_unique<relay_batch>())
 {
 #ifdef _WIN32
-    waitevent_ = CreateEvent(NULL, FALSE, FALSE, NULL);
     tcpevent_ = WSACreateEvent();
     udpevent_ = WSACreateEvent();
     WSAEventSelect(tcpsocket_, tcpevent_, FD_ACCEPT);
     WSAEventSelect(udpsocket_, udpevent_, FD_READ | FD_WRITE);
-#else
-    if (pipe(waitpipe_) != 0){
-        // TODO handle error
-    }
 #endif
+    // the listening worker
+    workers_.push_back(std::make_unique<server_worker>(*this, 0, true));
+
     commands_.resize(256, 1);
     events_.resize(256, 1);
 }
@@ -183,13 +367,12 @@ void aoonet_server_free(aoonet_server *server){
 }
 
 aoo::net::server::~server() {
+    // free workers (and clients) first!
+    workers_.clear();
+
 #ifdef _WIN32
-    CloseHandle(waitevent_);
     WSACloseEvent(tcpevent_);
     WSACloseEvent(udpevent_);
-#else
-    close(waitpipe_[0]);
-    close(waitpipe_[1]);
 #endif
 
     socket_close(tcpsocket_);
@@ -201,9 +384,24 @@ int32_t aoonet_server_run(aoonet_server *server){
 }
 
 int32_t aoo::net::server::run(){
+    if (nodes_.size() > 1 && cluster_secret_.empty()){
+        LOG_ERROR("aoo_server: the cluster secret must be set");
+        return 0;
+    }
+
+    running_.store(true);
+
+    // start the other workers
+    for (size_t i = 1; i < workers_.size(); ++i){
+        workers_[i]->start();
+    }
+
+    auto& listener = *workers_[0];
+    server_worker::current_ = &listener;
+
     while (!quit_.load()){
         // wait for networking or other events
-        wait_for_event();
+        listener.wait_for_event();
 
         if (quit_.load()) {
             break;
@@ -215,15 +413,20 @@ int32_t aoo::net::server::run(){
             commands_.read(cmd);
             cmd->perform(*this);
         }
+        listener.flush_signals();
     }
 
-    // need to close all the clients sockets without
-    // having them send anything out, so that active communication
-    // between connected peers can continue if the server goes down for maintainence
-    for (int i = 0; i < clients_.size(); ++i){
-        clients_[i]->close(false);
+    // the workers close their clients before they return
+    for (size_t i = 1; i < workers_.size(); ++i){
+        workers_[i]->join();
     }
-    
+
+    listener.close_all();
+
+    server_worker::current_ = nullptr;
+
+    running_.store(false);
+
     return 1;
 }
 
@@ -237,6 +440,83 @@ int32_t aoo::net::server::quit(){
     return 0;
 }
 
+int32_t aoonet_server_set_num_threads(aoonet_server *server, int32_t n){
+    return server->set_num_threads(n);
+}
+
+int32_t aoo::net::server::set_num_threads(int32_t n){
+    if (running_.load()){
+        LOG_ERROR("aoo_server: can't set number of threads while running");
+        return 0;
+    }
+#ifdef _WIN32
+    // WaitForMultipleObjects() is limited to 64 handles anyway
+    if (n > 1){
+        LOG_WARNING("aoo_server: threaded mode not supported on Windows");
+        n = 1;
+    }
+#endif
+    // remove all but the listening worker
+    workers_.resize(1);
+    if (n > 1){
+        for (int i = 1; i <= n; ++i){
+            workers_.push_back(std::make_unique<server_worker>(*this, i, false));
+        }
+    }
+    next_worker_ = 0;
+    return 1;
+}
+
+int32_t aoonet_server_add_node(aoonet_server *server, const char *host,
+                               int port, int32_t self){
+    return server->add_node(host, port, self);
+}
+
+int32_t aoo::net::server::add_node(const char *host, int port, bool self){
+    if (running_.load()){
+        LOG_ERROR("aoo_server: can't add cluster node while running");
+        return 0;
+    }
+    if (self && self_ >= 0){
+        LOG_ERROR("aoo_server: cluster node for this server already added");
+        return 0;
+    }
+    auto index = (int32_t)nodes_.size();
+    cluster_node node;
+    node.host = host;
+    node.port = port;
+    if (self){
+        self_ = index;
+    } else {
+        node.link = std::make_unique<node_link>(host, port, cluster_secret_);
+    }
+    // the ring position only depends on the address,
+    // so all nodes agree regardless of the order.
+    ring_.add_node(index, node.host + ":" + std::to_string(port));
+    nodes_.push_back(std::move(node));
+    LOG_VERBOSE("aoo_server: added cluster node " << host << ":" << port
+                << (self ? " (self)" : ""));
+    return 1;
+}
+
+int32_t aoonet_server_set_cluster_secret(aoonet_server *server, const char *secret){
+    return server->set_cluster_secret(secret);
+}
+
+int32_t aoo::net::server::set_cluster_secret(const char *secret){
+    if (running_.load()){
+        LOG_ERROR("aoo_server: can't set cluster secret while running");
+        return 0;
+    }
+    cluster_secret_ = secret;
+    for (auto& node : nodes_){
+        if (node.link){
+            node.link->set_secret(cluster_secret_);
+        }
+    }
+    return 1;
+}
+
 int32_t aoonet_server_events_available(aoonet_server *server){
     return server->events_available();
 }
@@ -283,59 +563,361 @@ std::string server::error_to_string(error e){
         return "permission denied";
     case server::error::wrong_password:
         return "wrong password";
+    case server::error::already_member:
+        return "already a group member";
+    case server::error::not_member:
+        return "not a group member";
+    case server::error::group_not_found:
+        return "couldn't find group";
+    case server::error::user_not_found:
+        return "couldn't find user";
+    case server::error::already_subscribed:
+        return "already subscribed";
+    case server::error::not_subscribed:
+        return "not subscribed";
     default:
         return "unknown error";
     }
 }
 
-std::shared_ptr<user> server::get_user(const std::string& name,
-                                       const std::string& pwd, error& e)
+std::shared_ptr<user> server::login(client_endpoint& ep, const std::string& name,
+                                    const std::string& pwd, error& e)
 {
-    auto usr = find_user(name);
-    if (usr){
-        // check if someone is already logged in
-        if (usr->endpoint){
-            e = error::access_denied;
-            return nullptr;
-        }
-        // check password for existing user
-        if (usr->password == pwd){
-            e = error::none;
-            return usr;
+    std::shared_ptr<user> usr;
+    {
+        auto& shard = get_user_shard(name);
+        unique_lock lock(shard.mutex);
+        auto it = shard.users.find(name);
+        if (it != shard.users.end()){
+            usr = it->second;
+            // check if someone is already logged in
+            // (or if this is the member of another cluster node)
+            if (usr->endpoint || usr->node >= 0){
+                e = error::access_denied;
+                return nullptr;
+            }
+            // check password for existing user
+            if (usr->password != pwd){
+                e = error::wrong_password;
+                return nullptr;
+            }
         } else {
-            e = error::wrong_password;
-            return nullptr;
-        }
-    } else {
-        // create new user (LATER add option to disallow this)
-        if (true){
+            // create new user (LATER add option to disallow this)
             usr = std::make_shared<user>(name, pwd);
-            users_.push_back(usr);
-            e = error::none;
-            return usr;
-        } else {
-            e = error::permission_denied;
-            return nullptr;
+            shard.users.emplace(name, usr);
+            num_users_++;
+        }
+        usr->endpoint = &ep;
+    }
+    e = error::none;
+
+    on_user_joined(*usr);
+
+    return usr;
+}
+
+bool server::join_group(const std::shared_ptr<user>& usr, const std::string& name,
+                        const std::string& pwd, bool is_public, bool partial, error& e)
+{
+    int32_t node = remote_owner(name);
+    if (node >= 0){
+        // forward to the owning node; it replies to the user directly
+        auto ep = usr->endpoint;
+        char buf[AOO_MAXPACKETSIZE];
+        osc::OutboundPacketStream msg(buf, sizeof(buf));
+        msg << osc::BeginMessage(AOONET_MSG_SERVER_CLUSTER_JOIN)
+            << usr->name.c_str()
+            << ep->public_address.name().c_str() << ep->public_address.port()
+            << ep->local_address.name().c_str() << ep->local_address.port()
+            << ep->token << name.c_str() << pwd.c_str() << is_public << partial
+            << osc::EndMessage;
+
+        cluster_send(node, msg.Data(), (int32_t) msg.Size());
+        usr->remote_groups.insert(name);
+        e = error::forwarded;
+        return false;
+    }
+
+    auto& shard = get_group_shard(name);
+    unique_lock lock(shard.mutex);
+    auto grp = get_group(shard, name, pwd, is_public, e);
+    if (!grp){
+        return false;
+    }
+    if (!usr->add_group(grp)){
+        e = error::already_member;
+        return false;
+    }
+    grp->add_user(usr, partial);
+    on_user_joined_group(*usr, *grp);
+    e = error::none;
+    return true;
+}
+
+bool server::leave_group(user& usr, const std::string& name, error& e){
+    if (remote_owner(name) >= 0){
+        cluster_leave(usr, name, true);
+        usr.remote_groups.erase(name);
+        e = error::forwarded;
+        return false;
+    }
+
+    auto& shard = get_group_shard(name);
+    unique_lock lock(shard.mutex);
+    auto grp = find_group(shard, name);
+    if (!grp){
+        e = error::group_not_found;
+        return false;
+    }
+    if (!usr.remove_group(*grp)){
+        e = error::not_member;
+        return false;
+    }
+    remove_member(shard, usr, *grp);
+    e = error::none;
+    return true;
+}
+
+void server::leave_all_groups(user& usr){
+    for (auto& name : usr.remote_groups){
+        cluster_leave(usr, name, false);
+    }
+    usr.remote_groups.clear();
+
+    for (auto& it : usr.groups()){
+        auto& grp = it.second;
+        auto& shard = get_group_shard(grp->name);
+        unique_lock lock(shard.mutex);
+        remove_member(shard, usr, *grp);
+    }
+}
+
+bool server::peer_subscribe(user& usr, const std::string& group,
+                            const std::string& name, error& e)
+{
+    int32_t node = remote_owner(group);
+    if (node >= 0){
+        char buf[AOO_MAXPACKETSIZE];
+        osc::OutboundPacketStream msg(buf, sizeof(buf));
+        msg << osc::BeginMessage(AOONET_MSG_SERVER_CLUSTER_PEER_ADD)
+            << usr.name.c_str() << group.c_str() << name.c_str()
+            << osc::EndMessage;
+
+        cluster_send(node, msg.Data(), (int32_t) msg.Size());
+        e = error::forwarded;
+        return false;
+    }
+
+    auto& shard = get_group_shard(group);
+    unique_lock lock(shard.mutex);
+    auto grp = find_group(shard, group);
+    if (!grp){
+        e = error::group_not_found;
+        return false;
+    }
+    if (!grp->users().count(&usr)){
+        e = error::not_member;
+        return false;
+    }
+    // the peer doesn't have to be a member (yet)
+    auto peer = grp->find_user(name);
+    if (peer == &usr){
+        peer = nullptr; // ignore
+    }
+    bool linked = peer && grp->is_linked(usr, *peer);
+    if (!grp->subscribe(usr, name)){
+        e = error::already_subscribed;
+        return false;
+    }
+    if (peer && !linked && grp->is_linked(usr, *peer)){
+        on_peers_linked(*grp, usr, *peer);
+    }
+    LOG_VERBOSE("aoo_server: " << usr.name << " subscribed to peer " << name
+                << " (" << group << ")");
+    e = error::none;
+    return true;
+}
+
+bool server::peer_unsubscribe(user& usr, const std::string& group,
+                              const std::string& name, error& e)
+{
+    int32_t node = remote_owner(group);
+    if (node >= 0){
+        char buf[AOO_MAXPACKETSIZE];
+        osc::OutboundPacketStream msg(buf, sizeof(buf));
+        msg << osc::BeginMessage(AOONET_MSG_SERVER_CLUSTER_PEER_DEL)
+            << usr.name.c_str() << group.c_str() << name.c_str()
+            << osc::EndMessage;
+
+        cluster_send(node, msg.Data(), (int32_t) msg.Size());
+        e = error::forwarded;
+        return false;
+    }
+
+    auto& shard = get_group_shard(group);
+    unique_lock lock(shard.mutex);
+    auto grp = find_group(shard, group);
+    if (!grp){
+        e = error::group_not_found;
+        return false;
+    }
+    if (!grp->users().count(&usr)){
+        e = error::not_member;
+        return false;
+    }
+    auto peer = grp->find_user(name);
+    if (peer == &usr){
+        peer = nullptr; // ignore
+    }
+    bool linked = peer && grp->is_linked(usr, *peer);
+    if (!grp->unsubscribe(usr, name)){
+        e = error::not_subscribed;
+        return false;
+    }
+    if (peer && linked && !grp->is_linked(usr, *peer)){
+        on_peers_unlinked(*grp, usr, *peer);
+    }
+    LOG_VERBOSE("aoo_server: " << usr.name << " unsubscribed from peer " << name
+                << " (" << group << ")");
+    e = error::none;
+    return true;
+}
+
+bool server::relay_subscribe(user& usr, const std::string& group,
+                             const std::string& name, int32_t sink, error& e)
+{
+    auto& shard = get_group_shard(group);
+    shared_lock lock(shard.mutex); // reader lock!
+    auto grp = find_group(shard, group);
+    if (!grp){
+        e = error::group_not_found;
+        return false;
+    }
+    // both users must be group members
+    if (!grp->users().count(&usr)){
+        e = error::not_member;
+        return false;
+    }
+    user *publisher = nullptr;
+    for (auto& it : grp->users()){
+        if (it.second->name == name){
+            publisher = it.second.get();
+            break;
+        }
+    }
+    if (!publisher || !publisher->endpoint){
+        // NOTE: relaying only works between users of the same cluster node
+        e = error::user_not_found;
+        return false;
+    }
+
+    unique_lock lock2(relay_mutex_);
+    auto it = relay_publishers_.find(publisher->endpoint->public_address);
+    if (it != relay_publishers_.end() && it->second.usr != publisher){
+        // stale entry: another user had the same address
+        relay_remove_publisher(it);
+        it = relay_publishers_.end();
+    }
+    if (it == relay_publishers_.end()){
+        it = relay_publishers_.emplace(publisher->endpoint->public_address,
+                                       relay_publisher{}).first;
+        it->second.usr = publisher;
+    }
+    auto& subscribers = it->second.subscribers;
+    auto& addr = usr.endpoint->public_address;
+    for (auto& sub : subscribers){
+        if (sub.address == addr && sub.sink == sink){
+            e = error::already_subscribed;
+            return false;
         }
     }
+    int32_t relay_sink;
+    do {
+        relay_sink = it->second.next_sink++;
+        if (it->second.next_sink < 0){
+            it->second.next_sink = 0; // wrap around
+        }
+    } while (std::find_if(subscribers.begin(), subscribers.end(),
+                          [&](auto& s){ return s.relay_sink == relay_sink; })
+             != subscribers.end());
+    subscribers.push_back(relay_subscriber { addr, sink, relay_sink, &usr, grp.get() });
+
+    LOG_VERBOSE("aoo_server: " << usr.name << " subscribed to " << name
+                << " (" << group << ")");
+    e = error::none;
+    return true;
 }
 
-std::shared_ptr<user> server::find_user(const std::string& name)
+bool server::relay_unsubscribe(user& usr, const std::string& group,
+                               const std::string& name, int32_t sink, error& e)
 {
-    for (auto& usr : users_){
-        if (usr->name == name){
-            return usr;
+    auto& shard = get_group_shard(group);
+    shared_lock lock(shard.mutex); // reader lock!
+    auto grp = find_group(shard, group);
+    if (!grp){
+        e = error::group_not_found;
+        return false;
+    }
+
+    unique_lock lock2(relay_mutex_);
+    for (auto it = relay_publishers_.begin(); it != relay_publishers_.end(); ++it){
+        if (it->second.usr->name == name){
+            auto& subscribers = it->second.subscribers;
+            auto sub = std::find_if(subscribers.begin(), subscribers.end(),
+                                    [&](auto& s){
+                return s.usr == &usr && s.sink == sink && s.grp == grp.get();
+            });
+            if (sub != subscribers.end()){
+                subscribers.erase(sub);
+                if (subscribers.empty()){
+                    relay_remove_publisher(it);
+                }
+                e = error::none;
+                return true;
+            }
+        }
+    }
+    e = error::not_subscribed;
+    return false;
+}
+
+void server::relay_remove_member(user& usr, group& grp){
+    unique_lock lock(relay_mutex_);
+    for (auto it = relay_publishers_.begin(); it != relay_publishers_.end(); ){
+        auto& pub = it->second;
+        // remove all subscriptions in this group which involve the user
+        auto& subscribers = pub.subscribers;
+        auto result = std::remove_if(subscribers.begin(), subscribers.end(),
+                                     [&](auto& s){
+            return s.grp == &grp && (s.usr == &usr || pub.usr == &usr);
+        });
+        subscribers.erase(result, subscribers.end());
+        if (subscribers.empty()){
+            auto next = std::next(it);
+            relay_remove_publisher(it);
+            it = next;
+        } else {
+            ++it;
         }
     }
-    return nullptr;
 }
 
-std::shared_ptr<group> server::get_group(const std::string& name,
+void server::relay_remove_publisher(
+        std::unordered_map<ip_address, relay_publisher, ip_address::hash>::iterator it)
+{
+    for (auto& stream : it->second.streams){
+        relay_streams_.erase(stream.second);
+    }
+    relay_publishers_.erase(it);
+}
+
+std::shared_ptr<group> server::get_group(group_shard& shard,
+                                         const std::string& name,
                                          const std::string& pwd,
                                          bool is_public,
                                          error& e)
 {
-    auto grp = find_group(name);
+    auto grp = find_group(shard, name);
     if (grp){
         // check password for existing group
         if (grp->is_public != is_public) {
@@ -353,7 +935,8 @@ std::shared_ptr<group> server::get_group(const std::string& name,
         // create new group (LATER add option to disallow this)
         if (true){
             grp = std::make_shared<group>(name, pwd, is_public);
-            groups_.push_back(grp);
+            shard.groups.emplace(name, grp);
+            num_groups_++;
             e = error::none;
             return grp;
         } else {
@@ -363,24 +946,56 @@ std::shared_ptr<group> server::get_group(const std::string& name,
     }
 }
 
-std::shared_ptr<group> server::find_group(const std::string& name)
+std::shared_ptr<group> server::find_group(group_shard& shard,
+                                          const std::string& name)
 {
-    for (auto& grp : groups_){
-        if (grp->name == name){
-            return grp;
+    auto it = shard.groups.find(name);
+    if (it != shard.groups.end()){
+        return it->second;
+    } else {
+        return nullptr;
+    }
+}
+
+void server::remove_member(group_shard& shard, user& usr, group& grp){
+    // only notify the members which know about the user
+    std::vector<std::shared_ptr<user>> peers;
+    for (auto& it : grp.users()){
+        if (it.first != &usr && grp.is_linked(usr, *it.second)){
+            peers.push_back(it.second);
+        }
+    }
+
+    grp.remove_user(usr);
+
+    relay_remove_member(usr, grp);
+
+    on_user_left_group(usr, grp, peers);
+
+    // automatically purge empty groups
+    // LATER add an option so that groups will persist
+    if (grp.num_users() == 0){
+        auto it = shard.groups.find(grp.name);
+        if (it != shard.groups.end()){
+            // keep the group alive until we're done
+            auto ptr = it->second;
+            shard.groups.erase(it);
+            num_groups_--;
+            if (grp.is_public) {
+                on_public_group_removed(grp);
+            }
         }
     }
-    return nullptr;
 }
 
 int32_t server::get_group_count() const
 {
-    return (int32_t) groups_.size();
+    return num_groups_.load();
 }
 
 int32_t server::get_user_count() const
 {
-    return (int32_t) users_.size();    
+    return num_users_.load();
 }
 
 void server::on_user_joined(user &usr){
@@ -390,38 +1005,36 @@ void server::on_user_joined(user &usr){
 }
 
 void server::on_user_left(user &usr){
+    {
+        unique_lock lock(watcher_mutex_);
+        public_group_watchers_.erase(&usr);
+    }
+    {
+        auto& shard = get_user_shard(usr.name);
+        unique_lock lock(shard.mutex);
+        // clear endpoint so the user can be removed
+        usr.endpoint = nullptr;
+        // automatically purge stale users
+        // LATER add an option so that users will persist
+        auto it = shard.users.find(usr.name);
+        if (it != shard.users.end() && it->second.get() == &usr){
+            shard.users.erase(it);
+            num_users_--;
+        }
+    }
+
     auto e = std::make_unique<user_event>(AOONET_SERVER_USER_LEAVE_EVENT,
                                           usr.name.c_str());
     push_event(std::move(e));
 }
 
 void server::on_user_joined_group(user& usr, group& grp){
-    // 1) send the new member to existing group members
-    // 2) send existing group members to the new member
-    for (auto& peer : grp.users()){
-        if (peer.get() != &usr){
-            char buf[AOO_MAXPACKETSIZE];
-
-            auto notify = [&](client_endpoint* dest, user& u){
-                auto e = u.endpoint;
-
-                osc::OutboundPacketStream msg(buf, sizeof(buf));
-                msg << osc::BeginMessage(AOONET_MSG_CLIENT_PEER_JOIN)
-                    << grp.name.c_str() << u.name.c_str()
-                    << e->public_address.name().c_str() << e->public_address.port()
-                    << e->local_address.name().c_str() << e->local_address.port()
-                    << e->token
-                    << osc::EndMessage;
-
-                dest->send_message(msg.Data(), (int32_t) msg.Size());
-            };
-
-            // notify new member
-            notify(usr.endpoint, *peer);
-
-            // notify existing member
-            notify(peer->endpoint, usr);
-
+    // introduce the new member and existing group members to each other
+    // (in partial mesh mode, only if one of them has subscribed to the other)
+    for (auto& it : grp.users()){
+        auto& peer = it.second;
+        if (peer.get() != &usr && grp.is_linked(usr, *peer)){
+            on_peers_linked(grp, usr, *peer);
         }
     }
 
@@ -434,24 +1047,21 @@ void server::on_user_joined_group(user& usr, group& grp){
     push_event(std::move(e));
 }
 
-void server::on_user_left_group(user& usr, group& grp){
+void server::on_user_left_group(user& usr, group& grp,
+                                const std::vector<std::shared_ptr<user>>& peers){
     // notify group members
-    for (auto& peer : grp.users()){
-        if (peer.get() != &usr){
-            char buf[AOO_MAXPACKETSIZE];
-            osc::OutboundPacketStream msg(buf, sizeof(buf));
-            msg << osc::BeginMessage(AOONET_MSG_CLIENT_PEER_LEAVE)
-                  << grp.name.c_str() << usr.name.c_str()
-                  << osc::EndMessage;
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(AOONET_MSG_CLIENT_PEER_LEAVE)
+          << grp.name.c_str() << usr.name.c_str()
+          << osc::EndMessage;
 
-            peer->endpoint->send_message(msg.Data(), (int32_t) msg.Size());
-        }
+    for (auto& peer : peers){
+        send_to_user(*peer, msg.Data(), (int32_t) msg.Size());
     }
 
     if (grp.is_public) {
         on_public_group_modified(grp);
-
-        update(); // possibly prune empty
     }
 
     auto e = std::make_unique<group_event>(AOONET_SERVER_GROUP_LEAVE_EVENT,
@@ -459,23 +1069,82 @@ void server::on_user_left_group(user& usr, group& grp){
     push_event(std::move(e));
 }
 
-void server::on_user_wants_public_groups(user& usr){
-    // 1) send all existing public groups to the user
-    for (auto& grp : groups_){
-        if (!grp->is_public) continue;
+void server::on_peers_linked(group& grp, user& a, user& b){
+    auto notify = [&](user& dest, user& u){
+        auto& public_address = u.get_public_address();
+        auto& local_address = u.get_local_address();
 
         char buf[AOO_MAXPACKETSIZE];
+        osc::OutboundPacketStream msg(buf, sizeof(buf));
+        msg << osc::BeginMessage(AOONET_MSG_CLIENT_PEER_JOIN)
+            << grp.name.c_str() << u.name.c_str()
+            << public_address.name().c_str() << public_address.port()
+            << local_address.name().c_str() << local_address.port()
+            << u.get_token()
+            << osc::EndMessage;
+
+        send_to_user(dest, msg.Data(), (int32_t) msg.Size());
+    };
+
+    notify(a, b);
+    notify(b, a);
+}
 
+void server::on_peers_unlinked(group& grp, user& a, user& b){
+    auto notify = [&](user& dest, user& u){
+        char buf[AOO_MAXPACKETSIZE];
         osc::OutboundPacketStream msg(buf, sizeof(buf));
-        msg << osc::BeginMessage(AOONET_MSG_CLIENT_GROUP_PUBLIC_ADD)
-        << grp->name.c_str()
-        << (int32_t) grp->users().size()
-        << osc::EndMessage;
+        msg << osc::BeginMessage(AOONET_MSG_CLIENT_PEER_LEAVE)
+              << grp.name.c_str() << u.name.c_str()
+              << osc::EndMessage;
+
+        send_to_user(dest, msg.Data(), (int32_t) msg.Size());
+    };
+
+    notify(a, b);
+    notify(b, a);
+}
 
-        usr.endpoint->send_message(msg.Data(), (int32_t) msg.Size());
+void server::send_to_user(user& usr, const char *msg, int32_t size){
+    if (usr.endpoint){
+        send_message(*usr.endpoint, msg, size);
+    } else if (usr.node >= 0){
+        cluster_deliver(usr.node, usr.name, msg, size);
     }
 }
 
+void server::on_user_wants_public_groups(user& usr){
+    usr.watch_public_groups = true;
+    {
+        unique_lock lock(watcher_mutex_);
+        public_group_watchers_.insert(&usr);
+    }
+    // send all existing public groups to the user
+    for (auto& shard : group_shards_){
+        shared_lock lock(shard.mutex);
+        for (auto& it : shard.groups){
+            auto& grp = it.second;
+            if (!grp->is_public) continue;
+
+            char buf[AOO_MAXPACKETSIZE];
+
+            osc::OutboundPacketStream msg(buf, sizeof(buf));
+            msg << osc::BeginMessage(AOONET_MSG_CLIENT_GROUP_PUBLIC_ADD)
+            << grp->name.c_str()
+            << (int32_t) grp->users().size()
+            << osc::EndMessage;
+
+            usr.endpoint->send_message(msg.Data(), (int32_t) msg.Size());
+        }
+    }
+}
+
+void server::on_user_ignores_public_groups(user& usr){
+    usr.watch_public_groups = false;
+    unique_lock lock(watcher_mutex_);
+    public_group_watchers_.erase(&usr);
+}
+
 void server::on_public_group_modified(group& grp)
 {
     char buf[AOO_MAXPACKETSIZE];
@@ -487,10 +1156,9 @@ void server::on_public_group_modified(group& grp)
     << osc::EndMessage;
 
     // notify all users who care
-    for (auto & peer : users_) {
-        if (peer->watch_public_groups) {
-            peer->endpoint->send_message(msg.Data(), (int32_t) msg.Size());
-        }
+    shared_lock lock(watcher_mutex_);
+    for (auto& peer : public_group_watchers_) {
+        send_message(*peer->endpoint, msg.Data(), (int32_t) msg.Size());
     }
 }
 
@@ -505,30 +1173,757 @@ void server::on_public_group_removed(group& grp)
     << osc::EndMessage;
 
     // notify all users who care
-    for (auto & peer : users_) {
-        if (peer->watch_public_groups) {
-            peer->endpoint->send_message(msg.Data(), (int32_t) msg.Size());
+    shared_lock lock(watcher_mutex_);
+    for (auto& peer : public_group_watchers_) {
+        send_message(*peer->endpoint, msg.Data(), (int32_t) msg.Size());
+    }
+}
+
+/*////////////////////////// cluster ////////////////////////////*/
+
+bool server::find_home(const std::string& name, std::string& host, int32_t& port) const {
+    int32_t node = remote_owner(name);
+    if (node >= 0){
+        host = nodes_[node].host;
+        port = nodes_[node].port;
+        return true;
+    } else {
+        return false;
+    }
+}
+
+void server::cluster_deliver(int32_t node, const std::string& name,
+                             const char *data, int32_t size){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(AOONET_MSG_SERVER_CLUSTER_DELIVER)
+        << name.c_str() << osc::Blob(data, size) << osc::EndMessage;
+
+    cluster_send(node, msg.Data(), (int32_t) msg.Size());
+}
+
+void server::cluster_leave(user& usr, const std::string& group, bool reply){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(AOONET_MSG_SERVER_CLUSTER_LEAVE)
+        << usr.name.c_str() << group.c_str() << reply << osc::EndMessage;
+
+    cluster_send(remote_owner(group), msg.Data(), (int32_t) msg.Size());
+    // NOTE: don't erase from usr.remote_groups because we might be iterating!
+}
+
+// Stub users live in the user directory of the group owner, but they
+// never log in there because the hash ring sends them to another node.
+
+std::shared_ptr<user> server::get_remote_user(const std::string& name, int32_t node,
+                                              const ip_address& public_addr,
+                                              const ip_address& local_addr, int64_t token)
+{
+    auto& shard = get_user_shard(name);
+    unique_lock lock(shard.mutex);
+    auto it = shard.users.find(name);
+    if (it != shard.users.end()){
+        // conflict with a local user or a user from another node
+        return it->second->node == node ? it->second : nullptr;
+    }
+    auto usr = std::make_shared<user>(name, "");
+    usr->node = node;
+    usr->public_address = public_addr;
+    usr->local_address = local_addr;
+    usr->token = token;
+    shard.users.emplace(name, usr);
+    return usr;
+}
+
+std::shared_ptr<user> server::find_remote_user(const std::string& name){
+    auto& shard = get_user_shard(name);
+    shared_lock lock(shard.mutex);
+    auto it = shard.users.find(name);
+    if (it != shard.users.end() && it->second->node >= 0){
+        return it->second;
+    } else {
+        return nullptr;
+    }
+}
+
+void server::remove_remote_user(user& usr){
+    auto& shard = get_user_shard(usr.name);
+    unique_lock lock(shard.mutex);
+    auto it = shard.users.find(usr.name);
+    if (it != shard.users.end() && it->second.get() == &usr){
+        shard.users.erase(it);
+    }
+}
+
+// All messages from a given node arrive on the same connection,
+// so they are handled in order and always on the same thread.
+void server::handle_cluster_message(const osc::ReceivedMessage& msg,
+                                    const char *pattern)
+{
+    if (nodes_.empty()){
+        LOG_ERROR("aoo_server: got cluster message " << msg.AddressPattern()
+                  << ", but we are not part of a cluster");
+        return;
+    }
+
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream reply(buf, sizeof(buf));
+    error err;
+
+    auto it = msg.ArgumentsBegin();
+    if (!strcmp(pattern, AOONET_MSG_JOIN)){
+        std::string name = (it++)->AsString();
+        std::string public_ip = (it++)->AsString();
+        int32_t public_port = (it++)->AsInt32();
+        std::string local_ip = (it++)->AsString();
+        int32_t local_port = (it++)->AsInt32();
+        int64_t token = (it++)->AsInt64();
+        std::string group = (it++)->AsString();
+        std::string pwd = (it++)->AsString();
+        bool is_public = (it++)->AsBool();
+        bool partial = (it++)->AsBool();
+
+        // the home node of the user (node indices are not the same on all nodes!)
+        int32_t node = remote_owner(name);
+        if (node < 0){
+            LOG_ERROR("aoo_server: cluster join: " << name << " should be our user");
+            return;
+        }
+
+        int32_t result = 0;
+        std::string errmsg;
+        auto usr = get_remote_user(name, node, ip_address(public_ip, public_port),
+                                   ip_address(local_ip, local_port), token);
+        if (usr){
+            if (join_group(usr, group, pwd, is_public, partial, err)){
+                result = 1;
+            } else {
+                errmsg = error_to_string(err);
+                if (usr->num_groups() == 0){
+                    remove_remote_user(*usr);
+                }
+            }
+        } else {
+            errmsg = error_to_string(error::access_denied);
+        }
+
+        reply << osc::BeginMessage(AOONET_MSG_CLIENT_GROUP_JOIN)
+              << group.c_str() << result << errmsg.c_str() << osc::EndMessage;
+
+        cluster_deliver(node, name, reply.Data(), (int32_t) reply.Size());
+    } else if (!strcmp(pattern, AOONET_MSG_LEAVE)){
+        std::string name = (it++)->AsString();
+        std::string group = (it++)->AsString();
+        bool want_reply = (it++)->AsBool();
+
+        int32_t result = 0;
+        std::string errmsg;
+        auto usr = find_remote_user(name);
+        if (usr){
+            if (leave_group(*usr, group, err)){
+                result = 1;
+            } else {
+                errmsg = error_to_string(err);
+            }
+            if (usr->num_groups() == 0){
+                remove_remote_user(*usr);
+            }
+
+            if (want_reply){
+                reply << osc::BeginMessage(AOONET_MSG_CLIENT_GROUP_LEAVE)
+                      << group.c_str() << result << errmsg.c_str() << osc::EndMessage;
+
+                send_to_user(*usr, reply.Data(), (int32_t) reply.Size());
+            }
+        } else {
+            LOG_WARNING("aoo_server: cluster leave: couldn't find user " << name);
+        }
+    } else if (!strcmp(pattern, AOONET_MSG_PEER AOONET_MSG_ADD) ||
+               !strcmp(pattern, AOONET_MSG_PEER AOONET_MSG_DEL)){
+        bool subscribe = !strcmp(pattern, AOONET_MSG_PEER AOONET_MSG_ADD);
+        std::string name = (it++)->AsString();
+        std::string group = (it++)->AsString();
+        std::string peer = (it++)->AsString();
+
+        auto usr = find_remote_user(name);
+        if (usr){
+            int32_t result = 0;
+            std::string errmsg;
+            bool ok = subscribe ? peer_subscribe(*usr, group, peer, err)
+                                : peer_unsubscribe(*usr, group, peer, err);
+            if (ok){
+                result = 1;
+            } else {
+                errmsg = error_to_string(err);
+            }
+
+            reply << osc::BeginMessage(subscribe ? AOONET_MSG_CLIENT_PEER_ADD
+                                                 : AOONET_MSG_CLIENT_PEER_DEL)
+                  << group.c_str() << peer.c_str() << result << errmsg.c_str()
+                  << osc::EndMessage;
+
+            send_to_user(*usr, reply.Data(), (int32_t) reply.Size());
+        } else {
+            // the user is not a member of any group on this node
+            LOG_WARNING("aoo_server: cluster peer subscription: couldn't find user " << name);
+        }
+    } else if (!strcmp(pattern, AOONET_MSG_DELIVER)){
+        std::string name = (it++)->AsString();
+        const void *data;
+        osc::osc_bundle_element_size_t size;
+        (it++)->AsBlob(data, size);
+
+        auto& shard = get_user_shard(name);
+        shared_lock lock(shard.mutex);
+        auto usr = shard.users.find(name);
+        // the user might have logged out in the meantime
+        if (usr != shard.users.end() && usr->second->endpoint){
+            send_message(*usr->second->endpoint, (const char *)data, size);
+        }
+    } else {
+        LOG_ERROR("aoo_server: unknown cluster message " << msg.AddressPattern());
+    }
+}
+
+void server::accept_clients(){
+    // accept new clients until accept() would block
+    while (true){
+        ip_address addr;
+        auto sock = accept(tcpsocket_, (struct sockaddr *)&addr.address, &addr.length);
+    #ifdef _WIN32
+        if (sock != INVALID_SOCKET){
+    #else
+        if (sock >= 0){
+    #endif
+            add_client(sock, addr);
+        } else {
+            int err = socket_errno();
+        #ifdef _WIN32
+            if (err != WSAEWOULDBLOCK){
+        #else
+            if (err != EWOULDBLOCK && err != EAGAIN){
+        #endif
+                LOG_ERROR("aoo_server: couldn't accept client (" << err << ")");
+            }
+            break;
+        }
+    }
+}
+
+void server::add_client(int sock, const ip_address& addr){
+    if (workers_.size() > 1){
+        // distribute clients round robin across the other workers
+        auto index = 1 + next_worker_;
+        next_worker_ = (next_worker_ + 1) % (workers_.size() - 1);
+        workers_[index]->post_client(sock, addr);
+    } else {
+        workers_[0]->add_client(sock, addr);
+    }
+}
+
+void server::receive_udp(){
+    if (udpsocket_ < 0){
+        return;
+    }
+    auto& batch = *relay_batch_;
+    // read as much data as possible until recv() would block
+    while (true){
+        auto buf = batch.buffer();
+        ip_address addr;
+        int32_t result = recvfrom(udpsocket_, buf, AOO_MAXPACKETSIZE, 0,
+                               (struct sockaddr *)&addr.address, &addr.length);
+        if (result > 0){
+            // relayed stream messages
+            int32_t type, id;
+            auto onset = aoo_parse_pattern(buf, result, &type, &id);
+            if (onset > 0){
+                if (type == AOO_TYPE_SINK){
+                    // the forwarded messages refer to the receive buffer
+                    if (relay_forward(buf, result, onset, id, addr)
+                            && !batch.keep_buffer()){
+                        batch.flush(udpsocket_);
+                    }
+                } else {
+                    relay_reply(buf, result, onset, id, addr);
+                }
+                continue;
+            }
+
+            try {
+                osc::ReceivedPacket packet(buf, result);
+                osc::ReceivedMessage msg(packet);
+
+                int32_t type;
+                auto onset = aoonet_parse_pattern(buf, result, &type);
+                if (!onset){
+                    LOG_WARNING("aoo_server: not an AOO NET message!");
+                    continue;
+                }
+
+                if (type != AOO_TYPE_SERVER){
+                    LOG_WARNING("aoo_server: not a client message!");
+                    continue;
+                }
+
+                handle_udp_message(msg, onset, addr);
+            } catch (const osc::Exception& e){
+                LOG_ERROR("aoo_server: exception in receive_udp: " << e.what());
+            }
+        } else if (result < 0){
+            int err = socket_errno();
+        #ifdef _WIN32
+            if (err == WSAEWOULDBLOCK)
+        #else
+            if (err == EWOULDBLOCK)
+        #endif
+            {
+            #if 0
+                LOG_VERBOSE("aoo_server: recv() would block");
+            #endif
+            }
+            else
+            {
+                // TODO handle error
+                LOG_ERROR("aoo_server: recv() failed (" << err << ")");
+            }
+            batch.flush(udpsocket_);
+            return;
+        }
+    }
+}
+
+void server::send_udp_message(const char *msg, int32_t size,
+                              const ip_address &addr)
+{
+    auto result = ::sendto(udpsocket_, msg, size, 0,
+                          (struct sockaddr *)&addr.address, addr.length);
+    if (result < 0){
+        int err = socket_errno();
+    #ifdef _WIN32
+        if (err != WSAEWOULDBLOCK)
+    #else
+        if (err != EWOULDBLOCK)
+    #endif
+        {
+            // TODO handle error
+            LOG_ERROR("aoo_server: send() failed (" << err << ")");
+        } else {
+            LOG_VERBOSE("aoo_server: send() would block");
+        }
+    }
+}
+
+void server::handle_udp_message(const osc::ReceivedMessage &msg, int onset,
+                                const ip_address& addr)
+{
+    auto pattern = msg.AddressPattern() + onset;
+    LOG_DEBUG("aoo_server: handle client UDP message " << pattern);
+
+    try {
+        if (!strcmp(pattern, AOONET_MSG_PING)){
+            // reply with /ping message
+            char buf[512];
+            osc::OutboundPacketStream reply(buf, sizeof(buf));
+            reply << osc::BeginMessage(AOONET_MSG_CLIENT_PING)
+                  << osc::EndMessage;
+
+            send_udp_message(reply.Data(), (int32_t) reply.Size(), addr);
+        } else if (!strcmp(pattern, AOONET_MSG_REQUEST)){
+            // reply with /reply message
+            char buf[512];
+            osc::OutboundPacketStream reply(buf, sizeof(buf));
+            reply << osc::BeginMessage(AOONET_MSG_CLIENT_REPLY)
+                  << addr.name().c_str() << addr.port() << osc::EndMessage;
+
+            send_udp_message(reply.Data(), (int32_t) reply.Size(), addr);
+        } else {
+            LOG_ERROR("aoo_server: unknown message " << pattern);
+        }
+    } catch (const osc::Exception& e){
+        LOG_ERROR("aoo_server: exception on handling " << pattern
+                  << " message: " << e.what());
+    }
+}
+
+// get the offset of the next OSC string or 0 on failure
+static int32_t osc_skip_string(const char *msg, int32_t size, int32_t offset){
+    if (offset >= size){
+        return 0;
+    }
+    auto end = (const char *)memchr(msg + offset, 0, size - offset);
+    if (!end){
+        return 0;
+    }
+    auto next = ((end - msg) + 4) & ~3;
+    return next <= size ? next : 0;
+}
+
+// /aoo/sink/<relay sink>/<msg> <src> ... from a publisher
+// -> /aoo/sink/<sink>/<msg> <relay ID> ... to the subscriber(s)
+bool server::relay_forward(char *msg, int32_t size, int32_t onset,
+                           int32_t id, const ip_address& addr)
+{
+    if (id == AOO_ID_NONE){
+        // compact data messages don't contain the source ID
+        LOG_DEBUG("aoo_server: can't relay compact data message");
+        return false;
+    }
+    // all source messages start with the source ID
+    auto typetags = osc_skip_string(msg, size, 0);
+    auto args = typetags ? osc_skip_string(msg, size, typetags) : 0;
+    if (!args || (args + 4) > size || memcmp(msg + typetags, ",i", 2)){
+        LOG_WARNING("aoo_server: bad relay message " << msg);
+        return false;
+    }
+    auto suffix = msg + onset;
+    auto suffixlen = strlen(suffix);
+    auto typetaglen = args - typetags;
+    // address pattern + type tags + relay ID
+    if ((AOO_MSG_DOMAIN_LEN + AOO_MSG_SINK_LEN + 16 + suffixlen
+         + typetaglen + 4) > AOO_RELAY_HEADERSIZE)
+    {
+        LOG_WARNING("aoo_server: relay message header too large");
+        return false;
+    }
+    auto src = aoo::from_bytes<int32_t>(msg + args);
+
+    auto& batch = *relay_batch_;
+    bool used = false;
+
+    shared_lock lock(relay_mutex_); // reader lock!
+    auto it = relay_publishers_.find(addr);
+    if (it == relay_publishers_.end()){
+        LOG_DEBUG("aoo_server: no relay subscribers for " << addr.name()
+                  << ":" << addr.port());
+        return false;
+    }
+    int32_t relayid;
+    auto stream = it->second.streams.find(src);
+    if (stream != it->second.streams.end()){
+        relayid = stream->second;
+    } else {
+        // new stream; we're the only thread that adds streams,
+        // but subscriptions might have changed in the meantime.
+        lock.unlock();
+        unique_lock lock2(relay_mutex_);
+        it = relay_publishers_.find(addr);
+        if (it == relay_publishers_.end()){
+            return false;
+        }
+        do {
+            relayid = next_relay_id_++;
+            if (next_relay_id_ < 0){
+                next_relay_id_ = 0; // wrap around
+            }
+        } while (relay_streams_.count(relayid));
+        it->second.streams.emplace(src, relayid);
+        relay_streams_.emplace(relayid, relay_stream { addr, src });
+        LOG_VERBOSE("aoo_server: new relay stream " << relayid << " for source "
+                    << src << " from " << addr.name() << ":" << addr.port());
+        lock2.unlock();
+        lock.lock();
+        it = relay_publishers_.find(addr);
+        if (it == relay_publishers_.end()){
+            return false;
+        }
+    }
+
+    for (auto& sub : it->second.subscribers){
+        if (id != AOO_ID_WILDCARD && id != sub.relay_sink){
+            continue;
+        }
+        if (batch.full()){
+            // the current receive buffer stays valid
+            batch.send(udpsocket_);
+        }
+        auto& m = batch.add();
+        m.address = sub.address;
+        // address pattern
+        auto n = snprintf(m.header, AOO_RELAY_HEADERSIZE, "%s%s/%d%s",
+                          AOO_MSG_DOMAIN, AOO_MSG_SINK, sub.sink, suffix);
+        // pad with zeros
+        do {
+            m.header[n++] = 0;
+        } while (n & 3);
+        // type tags
+        memcpy(m.header + n, msg + typetags, typetaglen);
+        n += typetaglen;
+        // replace source ID
+        aoo::to_bytes<int32_t>(relayid, m.header + n);
+        n += 4;
+        m.headersize = n;
+        // the remaining arguments are sent as is
+        m.payload = msg + args + 4;
+        m.payloadsize = size - (args + 4);
+        used = true;
+    }
+    return used;
+}
+
+// /aoo/src/<relay ID>/<msg> <sink> ... from a subscriber
+// -> /aoo/src/<src>/<msg> <relay sink> ... to the publisher
+void server::relay_reply(char *msg, int32_t size, int32_t onset,
+                         int32_t id, const ip_address& addr)
+{
+    // all sink messages start with the sink ID
+    auto typetags = osc_skip_string(msg, size, 0);
+    auto args = typetags ? osc_skip_string(msg, size, typetags) : 0;
+    if (!args || (args + 4) > size || memcmp(msg + typetags, ",i", 2)){
+        LOG_WARNING("aoo_server: bad relay message");
+        return;
+    }
+    if (id < 0){
+        LOG_DEBUG("aoo_server: can't relay message to source " << id);
+        return;
+    }
+    auto suffix = msg + onset;
+
+    auto sink = aoo::from_bytes<int32_t>(msg + args);
+
+    ip_address dest;
+    int32_t src;
+    int32_t relay_sink;
+    {
+        shared_lock lock(relay_mutex_); // reader lock!
+        auto stream = relay_streams_.find(id);
+        if (stream == relay_streams_.end()){
+            LOG_DEBUG("aoo_server: relay stream " << id << " not found");
+            return;
+        }
+        // check if the sender is really a subscriber
+        auto pub = relay_publishers_.find(stream->second.address);
+        if (pub == relay_publishers_.end()){
+            return;
+        }
+        auto& subscribers = pub->second.subscribers;
+        auto sub = std::find_if(subscribers.begin(), subscribers.end(),
+                                [&](auto& s){ return s.address == addr && s.sink == sink; });
+        if (sub == subscribers.end()){
+            LOG_DEBUG("aoo_server: sink " << sink << " on " << addr.name() << ":"
+                      << addr.port() << " is not subscribed to relay stream " << id);
+            return;
+        }
+        dest = stream->second.address;
+        src = stream->second.source;
+        relay_sink = sub->relay_sink;
+    }
+
+    // sink messages are small, so we can just copy them
+    char buf[AOO_MAXPACKETSIZE];
+    auto n = snprintf(buf, sizeof(buf), "%s%s/%d%s",
+                      AOO_MSG_DOMAIN, AOO_MSG_SOURCE, src, suffix);
+    do {
+        buf[n++] = 0;
+    } while (n & 3);
+    auto rest = size - typetags;
+    if ((n + rest) > (int32_t)sizeof(buf)){
+        LOG_WARNING("aoo_server: relay message too large");
+        return;
+    }
+    memcpy(buf + n, msg + typetags, rest);
+    // replace sink ID
+    auto newargs = n + (args - typetags);
+    aoo::to_bytes<int32_t>(relay_sink, buf + newargs);
+    if (!strcmp(suffix, AOO_MSG_FORMAT)){
+        // /format <sink> <version>: compact data messages don't contain
+        // the source ID, so we have to disable them for relayed streams.
+        if ((newargs + 8) <= (n + rest) && !memcmp(buf + n, ",ii", 3)){
+            auto version = aoo::from_bytes<int32_t>(buf + newargs + 4);
+            version &= ~AOO_PROTOCOL_FLAG_COMPACT_DATA;
+            aoo::to_bytes<int32_t>(version, buf + newargs + 4);
+        }
+    }
+    send_udp_message(buf, n + rest, dest);
+}
+
+void server::signal(){
+    for (auto& w : workers_){
+        w->signal();
+    }
+}
+
+/*///////////////////////// server_worker ///////////////////////////*/
+
+thread_local server_worker * server_worker::current_ = nullptr;
+
+server_worker * server_worker::current(){
+    return current_;
+}
+
+server_worker::server_worker(server& s, int32_t index, bool listen)
+    : server_(s), index_(index), listen_(listen)
+{
+#ifdef _WIN32
+    waitevent_ = CreateEvent(NULL, FALSE, FALSE, NULL);
+#elif defined(__linux__)
+    waitfd_[0] = waitfd_[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (waitfd_[0] < 0){
+        int err = errno;
+        LOG_ERROR("aoo_server: couldn't create eventfd (" << err << ")");
+    }
+#else
+    if (pipe(waitfd_) != 0){
+        int err = errno;
+        LOG_ERROR("aoo_server: couldn't create pipe (" << err << ")");
+    } else {
+        fcntl(waitfd_[0], F_SETFL, O_NONBLOCK);
+        fcntl(waitfd_[1], F_SETFL, O_NONBLOCK);
+    }
+#endif
+#ifndef _WIN32
+#if AOO_SERVER_EPOLL
+    epollfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd_ < 0){
+        int err = errno;
+        LOG_ERROR("aoo_server: couldn't create epoll instance (" << err << ")");
+    } else {
+        // use the addresses of the members as tags
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        if (listen_){
+            ev.data.ptr = &server_.tcpsocket_;
+            epoll_ctl(epollfd_, EPOLL_CTL_ADD, server_.tcpsocket_, &ev);
+            ev.data.ptr = &server_.udpsocket_;
+            epoll_ctl(epollfd_, EPOLL_CTL_ADD, server_.udpsocket_, &ev);
         }
+        ev.data.ptr = waitfd_;
+        epoll_ctl(epollfd_, EPOLL_CTL_ADD, waitfd_[0], &ev);
     }
+#endif
+#endif
 }
 
+server_worker::~server_worker(){
+    join();
+
+    // free clients before closing the wait pipe (or event)
+    clients_.clear();
 
-void server::wait_for_event(){
-    bool didclose = false;
 #ifdef _WIN32
-    // allocate three extra slots for master TCP socket, UDP socket and wait event
-    int numevents = (clients_.size() + 3);
-    auto events = (HANDLE *)alloca(numevents * sizeof(HANDLE));
+    CloseHandle(waitevent_);
+#else
+    close(waitfd_[0]);
+    if (waitfd_[1] != waitfd_[0]){
+        close(waitfd_[1]);
+    }
+#if AOO_SERVER_EPOLL
+    if (epollfd_ >= 0){
+        close(epollfd_);
+    }
+#endif
+#endif
+}
+
+void server_worker::start(){
+    thread_ = std::thread([this](){
+        current_ = this;
+        while (!server_.quit_.load()){
+            wait_for_event();
+        }
+        close_all();
+    });
+}
+
+void server_worker::join(){
+    if (thread_.joinable()){
+        thread_.join();
+    }
+}
+
+void server_worker::close_all(){
+    // need to close all the clients sockets without
+    // having them send anything out, so that active communication
+    // between connected peers can continue if the server goes down for maintainence
+    for (auto& c : clients_){
+        c->close(false);
+    }
+}
+
+void server_worker::signal(){
+#if defined(_WIN32)
+    SetEvent(waitevent_);
+#elif defined(__linux__)
+    uint64_t one = 1;
+    write(waitfd_[1], &one, sizeof(one));
+#else
+    // if the pipe is full, there's a pending wakeup anyway
+    write(waitfd_[1], "\0", 1);
+#endif
+}
+
+void server_worker::clear_signal(){
+#if defined(_WIN32)
+    // auto-reset
+#elif defined(__linux__)
+    uint64_t count;
+    read(waitfd_[0], &count, sizeof(count));
+#else
+    // drain the pipe completely
+    char buf[64];
+    while (read(waitfd_[0], buf, sizeof(buf)) > 0) ;
+#endif
+}
+
+void server_worker::flush_signals(){
+    for (auto w : pending_signals_){
+        w->signal();
+    }
+    pending_signals_.clear();
+}
+
+void server_worker::post_client(int sock, const ip_address& addr){
+    inbox_.push(sock, addr);
+    signal();
+}
+
+void server_worker::send_message(client_endpoint& c, const char *data, int32_t size){
+    if (current_ == this){
+        c.send_message(data, size);
+    } else {
+        // NOTE: always push the message right away, so that it
+        // is in the inbox before the client can leave its groups
+        // (see wait_for_event()); only defer the wakeup.
+        inbox_.push(&c, data, size);
+        if (current_){
+            auto& pending = current_->pending_signals_;
+            if (std::find(pending.begin(), pending.end(), this) == pending.end()){
+                pending.push_back(this);
+            }
+        } else {
+            signal();
+        }
+    }
+}
+
+void server_worker::handle_inbox(){
+    inbox_.consume_all([&](message& msg){
+        if (msg.client){
+            // the client might have been closed in the meantime
+            if (msg.client->is_active()){
+                msg.client->send_message(msg.data.data(), (int32_t)msg.data.size());
+            }
+        } else {
+            add_client(msg.socket, msg.address);
+        }
+    });
+}
+
+void server_worker::wait_for_event(){
+#ifdef _WIN32
+    // allocate extra slots for master TCP socket, UDP socket and wait event
     int numclients = clients_.size();
+    int numevents = numclients + (listen_ ? 3 : 1);
+    auto events = (HANDLE *)alloca(numevents * sizeof(HANDLE));
     for (int i = 0; i < numclients; ++i){
         events[i] = clients_[i]->event;
     }
-    int tcpindex = numclients;
-    int udpindex = numclients + 1;
-    int waitindex = numclients + 2;
-    events[tcpindex] = tcpevent_;
-    events[udpindex] = udpevent_;
-    events[waitindex] = waitevent_;
+    int tcpindex = listen_ ? numclients : -1;
+    int udpindex = listen_ ? numclients + 1 : -1;
+    if (listen_){
+        events[tcpindex] = server_.tcpevent_;
+        events[udpindex] = server_.udpevent_;
+    }
+    events[numevents - 1] = waitevent_;
 
     DWORD result = WaitForMultipleObjects(numevents, events, FALSE, INFINITE);
 
@@ -536,32 +1931,17 @@ void server::wait_for_event(){
     memset(&ne, 0, sizeof(ne));
 
     int index = result - WAIT_OBJECT_0;
-    if (index == tcpindex){
-        WSAEnumNetworkEvents(tcpsocket_, tcpevent_, &ne);
+    if (index >= 0 && index == tcpindex){
+        WSAEnumNetworkEvents(server_.tcpsocket_, server_.tcpevent_, &ne);
 
         if (ne.lNetworkEvents & FD_ACCEPT){
-            // accept new clients
-            while (true){
-                ip_address addr;
-                auto sock = accept(tcpsocket_, (struct sockaddr *)&addr.address, &addr.length);
-                if (sock != INVALID_SOCKET){
-                    clients_.push_back(std::make_unique<client_endpoint>(*this, sock, addr));
-                    LOG_VERBOSE("aoo_server: accepted client (IP: "
-                                << addr.name() << ", port: " << addr.port() << ")");
-                } else {
-                    int err = socket_errno();
-                    if (err != WSAEWOULDBLOCK){
-                        LOG_ERROR("aoo_server: couldn't accept client (" << err << ")");
-                    }
-                    break;
-                }
-            }
+            server_.accept_clients();
         }
-    } else if (index == udpindex){
-        WSAEnumNetworkEvents(udpsocket_, udpevent_, &ne);
+    } else if (index >= 0 && index == udpindex){
+        WSAEnumNetworkEvents(server_.udpsocket_, server_.udpevent_, &ne);
 
         if (ne.lNetworkEvents & FD_READ){
-            receive_udp();
+            server_.receive_udp();
         }
     } else if (index >= 0 && index < numclients){
         // iterate over all clients, starting at index (= the first item which caused an event)
@@ -575,39 +1955,95 @@ void server::wait_for_event(){
             if (ne.lNetworkEvents & FD_READ){
                 // receive data from client
                 if (!clients_[i]->receive_data()){
-                    clients_[i]->close();
-                    didclose = true;
+                    close_client(*clients_[i]);
                 }
             } else if (ne.lNetworkEvents & FD_CLOSE){
                 // connection was closed
                 int err = ne.iErrorCode[FD_CLOSE_BIT];
                 LOG_VERBOSE("aoo_server: client connection was closed (" << err << ")");
 
-                clients_[i]->close();
-                didclose = true;
-            } else {
-                // ignore FD_WRITE
+                close_client(*clients_[i]);
+            } else {
+                // ignore FD_WRITE
+            }
+        }
+    }
+#elif AOO_SERVER_EPOLL
+    // The epoll set is only modified when a client is added;
+    // closing a socket automatically removes it from the set.
+    struct epoll_event events[AOO_SERVER_MAXEVENTS];
+
+    int numevents = epoll_wait(epollfd_, events, AOO_SERVER_MAXEVENTS, -1);
+    if (numevents < 0){
+        int err = errno;
+        if (err != EINTR){
+            LOG_ERROR("aoo_server: epoll_wait failed (" << err << ")");
+        }
+        return;
+    }
+
+    bool accept = false;
+    bool receive = false;
+
+    for (int i = 0; i < numevents; ++i){
+        auto ptr = events[i].data.ptr;
+        auto flags = events[i].events;
+        if (ptr == waitfd_){
+            clear_signal();
+        } else if (ptr == &server_.tcpsocket_){
+            accept = true;
+        } else if (ptr == &server_.udpsocket_){
+            receive = true;
+        } else {
+            auto c = static_cast<client_endpoint *>(ptr);
+            // the client might have been closed by a previous event;
+            // it is only freed in update(), so the pointer is still valid.
+            if (c->is_active() && (flags & (EPOLLIN | EPOLLERR | EPOLLHUP))){
+                // receive data from client
+                if (!c->receive_data()){
+                    close_client(*c);
+                }
             }
         }
     }
+
+    if (server_.quit_.load()) {
+        return;
+    }
+
+    if (accept){
+        server_.accept_clients();
+    }
+
+    if (receive){
+        server_.receive_udp();
+    }
 #else
-    // allocate three extra slots for master TCP socket, UDP socket and wait pipe
-    int numfds = (int)(clients_.size() + 3);
-    auto fds = (struct pollfd *)alloca(numfds * sizeof(struct pollfd));
-    for (int i = 0; i < numfds; ++i){
-        fds[i].events = POLLIN;
-        fds[i].revents = 0;
-    }
-    int numclients = (int)clients_.size();
-    for (int i = 0; i < numclients; ++i){
-        fds[i].fd = clients_[i]->socket;
+    // the poll array is only rebuilt when the clients have changed.
+    // the first three slots are for master TCP socket, UDP socket and wait pipe;
+    // negative file descriptors are ignored by poll().
+    const int tcpindex = 0;
+    const int udpindex = 1;
+    const int waitindex = 2;
+    if (clients_changed_){
+        pollfds_.resize(clients_.size() + 3);
+        pollfds_[tcpindex].fd = listen_ ? server_.tcpsocket_ : -1;
+        pollfds_[udpindex].fd = listen_ ? server_.udpsocket_ : -1;
+        pollfds_[waitindex].fd = waitfd_[0];
+        for (int i = 0; i < (int)clients_.size(); ++i){
+            pollfds_[i + 3].fd = clients_[i]->socket;
+        }
+        for (auto& fd : pollfds_){
+            fd.events = POLLIN;
+        }
+        clients_changed_ = false;
+    }
+    for (auto& fd : pollfds_){
+        fd.revents = 0;
     }
-    int tcpindex = numclients;
-    int udpindex = numclients + 1;
-    int waitindex = numclients + 2;
-    fds[tcpindex].fd = tcpsocket_;
-    fds[udpindex].fd = udpsocket_;
-    fds[waitindex].fd = waitpipe_[0];
+    auto fds = pollfds_.data();
+    int numfds = (int)pollfds_.size();
+    int numclients = numfds - 3;
 
     // NOTE: macOS requires the negative timeout to be exactly -1!
     int result = poll(fds, numfds, -1);
@@ -623,195 +2059,93 @@ void server::wait_for_event(){
     }
 
     if (fds[waitindex].revents & POLLIN){
-        // clear pipe
-        char c;
-        read(waitpipe_[0], &c, 1);
+        clear_signal();
     }
 
-    if (quit_.load()) {
+    if (server_.quit_.load()) {
         return;
     }
-    
-    if (fds[tcpindex].revents & POLLIN){
-        // accept new clients
-        while (true){
-            ip_address addr;
-            int sock = accept(tcpsocket_, (struct sockaddr *)&addr.address, &addr.length);
-            if (sock >= 0){
-                clients_.push_back(std::make_unique<client_endpoint>(*this, sock, addr));
-                LOG_VERBOSE("aoo_server: accepted client (IP: "
-                            << addr.name() << ", port: " << addr.port() << ")");
-            } else {
-                int err = socket_errno();
-                if (err != EWOULDBLOCK){
-                    LOG_ERROR("aoo_server: couldn't accept client (" << err << ")");
-                }
-                break;
+
+    // NOTE: handle the clients before accepting new ones,
+    // because add_client() might invalidate 'fds'.
+    for (int i = 0; i < numclients; ++i){
+        if (fds[i + 3].revents & (POLLIN | POLLERR | POLLHUP)){
+            // receive data from client
+            auto& c = *clients_[i];
+            if (c.is_active() && !c.receive_data()){
+                close_client(c);
             }
         }
     }
 
+    bool accept = fds[tcpindex].revents & POLLIN;
+
     if (fds[udpindex].revents & POLLIN){
-        receive_udp();
+        server_.receive_udp();
     }
 
-
-    for (int i = 0; i < numclients; ++i){
-        if (fds[i].revents & POLLIN){
-            // receive data from client
-            if (!clients_[i]->receive_data()){
-                clients_[i]->close();
-                didclose = true;
-            }
-        }
+    if (accept){
+        server_.accept_clients();
     }
 #endif
 
-    if (didclose){
-        update();
-    }
-}
+    // wake up the workers we have posted messages to
+    flush_signals();
 
-void server::update(){
-    // remove closed clients
-    auto result = std::remove_if(clients_.begin(), clients_.end(),
-                                 [](auto& c){ return !c->is_active(); });
-    clients_.erase(result, clients_.end());
-    // automatically purge stale users
-    // LATER add an option so that users will persist
-    for (auto it = users_.begin(); it != users_.end(); ){
-        if (!(*it)->is_active()){
-            it = users_.erase(it);
-        } else {
-            ++it;
-        }
-    }
-    // automatically purge empty groups
-    // LATER add an option so that groups will persist
-    for (auto it = groups_.begin(); it != groups_.end(); ){
-        if ((*it)->num_users() == 0){
-            if ((*it)->is_public) {
-                on_public_group_removed(*(*it));
-            }
+    // NOTE: always handle the inbox before update()! Messages for a closed
+    // client can only have been posted before it left all its groups,
+    // so they are guaranteed to be in the inbox at this point.
+    handle_inbox();
 
-            it = groups_.erase(it);
-        } else {
-            ++it;
-        }
+    if (!closed_clients_.empty()){
+        update();
     }
 }
 
-void server::receive_udp(){
-    if (udpsocket_ < 0){
-        return;
+void server_worker::add_client(int sock, const ip_address& addr){
+    auto c = std::make_unique<client_endpoint>(server_, *this, sock, addr);
+    if (!c->is_active()){
+        return; // setting up the socket failed
     }
-    // read as much data as possible until recv() would block
-    while (true){
-        char buf[AOO_MAXPACKETSIZE];
-        ip_address addr;
-        int32_t result = recvfrom(udpsocket_, buf, sizeof(buf), 0,
-                               (struct sockaddr *)&addr.address, &addr.length);
-        if (result > 0){
-            try {
-                osc::ReceivedPacket packet(buf, result);
-                osc::ReceivedMessage msg(packet);
-
-                int32_t type;
-                auto onset = aoonet_parse_pattern(buf, result, &type);
-                if (!onset){
-                    LOG_WARNING("aoo_server: not an AOO NET message!");
-                    return;
-                }
-
-                if (type != AOO_TYPE_SERVER){
-                    LOG_WARNING("aoo_server: not a client message!");
-                    return;
-                }
-
-                handle_udp_message(msg, onset, addr);
-            } catch (const osc::Exception& e){
-                LOG_ERROR("aoo_server: exception in receive_udp: " << e.what());
-            }
-        } else if (result < 0){
-            int err = socket_errno();
-        #ifdef _WIN32
-            if (err == WSAEWOULDBLOCK)
-        #else
-            if (err == EWOULDBLOCK)
-        #endif
-            {
-            #if 0
-                LOG_VERBOSE("aoo_server: recv() would block");
-            #endif
-            }
-            else
-            {
-                // TODO handle error
-                LOG_ERROR("aoo_server: recv() failed (" << err << ")");
-            }
-            return;
-        }
+#if AOO_SERVER_EPOLL
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c.get();
+    if (epoll_ctl(epollfd_, EPOLL_CTL_ADD, c->socket, &ev) != 0){
+        int err = errno;
+        LOG_ERROR("aoo_server: couldn't add client to epoll set (" << err << ")");
+        c->close(false);
+        return;
     }
+#elif !defined(_WIN32)
+    clients_changed_ = true;
+#endif
+    c->index = (int32_t)clients_.size();
+    clients_.push_back(std::move(c));
+    LOG_VERBOSE("aoo_server: accepted client (IP: "
+                << addr.name() << ", port: " << addr.port() << ")");
 }
 
-void server::send_udp_message(const char *msg, int32_t size,
-                              const ip_address &addr)
-{
-    auto result = ::sendto(udpsocket_, msg, size, 0,
-                          (struct sockaddr *)&addr.address, addr.length);
-    if (result < 0){
-        int err = socket_errno();
-    #ifdef _WIN32
-        if (err != WSAEWOULDBLOCK)
-    #else
-        if (err != EWOULDBLOCK)
-    #endif
-        {
-            // TODO handle error
-            LOG_ERROR("aoo_server: send() failed (" << err << ")");
-        } else {
-            LOG_VERBOSE("aoo_server: send() would block");
-        }
+void server_worker::close_client(client_endpoint &c){
+    if (c.is_active()){
+        c.close();
+        closed_clients_.push_back(&c);
     }
 }
 
-void server::handle_udp_message(const osc::ReceivedMessage &msg, int onset,
-                                const ip_address& addr)
-{
-    auto pattern = msg.AddressPattern() + onset;
-    LOG_DEBUG("aoo_server: handle client UDP message " << pattern);
-
-    try {
-        if (!strcmp(pattern, AOONET_MSG_PING)){
-            // reply with /ping message
-            char buf[512];
-            osc::OutboundPacketStream reply(buf, sizeof(buf));
-            reply << osc::BeginMessage(AOONET_MSG_CLIENT_PING)
-                  << osc::EndMessage;
-
-            send_udp_message(reply.Data(), (int32_t) reply.Size(), addr);
-        } else if (!strcmp(pattern, AOONET_MSG_REQUEST)){
-            // reply with /reply message
-            char buf[512];
-            osc::OutboundPacketStream reply(buf, sizeof(buf));
-            reply << osc::BeginMessage(AOONET_MSG_CLIENT_REPLY)
-                  << addr.name().c_str() << addr.port() << osc::EndMessage;
-
-            send_udp_message(reply.Data(), (int32_t) reply.Size(), addr);
-        } else {
-            LOG_ERROR("aoo_server: unknown message " << pattern);
+void server_worker::update(){
+    // remove closed clients (swap with the last element and pop)
+    for (auto c : closed_clients_){
+        auto index = c->index;
+        if (index < (int32_t)clients_.size() - 1){
+            clients_[index] = std::move(clients_.back());
+            clients_[index]->index = index;
         }
-    } catch (const osc::Exception& e){
-        LOG_ERROR("aoo_server: exception on handling " << pattern
-                  << " message: " << e.what());
+        clients_.pop_back();
     }
-}
-
-void server::signal(){
-#ifdef _WIN32
-    SetEvent(waitevent_);
-#else
-    write(waitpipe_[1], "\0", 1);
+    closed_clients_.clear();
+#if !AOO_SERVER_EPOLL && !defined(_WIN32)
+    clients_changed_ = true;
 #endif
 }
 
@@ -819,70 +2153,87 @@ void server::signal(){
 
 void user::on_close(server& s){
     // disconnect user from groups
-    for (auto& grp : groups_){
-        grp->remove_user(*this);
-        s.on_user_left_group(*this, *grp);
-    }
-
-    s.on_user_left(*this);
+    s.leave_all_groups(*this);
 
     groups_.clear();
-    // clear endpoint so the server knows it can remove the user
-    endpoint = nullptr;
+
+    s.on_user_left(*this);
 }
 
 bool user::add_group(std::shared_ptr<group> grp){
-    auto it = std::find(groups_.begin(), groups_.end(), grp);
-    if (it == groups_.end()){
-        groups_.push_back(grp);
+    auto key = grp.get();
+    return groups_.emplace(key, std::move(grp)).second;
+}
+
+bool user::remove_group(const group& grp){
+    return groups_.erase(&grp) > 0;
+}
+
+/*////////////////////////// group /////////////////////////*/
+
+bool group::add_user(std::shared_ptr<user> usr, bool partial){
+    auto key = usr.get();
+    if (users_.emplace(key, std::move(usr)).second){
+        if (partial){
+            partial_.insert(key);
+        }
         return true;
     } else {
+        LOG_ERROR("group::add_user: bug");
         return false;
     }
 }
 
-bool user::remove_group(const group& grp){
-    // find by address
-    auto it = std::find_if(groups_.begin(), groups_.end(),
-                           [&](auto& g){ return g.get() == &grp; });
-    if (it != groups_.end()){
-        groups_.erase(it);
+bool group::remove_user(const user& usr){
+    if (users_.erase(&usr) > 0){
+        partial_.erase(&usr);
+        subscriptions_.erase(&usr);
         return true;
     } else {
+        LOG_ERROR("group::remove_user: bug");
         return false;
     }
 }
 
-/*////////////////////////// group /////////////////////////*/
+user * group::find_user(const std::string& name){
+    for (auto& it : users_){
+        if (it.second->name == name){
+            return it.second.get();
+        }
+    }
+    return nullptr;
+}
+
+bool group::subscribe(const user& usr, const std::string& peer){
+    return subscriptions_[&usr].insert(peer).second;
+}
 
-bool group::add_user(std::shared_ptr<user> grp){
-    auto it = std::find(users_.begin(), users_.end(), grp);
-    if (it == users_.end()){
-        users_.push_back(grp);
+bool group::unsubscribe(const user& usr, const std::string& peer){
+    auto it = subscriptions_.find(&usr);
+    if (it != subscriptions_.end() && it->second.erase(peer) > 0){
+        if (it->second.empty()){
+            subscriptions_.erase(it);
+        }
         return true;
     } else {
-        LOG_ERROR("group::add_user: bug");
         return false;
     }
 }
 
-bool group::remove_user(const user& usr){
-    // find by address
-    auto it = std::find_if(users_.begin(), users_.end(),
-                           [&](auto& u){ return u.get() == &usr; });
-    if (it != users_.end()){
-        users_.erase(it);
+bool group::wants_peer(const user& usr, const user& peer) const {
+    // full mesh members want everyone
+    if (!partial_.count(&usr)){
         return true;
-    } else {
-        LOG_ERROR("group::remove_user: bug");
-        return false;
     }
+    auto it = subscriptions_.find(&usr);
+    return it != subscriptions_.end() && it->second.count(peer.name);
 }
 
 /*///////////////////////// client_endpoint /////////////////////////////*/
 
-client_endpoint::client_endpoint(server &s, int sock, const ip_address &addr)
-    : server_(&s), socket(sock), addr_(addr)
+client_endpoint::client_endpoint(server &s, server_worker& w,
+                                 int sock, const ip_address &addr)
+    : server_(&s), worker_(&w), socket(sock), addr_(addr)
 {
     int val = 0;
     // NOTE: on POSIX systems, the socket returned by accept() does *not*
@@ -1000,7 +2351,7 @@ void client_endpoint::send_message(const char *msg, int32_t size){
 
             int32_t nbytes = 0;
             while (nbytes < total){
-                auto res = ::send(socket, (char *)buf + nbytes, total - nbytes, 0);
+                auto res = ::send(socket, (char *)buf + nbytes, total - nbytes, SEND_FLAGS);
                 if (res >= 0){
                     nbytes += res;
                 #if 0
@@ -1135,6 +2486,24 @@ void client_endpoint::handle_message(const osc::ReceivedMessage &msg){
             handle_group_leave(msg);
         } else if (!strcmp(pattern, AOONET_MSG_GROUP_PUBLIC)){
             handle_group_public(msg);
+        } else if (!strcmp(pattern, AOONET_MSG_PEER_ADD)){
+            handle_peer_subscribe(msg, true);
+        } else if (!strcmp(pattern, AOONET_MSG_PEER_DEL)){
+            handle_peer_subscribe(msg, false);
+        } else if (!strcmp(pattern, AOONET_MSG_RELAY_ADD)){
+            handle_relay(msg, true);
+        } else if (!strcmp(pattern, AOONET_MSG_RELAY_DEL)){
+            handle_relay(msg, false);
+        } else if (!strncmp(pattern, AOONET_MSG_CLUSTER, AOONET_MSG_CLUSTER_LEN)){
+            auto subpattern = pattern + AOONET_MSG_CLUSTER_LEN;
+            if (!strcmp(subpattern, AOONET_MSG_HELLO)){
+                handle_cluster_hello(msg);
+            } else if (cluster_){
+                server_->handle_cluster_message(msg, subpattern);
+            } else {
+                LOG_ERROR("aoo_server: ignoring cluster message " << msg.AddressPattern()
+                          << " from unauthenticated client");
+            }
         } else {
             LOG_ERROR("aoo_server: unknown message " << msg.AddressPattern());
         }
@@ -1167,27 +2536,33 @@ void client_endpoint::handle_login(const osc::ReceivedMessage& msg)
     int32_t local_port = (it++)->AsInt32();
     int64_t ctoken = msg.ArgumentCount() > 6 ? (it++)->AsInt64() : 0;
     
-    if (ctoken) {
-        token = ctoken;
-    }
-    
+    std::string redirect_host;
+    int32_t redirect_port = 0;
+
     server::error err;
-    if (!user_){
-        user_ = server_->get_user(username, password, err);
+    if (server_->find_home(username, redirect_host, redirect_port)){
+        // the user belongs to another cluster node
+        LOG_VERBOSE("aoo_server: redirect " << username << " to "
+                    << redirect_host << ":" << redirect_port);
+        errmsg = "redirect";
+    } else if (!user_){
+        // set before login because other threads can read them
+        // as soon as we're a group member.
+        if (ctoken) {
+            token = ctoken;
+        }
+        public_address = ip_address(public_ip, public_port);
+        local_address = ip_address(local_ip, local_port);
+
+        user_ = server_->login(*this, username, password, err);
         if (user_){
             // success
-            public_address = ip_address(public_ip, public_port);
-            local_address = ip_address(local_ip, local_port);
-            user_->endpoint = this;
-
             LOG_VERBOSE("aoo_server: login: "
                         << "username: " << username << ", password: " << password
                         << ", public IP: " << public_ip << ", public port: " << public_port
                         << ", local IP: " << local_ip << ", local port: " << local_port << ", token: " << token);
 
             result = 1;
-
-            server_->on_user_joined(*user_);
         } else {
             errmsg = server::error_to_string(err);
         }
@@ -1199,7 +2574,11 @@ void client_endpoint::handle_login(const osc::ReceivedMessage& msg)
     char buf[AOO_MAXPACKETSIZE];
     osc::OutboundPacketStream reply(buf, sizeof(buf));
     reply << osc::BeginMessage(AOONET_MSG_CLIENT_LOGIN)
-          << result << errmsg.c_str() << osc::EndMessage;
+          << result << errmsg.c_str();
+    if (redirect_port > 0){
+        reply << redirect_host.c_str() << redirect_port;
+    }
+    reply << osc::EndMessage;
 
     send_message(reply.Data(), (int32_t)reply.Size());
 }
@@ -1217,18 +2596,17 @@ void client_endpoint::handle_group_join(const osc::ReceivedMessage& msg)
     if (msg.ArgumentCount() > 2) {
         is_public = (it++)->AsBool();
     }
+    bool partial = false;
+    if (msg.ArgumentCount() > 3) {
+        partial = (it++)->AsBool();
+    }
 
     server::error err;
     if (user_){
-        auto grp = server_->get_group(name, password, is_public, err);
-        if (grp){
-            if (user_->add_group(grp)){
-                grp->add_user(user_);
-                server_->on_user_joined_group(*user_, *grp);
-                result = 1;
-            } else {
-                errmsg = "already a group member";
-            }
+        if (server_->join_group(user_, name, password, is_public, partial, err)){
+            result = 1;
+        } else if (err == server::error::forwarded){
+            return; // the owning node replies
         } else {
             errmsg = server::error_to_string(err);
         }
@@ -1252,18 +2630,14 @@ void client_endpoint::handle_group_leave(const osc::ReceivedMessage& msg){
     auto it = msg.ArgumentsBegin();
     std::string name = (it++)->AsString();
 
+    server::error err;
     if (user_){
-        auto grp = server_->find_group(name);
-        if (grp){
-            if (user_->remove_group(*grp)){
-                grp->remove_user(*user_);
-                server_->on_user_left_group(*user_, *grp);
-                result = 1;
-            } else {
-                errmsg = "not a group member";
-            }
+        if (server_->leave_group(*user_, name, err)){
+            result = 1;
+        } else if (err == server::error::forwarded){
+            return; // the owning node replies
         } else {
-            errmsg = "couldn't find group";
+            errmsg = server::error_to_string(err);
         }
     } else {
         errmsg = "not logged in";
@@ -1289,11 +2663,11 @@ void client_endpoint::handle_group_public(const osc::ReceivedMessage& msg)
     server::error err;
     if (user_){
         // register interest in seeing public groups
-        user_->watch_public_groups = shouldWatch;
-
         if (shouldWatch) {
-            // send current batch
+            // also sends current batch
             server_->on_user_wants_public_groups(*user_);
+        } else {
+            server_->on_user_ignores_public_groups(*user_);
         }
     } else {
         errmsg = "not logged in";
@@ -1308,6 +2682,93 @@ void client_endpoint::handle_group_public(const osc::ReceivedMessage& msg)
     send_message(reply.Data(), (int32_t)reply.Size());
 }
 
+// /relay/add|del <group> <user> <sink>
+void client_endpoint::handle_peer_subscribe(const osc::ReceivedMessage& msg, bool subscribe)
+{
+    int result = 0;
+    std::string errmsg;
+
+    auto it = msg.ArgumentsBegin();
+    std::string group = (it++)->AsString();
+    std::string name = (it++)->AsString();
+
+    server::error err;
+    if (user_){
+        bool ok = subscribe ?
+            server_->peer_subscribe(*user_, group, name, err) :
+            server_->peer_unsubscribe(*user_, group, name, err);
+        if (ok){
+            result = 1;
+        } else if (err == server::error::forwarded){
+            return; // the owning node replies
+        } else {
+            errmsg = server::error_to_string(err);
+        }
+    } else {
+        errmsg = "not logged in";
+    }
+
+    // send reply
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream reply(buf, sizeof(buf));
+    reply << osc::BeginMessage(subscribe ? AOONET_MSG_CLIENT_PEER_ADD
+                                         : AOONET_MSG_CLIENT_PEER_DEL)
+          << group.c_str() << name.c_str() << result << errmsg.c_str()
+          << osc::EndMessage;
+
+    send_message(reply.Data(), (int32_t)reply.Size());
+}
+
+void client_endpoint::handle_relay(const osc::ReceivedMessage& msg, bool subscribe)
+{
+    int result = 0;
+    std::string errmsg;
+
+    auto it = msg.ArgumentsBegin();
+    std::string group = (it++)->AsString();
+    std::string name = (it++)->AsString();
+    int32_t sink = (it++)->AsInt32();
+
+    server::error err;
+    if (user_){
+        bool ok = subscribe ?
+            server_->relay_subscribe(*user_, group, name, sink, err) :
+            server_->relay_unsubscribe(*user_, group, name, sink, err);
+        if (ok){
+            result = 1;
+        } else {
+            errmsg = server::error_to_string(err);
+        }
+    } else {
+        errmsg = "not logged in";
+    }
+
+    // send reply
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream reply(buf, sizeof(buf));
+    reply << osc::BeginMessage(subscribe ? AOONET_MSG_CLIENT_RELAY_ADD
+                                         : AOONET_MSG_CLIENT_RELAY_DEL)
+          << group.c_str() << name.c_str() << sink << result << errmsg.c_str()
+          << osc::EndMessage;
+
+    send_message(reply.Data(), (int32_t)reply.Size());
+}
+
+void client_endpoint::handle_cluster_hello(const osc::ReceivedMessage& msg){
+    auto it = msg.ArgumentsBegin();
+    auto nonce = (it++)->AsInt64();
+    auto digest = (it++)->AsString();
+
+    if (server_->check_cluster_node(nonce, digest)){
+        LOG_VERBOSE("aoo_server: cluster node " << addr_.name() << ":"
+                    << addr_.port() << " connected");
+        cluster_ = true;
+    } else {
+        LOG_ERROR("aoo_server: cluster node " << addr_.name() << ":"
+                  << addr_.port() << " failed to authenticate");
+    }
+}
+
 /*///////////////////// events ////////////////////////*/
 
 server::event::event(int32_t type, int32_t result,
@@ -4,11 +4,13 @@
 
 #pragma once
 
+#include "aoo/aoo.h"
 #include "aoo/aoo_net.hpp"
 #include "aoo/aoo_utils.hpp"
 
 #include "lockfree.hpp"
 #include "net_utils.hpp"
+#include "cluster.hpp"
 #include "SLIP.hpp"
 
 #include "oscpack/osc/OscOutboundPacketStream.h"
@@ -16,35 +18,90 @@
 
 #include <memory.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <random>
+#include <thread>
+
+// use epoll() on Linux, poll() is the portable fallback.
+#ifndef AOO_SERVER_EPOLL
+# ifdef __linux__
+#  define AOO_SERVER_EPOLL 1
+# else
+#  define AOO_SERVER_EPOLL 0
+# endif
+#endif
+
+#if AOO_SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// max. number of events per epoll_wait() call
+#ifndef AOO_SERVER_MAXEVENTS
+ #define AOO_SERVER_MAXEVENTS 64
+#endif
+
+// number of shards for the user and group directories
+#ifndef AOO_SERVER_NUMSHARDS
+ #define AOO_SERVER_NUMSHARDS 16
+#endif
+
+// max. number of outgoing relay messages per batch
+#ifndef AOO_SERVER_RELAY_BATCH
+ #define AOO_SERVER_RELAY_BATCH 64
+#endif
+
+// max. number of incoming relay packets per batch
+#ifndef AOO_SERVER_RELAY_BUFFERS
+ #define AOO_SERVER_RELAY_BUFFERS 16
+#endif
 
 namespace aoo {
 namespace net {
 
 class server;
 
+class server_worker;
+
+// Users and groups are kept in hash tables, so that login and
+// group join/leave don't depend on the total number of users/groups.
+
 struct user;
-using user_list = std::vector<std::shared_ptr<user>>;
+// membership set (key = address)
+using user_list = std::unordered_map<const user *, std::shared_ptr<user>>;
+// directory (key = name)
+using user_map = std::unordered_map<std::string, std::shared_ptr<user>>;
 
 struct group;
-using group_list = std::vector<std::shared_ptr<group>>;
+// membership set (key = address)
+using group_list = std::unordered_map<const group *, std::shared_ptr<group>>;
+// directory (key = name)
+using group_map = std::unordered_map<std::string, std::shared_ptr<group>>;
 
 
 class client_endpoint {
     server *server_;
+    server_worker *worker_;
 public:
-    client_endpoint(server &s, int sock, const ip_address& addr);
+    client_endpoint(server &s, server_worker& w, int sock, const ip_address& addr);
     ~client_endpoint();
 
     void close(bool notify=true);
 
     bool is_active() const { return socket >= 0; }
 
+    // NOTE: only call on the thread of the owning worker!
+    // Other threads must use server_worker::send_message().
     void send_message(const char *msg, int32_t);
 
     bool receive_data();
 
+    server_worker& worker() { return *worker_; }
+
     int socket = -1;
 #ifdef _WIN32
     HANDLE event;
@@ -52,6 +109,7 @@ public:
     ip_address public_address;
     ip_address local_address;
     int64_t token;
+    int32_t index = -1; // position in server_worker::clients_
 private:
     std::shared_ptr<user> user_;
     ip_address addr_;
@@ -71,8 +129,21 @@ private:
     void handle_group_leave(const osc::ReceivedMessage& msg);
 
     void handle_group_public(const osc::ReceivedMessage& msg);
+
+    void handle_peer_subscribe(const osc::ReceivedMessage& msg, bool subscribe);
+
+    void handle_relay(const osc::ReceivedMessage& msg, bool subscribe);
+
+    void handle_cluster_hello(const osc::ReceivedMessage& msg);
+
+    // another cluster node which has authenticated itself
+    bool cluster_ = false;
 };
 
+// 'endpoint' is protected by the mutex of the user's directory shard;
+// it is set on login and only cleared after the user has left all groups,
+// so group members can safely access it while holding the group lock.
+// The group list is only accessed by the thread of the endpoint.
 struct user {
     user(const std::string& _name, const std::string& _pwd)
         : name(_name), password(_pwd){}
@@ -82,9 +153,30 @@ struct user {
     const std::string password;
     client_endpoint *endpoint = nullptr;
     bool watch_public_groups = false;
+    // In a cluster, group members whose home is another node don't have
+    // an endpoint; they are reached through their home node.
+    // The following members are only set on creation.
+    int32_t node = -1;
+    ip_address public_address;
+    ip_address local_address;
+    int64_t token = 0;
+    // groups owned by other nodes; only accessed by the thread of the endpoint.
+    std::unordered_set<std::string> remote_groups;
     
     bool is_active() const { return endpoint != nullptr; }
 
+    const ip_address& get_public_address() const {
+        return endpoint ? endpoint->public_address : public_address;
+    }
+
+    const ip_address& get_local_address() const {
+        return endpoint ? endpoint->local_address : local_address;
+    }
+
+    int64_t get_token() const {
+        return endpoint ? endpoint->token : token;
+    }
+
     void on_close(server& s);
 
     bool add_group(std::shared_ptr<group> grp);
@@ -98,6 +190,7 @@ private:
     group_list groups_;
 };
 
+// the member list is protected by the mutex of the group's directory shard.
 struct group {
     group(const std::string& _name, const std::string& _pwd, bool _ispublic=false)
         : name(_name), password(_pwd), is_public(_ispublic) {}
@@ -107,34 +200,156 @@ struct group {
     const std::string password;
     const bool is_public;
 
-    bool add_user(std::shared_ptr<user> usr);
+    bool add_user(std::shared_ptr<user> usr, bool partial = false);
 
     bool remove_user(const user& usr);
 
     int32_t num_users() const { return (int32_t)users_.size(); }
 
     const user_list& users() { return users_; }
+
+    user * find_user(const std::string& name);
+
+    // Partial mesh: members who joined with the 'partial' flag are only
+    // introduced to the users they subscribe to (and to those who
+    // subscribe to them). Subscriptions are kept by name, so they also
+    // cover users who haven't joined yet.
+    bool subscribe(const user& usr, const std::string& peer);
+
+    bool unsubscribe(const user& usr, const std::string& peer);
+
+    // should the two members know about each other?
+    bool is_linked(const user& a, const user& b) const {
+        return wants_peer(a, b) || wants_peer(b, a);
+    }
 private:
     user_list users_;
+    std::unordered_set<const user *> partial_;
+    std::unordered_map<const user *, std::unordered_set<std::string>> subscriptions_;
+
+    bool wants_peer(const user& usr, const user& peer) const;
+};
+
+/*///////////////////// server_worker ////////////////////////*/
+
+// An event loop which owns a set of client connections.
+// In single-threaded mode, there is only a single worker which also
+// listens on the TCP and UDP socket. In threaded mode, the listening
+// worker runs on the server thread and hands new connections to the
+// other workers, each of them running on its own thread.
+// Other threads only talk to a worker through its (lock-free) inbox.
+
+class server_worker {
+public:
+    server_worker(server& s, int32_t index, bool listen);
+    ~server_worker();
+
+    int32_t index() const { return index_; }
+
+    // the worker which runs on the current thread (if any)
+    static server_worker * current();
+
+    // run the event loop on a new thread
+    void start();
+
+    void join();
+
+    void wait_for_event();
+
+    // close all clients without notification
+    void close_all();
+
+    void signal();
+
+    // add a new client (thread-safe)
+    void post_client(int sock, const ip_address& addr);
+
+    // send message to one of our clients (thread-safe)
+    void send_message(client_endpoint& c, const char *data, int32_t size);
+
+    void add_client(int sock, const ip_address& addr);
+
+    void close_client(client_endpoint& c);
+private:
+    friend class server;
+
+    struct message {
+        message(int sock, const ip_address& addr)
+            : client(nullptr), socket(sock), address(addr) {}
+        message(client_endpoint *c, const char *data, int32_t size)
+            : client(c), socket(-1), data(data, data + size) {}
+
+        client_endpoint *client; // nullptr: new client
+        int socket;
+        ip_address address;
+        aoo::vector<char> data;
+    };
+
+    server& server_;
+    int32_t index_;
+    bool listen_;
+    std::vector<std::unique_ptr<client_endpoint>> clients_;
+    // closed clients, removed in update()
+    std::vector<client_endpoint *> closed_clients_;
+#if AOO_SERVER_EPOLL
+    int epollfd_ = -1;
+#elif !defined(_WIN32)
+    // persistent poll() array, only rebuilt when the clients change
+    std::vector<struct pollfd> pollfds_;
+    bool clients_changed_ = true;
+#endif
+#ifdef _WIN32
+    HANDLE waitevent_ = 0;
+#else
+    // eventfd on Linux, otherwise a non-blocking pipe;
+    // signal() must never block because it might be called
+    // while holding a user or group lock.
+    int waitfd_[2] = { -1, -1 };
+#endif
+    // messages from other threads
+    lockfree::mpsc_queue<message> inbox_;
+    // workers which we have posted messages to. They are only signalled
+    // after the current event has been handled, so we never make a
+    // syscall while holding a lock.
+    std::vector<server_worker *> pending_signals_;
+    std::thread thread_;
+    static thread_local server_worker *current_;
+
+    void handle_inbox();
+
+    void clear_signal();
+
+    void flush_signals();
+
+    void update();
 };
 
-class server final : public iserver {
+/*///////////////////////// server ///////////////////////////*/
+
+class server final : public iserver, public memory_object {
 public:
     enum class error {
         none,
         wrong_password,
         permission_denied,
-        access_denied
+        access_denied,
+        already_member,
+        not_member,
+        group_not_found,
+        user_not_found,
+        already_subscribed,
+        not_subscribed,
+        forwarded // not an error: the request has been sent to another node
     };
 
     static std::string error_to_string(error e);
 
-    struct icommand {
+    struct icommand : memory_object {
         virtual ~icommand(){}
         virtual void perform(server&) = 0;
     };
 
-    struct ievent {
+    struct ievent : memory_object {
         virtual ~ievent(){}
 
         union {
@@ -152,66 +367,246 @@ public:
 
     int32_t quit() override;
 
+    int32_t set_num_threads(int32_t n) override;
+
+    int32_t add_node(const char *host, int port, bool self) override;
+
+    int32_t set_cluster_secret(const char *secret) override;
+
     int32_t events_available() override;
 
     int32_t handle_events(aoo_eventhandler fn, void *user) override;
 
-    std::shared_ptr<user> get_user(const std::string& name,
-                                   const std::string& pwd, error& e);
+    // The following methods are thread-safe; they are called by the
+    // workers. Lock order: group shard -> watchers -> event queue.
+    // The user shard lock is never held together with another lock.
 
-    std::shared_ptr<user> find_user(const std::string& name);
+    std::shared_ptr<user> login(client_endpoint& ep, const std::string& name,
+                                const std::string& pwd, error& e);
 
-    std::shared_ptr<group> get_group(const std::string& name,
-                                     const std::string& pwd, bool is_public, error& e);
+    bool join_group(const std::shared_ptr<user>& usr, const std::string& name,
+                    const std::string& pwd, bool is_public, bool partial, error& e);
+
+    bool leave_group(user& usr, const std::string& name, error& e);
+
+    void leave_all_groups(user& usr);
+
+    bool peer_subscribe(user& usr, const std::string& group,
+                        const std::string& name, error& e);
 
-    std::shared_ptr<group> find_group(const std::string& name);
+    bool peer_unsubscribe(user& usr, const std::string& group,
+                          const std::string& name, error& e);
+
+    bool relay_subscribe(user& usr, const std::string& group,
+                         const std::string& name, int32_t sink, error& e);
+
+    bool relay_unsubscribe(user& usr, const std::string& group,
+                           const std::string& name, int32_t sink, error& e);
 
     int32_t get_group_count() const override;
     int32_t get_user_count() const override;
-    
-    void on_user_joined(user& usr);
 
     void on_user_left(user& usr);
 
-    void on_user_joined_group(user& usr, group& grp);
+    void on_user_wants_public_groups(user& usr);
 
-    void on_user_left_group(user& usr, group& grp);
+    void on_user_ignores_public_groups(user& usr);
 
-    void on_user_wants_public_groups(user& usr);
+    // send a message to a client on any worker
+    void send_message(client_endpoint& dest, const char *msg, int32_t size){
+        dest.worker().send_message(dest, msg, size);
+    }
 
-    void on_public_group_modified(group& grp);
-    void on_public_group_removed(group& grp);
+    // send a message to a user, possibly through another cluster node
+    void send_to_user(user& usr, const char *msg, int32_t size);
 
+    // check if the user belongs to another cluster node
+    bool find_home(const std::string& name, std::string& host, int32_t& port) const;
 
+    // authenticate another cluster node (see cluster_digest())
+    bool check_cluster_node(int64_t nonce, const char *digest) const {
+        return nodes_.size() > 1 && cluster_check_digest(cluster_secret_, nonce, digest);
+    }
+
+    void handle_cluster_message(const osc::ReceivedMessage& msg, const char *pattern);
 private:
+    friend class server_worker;
+
+    struct user_shard {
+        shared_mutex mutex;
+        user_map users;
+    };
+
+    struct group_shard {
+        shared_mutex mutex;
+        group_map groups;
+    };
+
     int tcpsocket_;
     int udpsocket_;
 #ifdef _WIN32
     HANDLE tcpevent_;
     HANDLE udpevent_;
 #endif
-    std::vector<std::unique_ptr<client_endpoint>> clients_;
-    user_list users_;
-    group_list groups_;
+    // workers_[0] runs on the server thread and listens for connections
+    std::vector<std::unique_ptr<server_worker>> workers_;
+    int32_t next_worker_ = 0;
+    std::atomic<bool> running_{false};
+    // users and groups
+    user_shard user_shards_[AOO_SERVER_NUMSHARDS];
+    group_shard group_shards_[AOO_SERVER_NUMSHARDS];
+    std::atomic<int32_t> num_users_{0};
+    std::atomic<int32_t> num_groups_{0};
+    // users who watch public groups
+    std::unordered_set<user *> public_group_watchers_;
+    shared_mutex watcher_mutex_;
     // queues
     lockfree::queue<std::unique_ptr<icommand>> commands_;
     lockfree::queue<std::unique_ptr<ievent>> events_;
+    spinlock event_lock_; // several workers can push events
     void push_event(std::unique_ptr<ievent> e){
+        scoped_lock<spinlock> lock(event_lock_);
         if (events_.write_available()){
             events_.write(std::move(e));
         }
     }
     // signal
     std::atomic<bool> quit_{false};
-#ifdef _WIN32
-    HANDLE waitevent_ = 0;
-#else
-    int waitpipe_[2];
-#endif
 
-    void wait_for_event();
+    /*/////////////////// cluster //////////////////////*/
 
-    void update();
+    // Each node owns the users and groups which the hash ring assigns to it.
+    // Requests for groups owned by other nodes are forwarded over TCP
+    // ('/aoo/server/cluster/...'); the owner keeps a stub user for each
+    // remote member and sends replies and peer notifications back
+    // through the member's home node ('/aoo/server/cluster/deliver').
+
+    struct cluster_node {
+        std::string host;
+        int32_t port;
+        std::unique_ptr<node_link> link; // nullptr for ourselves
+    };
+
+    std::vector<cluster_node> nodes_;
+    int32_t self_ = -1;
+    hash_ring ring_;
+    std::string cluster_secret_;
+
+    // returns the owning node if it's not us, otherwise -1
+    int32_t remote_owner(const std::string& key) const {
+        auto node = ring_.find(key);
+        return node != self_ ? node : -1;
+    }
+
+    void cluster_send(int32_t node, const char *msg, int32_t size){
+        nodes_[node].link->send(msg, size);
+    }
+
+    void cluster_deliver(int32_t node, const std::string& name,
+                         const char *msg, int32_t size);
+
+    void cluster_leave(user& usr, const std::string& group, bool reply);
+
+    std::shared_ptr<user> get_remote_user(const std::string& name, int32_t node,
+                                          const ip_address& public_addr,
+                                          const ip_address& local_addr, int64_t token);
+
+    std::shared_ptr<user> find_remote_user(const std::string& name);
+
+    void remove_remote_user(user& usr);
+
+    /*/////////////////// relay //////////////////////*/
+
+    // In relay mode, a client sends its streams once to the server's UDP
+    // socket (to sink ID '*') and the server forwards them to all subscribers.
+    // Each (publisher, source ID) pair gets a server-wide unique relay ID,
+    // which replaces the source ID, so subscribers can tell apart
+    // streams from different publishers. Replies from the subscribers
+    // ('/aoo/src/<relay ID>/...') are sent back to the original source.
+    // Likewise, each subscriber gets a relay sink ID which is unique for
+    // the publisher, because all subscribers share the server address;
+    // otherwise subscribers with the same sink ID would look like the
+    // same sink to the source and its replies would go to all of them.
+
+    struct relay_subscriber {
+        ip_address address;
+        int32_t sink;
+        int32_t relay_sink; // the sink ID as seen by the publisher
+        const user *usr;
+        const group *grp; // the group the subscription was made in
+    };
+
+    struct relay_publisher {
+        const user *usr = nullptr;
+        std::vector<relay_subscriber> subscribers;
+        std::unordered_map<int32_t, int32_t> streams; // source ID -> relay ID
+        int32_t next_sink = 0;
+    };
+
+    struct relay_stream {
+        ip_address address; // publisher address
+        int32_t source;
+    };
+
+    // keyed by the public UDP address of the publisher
+    std::unordered_map<ip_address, relay_publisher, ip_address::hash> relay_publishers_;
+    std::unordered_map<int32_t, relay_stream> relay_streams_; // relay ID -> stream
+    int32_t next_relay_id_ = 0;
+    // lock order: group shard -> relay
+    shared_mutex relay_mutex_;
+    // only used by the listening worker
+    struct relay_batch;
+    std::unique_ptr<relay_batch> relay_batch_;
+
+    bool relay_forward(char *msg, int32_t size, int32_t onset,
+                       int32_t id, const ip_address& addr);
+
+    void relay_reply(char *msg, int32_t size, int32_t onset,
+                     int32_t id, const ip_address& addr);
+
+    // requires the relay lock
+    void relay_remove_publisher(
+            std::unordered_map<ip_address, relay_publisher, ip_address::hash>::iterator it);
+
+    user_shard& get_user_shard(const std::string& name){
+        return user_shards_[std::hash<std::string>()(name) % AOO_SERVER_NUMSHARDS];
+    }
+
+    group_shard& get_group_shard(const std::string& name){
+        return group_shards_[std::hash<std::string>()(name) % AOO_SERVER_NUMSHARDS];
+    }
+
+    // the following methods require the shard lock
+
+    std::shared_ptr<group> get_group(group_shard& shard, const std::string& name,
+                                     const std::string& pwd, bool is_public, error& e);
+
+    std::shared_ptr<group> find_group(group_shard& shard, const std::string& name);
+
+    void remove_member(group_shard& shard, user& usr, group& grp);
+
+    void relay_remove_member(user& usr, group& grp);
+
+    void on_user_joined(user& usr);
+
+    void on_user_joined_group(user& usr, group& grp);
+
+    void on_user_left_group(user& usr, group& grp,
+                            const std::vector<std::shared_ptr<user>>& peers);
+
+    void on_peers_linked(group& grp, user& a, user& b);
+
+    void on_peers_unlinked(group& grp, user& a, user& b);
+
+    void on_public_group_modified(group& grp);
+
+    void on_public_group_removed(group& grp);
+
+    // called by the listening worker
+
+    void accept_clients();
+
+    void add_client(int sock, const ip_address& addr);
 
     void receive_udp();
 
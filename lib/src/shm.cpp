@@ -0,0 +1,226 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "shm.hpp"
+
+#include "aoo/aoo_utils.hpp"
+
+#if AOO_LOCAL_TRANSPORT
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <random>
+#include <new>
+
+#define AOO_SHM_MAGIC 0x616f6f72 // "aoor"
+#define AOO_SHM_VERSION 1
+#define AOO_SHM_WRAP 0xffffffff
+#define AOO_SHM_ALIGN 8
+#define AOO_SHM_CACHELINE 64
+
+namespace aoo {
+
+// NOTE: the header is shared between processes, so it must only
+// contain plain data and lock-free atomics.
+struct shm_ring::header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t token;
+    uint32_t capacity;
+    // the counters increase monotonically; the actual position
+    // is the counter modulo the capacity.
+    alignas(AOO_SHM_CACHELINE) std::atomic<uint64_t> write;
+    alignas(AOO_SHM_CACHELINE) std::atomic<uint64_t> read;
+};
+
+#if ATOMIC_LLONG_LOCK_FREE != 2
+#error "shm_ring needs lock-free 64-bit atomics"
+#endif
+
+static inline uint32_t shm_align(uint32_t n){
+    return (n + AOO_SHM_ALIGN - 1) & ~(AOO_SHM_ALIGN - 1);
+}
+
+std::unique_ptr<shm_ring> shm_ring::create(int32_t size){
+    static std::atomic<uint32_t> counter{0};
+
+    std::random_device dev;
+    std::mt19937_64 mt(((uint64_t)dev() << 32) | dev());
+    uint64_t token = mt();
+
+    std::unique_ptr<shm_ring> ring(new shm_ring());
+    snprintf(ring->name_, sizeof(ring->name_), "/aoo-%d-%u",
+             (int)getpid(), counter.fetch_add(1));
+
+    auto capacity = shm_align(size > 0 ? size : AOO_SHM_RINGSIZE);
+    auto hsize = shm_align(sizeof(header));
+    auto mapsize = hsize + capacity;
+
+    int fd = shm_open(ring->name_, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0){
+        LOG_ERROR("shm_ring: couldn't create " << ring->name_
+                  << " (" << errno << ")");
+        return nullptr;
+    }
+    if (ftruncate(fd, mapsize) < 0){
+        LOG_ERROR("shm_ring: couldn't resize " << ring->name_
+                  << " (" << errno << ")");
+        close(fd);
+        shm_unlink(ring->name_);
+        return nullptr;
+    }
+    auto ptr = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED){
+        LOG_ERROR("shm_ring: couldn't map " << ring->name_
+                  << " (" << errno << ")");
+        shm_unlink(ring->name_);
+        return nullptr;
+    }
+
+    ring->header_ = new (ptr) header();
+    ring->header_->magic = AOO_SHM_MAGIC;
+    ring->header_->version = AOO_SHM_VERSION;
+    ring->header_->token = token;
+    ring->header_->capacity = capacity;
+    ring->header_->write.store(0);
+    ring->header_->read.store(0);
+    ring->data_ = (char *)ptr + hsize;
+    ring->mapsize_ = mapsize;
+    ring->owner_ = true;
+
+    LOG_DEBUG("shm_ring: created " << ring->name_ << " (" << capacity << " bytes)");
+
+    return ring;
+}
+
+std::unique_ptr<shm_ring> shm_ring::open(const char *name, uint64_t token){
+    if (strlen(name) >= AOO_SHM_MAXNAMELEN){
+        return nullptr;
+    }
+    // the ring might not exist on this machine, so don't complain
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0){
+        return nullptr;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header)){
+        close(fd);
+        return nullptr;
+    }
+    auto mapsize = (size_t)st.st_size;
+    auto ptr = mmap(nullptr, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED){
+        return nullptr;
+    }
+
+    auto h = (header *)ptr;
+    auto hsize = shm_align(sizeof(header));
+    if (h->magic != AOO_SHM_MAGIC || h->version != AOO_SHM_VERSION
+            || h->token != token || (hsize + h->capacity) != mapsize){
+        munmap(ptr, mapsize);
+        return nullptr;
+    }
+
+    std::unique_ptr<shm_ring> ring(new shm_ring());
+    snprintf(ring->name_, sizeof(ring->name_), "%s", name);
+    ring->header_ = h;
+    ring->data_ = (char *)ptr + hsize;
+    ring->mapsize_ = mapsize;
+    ring->owner_ = false;
+
+    LOG_DEBUG("shm_ring: opened " << name);
+
+    return ring;
+}
+
+shm_ring::~shm_ring(){
+    munmap(header_, mapsize_);
+    if (owner_){
+        // existing mappings stay valid
+        shm_unlink(name_);
+    }
+}
+
+uint64_t shm_ring::token() const {
+    return header_->token;
+}
+
+int32_t shm_ring::capacity() const {
+    return header_->capacity;
+}
+
+bool shm_ring::write(const void *hdr, int32_t hsize,
+                     const char *data, int32_t size){
+    auto capacity = header_->capacity;
+    auto need = shm_align(sizeof(uint32_t) + hsize + size);
+    auto w = header_->write.load(std::memory_order_relaxed);
+    auto r = header_->read.load(std::memory_order_acquire);
+    auto pos = (uint32_t)(w % capacity);
+    // records don't wrap around; skip the rest of the buffer instead
+    auto skip = (capacity - pos < need) ? capacity - pos : 0;
+    if ((w - r) + skip + need > capacity){
+        return false; // full
+    }
+    if (skip){
+        // there's always room for the marker (all records are aligned)
+        uint32_t marker = AOO_SHM_WRAP;
+        memcpy(data_ + pos, &marker, sizeof(marker));
+        w += skip;
+        pos = 0;
+    }
+    uint32_t total = hsize + size;
+    auto ptr = data_ + pos;
+    memcpy(ptr, &total, sizeof(total));
+    memcpy(ptr + sizeof(total), hdr, hsize);
+    if (size > 0){
+        memcpy(ptr + sizeof(total) + hsize, data, size);
+    }
+    header_->write.store(w + need, std::memory_order_release);
+    return true;
+}
+
+const char * shm_ring::read_data(int32_t& size){
+    auto capacity = header_->capacity;
+    auto r = header_->read.load(std::memory_order_relaxed);
+    for (;;){
+        auto w = header_->write.load(std::memory_order_acquire);
+        if (r == w){
+            return nullptr; // empty
+        }
+        auto pos = (uint32_t)(r % capacity);
+        uint32_t total;
+        memcpy(&total, data_ + pos, sizeof(total));
+        if (total == AOO_SHM_WRAP){
+            r += capacity - pos;
+            header_->read.store(r, std::memory_order_release);
+            continue;
+        }
+        if (total > capacity - pos - sizeof(total)){
+            // corrupted; drop everything
+            LOG_ERROR("shm_ring: bad record size " << total);
+            header_->read.store(w, std::memory_order_release);
+            return nullptr;
+        }
+        readsize_ = shm_align(sizeof(total) + total);
+        size = total;
+        return data_ + pos + sizeof(total);
+    }
+}
+
+void shm_ring::read_commit(){
+    header_->read.fetch_add(readsize_, std::memory_order_release);
+    readsize_ = 0;
+}
+
+} // aoo
+
+#endif // AOO_LOCAL_TRANSPORT
@@ -0,0 +1,96 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "aoo/aoo.h"
+
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+// local (shared memory) transport between a source and a sink
+// on the same machine; currently POSIX only.
+#ifndef AOO_LOCAL_TRANSPORT
+# ifdef _WIN32
+#  define AOO_LOCAL_TRANSPORT 0
+# else
+#  define AOO_LOCAL_TRANSPORT 1
+# endif
+#endif
+
+// default ring size in bytes
+#ifndef AOO_SHM_RINGSIZE
+#define AOO_SHM_RINGSIZE (1 << 18)
+#endif
+
+// number of unanswered offers after which the source frees the ring;
+// the sink is most likely on another machine.
+#ifndef AOO_SHM_MAXOFFERS
+#define AOO_SHM_MAXOFFERS 3
+#endif
+
+#define AOO_SHM_MAXNAMELEN 32
+
+namespace aoo {
+
+/*///////////////////////// shm_ring /////////////////////////*/
+
+// A single-producer/single-consumer ring buffer in POSIX shared memory.
+// The source creates the ring and writes encoded blocks; the sink
+// opens it by name and reads the blocks in place.
+// Records are stored as [uint32 size][payload], padded to 8 bytes;
+// a record never wraps around, instead the writer leaves a wrap marker.
+// The random token prevents a sink from mapping an unrelated ring
+// with the same name (e.g. the name was sent from another machine).
+
+class shm_ring {
+public:
+    // create a new ring (producer side)
+    static std::unique_ptr<shm_ring> create(int32_t size);
+    // map an existing ring (consumer side); returns nullptr on failure.
+    static std::unique_ptr<shm_ring> open(const char *name, uint64_t token);
+
+    ~shm_ring();
+    shm_ring(const shm_ring&) = delete;
+    shm_ring& operator=(const shm_ring&) = delete;
+
+    const char *name() const { return name_; }
+
+    uint64_t token() const;
+
+    int32_t capacity() const;
+
+    // write a record, consisting of a header and the payload;
+    // returns false if the ring is full.
+    bool write(const void *header, int32_t hsize,
+               const char *data, int32_t size);
+
+    // get the next record (nullptr if empty) and release it
+    // with read_commit() after it has been processed.
+    const char * read_data(int32_t& size);
+
+    void read_commit();
+private:
+    shm_ring() = default;
+
+    struct header;
+    header *header_ = nullptr;
+    char *data_ = nullptr;
+    size_t mapsize_ = 0;
+    uint32_t readsize_ = 0; // size of the current record (consumer)
+    bool owner_ = false;
+    char name_[AOO_SHM_MAXNAMELEN];
+};
+
+// header of a block in the ring, followed by the encoded data
+struct shm_block {
+    int32_t salt;
+    int32_t sequence;
+    double samplerate;
+    int32_t channel;
+    int32_t size;
+};
+
+} // aoo
@@ -202,6 +202,15 @@ int32_t aoo::sink::set_option(int32_t opt, void *ptr, int32_t size)
         CHECKARG(int32_t);
         protocol_flags_ = as<int32_t>(ptr) & 0xff;
         break;
+    // clock
+    case aoo_opt_clock:
+        CHECKARG(aoo_clock);
+        clock_.set(as<aoo_clock>(ptr));
+        break;
+    // capture
+    case aoo_opt_capture:
+        CHECKARG(const char *);
+        return set_capture(as<const char *>(ptr));
     // unknown
     default:
         LOG_WARNING("aoo_sink: unsupported option " << opt);
@@ -256,6 +265,11 @@ int32_t aoo::sink::get_option(int32_t opt, void *ptr, int32_t size)
         CHECKARG(int32_t);
         as<int32_t>(ptr) = protocol_flags_;
         break;
+    // clock
+    case aoo_opt_clock:
+        CHECKARG(aoo_clock);
+        as<aoo_clock>(ptr) = clock_.get();
+        break;
     // unknown
     default:
         LOG_WARNING("aoo_sink: unsupported option " << opt);
@@ -279,7 +293,22 @@ int32_t aoo::sink::set_sourceoption(void *endpoint, int32_t id,
         // reset
         case aoo_opt_reset:
             src->update(*this);
+            src->stats().reset();
+            break;
+        // output bus
+        case aoo_opt_bus:
+            CHECKARG(int32_t);
+            src->set_bus(as<int32_t>(ptr));
+            break;
+        // gain
+        case aoo_opt_gain:
+            CHECKARG(float);
+            src->set_gain(as<float>(ptr));
             break;
+        // mixing matrix
+        case aoo_opt_mix_matrix:
+            CHECKARG(aoo_mix_matrix);
+            return src->set_mix_matrix(as<aoo_mix_matrix>(ptr));
         // unsupported
         default:
             LOG_WARNING("aoo_sink: unsupported source option " << opt);
@@ -312,6 +341,21 @@ int32_t aoo::sink::get_sourceoption(void *endpoint, int32_t id,
             return src->get_buffer_fill_ratio(as<float>(p));
         case aoo_opt_userformat:
             return src->get_userformat(static_cast<char*>(p), size);
+        // statistics
+        case aoo_opt_stream_stats:
+            CHECKARG(aoo_stream_stats);
+            src->stats().get(as<aoo_stream_stats>(p));
+            break;
+        // output bus
+        case aoo_opt_bus:
+            CHECKARG(int32_t);
+            as<int32_t>(p) = src->bus();
+            break;
+        // gain
+        case aoo_opt_gain:
+            CHECKARG(float);
+            as<float>(p) = src->gain();
+            break;
         // unsupported
         default:
             LOG_WARNING("aoo_sink: unsupported source option " << opt);
@@ -330,6 +374,16 @@ int32_t aoo_sink_handle_message(aoo_sink *sink, const char *data, int32_t n,
 
 int32_t aoo::sink::handle_message(const char *data, int32_t n,
                                   void *endpoint, aoo_replyfn fn) {
+#if AOO_CAPTURE
+    if (capturing_.load(std::memory_order_acquire)){
+        scoped_lock<spinlock> lock(capture_lock_);
+        if (capture_){
+            // first write all process() calls which have happened before
+            flush_capture();
+            capture_->write(data, n, endpoint, clock_.now());
+        }
+    }
+#endif
     try {
         osc::ReceivedPacket packet(data, n);
         osc::ReceivedMessage msg(packet);
@@ -358,7 +412,7 @@ int32_t aoo::sink::handle_message(const char *data, int32_t n,
             auto salt = (it++)->AsInt32();
             auto src = find_source_by_salt(endpoint, salt);
             if (src){
-                return handle_compact_data_message(endpoint, fn, msg);
+                return handle_compact_data_message(endpoint, fn, msg, n);
             }
             else {
                 //LOG_WARNING("compact data doesn't match!");
@@ -374,9 +428,11 @@ int32_t aoo::sink::handle_message(const char *data, int32_t n,
         if (!strcmp(pattern, AOO_MSG_FORMAT)){
             return handle_format_message(endpoint, fn, msg);
         } else if (!strcmp(pattern, AOO_MSG_DATA)){
-            return handle_data_message(endpoint, fn, msg);
+            return handle_data_message(endpoint, fn, msg, n);
         } else if (!strcmp(pattern, AOO_MSG_PING)){
-            return handle_ping_message(endpoint, fn, msg);
+            return handle_ping_message(endpoint, fn, msg, n);
+        } else if (!strcmp(pattern, AOO_MSG_SHM)){
+            return handle_local_transport_message(endpoint, msg);
         } else {
             LOG_WARNING("unknown message " << pattern);
         }
@@ -391,6 +447,14 @@ int32_t aoo_sink_send(aoo_sink *sink){
 }
 
 int32_t aoo::sink::send(){
+#if AOO_CAPTURE
+    if (capturing_.load(std::memory_order_acquire)){
+        scoped_lock<spinlock> lock(capture_lock_);
+        if (capture_){
+            flush_capture();
+        }
+    }
+#endif
     bool didsomething = false;
     for (auto& s: sources_){
         if (s.send(*this)){
@@ -408,18 +472,121 @@ int32_t aoo_sink_process(aoo_sink *sink, aoo_sample **data,
 #define AOO_MAXNUMEVENTS 256
 
 int32_t aoo::sink::process(aoo_sample **data, int32_t nsampframes, uint64_t t){
+    // report any allocation to the debug hook
+    rt_scope rtscope;
+
+#if AOO_CAPTURE
+    capture_process(nsampframes, t);
+#endif
+
     // we need to respect the nframes passed in here, which may be smaller than
     // the blocksize (the host may be splitting the processing, etc)
     std::fill(buffer_.begin(), buffer_.end(), 0);
 
     bool didsomething = false;
 
+    update_timer(t);
+
+    // sum all sources into the buffer
+    auto channels = (aoo_sample **)alloca(nchannels_ * sizeof(aoo_sample *));
+    for (int i = 0; i < nchannels_; ++i){
+        channels[i] = &buffer_[i * blocksize_];
+    }
+
+    for (auto& src : sources_){
+        if (src.process(*this, channels, nchannels_, nsampframes)){
+            didsomething = true;
+        }
+    }
+
+    if (didsomething){
+    #if AOO_CLIP_OUTPUT
+        for (auto it = buffer_.begin(); it != buffer_.end(); ++it){
+            if (*it > 1.0){
+                *it = 1.0;
+            } else if (*it < -1.0){
+                *it = -1.0;
+            }
+        }
+    #endif
+        // copy buffers
+        for (int i = 0; i < nchannels_; ++i){
+            auto buf = &buffer_[i * blocksize_];
+            std::copy(buf, buf + nsampframes, data[i]);
+        }
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+int32_t aoo_sink_process_buses(aoo_sink *sink, aoo_sink_bus *buses,
+                               int32_t nbuses, int32_t nsamples, uint64_t t) {
+    return sink->process_buses(buses, nbuses, nsamples, t);
+}
+
+int32_t aoo::sink::process_buses(aoo_sink_bus *buses, int32_t nbuses,
+                                 int32_t nsampframes, uint64_t t){
+    // report any allocation to the debug hook
+    rt_scope rtscope;
+
+#if AOO_CAPTURE
+    capture_process(nsampframes, t);
+#endif
+
+    // the sources are summed directly into the host buffers
+    for (int i = 0; i < nbuses; ++i){
+        for (int j = 0; j < buses[i].nchannels; ++j){
+            auto buf = buses[i].data[j];
+            std::fill(buf, buf + nsampframes, 0);
+        }
+    }
+
+    bool didsomething = false;
+
+    update_timer(t);
+
+    for (auto& src : sources_){
+        auto bus = src.bus();
+        bool result;
+        if (bus >= 0 && bus < nbuses){
+            result = src.process(*this, buses[bus].data, buses[bus].nchannels, nsampframes);
+        } else {
+            // still consume the audio to keep the source running
+            result = src.process(*this, nullptr, 0, nsampframes);
+        }
+        if (result){
+            didsomething = true;
+        }
+    }
+
+#if AOO_CLIP_OUTPUT
+    if (didsomething){
+        for (int i = 0; i < nbuses; ++i){
+            for (int j = 0; j < buses[i].nchannels; ++j){
+                auto buf = buses[i].data[j];
+                for (int k = 0; k < nsampframes; ++k){
+                    if (buf[k] > 1.0){
+                        buf[k] = 1.0;
+                    } else if (buf[k] < -1.0){
+                        buf[k] = -1.0;
+                    }
+                }
+            }
+        }
+    }
+#endif
+
+    return didsomething;
+}
+
+// shared by process() and process_buses()
+void aoo::sink::update_timer(uint64_t t){
     // update time DLL filter
     // TODO deal with when we are called with less than the blocksize for this
     double error;
     auto state = timer_.update(t, error);
-    
-   
+
     if (state == timer::state::reset){
         LOG_DEBUG("setup time DLL filter for sink");
         dll_.setup(samplerate_, blocksize_, bandwidth_, 0);
@@ -445,35 +612,8 @@ int32_t aoo::sink::process(aoo_sample **data, int32_t nsampframes, uint64_t t){
         ignoredll = true;
     }
     ignore_dll_ = ignoredll;
-    
-    // the mutex is uncontended most of the time, but LATER we might replace
-    // this with a lockless and/or waitfree solution
-    for (auto& src : sources_){
-        if (src.process(*this, buffer_.data(), blocksize_, nsampframes)){
-            didsomething = true;
-        }
-    }
-
-    if (didsomething){
-    #if AOO_CLIP_OUTPUT
-        for (auto it = buffer_.begin(); it != buffer_.end(); ++it){
-            if (*it > 1.0){
-                *it = 1.0;
-            } else if (*it < -1.0){
-                *it = -1.0;
-            }
-        }
-    #endif
-        // copy buffers
-        for (int i = 0; i < nchannels_; ++i){
-            auto buf = &buffer_[i * blocksize_];
-            std::copy(buf, buf + nsampframes, data[i]);
-        }
-        return 1;
-    } else {
-        return 0;
-    }
 }
+
 int32_t aoo_sink_events_available(aoo_sink *sink){
     return sink->events_available();
 }
@@ -523,7 +663,7 @@ aoo::source_desc * sink::find_source(void *endpoint, int32_t id){
 
 aoo::source_desc * sink::find_source_by_salt(void *endpoint, int32_t salt){
     for (auto& src : sources_){
-        if ((src.endpoint() == endpoint) && (src.get_current_salt() == salt)){
+        if ((src.endpoint() == endpoint) && src.match_salt(salt)){
             return &src;
         }
     }
@@ -536,6 +676,87 @@ void sink::update_sources(){
     }
 }
 
+int32_t sink::set_capture(const char *path){
+#if AOO_CAPTURE
+    std::unique_ptr<capture_writer> writer;
+    if (path){
+        capture_header info;
+        info.type = AOO_TYPE_SINK;
+        info.id = id();
+        info.samplerate = samplerate_;
+        info.blocksize = blocksize_;
+        info.nchannels = nchannels_;
+        info.buffersize = buffersize_;
+        info.start = clock_.now().to_uint64();
+        // creates the file and prefaults the first chunk
+        writer = capture_writer::create(path, info);
+        if (!writer){
+            return 0;
+        }
+    }
+    // only swap the writer under the lock; pending process() calls
+    // are copied out and written to the previous capture afterwards.
+    std::vector<capture_record> pending;
+    pending.reserve(AOO_CAPTURE_QUEUESIZE);
+    {
+        scoped_lock<spinlock> lock(capture_lock_);
+        while (capture_queue_.read_available()){
+            capture_record r;
+            capture_queue_.read(r);
+            pending.push_back(r);
+        }
+        capture_.swap(writer);
+        capturing_.store(capture_ != nullptr, std::memory_order_release);
+    }
+    // 'writer' is the previous capture (if any)
+    if (writer){
+        for (auto& r : pending){
+            writer->write_process(r.size, r.time);
+        }
+        auto dropped = capture_dropped_.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0){
+            LOG_WARNING("aoo_sink: capture: dropped " << dropped << " process() calls");
+        }
+    }
+    return 1;
+#else
+    LOG_WARNING("aoo_sink: capture not supported on this platform");
+    return 0;
+#endif
+}
+
+#if AOO_CAPTURE
+// called on the audio thread; never blocks.
+void sink::capture_process(int32_t nsampframes, uint64_t t){
+    if (capturing_.load(std::memory_order_acquire)){
+        if (capture_queue_.write_available()){
+            capture_record r;
+            r.time = t;
+            r.endpoint = AOO_CAPTURE_PROCESS;
+            r.size = nsampframes;
+            capture_queue_.write(r);
+        } else {
+            capture_dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// called on the network thread with capture_lock_ held.
+void sink::flush_capture(){
+    while (capture_queue_.read_available()){
+        capture_record r;
+        capture_queue_.read(r);
+        if (capture_){
+            capture_->write_process(r.size, r.time);
+        }
+    }
+    auto dropped = capture_dropped_.exchange(0, std::memory_order_relaxed);
+    if (dropped > 0){
+        LOG_WARNING("aoo_sink: capture: dropped " << dropped << " process() calls");
+    }
+}
+#endif
+
 int32_t sink::handle_format_message(void *endpoint, aoo_replyfn fn,
                                     const osc::ReceivedMessage& msg)
 {
@@ -568,6 +789,14 @@ int32_t sink::handle_format_message(void *endpoint, aoo_replyfn fn,
         (it++)->AsBlob(userfmt, ufsize);
     }
 
+    // format switch
+    int32_t prevsalt = 0;
+    int32_t switchseq = -1;
+    if (msg.ArgumentCount() > 10) {
+        prevsalt = (it++)->AsInt32();
+        switchseq = (it++)->AsInt32();
+    }
+
     if (id < 0){
         LOG_WARNING("bad ID for " << AOO_MSG_FORMAT << " message");
         return 0;
@@ -582,11 +811,16 @@ int32_t sink::handle_format_message(void *endpoint, aoo_replyfn fn,
         src->set_protocol_flags(protocol_flags_);
     }
 
-    return src->handle_format(*this, salt, f, (const char *)settings, size, version, (const char *) userfmt, ufsize);
+    if (switchseq >= 0){
+        return src->handle_format_switch(*this, salt, prevsalt, switchseq, f, (const char *)settings,
+                                         size, version, (const char *) userfmt, ufsize);
+    } else {
+        return src->handle_format(*this, salt, f, (const char *)settings, size, version, (const char *) userfmt, ufsize);
+    }
 }
 
 int32_t sink::handle_data_message(void *endpoint, aoo_replyfn fn,
-                                  const osc::ReceivedMessage& msg)
+                                  const osc::ReceivedMessage& msg, int32_t size)
 {
     auto it = msg.ArgumentsBegin();
 
@@ -612,6 +846,7 @@ int32_t sink::handle_data_message(void *endpoint, aoo_replyfn fn,
     // try to find existing source
     auto src = find_source(endpoint, id);
     if (src){
+        src->stats().add_packet_in(size);
         return src->handle_data(*this, salt, d);
     } else {
         // discard data message, add source and request format!
@@ -624,7 +859,7 @@ int32_t sink::handle_data_message(void *endpoint, aoo_replyfn fn,
 }
 
 int32_t sink::handle_compact_data_message(void *endpoint, aoo_replyfn fn,
-                                          const osc::ReceivedMessage& msg)
+                                          const osc::ReceivedMessage& msg, int32_t size)
 {
     // /d <i:salt> <i:seq> <b:data>
     // /d <i:salt> <i:seq> <f:srate> <b:data>
@@ -654,6 +889,7 @@ int32_t sink::handle_compact_data_message(void *endpoint, aoo_replyfn fn,
     // try to find existing source by salt
     auto src = find_source_by_salt(endpoint, salt);
     if (src){
+        src->stats().add_packet_in(size);
         return src->handle_data(*this, salt, d);
     } else {
         // discard data message
@@ -662,7 +898,7 @@ int32_t sink::handle_compact_data_message(void *endpoint, aoo_replyfn fn,
 }
 
 int32_t sink::handle_ping_message(void *endpoint, aoo_replyfn fn,
-                                  const osc::ReceivedMessage& msg)
+                                  const osc::ReceivedMessage& msg, int32_t size)
 {
     auto it = msg.ArgumentsBegin();
 
@@ -676,6 +912,7 @@ int32_t sink::handle_ping_message(void *endpoint, aoo_replyfn fn,
     // try to find existing source
     auto src = find_source(endpoint, id);
     if (src){
+        src->stats().add_packet_in(size);
         return src->handle_ping(*this, tt);
     } else {
         LOG_WARNING("couldn't find source " << id << " for " << AOO_MSG_PING << " message");
@@ -683,6 +920,31 @@ int32_t sink::handle_ping_message(void *endpoint, aoo_replyfn fn,
     }
 }
 
+// /aoo/sink/<id>/shm <src> <name> <token>
+
+int32_t sink::handle_local_transport_message(void *endpoint,
+                                             const osc::ReceivedMessage& msg)
+{
+    auto it = msg.ArgumentsBegin();
+
+    auto id = (it++)->AsInt32();
+    auto name = (it++)->AsString();
+    auto token = (uint64_t)(it++)->AsInt64();
+
+    if (id < 0){
+        LOG_WARNING("bad ID for " << AOO_MSG_SHM << " message");
+        return 0;
+    }
+    // the source sends the format first
+    auto src = find_source(endpoint, id);
+    if (src){
+        return src->handle_local_transport(*this, name, token);
+    } else {
+        LOG_VERBOSE("couldn't find source " << id << " for " << AOO_MSG_SHM << " message");
+        return 0;
+    }
+}
+
 /*////////////////////////// source_desc /////////////////////////////*/
 
 source_desc::source_desc(void *endpoint, aoo_replyfn fn, int32_t id, int32_t salt)
@@ -723,8 +985,11 @@ void source_desc::request_codec_change(aoo_format & f)
 }
 
 int32_t source_desc::get_buffer_fill_ratio(float &ratio){
-    if (audioqueue_.capacity() > 0) {
-        ratio = (audioqueue_.read_available() * audioqueue_.blocksize()) / (float)audioqueue_.capacity();
+    shared_lock lock(mutex_);
+    auto state = state_.get();
+    if (state && state->audioqueue.capacity() > 0) {
+        auto& audioqueue = state->audioqueue;
+        ratio = (audioqueue.read_available() * audioqueue.blocksize()) / (float)audioqueue.capacity();
     } else {
         ratio = 0.0f;
     }
@@ -760,17 +1025,20 @@ void source_desc::do_update(const sink &s){
         int32_t nbuffers = d.quot + (d.rem != 0); // round up
         nbuffers = std::max<int32_t>(1, nbuffers); // e.g. if buffersize_ is 0
         // resize audio buffer and initially fill with zeros.
+        // build the new state off the audio thread
+        auto state = std::make_unique<decoder_state>();
+        state->nchannels = decoder_->nchannels();
         auto nsamples = decoder_->nchannels() * decoder_->blocksize();
-        audioqueue_.resize(nbuffers * nsamples, nsamples);
-        infoqueue_.resize(nbuffers, 1);
+        state->audioqueue.resize(nbuffers * nsamples, nsamples);
+        state->infoqueue.resize(nbuffers, 1);
         int count = 0;
-        while (audioqueue_.write_available() && infoqueue_.write_available()){
-            audioqueue_.write_commit();
+        while (state->audioqueue.write_available() && state->infoqueue.write_available()){
+            state->audioqueue.write_commit();
             // push nominal samplerate + default channel (0)
             block_info i;
             i.sr = decoder_->samplerate();
             i.channel = 0;
-            infoqueue_.write(i);
+            state->infoqueue.write(i);
             count++;
         };
         LOG_VERBOSE("reset source queues to " << nbuffers << " buffers");
@@ -779,12 +1047,16 @@ void source_desc::do_update(const sink &s){
         eventqueue_.reset();
     #endif
         // setup resampler
-        resampler_.setup(decoder_->blocksize(), s.blocksize(),
-                            decoder_->samplerate(), s.samplerate(), decoder_->nchannels());
+        state->resampler.setup(decoder_->blocksize(), s.blocksize(),
+                               decoder_->samplerate(), s.samplerate(), decoder_->nchannels());
+        // swap in the new state; the old one is retired and freed
+        // as soon as process() doesn't use it anymore.
+        state_.publish(std::move(state));
         // resize block queue
         blockqueue_.resize(nbuffers + 8); // (32) extra capacity for network jitter (allows lower buffersizes) (should be option?)
         newest_ = 0;
         next_ = -1;
+        lastarrivalseq_ = -1;
         nextneedsfadein_ = 0;
         channel_ = 0;
         samplerate_ = decoder_->samplerate();
@@ -811,6 +1083,10 @@ int32_t source_desc::handle_format(const sink& s, int32_t salt, const aoo_format
 
     salt_ = salt;
 
+    // cancel pending format switch
+    olddecoder_ = nullptr;
+    switchseq_ = -1;
+
     // create/change decoder if needed
     if (!decoder_ || strcmp(decoder_->name(), f.codec)){
         auto c = aoo::find_codec(f.codec);
@@ -849,27 +1125,120 @@ int32_t source_desc::handle_format(const sink& s, int32_t salt, const aoo_format
     return 1;
 }
 
+// Switch to a new format without resetting the stream: keep the buffers and
+// decode all blocks before 'switchseq' with the old decoder, then crossfade
+// into the new decoder (see process_blocks()). Falls back to handle_format()
+// if this is not possible, e.g. because we've missed the previous format.
+
+int32_t source_desc::handle_format_switch(const sink& s, int32_t salt, int32_t prevsalt, int32_t switchseq,
+                                          const aoo_format& f, const char *settings, int32_t size,
+                                          int32_t version, const char *userformat, int32_t ufsize){
+    // take writer lock!
+    unique_lock lock(mutex_);
+
+    if (salt == salt_ && decoder_){
+        // already switched (e.g. resent format message)
+        LOG_DEBUG("ignore format switch: already switched");
+        return 0;
+    }
+
+    bool canswitch = prevsalt == salt_ && decoder_ && state_.get() && next_ >= 0
+            && switchseq >= next_
+            && f.nchannels == decoder_->nchannels()
+            && f.samplerate == decoder_->samplerate()
+            && f.blocksize == decoder_->blocksize()
+            && !(olddecoder_ && next_ <= switchseq_); // previous switch still pending
+
+    std::unique_ptr<aoo::decoder> dec;
+    if (canswitch){
+        auto c = aoo::find_codec(f.codec);
+        if (c){
+            dec = c->create_decoder();
+        } else {
+            LOG_ERROR("codec '" << f.codec << "' not supported!");
+            return 0;
+        }
+        if (!dec){
+            LOG_ERROR("couldn't create decoder!");
+            return 0;
+        }
+        if (dec->read_format(f, settings, size) < 0){
+            canswitch = false;
+        }
+    }
+
+    if (!canswitch){
+        lock.unlock();
+        return handle_format(s, salt, f, settings, size, version, userformat, ufsize);
+    }
+
+    LOG_VERBOSE("source " << id_ << ": switch format at block " << switchseq);
+
+    olddecoder_ = std::move(decoder_);
+    decoder_ = std::move(dec);
+    oldsalt_ = salt_;
+    salt_ = salt;
+    switchseq_ = switchseq;
+    xfadebuffer_.resize(decoder_->nchannels() * decoder_->blocksize());
+
+    // see what protocol flags are in the LSB of the version
+    protocol_flags_ = (0xFF & version);
+
+    // user format
+    if (userformat) {
+        userformat_.assign(userformat, userformat+ufsize);
+    }
+
+    // push event
+    event e;
+    e.type = AOO_SOURCE_FORMAT_EVENT;
+    e.source.endpoint = endpoint_;
+    e.source.id = id_;
+    push_event(e);
+
+    return 1;
+}
+
 // /aoo/sink/<id>/data <src> <salt> <seq> <sr> <channel_onset> <totalsize> <numpackets> <packetnum> <data>
 
 int32_t source_desc::handle_data(const sink& s, int32_t salt, const aoo::data_packet& d){
     // synchronize with update()!
     shared_lock lock(mutex_);
+#if AOO_LOCAL_TRANSPORT
+    scoped_lock<spinlock> datalock(datalock_);
+#endif
 
     // the source format might have changed and we haven't noticed,
     // e.g. because of dropped UDP packets.
-    if (salt != salt_){
+    // NOTE: blocks before a format switch still have the old salt.
+    if (salt != salt_ && !(switchseq_ >= 0 && salt == oldsalt_
+                           && d.sequence < switchseq_)){
         streamstate_.request_format();
         return 0;
     }
 
 #if 1
-    if (!decoder_){
+    if (!decoder_ || !state_.get()){
         LOG_DEBUG("ignore data message");
         return 0;
     }
 #else
     assert(decoder_ != nullptr);
 #endif
+    AOO_TRACE_EVENT(receive, d.sequence);
+
+    // arrival jitter: compare the arrival times of the first
+    // frame of consecutive blocks with the nominal block period.
+    if (d.framenum == 0 && d.sequence > lastarrivalseq_){
+        auto now = s.clock().seconds();
+        if (d.sequence == lastarrivalseq_ + 1 && decoder_->samplerate() > 0){
+            auto period = (double)decoder_->blocksize() / decoder_->samplerate();
+            stats_.add_jitter(std::abs((now - lastarrival_) - period));
+        }
+        lastarrivalseq_ = d.sequence;
+        lastarrival_ = now;
+    }
+
     LOG_DEBUG("got block: seq = " << d.sequence << ", sr = " << d.samplerate
               << ", chn = " << d.channel << ", totalsize = " << d.totalsize
               << ", nframes = " << d.nframes << ", frame = " << d.framenum << ", size " << d.size);
@@ -918,11 +1287,23 @@ int32_t source_desc::handle_ping(const sink &s, time_tag tt){
 #if 0
     time_tag tt2 = s.absolute_time(); // use last stream time
 #else
-    time_tag tt2 = aoo_osctime_get(); // use real system time
+    time_tag tt2 = s.clock().now(); // use real (or user) time
 #endif
 
     streamstate_.set_ping(tt, tt2);
 
+    // latency = network delay + jitter buffer
+    {
+        shared_lock lock(mutex_);
+        auto state = state_.get();
+        auto latency = std::max<double>(0, time_tag::duration(tt, tt2));
+        if (state && decoder_ && decoder_->samplerate() > 0){
+            latency += (double)state->audioqueue.read_available()
+                    * decoder_->blocksize() / decoder_->samplerate();
+        }
+        stats_.add_latency(latency);
+    }
+
     // push "ping" event
     event e;
     e.type = AOO_PING_EVENT;
@@ -937,8 +1318,15 @@ int32_t source_desc::handle_ping(const sink &s, time_tag tt){
 }
 
 bool source_desc::send(const sink& s){
+    // free old decoder states and mixing matrices (not on the audio thread!)
+    state_.collect();
+    matrix_.collect();
+
     bool didsomething = false;
 
+    if (receive_local(s)){
+        didsomething = true;
+    }
     if (send_format_request(s)){
         didsomething = true;
     }
@@ -954,15 +1342,96 @@ bool source_desc::send(const sink& s){
     return didsomething;
 }
 
-bool source_desc::process(const sink& s, aoo_sample *buffer, int32_t stride, int32_t numsampleframes){
-    // synchronize with handle_format() and update()!
-    // the mutex should be uncontended most of the time.
-    // NOTE: We could use try_lock() and skip the block if we couldn't aquire the lock.
-    shared_lock lock(mutex_);
+// Try to map the ring; this only works if the source runs on the same
+// machine. If successful, reply with the token, so the source can stop
+// sending audio data over the network. Otherwise we just stay silent.
+
+int32_t source_desc::handle_local_transport(const sink& s, const char *name,
+                                            uint64_t token){
+#if AOO_LOCAL_TRANSPORT
+    unique_lock lock(ringmutex_); // writer lock!
+    if (!ring_ || ring_->token() != token || strcmp(ring_->name(), name)){
+        auto ring = shm_ring::open(name, token);
+        if (!ring){
+            return 0;
+        }
+        LOG_VERBOSE("aoo_sink: use local transport for source " << id_);
+        ring_ = std::move(ring);
+    }
+    lock.unlock();
+
+    // /aoo/src/<id>/shm <sink> <token>
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+
+    const int32_t max_addr_size = AOO_MSG_DOMAIN_LEN
+            + AOO_MSG_SOURCE_LEN + 16 + AOO_MSG_SHM_LEN;
+    char address[max_addr_size];
+    snprintf(address, sizeof(address), "%s%s/%d%s",
+             AOO_MSG_DOMAIN, AOO_MSG_SOURCE, id_, AOO_MSG_SHM);
+
+    msg << osc::BeginMessage(address) << s.id()
+        << (osc::int64)token << osc::EndMessage;
+
+    dosend(msg.Data(), (int32_t)msg.Size());
+
+    return 1;
+#else
+    return 0;
+#endif
+}
 
-    if (!decoder_){
+// read all blocks from the shared memory ring; each record
+// contains a complete block, so there's nothing to reassemble.
+bool source_desc::receive_local(const sink& s){
+#if AOO_LOCAL_TRANSPORT
+    shared_lock lock(ringmutex_); // reader lock!
+    if (!ring_){
         return false;
     }
+    bool didsomething = false;
+    const char *ptr;
+    int32_t size;
+    while ((ptr = ring_->read_data(size))){
+        shm_block b;
+        if (size >= (int32_t)sizeof(b)){
+            memcpy(&b, ptr, sizeof(b));
+            if (b.size == size - (int32_t)sizeof(b)){
+                aoo::data_packet d;
+                d.sequence = b.sequence;
+                d.samplerate = b.samplerate;
+                d.channel = b.channel;
+                d.totalsize = b.size;
+                d.nframes = b.size > 0 ? 1 : 0;
+                d.framenum = 0;
+                d.data = ptr + sizeof(b);
+                d.size = b.size;
+                stats_.add_packet_in(size);
+                handle_data(s, b.salt, d);
+            }
+        }
+        ring_->read_commit();
+        didsomething = true;
+    }
+    return didsomething;
+#else
+    return false;
+#endif
+}
+
+bool source_desc::process(const sink& s, aoo_sample **data, int32_t nchannels, int32_t numsampleframes){
+    // never blocks: handle_format() and update() build a new state
+    // and swap it in, the old one is freed on a non-realtime thread.
+    lockfree::rcu_ptr<decoder_state>::reader state(state_);
+
+    if (!state){
+        return false;
+    }
+    AOO_TRACE_SCOPE(trace, sink_process, -1);
+
+    auto& audioqueue = state->audioqueue;
+    auto& infoqueue = state->infoqueue;
+    auto& resampler = state->resampler;
 
     // record stream state
     int32_t lost = streamstate_.get_lost();
@@ -1000,64 +1469,62 @@ bool source_desc::process(const sink& s, aoo_sample *buffer, int32_t stride, int
 
     // don't process anything until the first few blocks are recv'd into the blockqueue
     // after a reset to keep the jitter buffer as full as possible at the start
-    //if (streamstate_.get_blocks_recvd() <  std::min(infoqueue_.capacity()/2, 10)) {
+    //if (streamstate_.get_blocks_recvd() <  std::min(infoqueue.capacity()/2, 10)) {
     //    LOG_VERBOSE("waiting for some blocks: " << streamstate_.get_blocks_recvd());
     //    return false;
     //}
     
-    int32_t nsamples = audioqueue_.blocksize();
+    int32_t nsamples = audioqueue.blocksize();
 
     // read samples from resampler
-    auto nchannels = decoder_->nchannels();
+    auto nsrcchannels = state->nchannels;
     // we need to respect the sample frame size passed in this method
     // because it may be less than the sink blocksize
-    auto readsamples = numsampleframes * nchannels;
+    auto readsamples = numsampleframes * nsrcchannels;
 
 #if 0
-    auto capacity = audioqueue_.capacity() / audioqueue_.blocksize();
-    DO_LOG("audioqueue: " << audioqueue_.read_available() << " / " << capacity);
+    auto capacity = audioqueue.capacity() / audioqueue.blocksize();
+    DO_LOG("audioqueue: " << audioqueue.read_available() << " / " << capacity);
 #endif
 
-    while (audioqueue_.read_available() && infoqueue_.read_available()
-           && readsamples > resampler_.read_available() && resampler_.write_available() >= nsamples){
+    while (audioqueue.read_available() && infoqueue.read_available()
+           && readsamples > resampler.read_available() && resampler.write_available() >= nsamples){
 
         // get block info and set current channel + samplerate
         block_info info;
-        infoqueue_.read(info);
+        infoqueue.read(info);
         channel_ = info.channel;
         samplerate_ = info.sr;
+        AOO_TRACE_SEQUENCE(trace, info.sequence);
 
         // write audio into resampler
-        resampler_.write(audioqueue_.read_data(), nsamples);
+        resampler.write(audioqueue.read_data(), nsamples);
 
-        audioqueue_.read_commit();
+        audioqueue.read_commit();
 
 
     }
     // update resampler
-    resampler_.update(samplerate_, s.real_samplerate());
+    resampler.update(samplerate_, s.real_samplerate());
+
+    // record statistics
+    if (audioqueue.capacity() > 0){
+        stats_.add_buffer_fill((audioqueue.read_available() * nsamples)
+                               / (float)audioqueue.capacity());
+    }
+    stats_.set_resample_ratio(resampler.ratio());
+    stats_.set_dll_error(s.dll_error());
     // read samples from resampler
     
-    //LOG_VERBOSE("s.blocksize: " << s.blocksize() << "  size: " << numsampleframes << "  stride: " << stride << " readsamp: " << readsamples << " ravail: " << resampler_.read_available() << " wavail: " << resampler_.write_available());
+    //LOG_VERBOSE("s.blocksize: " << s.blocksize() << "  size: " << numsampleframes << "  stride: " << stride << " readsamp: " << readsamples << " ravail: " << resampler.read_available() << " wavail: " << resampler.write_available());
     
-    if (resampler_.read_available() >= readsamples){
+    if (resampler.read_available() >= readsamples){
         auto buf = (aoo_sample *)alloca(readsamples * sizeof(aoo_sample));
-        resampler_.read(buf, readsamples);
+        resampler.read(buf, readsamples);
 
         // sum source into sink (interleaved -> non-interleaved),
         // starting at the desired sink channel offset.
-        // out of bound source channels are silently ignored.
-        for (int i = 0; i < nchannels; ++i){
-            auto chn = i + channel_;
-            // ignore out-of-bound source channels!
-            if (chn < s.nchannels()){
-                auto n = numsampleframes;
-                auto out = buffer + stride * chn;
-                for (int j = 0; j < n; ++j){
-                    out[j] += buf[j * nchannels + i];
-                }
-            }
-        }
+        mix(data, nchannels, buf, nsrcchannels, numsampleframes);
 
         // LOG_DEBUG("read samples from source " << id_);
 
@@ -1082,7 +1549,7 @@ bool source_desc::process(const sink& s, aoo_sample *buffer, int32_t stride, int
             e.source_state.state = AOO_SOURCE_STATE_STOP;
             push_event(e);
 
-            LOG_VERBOSE("UNDERRUN resampler avail " << resampler_.read_available() << "  readsamp: " << readsamples);
+            LOG_VERBOSE("UNDERRUN resampler avail " << resampler.read_available() << "  readsamp: " << readsamples);
 
             // this doesn't do anything if the stream simply stopped
             streamstate_.set_underrun();
@@ -1110,6 +1577,9 @@ int32_t source_desc::handle_events(aoo_eventhandler fn, void *user){
 }
 
 bool source_desc::check_packet(const data_packet &d){
+    // called with reader lock, so the state can't be replaced
+    auto& audioqueue = state_.get()->audioqueue;
+    auto& infoqueue = state_.get()->infoqueue;
     if (d.sequence < next_){
         // block too old, discard!
         LOG_VERBOSE("discarded old block " << d.sequence);
@@ -1136,6 +1606,7 @@ bool source_desc::check_packet(const data_packet &d){
         if (ack_list_.find(d.sequence)){
             LOG_DEBUG("resent block " << d.sequence);
             streamstate_.add_resent(1);
+            stats_.add_resend_responses(1);
         } else {
             LOG_VERBOSE("block " << d.sequence << " out of order!");
             streamstate_.add_reordered(1);
@@ -1161,18 +1632,18 @@ bool source_desc::check_packet(const data_packet &d){
         next_ = d.sequence;
         // push empty blocks to keep the buffer full, but leave room for one block!
         int count = 0;
-        auto nsamples = audioqueue_.blocksize();
-        while (audioqueue_.write_available() > 1 && infoqueue_.write_available() > 1){
-            auto ptr = audioqueue_.write_data();
+        auto nsamples = audioqueue.blocksize();
+        while (audioqueue.write_available() > 1 && infoqueue.write_available() > 1){
+            auto ptr = audioqueue.write_data();
             if (!decoder_->decode(nullptr, 0, ptr, nsamples)) {
-                LOG_WARNING("decode failed nsamples: " << nsamples << " audioqavail: " << audioqueue_.write_available());
+                LOG_WARNING("decode failed nsamples: " << nsamples << " audioqavail: " << audioqueue.write_available());
             }
-            audioqueue_.write_commit();
+            audioqueue.write_commit();
             // push nominal samplerate + current channel
             block_info i;
             i.sr = decoder_->samplerate();
             i.channel = channel_;
-            infoqueue_.write(i);
+            infoqueue.write(i);
 
             count++;
         }
@@ -1199,6 +1670,9 @@ bool source_desc::check_packet(const data_packet &d){
 }
 
 bool source_desc::add_packet(const data_packet& d){
+    // called with reader lock, so the state can't be replaced
+    auto& audioqueue = state_.get()->audioqueue;
+    auto& infoqueue = state_.get()->infoqueue;
     auto block = blockqueue_.find(d.sequence);
     if (!block){
         if (blockqueue_.full()){
@@ -1213,16 +1687,16 @@ bool source_desc::add_packet(const data_packet& d){
                 ack_list_.clear();
                 // push empty blocks to keep the buffer full, but leave room for one block!
                 int count = 0;
-                auto nsamples = audioqueue_.blocksize();
-                while (audioqueue_.write_available() > 1 && infoqueue_.write_available() > 1){
-                    auto ptr = audioqueue_.write_data();
+                auto nsamples = audioqueue.blocksize();
+                while (audioqueue.write_available() > 1 && infoqueue.write_available() > 1){
+                    auto ptr = audioqueue.write_data();
                     decoder_->decode(nullptr, 0, ptr, nsamples);
-                    audioqueue_.write_commit();
+                    audioqueue.write_commit();
                     // push nominal samplerate + current channel
                     block_info i;
                     i.sr = decoder_->samplerate();
                     i.channel = channel_;
-                    infoqueue_.write(i);
+                    infoqueue.write(i);
 
                     count++;
                 }
@@ -1232,16 +1706,16 @@ bool source_desc::add_packet(const data_packet& d){
                 next_ = d.sequence;
                 LOG_VERBOSE("dropped " << count << " blocks to handle buffer overrun");
             } else {
-                if (audioqueue_.write_available() && infoqueue_.write_available()){
-                    auto ptr = audioqueue_.write_data();
-                    auto nsamples = audioqueue_.blocksize();
+                if (audioqueue.write_available() && infoqueue.write_available()){
+                    auto ptr = audioqueue.write_data();
+                    auto nsamples = audioqueue.blocksize();
                     decoder_->decode(nullptr, 0, ptr, nsamples);
-                    audioqueue_.write_commit();
+                    audioqueue.write_commit();
                     // push nominal samplerate + current channel
                     block_info i;
                     i.sr = decoder_->samplerate();
                     i.channel = channel_;
-                    infoqueue_.write(i);
+                    infoqueue.write(i);
                 }
                 // record dropped block
                 streamstate_.add_lost(1);
@@ -1276,7 +1750,160 @@ bool source_desc::add_packet(const data_packet& d){
     return true;
 }
 
+// called from any thread
+int32_t source_desc::set_mix_matrix(const aoo_mix_matrix& m){
+    // NOTE: the spinlock only protects the pointer swap; the matrix is
+    // built before and the old matrix is retired after (both touch the heap).
+    // Also, we must not lock mutex_ while holding it.
+    if (m.ninputs > 0 && m.noutputs > 0){
+        if (!m.gains){
+            return 0;
+        }
+        auto matrix = std::make_unique<mix_matrix>();
+        matrix->ninputs = m.ninputs;
+        matrix->noutputs = m.noutputs;
+        matrix->gains.assign(m.gains, m.gains + m.ninputs * m.noutputs);
+        matrix->current.resize(matrix->gains.size());
+
+        mix_matrix *old;
+        {
+            scoped_lock<spinlock> lock(matrixlock_);
+            old = matrix_.exchange(std::move(matrix));
+        }
+        matrix_.retire(old);
+        return 1;
+    }
+    // go back to a one-to-one mapping. We still need a matrix
+    // (large enough for the old matrix and the current stream),
+    // so that process() can ramp to the new gains.
+    int32_t n = 0;
+    {
+        shared_lock lock(mutex_);
+        auto state = state_.get();
+        if (state){
+            n = state->nchannels;
+        }
+    }
+    std::unique_ptr<mix_matrix> matrix;
+    while (true){
+        mix_matrix *old = nullptr;
+        bool published = false;
+        {
+            scoped_lock<spinlock> lock(matrixlock_);
+            auto size = n;
+            auto current = matrix_.get();
+            if (current){
+                size = std::max(size, std::max(current->ninputs, current->noutputs));
+            }
+            if (size == 0){
+                return 1; // nothing to do
+            }
+            if (matrix && size == n){
+                old = matrix_.exchange(std::move(matrix));
+                published = true;
+            } else {
+                // first try or another thread has published
+                // a larger matrix in the meantime.
+                n = size;
+            }
+        }
+        if (published){
+            matrix_.retire(old);
+            return 1;
+        }
+        matrix = std::make_unique<mix_matrix>();
+        matrix->ninputs = matrix->noutputs = n;
+        matrix->gains.resize(n * n);
+        for (int i = 0; i < n; ++i){
+            matrix->gains[i * n + i] = 1.0;
+        }
+        matrix->current.resize(matrix->gains.size());
+    }
+}
+
+// called by process()
+void source_desc::update_mix_matrix(){
+    if (matrix_.get() == curmatrix_){
+        return;
+    }
+    // pin the new matrix in the other hazard slot,
+    // so that we can still read the gains of the old one.
+    auto slot = 1 - matrixslot_;
+    auto next = matrix_.acquire(slot);
+    if (next){
+        auto old = curmatrix_;
+        for (int i = 0; i < next->noutputs; ++i){
+            for (int j = 0; j < next->ninputs; ++j){
+                float g;
+                if (old){
+                    if (i < old->noutputs && j < old->ninputs){
+                        g = old->current[i * old->ninputs + j];
+                    } else {
+                        g = 0;
+                    }
+                } else {
+                    g = (i == j) ? curgain_ : 0;
+                }
+                next->current[i * next->ninputs + j] = g;
+            }
+        }
+    }
+    matrix_.release(matrixslot_);
+    matrixslot_ = slot;
+    curmatrix_ = next;
+}
+
+// called by process()
+void source_desc::mix(aoo_sample **data, int32_t nchannels, const aoo_sample *buf,
+                      int32_t nsrcchannels, int32_t nframes){
+    update_mix_matrix();
+
+    // the gain ramps over one block
+    auto gain = gain_.load(std::memory_order_relaxed);
+    auto scale = 1.f / nframes;
+    // deinterleaved source channel
+    auto temp = (aoo_sample *)alloca(nframes * sizeof(aoo_sample));
+
+    if (curmatrix_){
+        auto m = curmatrix_;
+        auto ninputs = std::min(m->ninputs, nsrcchannels);
+        for (int j = 0; j < ninputs; ++j){
+            for (int k = 0; k < nframes; ++k){
+                temp[k] = buf[k * nsrcchannels + j];
+            }
+            for (int i = 0; i < m->noutputs; ++i){
+                auto index = i * m->ninputs + j;
+                auto g1 = m->current[index];
+                auto g2 = m->gains[index] * gain;
+                m->current[index] = g2;
+                auto chn = i + channel_;
+                // ignore out-of-bound channels and silent connections
+                if (chn >= 0 && chn < nchannels && (g1 != 0 || g2 != 0)){
+                    mix_accumulate(data[chn], temp, nframes, g1, (g2 - g1) * scale);
+                }
+            }
+        }
+    } else {
+        // one-to-one mapping, out of bound source channels are silently ignored.
+        auto g1 = curgain_;
+        auto g2 = gain;
+        for (int j = 0; j < nsrcchannels; ++j){
+            auto chn = j + channel_;
+            if (chn >= 0 && chn < nchannels){
+                for (int k = 0; k < nframes; ++k){
+                    temp[k] = buf[k * nsrcchannels + j];
+                }
+                mix_accumulate(data[chn], temp, nframes, g1, (g2 - g1) * scale);
+            }
+        }
+    }
+    curgain_ = gain;
+}
+
 void source_desc::process_blocks(){
+    // called with reader lock, so the state can't be replaced
+    auto& audioqueue = state_.get()->audioqueue;
+    auto& infoqueue = state_.get()->infoqueue;
     // Transfer all consecutive complete blocks as long as
     // no previous (expected) blocks are missing.
     if (blockqueue_.empty()){
@@ -1285,7 +1912,7 @@ void source_desc::process_blocks(){
 
     auto b = blockqueue_.begin();
     int32_t next = next_;
-    while (b != blockqueue_.end() && audioqueue_.write_available())
+    while (b != blockqueue_.end() && audioqueue.write_available())
     {
         const char *data;
         int32_t size;
@@ -1319,13 +1946,24 @@ void source_desc::process_blocks(){
             break;
         }
 
-        next++;
+        auto seq = next++;
+        i.sequence = seq;
+
+        // blocks before a format switch are decoded with the old decoder
+        auto decoder = decoder_.get();
+        if (olddecoder_ && seq < switchseq_){
+            decoder = olddecoder_.get();
+        }
 
         // decode data and push samples
-        auto ptr = audioqueue_.write_data();
-        auto nsamples = audioqueue_.blocksize();
+        auto ptr = audioqueue.write_data();
+        auto nsamples = audioqueue.blocksize();
         // decode audio data
-        if (decoder_->decode(data, size, ptr, nsamples) < 0){
+        auto t1 = stream_stats::clock();
+        AOO_TRACE_SCOPE(trace, decode, seq);
+        auto result = decoder->decode(data, size, ptr, nsamples);
+        stats_.add_codec_time(stream_stats::clock() - t1);
+        if (result < 0){
             LOG_WARNING("aoo_sink: couldn't decode block!");
             // decoder failed - fill with zeros
             std::fill(ptr, ptr + nsamples, 0);
@@ -1346,12 +1984,37 @@ void source_desc::process_blocks(){
             
             nextneedsfadein_ = -1;
         }
-        audioqueue_.write_commit();
+        else if (olddecoder_ && seq == switchseq_
+                 && olddecoder_->decode(nullptr, 0, xfadebuffer_.data(), nsamples) > 0) {
+            // crossfade from the old decoder (which conceals the missing
+            // block) to the first block of the new decoder. Decoders which
+            // can't conceal (e.g. PCM) only return silence, so we switch
+            // without fade; this is seamless because the blocks are contiguous.
+            LOG_VERBOSE("crossfade format switch");
+            auto xfade = xfadebuffer_.data();
+            auto nchannels = decoder_->nchannels();
+            const int sframes = nsamples/nchannels;
+            const float gaindelta = 1.0f / sframes;
+            float gain = 0.0f;
+            for (int j = 0; j < sframes; ++j){
+                for (int i = 0; i < nchannels; ++i){
+                    auto k = j*nchannels+i;
+                    ptr[k] = xfade[k] + (ptr[k] - xfade[k]) * gain;
+                }
+                gain += gaindelta;
+            }
+        }
+        audioqueue.write_commit();
 
         // push info
-        infoqueue_.write(i);
+        infoqueue.write(i);
     }
     next_ = next;
+    // the format switch is complete
+    if (olddecoder_ && next_ > switchseq_){
+        olddecoder_ = nullptr;
+        switchseq_ = -1;
+    }
     // pop blocks
     auto count = b - blockqueue_.begin();
     while (count--){
@@ -1556,6 +2219,7 @@ int32_t source_desc::send_data_request(const sink &s){
         auto d = div(numrequests, maxrequests);
 
         auto dorequest = [&](int32_t n){
+            stats_.add_resend_requests(n);
             msg << osc::BeginMessage(address) << s.id() << salt;
             while (n--){
                 data_request request;
@@ -12,6 +12,9 @@
 #include "common.hpp"
 #include "lockfree.hpp"
 #include "time_dll.hpp"
+#include "shm.hpp"
+#include "trace.hpp"
+#include "capture.hpp"
 
 #include "oscpack/osc/OscOutboundPacketStream.h"
 #include "oscpack/osc/OscReceivedElements.h"
@@ -125,6 +128,7 @@ private:
 struct block_info {
     double sr;
     int32_t channel;
+    int32_t sequence = -1; // for tracing (-1: empty block)
 };
 
 class sink;
@@ -158,9 +162,26 @@ public:
     
     int32_t get_buffer_fill_ratio(float &ratio);
 
+    stream_stats& stats() { return stats_; }
+
     int32_t get_userformat(char * buf, int32_t size);
 
     int32_t get_current_salt() const { return salt_; }
+
+    int32_t bus() const { return bus_.load(std::memory_order_relaxed); }
+
+    void set_bus(int32_t bus) { bus_.store(bus, std::memory_order_relaxed); }
+
+    float gain() const { return gain_.load(std::memory_order_relaxed); }
+
+    void set_gain(float gain) { gain_.store(gain, std::memory_order_relaxed); }
+
+    int32_t set_mix_matrix(const aoo_mix_matrix& m);
+
+    bool match_salt(int32_t salt) const {
+        // the previous salt is still valid during a format switch
+        return salt == salt_ || (switchseq_ >= 0 && salt == oldsalt_);
+    }
     
     void set_protocol_flags(int32_t flags) { protocol_flags_ = flags; }
     
@@ -170,16 +191,24 @@ public:
     int32_t handle_format(const sink& s, int32_t salt, const aoo_format& f,
                           const char *settings, int32_t size, int32_t version, const char *userformat=nullptr, int32_t ufsize=0);
 
+    int32_t handle_format_switch(const sink& s, int32_t salt, int32_t prevsalt, int32_t switchseq,
+                                 const aoo_format& f, const char *settings, int32_t size, int32_t version,
+                                 const char *userformat=nullptr, int32_t ufsize=0);
+
     int32_t handle_data(const sink& s, int32_t salt,
                                      const aoo::data_packet& d);
 
     int32_t handle_ping(const sink& s, time_tag tt);
 
+    int32_t handle_local_transport(const sink& s, const char *name, uint64_t token);
+
     int32_t handle_events(aoo_eventhandler fn, void *user);
 
     bool send(const sink& s);
 
-    bool process(const sink& s, aoo_sample *buffer, int32_t stride, int32_t numsampleframes);
+    // sum into the given channels (non-interleaved); returns false on underrun.
+    // if 'nchannels' is 0, the audio is consumed but discarded.
+    bool process(const sink& s, aoo_sample **data, int32_t nchannels, int32_t numsampleframes);
 
     void request_recover(){ streamstate_.request_recover(); }
 
@@ -203,6 +232,11 @@ private:
 
     void process_blocks();
 
+    void update_mix_matrix();
+
+    void mix(aoo_sample **data, int32_t nchannels, const aoo_sample *buf,
+             int32_t nsrcchannels, int32_t nframes);
+
     void check_outdated_blocks();
 
     void check_missing_blocks(const sink& s);
@@ -214,8 +248,11 @@ private:
 
     bool send_notifications(const sink& s);
 
+    bool receive_local(const sink& s);
+
     void dosend(const char *data, int32_t n){
         fn_(endpoint_, data, n);
+        stats_.add_packet_out(n);
     }
     // data
     void * const endpoint_;
@@ -224,6 +261,11 @@ private:
     int32_t salt_;
     // audio decoder
     std::unique_ptr<aoo::decoder> decoder_;
+    // format switch: blocks before 'switchseq_' are decoded with 'olddecoder_'
+    std::unique_ptr<aoo::decoder> olddecoder_;
+    int32_t oldsalt_ = 0;
+    int32_t switchseq_ = -1;
+    aoo::vector<aoo_sample> xfadebuffer_;
     // state
     int32_t newest_ = 0; // sequence number of most recent incoming block
     int32_t next_ = 0; // next outgoing block
@@ -231,13 +273,39 @@ private:
     int32_t channel_ = 0; // recent channel onset
     double samplerate_ = 0; // recent samplerate
     int32_t protocol_flags_ = 0; // protocol flags sent from the remote source
+    std::atomic<int32_t> bus_{0}; // output bus (see sink::process_buses())
     stream_state streamstate_;
-    std::vector<char> userformat_;
+    stream_stats stats_;
+    int32_t lastarrivalseq_ = -1; // for the arrival jitter
+    double lastarrival_ = 0;
+    aoo::vector<char> userformat_;
     // queues and buffers
     block_queue blockqueue_;
     block_ack_list ack_list_;
-    lockfree::queue<aoo_sample> audioqueue_;
-    lockfree::queue<block_info> infoqueue_;
+    // everything process() needs is kept in a separate state object
+    // which do_update() rebuilds and swaps in, so the audio thread never
+    // has to wait for a format change.
+    struct decoder_state : memory_object {
+        int32_t nchannels = 0;
+        lockfree::queue<aoo_sample> audioqueue;
+        lockfree::queue<block_info> infoqueue;
+        dynamic_resampler resampler;
+    };
+    lockfree::rcu_ptr<decoder_state> state_;
+    // mixing matrix; process() keeps its current matrix in one of
+    // the two hazard slots, so it can ramp from the old to the new gains.
+    struct mix_matrix : memory_object {
+        int32_t ninputs = 0;
+        int32_t noutputs = 0;
+        aoo::vector<float> gains; // target gains
+        aoo::vector<float> current; // smoothed gains (only used by process())
+    };
+    lockfree::rcu_ptr<mix_matrix, 2> matrix_;
+    spinlock matrixlock_; // serialize writers
+    mix_matrix *curmatrix_ = nullptr; // only used by process()
+    int32_t matrixslot_ = 0;
+    std::atomic<float> gain_{1.0};
+    float curgain_ = 1.0; // only used by process()
     lockfree::queue<data_request> resendqueue_;
     lockfree::queue<event> eventqueue_;
     spinlock eventqueuelock_;
@@ -247,15 +315,29 @@ private:
             eventqueue_.write(e);
         }
     }
-    dynamic_resampler resampler_;
-    // thread synchronization
+    // thread synchronization (not used by process())
     aoo::shared_mutex mutex_; // LATER replace with a spinlock?
+#if AOO_LOCAL_TRANSPORT
+    // shared memory ring of a source on the same machine;
+    // drained by send(), replaced by handle_local_transport().
+    std::unique_ptr<shm_ring> ring_;
+    aoo::shared_mutex ringmutex_;
+    // handle_data() is called from the network thread and (for
+    // the ring) from the send thread, so we must serialize it.
+    spinlock datalock_;
+#endif
 };
 
-class sink final : public isink {
+class sink final : public isink, public memory_object {
 public:
     sink(int32_t id)
-        : id_(id) {}
+        : id_(id) {
+    #if AOO_CAPTURE
+        // allocated once and never resized, because the audio thread
+        // might write to it (see set_capture()).
+        capture_queue_.resize(AOO_CAPTURE_QUEUESIZE, 1);
+    #endif
+    }
 
     ~sink(){}
 
@@ -274,6 +356,9 @@ public:
 
     int32_t process(aoo_sample **data, int32_t nsampframes, uint64_t t) override;
 
+    int32_t process_buses(aoo_sink_bus *buses, int32_t nbuses,
+                          int32_t nsampframes, uint64_t t) override;
+
     int32_t events_available() override;
 
     int32_t handle_events(aoo_eventhandler fn, void *user) override;
@@ -300,6 +385,8 @@ public:
 
     double real_samplerate() const { return ignore_dll_ ? samplerate_ : dll_.samplerate(); }
 
+    double dll_error() const { return ignore_dll_ ? 0 : dll_.error(); }
+
     int32_t blocksize() const { return blocksize_; }
 
     int32_t buffersize() const { return buffersize_; }
@@ -316,6 +403,8 @@ public:
 
     time_tag absolute_time() const { return timer_.get_absolute(); }
 
+    const clock_source& clock() const { return clock_; }
+
     int32_t protocol_flags() const { return protocol_flags_; }
 
 private:
@@ -325,7 +414,7 @@ private:
     int32_t samplerate_ = 0;
     int32_t blocksize_ = 0;
     // buffer for summing source audio output
-    std::vector<aoo_sample> buffer_;
+    aoo::vector<aoo_sample> buffer_;
     // options
     std::atomic<int32_t> buffersize_{ AOO_SINK_BUFSIZE };
     std::atomic<int32_t> packetsize_{ AOO_PACKETSIZE };
@@ -333,6 +422,17 @@ private:
     std::atomic<float> resend_interval_{ AOO_RESEND_INTERVAL * 0.001 };
     std::atomic<int32_t> resend_maxnumframes_{ AOO_RESEND_MAXNUMFRAMES };
     std::atomic<int32_t> protocol_flags_{ 0 };
+    clock_source clock_;
+#if AOO_CAPTURE
+    // only accessed on the network thread(s)
+    std::unique_ptr<capture_writer> capture_;
+    spinlock capture_lock_;
+    // process() calls are passed to the network thread,
+    // so the audio thread never touches the capture file.
+    lockfree::queue<capture_record> capture_queue_;
+    std::atomic<bool> capturing_{false};
+    std::atomic<int32_t> capture_dropped_{0};
+#endif
     // the sources
     lockfree::list<source_desc> sources_;
     // timing
@@ -347,17 +447,29 @@ private:
 
     void update_sources();
 
+    int32_t set_capture(const char *path);
+#if AOO_CAPTURE
+    void capture_process(int32_t nsampframes, uint64_t t);
+
+    void flush_capture();
+#endif
+
+    void update_timer(uint64_t t);
+
     int32_t handle_format_message(void *endpoint, aoo_replyfn fn,
                                   const osc::ReceivedMessage& msg);
 
     int32_t handle_data_message(void *endpoint, aoo_replyfn fn,
-                                const osc::ReceivedMessage& msg);
+                                const osc::ReceivedMessage& msg, int32_t size);
 
     int32_t handle_compact_data_message(void *endpoint, aoo_replyfn fn,
-                                        const osc::ReceivedMessage& msg);
+                                        const osc::ReceivedMessage& msg, int32_t size);
 
     int32_t handle_ping_message(void *endpoint, aoo_replyfn fn,
-                                const osc::ReceivedMessage& msg);
+                                const osc::ReceivedMessage& msg, int32_t size);
+
+    int32_t handle_local_transport_message(void *endpoint,
+                                           const osc::ReceivedMessage& msg);
 };
 
 } // aoo
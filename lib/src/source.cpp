@@ -149,9 +149,42 @@ int32_t aoo::source::set_option(int32_t opt, void *ptr, int32_t size)
         CHECKARG(int32_t);
         respect_codec_change_req_ = as<int32_t>(ptr);
         break;
+    // local transport
+    case aoo_opt_local_transport:
+    {
+        CHECKARG(int32_t);
+    #if AOO_LOCAL_TRANSPORT
+        auto enable = as<int32_t>(ptr) != 0;
+        unique_lock lock(sink_mutex_); // writer lock!
+        local_transport_ = enable;
+        for (auto& sink : sinks_){
+            if (enable){
+                // offer the rings again
+                sink.state->offers = 0;
+            } else {
+                // go back to the network; the rings are kept
+                sink.ring = nullptr;
+            }
+        }
+    #else
+        if (as<int32_t>(ptr) != 0){
+            LOG_WARNING("aoo_source: local transport not supported");
+        }
+    #endif
+        break;
+    }
     // format
     case aoo_opt_userformat:
         return set_userformat(ptr, size);
+    // clock
+    case aoo_opt_clock:
+        CHECKARG(aoo_clock);
+        clock_.set(as<aoo_clock>(ptr));
+        break;
+    // capture
+    case aoo_opt_capture:
+        CHECKARG(const char *);
+        return set_capture(as<const char *>(ptr));
     // unknown
     default:
         LOG_WARNING("aoo_source: unsupported option " << opt);
@@ -213,6 +246,16 @@ int32_t aoo::source::get_option(int32_t opt, void *ptr, int32_t size)
         CHECKARG(int32_t);
         as<int32_t>(ptr) = redundancy_;
         break;
+    // local transport
+    case aoo_opt_local_transport:
+        CHECKARG(int32_t);
+        as<int32_t>(ptr) = local_transport_;
+        break;
+    // clock
+    case aoo_opt_clock:
+        CHECKARG(aoo_clock);
+        as<aoo_clock>(ptr) = clock_.get();
+        break;
     // unknown
     default:
         LOG_WARNING("aoo_source: unsupported option " << opt);
@@ -320,6 +363,27 @@ int32_t aoo::source::get_sinkoption(void *endpoint, int32_t id,
             CHECKARG(int32_t);
             as<int32_t>(p) = sink->channel;
             break;
+        // statistics
+        case aoo_opt_stream_stats:
+        {
+            CHECKARG(aoo_stream_stats);
+            auto& stats = as<aoo_stream_stats>(p);
+            // The min/max values of the source statistics are shared by
+            // all sinks, so we first pass them on to every sink; this way
+            // a query only resets the values of the given sink.
+            auto minmax = stats_.take_minmax();
+            for (auto& s : sinks_){
+                s.state->stats.merge_minmax(minmax);
+            }
+            sink->state->stats.get(stats);
+            // add the current source statistics
+            aoo_stream_stats srcstats;
+            stats_.get(srcstats, false);
+            stats.resample_ratio = srcstats.resample_ratio;
+            stats.dll_error = srcstats.dll_error;
+            stats.codec_time_avg = srcstats.codec_time_avg;
+            break;
+        }
         // unknown
         default:
             LOG_WARNING("aoo_source: unsupported sink option " << opt);
@@ -369,6 +433,9 @@ int32_t aoo::source::add_sink(void *endpoint, int32_t id, aoo_replyfn fn){
         auto it = std::remove_if(sinks_.begin(), sinks_.end(), [&](auto& s){
             return s.user == endpoint;
         });
+        for (auto s = it; s != sinks_.end(); ++s){
+            retire_sink_state(s->state);
+        }
         sinks_.erase(it, sinks_.end());
     } else {
         // check if sink exists!
@@ -385,6 +452,11 @@ int32_t aoo::source::add_sink(void *endpoint, int32_t id, aoo_replyfn fn){
     }
     // add sink descriptor
     sinks_.emplace_back(endpoint, fn, id);
+    sinks_.back().state = get_sink_state(endpoint, id);
+    sinks_.back().state->stats.reset();
+#if AOO_LOCAL_TRANSPORT
+    sinks_.back().state->offers = 0;
+#endif
     // notify send_format()
     format_changed_ = true;
 
@@ -402,6 +474,9 @@ int32_t aoo::source::remove_sink(void *endpoint, int32_t id){
         auto it = std::remove_if(sinks_.begin(), sinks_.end(), [&](auto& s){
             return s.user == endpoint;
         });
+        for (auto s = it; s != sinks_.end(); ++s){
+            retire_sink_state(s->state);
+        }
         sinks_.erase(it, sinks_.end());
         return 1;
     } else {
@@ -412,6 +487,7 @@ int32_t aoo::source::remove_sink(void *endpoint, int32_t id){
                                 << id << " because of wildcard!");
                     return 0;
                 } else if (it->id == id){
+                    retire_sink_state(it->state);
                     sinks_.erase(it);
                     return 1;
                 }
@@ -428,6 +504,9 @@ void aoo_source_remove_all(aoo_source *src) {
 
 void aoo::source::remove_all(){
     unique_lock lock(sink_mutex_); // writer lock!
+    for (auto& s : sinks_){
+        retire_sink_state(s.state);
+    }
     sinks_.clear();
 }
 
@@ -438,6 +517,14 @@ int32_t aoo_source_handle_message(aoo_source *src, const char *data, int32_t n,
 
 // /aoo/src/<id>/format <sink>
 int32_t aoo::source::handle_message(const char *data, int32_t n, void *endpoint, aoo_replyfn fn){
+#if AOO_CAPTURE
+    {
+        scoped_lock<spinlock> lock(capture_lock_);
+        if (capture_){
+            capture_->write(data, n, endpoint, clock_.now());
+        }
+    }
+#endif
     try {
         osc::ReceivedPacket packet(data, n);
         osc::ReceivedMessage msg(packet);
@@ -461,6 +548,15 @@ int32_t aoo::source::handle_message(const char *data, int32_t n, void *endpoint,
             return 0;
         }
 
+        // record statistics (the first argument is always the sink ID)
+        if (msg.ArgumentCount() > 0 && msg.ArgumentsBegin()->IsInt32()){
+            shared_lock lock(sink_mutex_); // reader lock!
+            auto sink = find_sink(endpoint, msg.ArgumentsBegin()->AsInt32());
+            if (sink){
+                sink->state->stats.add_packet_in(n);
+            }
+        }
+
         auto pattern = msg.AddressPattern() + onset;
         if (!strcmp(pattern, AOO_MSG_FORMAT)){
             handle_format_request(endpoint, fn, msg);
@@ -480,6 +576,9 @@ int32_t aoo::source::handle_message(const char *data, int32_t n, void *endpoint,
         } else if (!strcmp(pattern, AOO_MSG_CODEC_CHANGE)){
             handle_codec_change(endpoint, fn, msg);
             return 1;
+        } else if (!strcmp(pattern, AOO_MSG_SHM)){
+            handle_local_transport(endpoint, msg);
+            return 1;
         } else {
             LOG_WARNING("unknown message " << pattern);
         }
@@ -501,6 +600,11 @@ int32_t aoo_source_send(aoo_source *src) {
 // We have to make a local copy of the sink list, but this should be
 // rather cheap in comparison to encoding and sending the audio data.
 int32_t aoo::source::send(){
+    // free old encoder states (not on the audio thread!)
+    state_.collect();
+    // free the states of removed sinks
+    free_sink_states();
+
     if (!play_.load() && !activeplay_.load()){
         return false;
     }
@@ -535,6 +639,11 @@ int32_t aoo::source::process(const aoo_sample **data, int32_t n, uint64_t t){
         return 0; // pausing
     }
 
+    // report any allocation to the debug hook
+    rt_scope rtscope;
+
+    AOO_TRACE_SCOPE(trace, source_process, -1);
+
     // update time DLL filter
     double error;
     auto state = timer_.update(t, error);
@@ -565,26 +674,39 @@ int32_t aoo::source::process(const aoo_sample **data, int32_t n, uint64_t t){
     }
     
     
-    // the mutex should be uncontended most of the time.
-    // NOTE: We could use try_lock() and skip the block if we couldn't aquire the lock.
-    shared_lock lock(update_mutex_);
+    // never blocks: update() builds a new state and swaps it in,
+    // the old one is freed on a non-realtime thread.
+    lockfree::rcu_ptr<encoder_state>::reader stream(state_);
 
-    if (!encoder_){
+    if (!stream){
         return 0;
     }
 
-     bool dofadein = play_ && !lastplay_;
-     bool dofadeout = !play_ && lastplay_;
+    auto nchannels = stream->nchannels;
+    auto& resampler = stream->resampler;
+    auto& audioqueue = stream->audioqueue;
+    auto& srqueue = stream->srqueue;
+
+    // record statistics
+    if (audioqueue.capacity() > 0){
+        stats_.add_buffer_fill((audioqueue.read_available() * audioqueue.blocksize())
+                               / (float)audioqueue.capacity());
+    }
+    stats_.set_resample_ratio(resampler.ratio());
+    stats_.set_dll_error(dll_.error());
+
+     bool dofadein = play_ && !stream->lastplay;
+     bool dofadeout = !play_ && stream->lastplay;
      
      if (dofadeout) {
-         pushing_silent_frames_ = 4 * encoder_->blocksize();
+         pushing_silent_frames_ = 4 * stream->encoder_blocksize;
          LOG_VERBOSE("do play fadeout, pushing silent: " << pushing_silent_frames_);
      }
      if (dofadein) {
          LOG_VERBOSE("do play fadein");
      }
      
-     lastplay_ = play_;
+     stream->lastplay = play_;
 
      bool pushingSilence = !dofadeout && !play_ && pushing_silent_frames_ > 0;
      
@@ -607,24 +729,24 @@ int32_t aoo::source::process(const aoo_sample **data, int32_t n, uint64_t t){
     
     // non-interleaved -> interleaved
     //auto insamples = blocksize_ * nchannels_;
-    auto insamples = n * nchannels_;
-    auto outsamples = audioqueue_.blocksize(); // encoder_->blocksize() * nchannels_;
+    auto insamples = n * nchannels;
+    auto outsamples = audioqueue.blocksize(); // encoder_->blocksize() * nchannels_;
     auto *buf = (aoo_sample *)alloca(insamples * sizeof(aoo_sample));
 
     if (n > 0 && (dofadein || dofadeout || pushingSilence)) {
         const float fadedelta = dofadeout ? (-1.0f / n) : pushingSilence ? 0.0f : (1.0f / n);
         
-        for (int i = 0; i < nchannels_; ++i){
+        for (int i = 0; i < nchannels; ++i){
             float gain = dofadeout ? 1.0f : 0.0f;
             for (int j = 0; j < n; ++j){
-                buf[j * nchannels_ + i] = data[i][j] * gain;
+                buf[j * nchannels + i] = data[i][j] * gain;
                 gain += fadedelta;
             }
         }
     } else {
-        for (int i = 0; i < nchannels_; ++i){
+        for (int i = 0; i < nchannels; ++i){
             for (int j = 0; j < n; ++j){
-                buf[j * nchannels_ + i] = data[i][j];
+                buf[j * nchannels + i] = data[i][j];
             }
         }
     }
@@ -641,43 +763,49 @@ int32_t aoo::source::process(const aoo_sample **data, int32_t n, uint64_t t){
         auto samplesleft = insamples;
         auto * pbuf = buf;
 
-        auto availsamples = resampler_.write_available();
+        auto availsamples = resampler.write_available();
         
         while (samplesleft > 0) {
             auto usesamples = std::min(samplesleft, availsamples);
             
-            resampler_.write(pbuf, usesamples);
+            resampler.write(pbuf, usesamples);
 
             samplesleft -= usesamples;
             pbuf += usesamples;
             
             bool didconsume = false;
             
-            while (resampler_.read_available() >= outsamples
-                   && audioqueue_.write_available()
-                   && srqueue_.write_available())
+            while (resampler.read_available() >= outsamples
+                   && audioqueue.write_available()
+                   && srqueue.write_available())
             {
                 // copy audio samples
-                resampler_.read(audioqueue_.write_data(), outsamples);
-                audioqueue_.write_commit();
+                resampler.read(audioqueue.write_data(), outsamples);
+                audioqueue.write_commit();
+            #if AOO_TRACE
+                // the sequence number which send_data() will assign to this block
+                AOO_TRACE_SEQUENCE(trace, sequence_.load(std::memory_order_relaxed)
+                                   + dropped_.load(std::memory_order_relaxed)
+                                   + audioqueue.read_available() - 1);
+            #endif
                 
                 // push samplerate
                 if (!ignoredll) {
-                    auto ratio = (double)encoder_->samplerate() / (double)samplerate_;
-                    srqueue_.write(dll_.samplerate() * ratio);
+                    auto ratio = (double)stream->encoder_samplerate / (double)stream->samplerate;
+                    srqueue.write(dll_.samplerate() * ratio);
                 } else {
-                    srqueue_.write(encoder_->samplerate());
+                    srqueue.write(stream->encoder_samplerate);
                 }
 
                 didconsume = true;
             }
 
             // now update after any processing
-            availsamples = resampler_.write_available();
+            availsamples = resampler.write_available();
             
             if (!didconsume && samplesleft > availsamples) {
                 // didn't consume any, and we can't fit any more
-                //LOG_WARNING("resampler could not handle all input samples, " << samplesleft << " unprocessed, avail " << availsamples << " audioqu_wravail: " << audioqueue_.write_available()  << " audqbs: " << audioqueue_.blocksize() << " encbs: " << encoder_->blocksize());
+                //LOG_WARNING("resampler could not handle all input samples, " << samplesleft << " unprocessed, avail " << availsamples << " audioqu_wravail: " << audioqueue.write_available()  << " audqbs: " << audioqueue.blocksize() << " encbs: " << encoder_->blocksize());
                 break;
             }
         }
@@ -685,13 +813,13 @@ int32_t aoo::source::process(const aoo_sample **data, int32_t n, uint64_t t){
 #if 0
     else {
         // bypass resampler
-        if (audioqueue_.write_available() && srqueue_.write_available()){
+        if (audioqueue.write_available() && srqueue.write_available()){
             // copy audio samples
-            std::copy(buf, buf + outsamples, audioqueue_.write_data());
-            audioqueue_.write_commit();
+            std::copy(buf, buf + outsamples, audioqueue.write_data());
+            audioqueue.write_commit();
 
             // push samplerate
-            srqueue_.write(dll_.samplerate());
+            srqueue.write(dll_.samplerate());
         } else {
             // LOG_DEBUG("couldn't process");
         }
@@ -743,7 +871,7 @@ namespace aoo {
 
 // /aoo/sink/<id>/data <src> <salt> <seq> <sr> <channel_onset> <totalsize> <nframes> <frame> <data>
 
-void endpoint::send_data(int32_t src, int32_t salt, const aoo::data_packet& d) const{
+int32_t endpoint::send_data(int32_t src, int32_t salt, const aoo::data_packet& d) const{
     // call without lock!
 
     char buf[AOO_MAXPACKETSIZE];
@@ -771,12 +899,14 @@ void endpoint::send_data(int32_t src, int32_t salt, const aoo::data_packet& d) c
 
 
     send(msg.Data(), (int32_t)msg.Size());
+
+    return (int32_t)msg.Size();
 }
 
 // /d <salt> <seq> <data>
 // /d <salt> <seq> <srate> <data>
 
-void endpoint::send_data_compact(int32_t src, int32_t salt, const aoo::data_packet& d, bool sendrate) {
+int32_t endpoint::send_data_compact(int32_t src, int32_t salt, const aoo::data_packet& d, bool sendrate) {
     // call without lock!
 
     char buf[AOO_MAXPACKETSIZE];
@@ -801,12 +931,15 @@ void endpoint::send_data_compact(int32_t src, int32_t salt, const aoo::data_pack
 
 
     send(msg.Data(), (int32_t)msg.Size());
+
+    return (int32_t)msg.Size();
 }
 
-// /aoo/sink/<id>/format <src> <version> <salt> <numchannels> <samplerate> <blocksize> <codec> <options...> [<userformat..>]
+// /aoo/sink/<id>/format <src> <version> <salt> <numchannels> <samplerate> <blocksize> <codec> <options...> [<userformat..>] [<prevsalt> <switchseq>]
 
 void endpoint::send_format(int32_t src, int32_t salt, const aoo_format& f,
-                            const char *options, int32_t size, const char * userformat, int32_t ufsize) const {
+                            const char *options, int32_t size, const char * userformat, int32_t ufsize,
+                            int32_t prevsalt, int32_t switchseq) const {
     // call without lock!
     LOG_DEBUG("send format to " << id << " (salt = " << salt << ")");
 
@@ -830,6 +963,15 @@ void endpoint::send_format(int32_t src, int32_t salt, const aoo_format& f,
 
     if (userformat && ufsize > 0) {
         msg << osc::Blob(userformat, ufsize);
+    } else if (switchseq >= 0) {
+        msg << osc::Blob(nullptr, 0); // placeholder
+    }
+
+    // format switch: the sink may keep its buffers and decode all blocks
+    // before 'switchseq' (sent with 'prevsalt') with the previous decoder.
+    // Older sinks simply ignore these arguments and start a new stream.
+    if (switchseq >= 0) {
+        msg << prevsalt << switchseq;
     }
 
     msg << osc::EndMessage;
@@ -839,7 +981,7 @@ void endpoint::send_format(int32_t src, int32_t salt, const aoo_format& f,
 
 // /aoo/sink/<id>/ping <src> <time>
 
-void endpoint::send_ping(int32_t src, time_tag t) const {
+int32_t endpoint::send_ping(int32_t src, time_tag t) const {
     // call without lock!
     LOG_DEBUG("send ping to " << id);
 
@@ -861,6 +1003,8 @@ void endpoint::send_ping(int32_t src, time_tag t) const {
     msg << src << osc::TimeTag(t.to_uint64()) << osc::EndMessage;
 
     send(msg.Data(), (int32_t)msg.Size());
+
+    return (int32_t)msg.Size();
 }
 
 /*///////////////////////// source ////////////////////////////////*/
@@ -876,8 +1020,64 @@ sink_desc * source::find_sink(void *endpoint, int32_t id){
     return nullptr;
 }
 
+// called with writer lock!
+sink_state * source::get_sink_state(void *endpoint, int32_t id){
+    for (auto& s : sinkstates_){
+        if (s->endpoint == endpoint && s->id == id){
+            return s.get();
+        }
+    }
+    // the sink might have been removed and added again
+    for (auto it = retired_states_.begin(); it != retired_states_.end(); ++it){
+        if ((*it)->endpoint == endpoint && (*it)->id == id){
+            sinkstates_.push_back(std::move(*it));
+            retired_states_.erase(it);
+            return sinkstates_.back().get();
+        }
+    }
+    sinkstates_.push_back(std::make_unique<sink_state>(endpoint, id));
+    return sinkstates_.back().get();
+}
+
+// called with writer lock!
+void source::retire_sink_state(sink_state *state){
+    for (auto it = sinkstates_.begin(); it != sinkstates_.end(); ++it){
+        if (it->get() == state){
+            retired_states_.push_back(std::move(*it));
+            sinkstates_.erase(it);
+            have_retired_states_.store(true);
+            return;
+        }
+    }
+}
+
+// Called on the send thread. The sink descriptors are only copied in send(),
+// so there can't be any references to the retired states at this point,
+// except for pending resend requests (see handle_data_request()).
+void source::free_sink_states(){
+    if (!have_retired_states_.exchange(false)){
+        return;
+    }
+    aoo::vector<std::unique_ptr<sink_state>> retired;
+    unique_lock lock(sink_mutex_); // writer lock!
+    retired.swap(retired_states_);
+    lock.unlock();
+    // discard pending resend requests because they might refer to
+    // a retired sink state. The sinks will simply ask again.
+    while (datarequestqueue_.read_available()){
+        data_request request;
+        datarequestqueue_.read(request);
+    }
+    // now free the states (and rings)
+}
+
 int32_t source::set_format(aoo_format &f){
     unique_lock lock(update_mutex_); // writer lock!
+    // remember the current format for switch_format()
+    int32_t nchannels = encoder_ ? encoder_->nchannels() : 0;
+    int32_t samplerate = encoder_ ? encoder_->samplerate() : 0;
+    int32_t blocksize = encoder_ ? encoder_->blocksize() : 0;
+
     if (!encoder_ || strcmp(encoder_->name(), f.codec)){
         auto codec = aoo::find_codec(f.codec);
         if (codec){
@@ -893,7 +1093,9 @@ int32_t source::set_format(aoo_format &f){
     }
     encoder_->set_format(f);
 
-    update();
+    if (!switch_format(nchannels, samplerate, blocksize)){
+        update();
+    }
 
     return 1;
 }
@@ -921,6 +1123,35 @@ int32_t source::set_userformat(void * ptr, int32_t size){
     return 1;
 }
 
+int32_t source::set_capture(const char *path){
+#if AOO_CAPTURE
+    std::unique_ptr<capture_writer> writer;
+    if (path){
+        capture_header info;
+        info.type = AOO_TYPE_SOURCE;
+        info.id = id();
+        info.samplerate = samplerate_;
+        info.blocksize = blocksize_;
+        info.nchannels = nchannels_;
+        info.buffersize = 0;
+        info.start = clock_.now().to_uint64();
+        writer = capture_writer::create(path, info);
+        if (!writer){
+            return 0;
+        }
+    }
+    {
+        scoped_lock<spinlock> lock(capture_lock_);
+        capture_.swap(writer);
+    }
+    // the previous capture (if any) is closed outside of the lock
+    return 1;
+#else
+    LOG_WARNING("aoo_source: capture not supported on this platform");
+    return 0;
+#endif
+}
+
 
 // always called with update_mutex_ locked!
 void source::update(){
@@ -931,6 +1162,12 @@ void source::update(){
 
     if (blocksize_ > 0){
         assert(samplerate_ > 0 && nchannels_ > 0);
+        // build the new state off the audio thread
+        auto state = std::make_unique<encoder_state>();
+        state->nchannels = nchannels_;
+        state->samplerate = samplerate_;
+        state->encoder_samplerate = encoder_->samplerate();
+        state->encoder_blocksize = encoder_->blocksize();
         // setup audio buffer
         auto nsamples = encoder_->blocksize() * nchannels_;
         double bufsize = (double)buffersize_ * encoder_->samplerate() * 0.001;
@@ -938,19 +1175,26 @@ void source::update(){
         auto d = div(bufsize, encoder_->blocksize());
         int32_t nbuffers = d.quot + (d.rem != 0); // round up
         nbuffers = std::max<int32_t>(nbuffers, 1); // need at least 1 buffer!
-        audioqueue_.resize(nbuffers * nsamples, nsamples);
-        srqueue_.resize(nbuffers, 1);
+        state->audioqueue.resize(nbuffers * nsamples, nsamples);
+        state->srqueue.resize(nbuffers, 1);
         LOG_DEBUG("aoo::source::update: id: " << id_ << " nbuffers = " << nbuffers << " dquot: " << d.quot << " drem: " << d.rem <<  " bufsize: " << bufsize << " bs: " << encoder_->blocksize() << " reqbufms: " << buffersize_);
 
         // resampler
        // if (blocksize_ != encoder_->blocksize() || samplerate_ != encoder_->samplerate()){
-            resampler_.setup(blocksize_, encoder_->blocksize(),
-                             samplerate_, encoder_->samplerate(), nchannels_);
-            resampler_.update(samplerate_, encoder_->samplerate());
+            state->resampler.setup(blocksize_, encoder_->blocksize(),
+                                   samplerate_, encoder_->samplerate(), nchannels_);
+            state->resampler.update(samplerate_, encoder_->samplerate());
         //} else {
         //    resampler_.clear();
         //}
 
+        // swap in the new state; the old one is retired and freed
+        // as soon as process() doesn't use it anymore.
+        state_.publish(std::move(state));
+
+        // preallocate the send buffer (see send_data())
+        sendbuffer_.reserve(sizeof(double) * encoder_->nchannels() * encoder_->blocksize());
+
         // history buffer
         update_historybuffer();
         
@@ -960,7 +1204,6 @@ void source::update(){
         // reset time DLL to be on the safe side
         timer_.reset();
         lastpingtime_ = -1000; // force first ping
-        lastplay_ = false;
         
         // Start new sequence and resend format.
         // We naturally want to do this when setting the format,
@@ -968,6 +1211,7 @@ void source::update(){
         // any timing gaps.
         salt_ = make_salt();
         sequence_ = 0;
+        switchseq_ = -1;
         dropped_ = 0;
         {
             shared_lock lock2(sink_mutex_);
@@ -980,6 +1224,37 @@ void source::update(){
     }
 }
 
+// always called with update_mutex_ locked!
+// Switch to the new encoder without starting a new stream, so that sinks
+// can keep their buffers and sequence numbers and crossfade between the
+// old and new decoder. Only possible while streaming and if the audio
+// buffers stay the same, otherwise we need a full update().
+bool source::switch_format(int32_t nchannels, int32_t samplerate, int32_t blocksize){
+    if (!encoder_ || !state_.get() || sequence_ == 0){
+        return false;
+    }
+    if (encoder_->nchannels() != nchannels || encoder_->samplerate() != samplerate
+            || encoder_->blocksize() != blocksize){
+        return false;
+    }
+    LOG_VERBOSE("aoo_source: switch format at block " << sequence_);
+    // the new format gets a new salt, so sinks which miss the format
+    // message will ask for it. The blocks in the history buffer
+    // can still be resent with the previous salt.
+    prevsalt_ = salt_;
+    salt_ = make_salt();
+    switchseq_ = sequence_;
+    {
+        shared_lock lock(sink_mutex_);
+        for (auto& sink : sinks_){
+            sink.format_changed = true;
+        }
+        // notify send_format()
+        format_changed_ = true;
+    }
+    return true;
+}
+
 void source::update_historybuffer(){
     if (samplerate_ > 0 && encoder_){
         double bufsize = (double)resend_buffersize_ * 0.001 * samplerate_;
@@ -1004,6 +1279,8 @@ bool source::send_format(){
     }
 
     int32_t salt = salt_;
+    int32_t prevsalt = prevsalt_;
+    int32_t switchseq = switchseq_;
 
     aoo_format fmt;
     char settings[AOO_CODEC_MAXSETTINGSIZE];
@@ -1021,7 +1298,7 @@ bool source::send_format(){
     if (format_changed){
         // only copy sinks which require a format update!
         shared_lock sinklock(sink_mutex_);
-        auto sinks = (aoo::sink_desc *)alloca((sinks_.size() + 1) * sizeof(aoo::endpoint)); // avoid alloca(0)
+        auto sinks = (aoo::endpoint *)alloca((sinks_.size() + 1) * sizeof(aoo::endpoint)); // avoid alloca(0)
         int numsinks = 0;
         for (auto& sink : sinks_){
             if (sink.format_changed.exchange(false)){
@@ -1033,7 +1310,9 @@ bool source::send_format(){
         // now we don't hold any lock!
 
         for (int i = 0; i < numsinks; ++i){
-            sinks[i].send_format(id(), salt, fmt, settings, size, userfmt, userfmtsize);
+            sinks[i].send_format(id(), salt, fmt, settings, size, userfmt, userfmtsize,
+                                 prevsalt, switchseq);
+            send_local_transport(sinks[i]);
         }
     }
 
@@ -1041,7 +1320,9 @@ bool source::send_format(){
         while (formatrequestqueue_.read_available()){
             endpoint ep;
             formatrequestqueue_.read(ep);
-            ep.send_format(id(), salt, fmt, settings, size, userfmt, userfmtsize);
+            ep.send_format(id(), salt, fmt, settings, size, userfmt, userfmtsize,
+                           prevsalt, switchseq);
+            send_local_transport(ep, true);
         }
     }
 
@@ -1062,8 +1343,14 @@ bool source::resend_data(){
 
         auto salt = salt_;
         if (salt != request.salt){
-            // outdated request
-            continue;
+            // blocks before a format switch can still be resent
+            if (switchseq_ >= 0 && request.salt == prevsalt_
+                    && request.sequence < switchseq_){
+                salt = prevsalt_;
+            } else {
+                // outdated request
+                continue;
+            }
         }
 
         auto block = history_.find(request.sequence);
@@ -1071,7 +1358,7 @@ bool source::resend_data(){
             aoo::data_packet d;
             d.sequence = block->sequence;
             d.samplerate = block->samplerate;
-            d.channel = block->channel;
+            d.channel = request.channel;
             d.totalsize = block->size();
             d.nframes = block->num_frames();
             // We use a buffer on the heap because blocks and even frames
@@ -1102,7 +1389,11 @@ bool source::resend_data(){
                     d.framenum = i;
                     d.data = frameptr[i];
                     d.size = framesize[i];
-                    request.send_data(id(), salt, d);
+                    auto n = request.send_data(id(), salt, d);
+                    if (request.stats){
+                        request.stats->add_packet_out(n);
+                        request.stats->add_resend_responses(1);
+                    }
                 }
             } else {
                 // Copy a single frame
@@ -1117,7 +1408,11 @@ bool source::resend_data(){
                     d.framenum = request.frame;
                     d.data = sendbuffer_.data();
                     d.size = size;
-                    request.send_data(id(), salt, d);
+                    auto n = request.send_data(id(), salt, d);
+                    if (request.stats){
+                        request.stats->add_packet_out(n);
+                        request.stats->add_resend_responses(1);
+                    }
                 } else {
                     LOG_ERROR("frame number " << request.frame << " out of range!");
                 }
@@ -1135,10 +1430,16 @@ bool source::resend_data(){
 }
 
 bool source::send_data(){
+    AOO_TRACE_SCOPE(trace, send_data, -1);
+
     shared_lock updatelock(update_mutex_); // reader lock!
-    if (!encoder_){
+    // NOTE: the state can't be replaced while we hold the reader lock
+    auto state = state_.get();
+    if (!encoder_ || !state){
         return 0;
     }
+    auto& audioqueue = state->audioqueue;
+    auto& srqueue = state->srqueue;
 
     data_packet d;
     int32_t salt = salt_;
@@ -1168,10 +1469,13 @@ bool source::send_data(){
 
         // send block to sinks
         for (int i = 0; i < numsinks; ++i){
-            sinks[i].send_data(id(), salt, d);            
+            if (!write_local(sinks[i], salt, d)){
+                auto n = sinks[i].send_data(id(), salt, d);
+                sinks[i].state->stats.add_packet_out(n);
+            }
         }
         --dropped_;
-    } else if (audioqueue_.read_available() && srqueue_.read_available()){
+    } else if (audioqueue.read_available() && srqueue.read_available()){
         // make local copy of sink descriptors
         shared_lock listlock(sink_mutex_);
         int32_t numsinks = (int32_t) sinks_.size();
@@ -1182,7 +1486,8 @@ bool source::send_data(){
         listlock.unlock();
 
         d.sequence = sequence_++;
-        srqueue_.read(d.samplerate); // always read samplerate from ringbuffer
+        AOO_TRACE_SEQUENCE(trace, d.sequence);
+        srqueue.read(d.samplerate); // always read samplerate from ringbuffer
 
         // for compact data sending purposes... only send rate when necessary
         bool sendrate = false;
@@ -1197,9 +1502,14 @@ bool source::send_data(){
             auto blocksize = encoder_->blocksize();
             sendbuffer_.resize(sizeof(double) * nchannels * blocksize); // overallocate
 
-            d.totalsize = encoder_->encode(audioqueue_.read_data(), audioqueue_.blocksize(),
-                                           sendbuffer_.data(), (int32_t) sendbuffer_.size());
-            audioqueue_.read_commit();
+            auto t1 = stream_stats::clock();
+            {
+                AOO_TRACE_SCOPE(trace2, encode, d.sequence);
+                d.totalsize = encoder_->encode(audioqueue.read_data(), audioqueue.blocksize(),
+                                               sendbuffer_.data(), (int32_t) sendbuffer_.size());
+            }
+            stats_.add_codec_time(stream_stats::clock() - t1);
+            audioqueue.read_commit();
 
             if (d.totalsize > 0){
                 // calculate number of frames
@@ -1216,6 +1526,16 @@ bool source::send_data(){
 
                 // from here on we don't hold any lock!
 
+                // sinks on the same machine get the whole block through their
+                // shared memory ring, all other sinks (or if the ring is full)
+                // get it over the network.
+                auto remote = (bool *)alloca(numsinks);
+                d.data = sendbuffer_.data();
+                d.size = d.totalsize;
+                for (int i = 0; i < numsinks; ++i){
+                    remote[i] = !write_local(sinks[i], salt, d);
+                }
+
                 // send a single frame to all sinks
                 // /AoO/<sink>/data <src> <salt> <seq> <sr> <channel_onset> <totalsize> <numpackets> <packetnum> <data>
                 auto dosend = [&](int32_t frame, const char* data, auto n){
@@ -1223,13 +1543,18 @@ bool source::send_data(){
                     d.data = data;
                     d.size = n;
                     for (int i = 0; i < numsinks; ++i){
+                        if (!remote[i]){
+                            continue;
+                        }
                         d.channel = sinks[i].channel;
                         // if the protocol_flags allow using the compact data message, use it if appropriate
+                        int32_t n;
                         if (d.nframes == 1 && d.channel == 0 && sinks[i].protocol_flags & AOO_PROTOCOL_FLAG_COMPACT_DATA) {
-                            sinks[i].send_data_compact(id(), salt, d, sendrate);                
+                            n = sinks[i].send_data_compact(id(), salt, d, sendrate);
                         } else {
-                            sinks[i].send_data(id(), salt, d);
+                            n = sinks[i].send_data(id(), salt, d);
                         }
+                        sinks[i].state->stats.add_packet_out(n);
                     }
                 };
 
@@ -1250,7 +1575,7 @@ bool source::send_data(){
             }
         } else {
             // drain buffer anyway
-            audioqueue_.read_commit();
+            audioqueue.read_commit();
         }
     } else {
         // LOG_DEBUG("couldn't send");       
@@ -1272,6 +1597,27 @@ bool source::send_data(){
     return 1;
 }
 
+// write a block to the sink's shared memory ring (if any).
+// returns false if the block has to be sent over the network.
+bool source::write_local(const sink_desc& sink, int32_t salt, const data_packet& d){
+#if AOO_LOCAL_TRANSPORT
+    if (sink.ring){
+        shm_block b;
+        b.salt = salt;
+        b.sequence = d.sequence;
+        b.samplerate = d.samplerate;
+        b.channel = sink.channel;
+        b.size = d.totalsize;
+        if (sink.ring->write(&b, sizeof(b), d.data, d.totalsize)){
+            sink.state->stats.add_packet_out(sizeof(b) + d.totalsize);
+            return true;
+        }
+        LOG_DEBUG("aoo_source: ring full, send block " << d.sequence << " over network");
+    }
+#endif
+    return false;
+}
+
 bool source::send_ping(){
     // if stream is stopped, the timer won't increment anyway
     auto elapsed = timer_.get_elapsed();
@@ -1288,7 +1634,14 @@ bool source::send_ping(){
         auto tt = timer_.get_absolute();
 
         for (int i = 0; i < numsinks; ++i){
-            sinks[i].send_ping(id(), tt);
+            auto n = sinks[i].send_ping(id(), tt);
+            sinks[i].state->stats.add_packet_out(n);
+        #if AOO_LOCAL_TRANSPORT
+            // the offer (or the answer) might have been lost
+            if (!sinks[i].ring && local_transport_.load()){
+                send_local_transport(sinks[i]);
+            }
+        #endif
         }
 
         lastpingtime_ = elapsed;
@@ -1339,18 +1692,21 @@ void source::handle_data_request(void *endpoint, aoo_replyfn fn,
     LOG_DEBUG("handle data request");
 
     // check if sink exists (not strictly necessary, but might help catch errors)
+    // NOTE: keep the lock while pushing the requests, so the sink state
+    // can't be retired in the meantime (see free_sink_states()).
     shared_lock lock(sink_mutex_); // reader lock!
     auto sink = find_sink(endpoint, id);
-    lock.unlock();
-
     if (sink){
+        auto stats = &sink->state->stats;
+        int32_t channel = sink->channel.load();
         // get pairs of [seq, frame]
         int npairs = (msg.ArgumentCount() - 2) / 2;
+        stats->add_resend_requests(npairs);
         while (npairs--){
             auto seq = (it++)->AsInt32();
             auto frame = (it++)->AsInt32();
             if (datarequestqueue_.write_available()){
-                datarequestqueue_.write(data_request{ endpoint, fn, id, salt, seq, frame });
+                datarequestqueue_.write(data_request{ endpoint, fn, id, salt, seq, frame, channel, stats });
             }
         }
     } else {
@@ -1429,6 +1785,11 @@ void source::handle_ping(void *endpoint, aoo_replyfn fn,
     // check if sink exists (not strictly necessary, but might help catch errors)
     shared_lock lock(sink_mutex_); // reader lock!
     auto sink = find_sink(endpoint, id);
+    if (sink){
+        // round trip time
+        time_tag tt3 = clock_.now();
+        sink->state->stats.add_latency(std::max<double>(0, time_tag::duration(tt1, tt3)));
+    }
     lock.unlock();
 
     if (sink){
@@ -1445,7 +1806,7 @@ void source::handle_ping(void *endpoint, aoo_replyfn fn,
         #if 0
             e.ping.tt3 = timer_.get_absolute().to_uint64(); // use last stream time
         #else
-            e.ping.tt3 = aoo_osctime_get(); // use real system time
+            e.ping.tt3 = clock_.now().to_uint64(); // use real (or user) time
         #endif
             eventqueue_.write(e);
         }
@@ -1498,6 +1859,10 @@ void source::handle_codec_change(void *endpoint, aoo_replyfn fn,
         { // only if the requesting sink exists we will respect this request
             LOG_DEBUG("handle codec change");
             unique_lock lock(update_mutex_); // writer lock!
+            // remember the current format for switch_format()
+            int32_t nchannels = encoder_ ? encoder_->nchannels() : 0;
+            int32_t samplerate = encoder_ ? encoder_->samplerate() : 0;
+            int32_t blocksize = encoder_ ? encoder_->blocksize() : 0;
             
             if (!encoder_ || strcmp(encoder_->name(), f.codec)){
                 auto codec = aoo::find_codec(f.codec);
@@ -1514,7 +1879,9 @@ void source::handle_codec_change(void *endpoint, aoo_replyfn fn,
             }
         
             encoder_->read_format(f, (const char *)settings, size);
-            update();
+            if (!switch_format(nchannels, samplerate, blocksize)){
+                update();
+            }
         }
                
         
@@ -1532,6 +1899,104 @@ void source::handle_codec_change(void *endpoint, aoo_replyfn fn,
     }
 }
 
+// /aoo/sink/<id>/shm <src> <name> <token>
+// Offer a shared memory ring to the sink; only sinks on the same machine
+// can open it and reply with the token (see handle_local_transport()).
+// Called after sending the format, so the sink knows the source.
 
+void source::send_local_transport(const endpoint& ep, bool requested){
+#if AOO_LOCAL_TRANSPORT
+    if (!local_transport_.load() || ep.id == AOO_ID_WILDCARD){
+        return; // a ring can only have a single reader
+    }
+
+    char name[AOO_SHM_MAXNAMELEN];
+    uint64_t token;
+    {
+        unique_lock lock(sink_mutex_); // writer lock!
+        auto sink = find_sink(ep.user, ep.id);
+        if (!sink || sink->id != ep.id){
+            return; // wildcard or not a sink of ours
+        }
+        auto state = sink->state;
+        if (!sink->ring){
+            // a format request means that the sink is (still) alive
+            if (requested){
+                state->offers = 0;
+            }
+            // if the sink doesn't answer, it is most likely on another
+            // machine, so we can free the ring. The ring is not in use,
+            // so there can't be any references to it (see write_local()).
+            if (state->offers >= AOO_SHM_MAXOFFERS){
+                if (state->ring){
+                    LOG_VERBOSE("aoo_source: sink " << ep.id
+                                << " doesn't use the local transport");
+                    state->ring.reset();
+                }
+                return;
+            }
+            state->offers++;
+        }
+        auto& ring = state->ring;
+        if (!ring){
+            ring = shm_ring::create(AOO_SHM_RINGSIZE);
+            if (!ring){
+                return;
+            }
+        }
+        snprintf(name, sizeof(name), "%s", ring->name());
+        token = ring->token();
+    }
+
+    LOG_DEBUG("offer local transport " << name << " to sink " << ep.id);
+
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+
+    const int32_t max_addr_size = AOO_MSG_DOMAIN_LEN
+            + AOO_MSG_SINK_LEN + 16 + AOO_MSG_SHM_LEN;
+    char address[max_addr_size];
+    snprintf(address, sizeof(address), "%s%s/%d%s",
+             AOO_MSG_DOMAIN, AOO_MSG_SINK, ep.id, AOO_MSG_SHM);
+
+    msg << osc::BeginMessage(address) << id() << name
+        << (osc::int64)token << osc::EndMessage;
+
+    ep.send(msg.Data(), (int32_t)msg.Size());
+#endif
+}
+
+// /aoo/src/<id>/shm <sink> <token>
+
+void source::handle_local_transport(void *endpoint,
+                                    const osc::ReceivedMessage& msg)
+{
+    auto it = msg.ArgumentsBegin();
+    auto id = (it++)->AsInt32();
+    auto token = (uint64_t)(it++)->AsInt64();
+
+    LOG_DEBUG("handle local transport");
+
+#if AOO_LOCAL_TRANSPORT
+    if (!local_transport_.load()){
+        return;
+    }
+    unique_lock lock(sink_mutex_); // writer lock!
+    auto sink = find_sink(endpoint, id);
+    if (sink && sink->id == id){
+        auto ring = sink->state->ring.get();
+        if (ring && ring->token() == token){
+            if (sink->ring != ring){
+                LOG_VERBOSE("aoo_source: use local transport for sink " << id);
+                sink->ring = ring;
+            }
+        } else {
+            LOG_WARNING("ignoring '" << AOO_MSG_SHM << "' message: unknown token");
+        }
+    } else {
+        LOG_VERBOSE("ignoring '" << AOO_MSG_SHM << "' message: sink not found");
+    }
+#endif
+}
 
 } // aoo
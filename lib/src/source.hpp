@@ -11,6 +11,9 @@
 #include "common.hpp"
 #include "lockfree.hpp"
 #include "time_dll.hpp"
+#include "shm.hpp"
+#include "trace.hpp"
+#include "capture.hpp"
 
 #include "oscpack/osc/OscOutboundPacketStream.h"
 #include "oscpack/osc/OscReceivedElements.h"
@@ -28,13 +31,15 @@ struct endpoint {
     int32_t id = 0;
     
     // methods
-    void send_data(int32_t src, int32_t salt, const data_packet& data) const;
-    void send_data_compact(int32_t src, int32_t salt, const data_packet& data, bool sendrate=false);
+    // the send methods return the message size
+    int32_t send_data(int32_t src, int32_t salt, const data_packet& data) const;
+    int32_t send_data_compact(int32_t src, int32_t salt, const data_packet& data, bool sendrate=false);
 
     void send_format(int32_t src, int32_t salt, const aoo_format& f,
-                     const char *options, int32_t size, const char * userformat = nullptr, int32_t ufsize=0) const;
+                     const char *options, int32_t size, const char * userformat = nullptr, int32_t ufsize=0,
+                     int32_t prevsalt = 0, int32_t switchseq = -1) const;
 
-    void send_ping(int32_t src, time_tag t) const;
+    int32_t send_ping(int32_t src, time_tag t) const;
 
     void send(const char *data, int32_t n) const {
         fn(user, data, n);
@@ -46,12 +51,18 @@ struct endpoint {
 struct data_request : endpoint {
     data_request() = default;
     data_request(void *_user, aoo_replyfn _fn, int32_t _id,
-                 int32_t _salt, int32_t _sequence, int32_t _frame)
+                 int32_t _salt, int32_t _sequence, int32_t _frame,
+                 int32_t _channel, stream_stats *_stats = nullptr)
         : endpoint(_user, _fn, _id),
-          salt(_salt), sequence(_sequence), frame(_frame){}
+          salt(_salt), sequence(_sequence), frame(_frame),
+          channel(_channel), stats(_stats){}
     int32_t salt = 0;
     int32_t sequence = 0;
     int32_t frame = 0;
+    // the history is shared by all sinks, so we have to
+    // remember the channel onset of the requesting sink.
+    int32_t channel = 0;
+    stream_stats *stats = nullptr;
 };
 
 struct invite_request : endpoint {
@@ -66,6 +77,24 @@ struct invite_request : endpoint {
     int32_t type = 0;
 };
 
+// Per-sink data which must outlive the sink descriptor, because the
+// send thread works on a copy of the sink list. When the sink is removed,
+// the state is retired and only freed at the beginning of the next
+// source::send() call; it is reused if the same sink is added again before.
+struct sink_state : memory_object {
+    sink_state(void *_endpoint, int32_t _id)
+        : endpoint(_endpoint), id(_id){}
+
+    void * const endpoint;
+    const int32_t id;
+    stream_stats stats;
+#if AOO_LOCAL_TRANSPORT
+    // created on demand, see source::send_local_transport()
+    std::unique_ptr<shm_ring> ring;
+    int32_t offers = 0; // number of unanswered offers
+#endif
+};
+
 struct sink_desc : endpoint {
     sink_desc(void *_user, aoo_replyfn _fn, int32_t _id)
         : endpoint(_user, _fn, _id), channel(0), format_changed(true), protocol_flags(0) {}
@@ -73,7 +102,8 @@ struct sink_desc : endpoint {
         : endpoint(other.user, other.fn, other.id),
           channel(other.channel.load()),
           format_changed(other.format_changed.load()),
-          protocol_flags(other.protocol_flags.load()){}
+          protocol_flags(other.protocol_flags.load()),
+          state(other.state), ring(other.ring){}
     sink_desc& operator=(const sink_desc& other){
         user = other.user;
         fn = other.fn;
@@ -81,6 +111,8 @@ struct sink_desc : endpoint {
         channel = other.channel.load();
         format_changed = other.format_changed.load();
         protocol_flags = other.protocol_flags.load();
+        state = other.state;
+        ring = other.ring;
         return *this;
     }
 
@@ -88,10 +120,14 @@ struct sink_desc : endpoint {
     std::atomic<int16_t> channel;
     std::atomic<bool> format_changed;
     std::atomic<int8_t> protocol_flags;
+    // owned by the source (see source::sinkstates_)
+    sink_state *state = nullptr;
+    // local transport; only set after the sink has acknowledged the ring.
+    shm_ring *ring = nullptr;
 
 };
 
-class source final : public isource {
+class source final : public isource, public memory_object {
  public:
     typedef union event
     {
@@ -146,7 +182,10 @@ class source final : public isource {
     // audio encoder
     std::unique_ptr<encoder> encoder_;
     // state
-    int32_t sequence_ = 0;
+    std::atomic<int32_t> sequence_{0};
+    // format switch: blocks before 'switchseq_' belong to 'prevsalt_'
+    int32_t prevsalt_ = 0;
+    int32_t switchseq_ = -1;
     std::atomic<int32_t> dropped_{0};
     std::atomic<float> lastpingtime_{0};
     std::atomic<bool> format_changed_{false};
@@ -155,16 +194,33 @@ class source final : public isource {
     time_dll dll_;
     timer timer_;
     // buffers and queues
-    std::vector<char> sendbuffer_;
-    dynamic_resampler resampler_;
-    lockfree::queue<aoo_sample> audioqueue_;
-    lockfree::queue<double> srqueue_;
+    aoo::vector<char> sendbuffer_;
+    // everything process() needs is kept in a separate state object
+    // which update() rebuilds and swaps in, so the audio thread never
+    // has to wait for a format change.
+    struct encoder_state : memory_object {
+        int32_t nchannels = 0;
+        int32_t samplerate = 0;
+        int32_t encoder_samplerate = 0;
+        int32_t encoder_blocksize = 0;
+        bool lastplay = false; // only touched by process()
+        dynamic_resampler resampler;
+        lockfree::queue<aoo_sample> audioqueue;
+        lockfree::queue<double> srqueue;
+    };
+    lockfree::rcu_ptr<encoder_state> state_;
     lockfree::queue<event> eventqueue_;
     lockfree::queue<endpoint> formatrequestqueue_;
     lockfree::queue<data_request> datarequestqueue_;
     history_buffer history_;
     // sinks
-    std::vector<sink_desc> sinks_;
+    aoo::vector<sink_desc> sinks_;
+    // (protected by sink_mutex_)
+    aoo::vector<std::unique_ptr<sink_state>> sinkstates_;
+    aoo::vector<std::unique_ptr<sink_state>> retired_states_;
+    std::atomic<bool> have_retired_states_{false};
+    // source statistics which are shared by all sinks
+    stream_stats stats_;
     // thread synchronization
     aoo::shared_mutex update_mutex_;
     aoo::shared_mutex sink_mutex_;
@@ -178,24 +234,39 @@ class source final : public isource {
     std::atomic<float> ping_interval_{ AOO_PING_INTERVAL * 0.001 };
     std::atomic<int32_t> protocol_flags_{ 0 };
     std::atomic<int32_t> respect_codec_change_req_{ 0 };
-    std::vector<char> userformat_;
+    std::atomic<int32_t> local_transport_{ 0 };
+    clock_source clock_;
+#if AOO_CAPTURE
+    std::unique_ptr<capture_writer> capture_;
+    spinlock capture_lock_;
+#endif
+    aoo::vector<char> userformat_;
     // runtime
     double prev_sent_samplerate_ = 0.0;
     std::atomic<int32_t> activeplay_ { 0 };
     std::atomic<int32_t> flushingout_ { 0 };
-    bool lastplay_ = false;
     int32_t pushing_silent_frames_ = 0;
     
     // helper methods
     sink_desc * find_sink(void *endpoint, int32_t id);
 
+    sink_state * get_sink_state(void *endpoint, int32_t id);
+
+    void retire_sink_state(sink_state *state);
+
+    void free_sink_states();
+
     int32_t set_format(aoo_format& f);
     int32_t set_userformat(void * ptr, int32_t size);
 
+    int32_t set_capture(const char *path);
+
     int32_t make_salt();
 
     void update();
 
+    bool switch_format(int32_t nchannels, int32_t samplerate, int32_t blocksize);
+
     void update_historybuffer();
 
     bool send_format();
@@ -206,6 +277,10 @@ class source final : public isource {
 
     bool send_ping();
 
+    void send_local_transport(const endpoint& ep, bool requested = false);
+
+    bool write_local(const sink_desc& sink, int32_t salt, const data_packet& d);
+
     void handle_format_request(void *endpoint, aoo_replyfn fn,
                                const osc::ReceivedMessage& msg);
 
@@ -223,6 +298,9 @@ class source final : public isource {
     
     void handle_codec_change(void *endpoint, aoo_replyfn fn,
                                const osc::ReceivedMessage& msg);
+
+    void handle_local_transport(void *endpoint,
+                                const osc::ReceivedMessage& msg);
 };
 
 } // aoo
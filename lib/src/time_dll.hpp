@@ -53,6 +53,10 @@ public:
     double samplerate() const {
         return nper_ / period();
     }
+    // most recent loop error in seconds
+    double error() const {
+        return e_;
+    }
 private:
     double b_ = 0;
     double c_ = 0;
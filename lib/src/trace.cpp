@@ -0,0 +1,168 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#include "trace.hpp"
+
+#include "aoo/aoo_utils.hpp"
+
+#include <stdio.h>
+#include <chrono>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+namespace aoo {
+
+const char * trace_stage_name(trace_stage stage){
+    switch (stage){
+    case trace_stage::source_process:
+        return "source_process";
+    case trace_stage::encode:
+        return "encode";
+    case trace_stage::send_data:
+        return "send_data";
+    case trace_stage::receive:
+        return "receive";
+    case trace_stage::decode:
+        return "decode";
+    case trace_stage::sink_process:
+        return "sink_process";
+    default:
+        return "unknown";
+    }
+}
+
+#if AOO_TRACE
+
+// all thread rings; they are preallocated, so that recording never
+// allocates memory, and never freed, so that aoo_trace_dump() can
+// safely read the events of threads which have already finished.
+static trace_ring g_trace_rings[AOO_TRACE_MAXTHREADS];
+static std::atomic<int32_t> g_trace_numrings{0};
+// events before this time are ignored (see aoo_trace_clear())
+static std::atomic<uint64_t> g_trace_start{0};
+
+uint64_t trace_time(){
+    using namespace std::chrono;
+    return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_init(){
+    // touch all pages, so the audio thread doesn't page fault
+    for (auto& ring : g_trace_rings){
+        memset(ring.events, 0, sizeof(ring.events));
+    }
+}
+
+// returns nullptr if all rings are taken
+static trace_ring * get_trace_ring(){
+    thread_local trace_ring *ring = nullptr;
+    thread_local bool init = false;
+    if (!init){
+        auto index = g_trace_numrings.fetch_add(1);
+        if (index < AOO_TRACE_MAXTHREADS){
+            ring = &g_trace_rings[index];
+        } else {
+            LOG_WARNING("aoo_trace: too many threads (see AOO_TRACE_MAXTHREADS)");
+        }
+        init = true;
+    }
+    return ring;
+}
+
+void trace_record(trace_stage stage, int32_t sequence,
+                  uint64_t time, uint64_t duration){
+    auto ring = get_trace_ring();
+    if (!ring){
+        return;
+    }
+    auto head = ring->head.load(std::memory_order_relaxed);
+    auto& e = ring->events[head % AOO_TRACE_RINGSIZE];
+    e.time = time;
+    e.duration = duration;
+    e.sequence = sequence;
+    e.stage = stage;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+// copy the valid events of a ring; events which might have been
+// overwritten while copying are discarded.
+static void read_trace_ring(trace_ring& ring, std::vector<trace_event>& events){
+    auto head = ring.head.load(std::memory_order_acquire);
+    auto n = std::min<uint64_t>(head, AOO_TRACE_RINGSIZE);
+    auto onset = events.size();
+    for (auto i = head - n; i < head; ++i){
+        events.push_back(ring.events[i % AOO_TRACE_RINGSIZE]);
+    }
+    // the writer might be in the middle of writing the slot of 'newhead',
+    // so only the events from 'newhead - AOO_TRACE_RINGSIZE + 1' are valid.
+    auto newhead = ring.head.load(std::memory_order_acquire);
+    auto first = head - n;
+    auto valid = newhead + 1 > AOO_TRACE_RINGSIZE ?
+                newhead + 1 - AOO_TRACE_RINGSIZE : 0;
+    auto overwritten = valid > first ? std::min<uint64_t>(n, valid - first) : 0;
+    events.erase(events.begin() + onset, events.begin() + onset + overwritten);
+}
+
+#endif // AOO_TRACE
+
+} // aoo
+
+int32_t aoo_trace_dump(const char *path){
+#if AOO_TRACE
+    auto fp = fopen(path, "w");
+    if (!fp){
+        LOG_ERROR("aoo_trace_dump: couldn't open " << path);
+        return 0;
+    }
+
+    auto numrings = std::min<int32_t>(aoo::g_trace_numrings.load(),
+                                      AOO_TRACE_MAXTHREADS);
+    auto start = aoo::g_trace_start.load();
+
+    // Chrome trace event format; timestamps are in microseconds.
+    fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    bool first = true;
+    std::vector<aoo::trace_event> events;
+    for (int i = 0; i < numrings; ++i){
+        auto ring = &aoo::g_trace_rings[i];
+        auto id = i + 1;
+        events.clear();
+        aoo::read_trace_ring(*ring, events);
+
+        fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                "\"args\":{\"name\":\"thread %d\"}}", first ? "" : ",\n",
+                id, id);
+        first = false;
+
+        for (auto& e : events){
+            if (e.time < start){
+                continue;
+            }
+            fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"aoo\",\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f,", aoo::trace_stage_name(e.stage), id,
+                    (double)(e.time - start) * 0.001);
+            if (e.duration > 0){
+                fprintf(fp, "\"ph\":\"X\",\"dur\":%.3f,", (double)e.duration * 0.001);
+            } else {
+                fprintf(fp, "\"ph\":\"i\",\"s\":\"t\",");
+            }
+            fprintf(fp, "\"args\":{\"seq\":%d}}", e.sequence);
+        }
+    }
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+    return 1;
+#else
+    (void)path;
+    LOG_WARNING("aoo_trace_dump: tracing not enabled (compile with AOO_TRACE=1)");
+    return 0;
+#endif
+}
+
+void aoo_trace_clear(void){
+#if AOO_TRACE
+    aoo::g_trace_start.store(aoo::trace_time());
+#endif
+}
@@ -0,0 +1,101 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+#pragma once
+
+#include "aoo/aoo.h"
+
+#include <stdint.h>
+#include <atomic>
+
+// pipeline tracing (see aoo_trace_dump()); off by default.
+#ifndef AOO_TRACE
+#define AOO_TRACE 0
+#endif
+
+// number of events per thread
+#ifndef AOO_TRACE_RINGSIZE
+#define AOO_TRACE_RINGSIZE 16384
+#endif
+
+// max. number of traced threads; the rings are preallocated,
+// events of any further threads are ignored.
+#ifndef AOO_TRACE_MAXTHREADS
+#define AOO_TRACE_MAXTHREADS 16
+#endif
+
+namespace aoo {
+
+/*///////////////////////// tracing /////////////////////////*/
+
+enum class trace_stage : int32_t {
+    source_process,
+    encode,
+    send_data,
+    receive,
+    decode,
+    sink_process
+};
+
+const char * trace_stage_name(trace_stage stage);
+
+#if AOO_TRACE
+
+struct trace_event {
+    uint64_t time;     // start time in nanoseconds
+    uint64_t duration; // 0: instant event
+    int32_t sequence;  // block sequence number (-1: unknown)
+    trace_stage stage;
+};
+
+// A per-thread ring buffer. Only the owning thread writes;
+// aoo_trace_dump() reads from any thread.
+struct trace_ring {
+    std::atomic<uint64_t> head{0};
+    trace_event events[AOO_TRACE_RINGSIZE];
+};
+
+uint64_t trace_time();
+
+// prefault the preallocated rings (called in aoo_initialize())
+void trace_init();
+
+// record an event on the current thread
+// (the first call on a thread takes a free ring, but never blocks)
+void trace_record(trace_stage stage, int32_t sequence,
+                  uint64_t time, uint64_t duration);
+
+// record the duration of a scope
+class trace_scope {
+public:
+    trace_scope(trace_stage stage, int32_t sequence = -1)
+        : stage_(stage), sequence_(sequence), start_(trace_time()){}
+    ~trace_scope(){
+        trace_record(stage_, sequence_, start_, trace_time() - start_);
+    }
+    trace_scope(const trace_scope&) = delete;
+    trace_scope& operator=(const trace_scope&) = delete;
+
+    void set_sequence(int32_t sequence){ sequence_ = sequence; }
+private:
+    trace_stage stage_;
+    int32_t sequence_;
+    uint64_t start_;
+};
+
+#define AOO_TRACE_SCOPE(name, stage, seq) \
+    aoo::trace_scope name(aoo::trace_stage::stage, seq)
+#define AOO_TRACE_SEQUENCE(name, seq) name.set_sequence(seq)
+#define AOO_TRACE_EVENT(stage, seq) \
+    aoo::trace_record(aoo::trace_stage::stage, seq, aoo::trace_time(), 0)
+
+#else
+
+#define AOO_TRACE_SCOPE(name, stage, seq)
+#define AOO_TRACE_SEQUENCE(name, seq)
+#define AOO_TRACE_EVENT(stage, seq)
+
+#endif // AOO_TRACE
+
+} // aoo
@@ -202,6 +202,27 @@ static void aoo_client_group_join(t_aoo_client *x, t_symbol *group, t_symbol *pw
     }
 }
 
+static void aoo_client_group_join_partial(t_aoo_client *x, t_symbol *group, t_symbol *pwd)
+{
+    if (x->x_client){
+        aoonet_client_group_join_partial(x->x_client, group->s_name, pwd->s_name);
+    }
+}
+
+static void aoo_client_peer_subscribe(t_aoo_client *x, t_symbol *group, t_symbol *user)
+{
+    if (x->x_client){
+        aoonet_client_peer_subscribe(x->x_client, group->s_name, user->s_name);
+    }
+}
+
+static void aoo_client_peer_unsubscribe(t_aoo_client *x, t_symbol *group, t_symbol *user)
+{
+    if (x->x_client){
+        aoonet_client_peer_unsubscribe(x->x_client, group->s_name, user->s_name);
+    }
+}
+
 static void aoo_client_group_leave(t_aoo_client *x, t_symbol *s)
 {
     if (x->x_client){
@@ -264,6 +285,12 @@ void aoo_client_setup(void)
                     gensym("disconnect"), A_NULL);
     class_addmethod(aoo_client_class, (t_method)aoo_client_group_join,
                     gensym("group_join"), A_SYMBOL, A_SYMBOL, A_NULL);
+    class_addmethod(aoo_client_class, (t_method)aoo_client_group_join_partial,
+                    gensym("group_join_partial"), A_SYMBOL, A_SYMBOL, A_NULL);
+    class_addmethod(aoo_client_class, (t_method)aoo_client_peer_subscribe,
+                    gensym("peer_subscribe"), A_SYMBOL, A_SYMBOL, A_NULL);
+    class_addmethod(aoo_client_class, (t_method)aoo_client_peer_unsubscribe,
+                    gensym("peer_unsubscribe"), A_SYMBOL, A_SYMBOL, A_NULL);
     class_addmethod(aoo_client_class, (t_method)aoo_client_group_leave,
                     gensym("group_leave"), A_SYMBOL, A_NULL);
 }
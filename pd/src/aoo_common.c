@@ -410,3 +410,45 @@ int aoo_format_toatoms(const aoo_format *f, int argc, t_atom *argv)
     }
     return 0;
 }
+
+/*/////////////////////////// aoo_blob ///////////////////////////////////////*/
+
+void aoo_blob_pack(const char *data, int32_t n, t_atom *argv)
+{
+    const unsigned char *b = (const unsigned char *)data;
+    SETFLOAT(argv, n);
+    int i = 0, k = 1;
+    for (; i + 3 <= n; i += 3, k++){
+        SETFLOAT(argv + k, (b[i] << 16) | (b[i + 1] << 8) | b[i + 2]);
+    }
+    // remaining bytes, padded with zeros
+    if (i < n){
+        int32_t word = b[i] << 16;
+        if (i + 1 < n){
+            word |= b[i + 1] << 8;
+        }
+        SETFLOAT(argv + k, word);
+    }
+}
+
+int32_t aoo_blob_unpack(int argc, const t_atom *argv, char *buf, int32_t size)
+{
+    if (argc < 1){
+        return -1;
+    }
+    int32_t n = atom_getfloat(argv);
+    if (n < 0 || n > size || argc < AOO_BLOB_NUMATOMS(n)){
+        return -1;
+    }
+    for (int i = 0; i < n; i += 3){
+        int32_t word = atom_getfloat(argv + 1 + i / 3);
+        buf[i] = (word >> 16) & 0xff;
+        if (i + 1 < n){
+            buf[i + 1] = (word >> 8) & 0xff;
+        }
+        if (i + 2 < n){
+            buf[i + 2] = word & 0xff;
+        }
+    }
+    return n;
+}
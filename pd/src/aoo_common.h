@@ -100,3 +100,18 @@ void aoo_format_makedefault(aoo_format_storage *f, int nchannels);
 int aoo_format_parse(void *x, aoo_format_storage *f, int argc, t_atom *argv);
 
 int aoo_format_toatoms(const aoo_format *f, int argc, t_atom *argv);
+
+/*///////////////////////////// aoo_blob /////////////////////////////*/
+
+// aoo_pack~ and aoo_unpack~ can exchange packets either as a list
+// with one float atom per byte or as a 'blob' message: the number of
+// bytes followed by the data packed into 24-bit words (which can be
+// represented exactly by a single precision float).
+
+// number of atoms needed for a blob of the given size
+#define AOO_BLOB_NUMATOMS(n) (1 + ((n) + 2) / 3)
+
+void aoo_blob_pack(const char *data, int32_t n, t_atom *argv);
+
+// returns the number of bytes or -1 on error
+int32_t aoo_blob_unpack(int argc, const t_atom *argv, char *buf, int32_t size);
@@ -248,6 +248,8 @@ t_endpoint * endpoint_new(void *owner, const struct sockaddr_storage *sa, sockle
         memcpy(&e->addr, sa, len);
         e->addrlen = len;
         e->next = 0;
+        e->retired = 0;
+        e->idle = 0;
     }
     return e;
 }
@@ -260,6 +262,7 @@ void endpoint_free(t_endpoint *e)
 int endpoint_send(t_endpoint *e, const char *data, int size)
 {
     int socket = *((int *)e->owner);
+    endpoint_touch(e);
     int result = sendto(socket, data, size, 0,
                        (const struct sockaddr *)&e->addr, e->addrlen);
     if (result < 0){
@@ -302,6 +305,19 @@ int endpoint_match(t_endpoint *e, const struct sockaddr_storage *sa)
     }
 }
 
+uint32_t endpoint_hash(const struct sockaddr_storage *sa)
+{
+    // LATER add IPv6 support
+    if (sa->ss_family == AF_INET){
+        const struct sockaddr_in *a = (const struct sockaddr_in *)sa;
+        uint32_t h = (uint32_t)a->sin_addr.s_addr * 2654435761u;
+        h ^= (uint32_t)a->sin_port * 40503u;
+        return h ^ (h >> 16);
+    } else {
+        return 0;
+    }
+}
+
 t_endpoint * endpoint_find(t_endpoint *e, const struct sockaddr_storage *sa)
 {
     for (t_endpoint *ep = e; ep; ep = ep->next){
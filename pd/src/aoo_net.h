@@ -13,6 +13,8 @@ typedef int socklen_t;
 
 #include "m_pd.h"
 
+#include <stdint.h>
+
 int socket_udp(void);
 
 int socket_close(int socket);
@@ -42,14 +44,41 @@ void socket_error_print(const char *label);
 
 int sockaddr_to_atoms(const struct sockaddr *sa, socklen_t len, t_atom *a);
 
-// use linked list for persistent memory
+// endpoints are persistent: objects (and the AOO library)
+// hold on to them, so they are only freed together with their node.
 typedef struct _endpoint {
     void *owner;
     struct sockaddr_storage addr;
     socklen_t addrlen;
-    struct _endpoint *next;
+    struct _endpoint *next; // hash chain
+    struct _endpoint *retired; // list of expired endpoints
+    long idle; // atomic, see endpoint_touch()
 } t_endpoint;
 
+// 'idle' is reset by the threads which send to or receive from the
+// endpoint and incremented by the expiry in the node's send loop.
+#ifdef _MSC_VER
+ #define atomic_load_long(p) \
+    InterlockedCompareExchange((volatile long *)(p), 0, 0)
+ #define atomic_store_long(p, v) \
+    InterlockedExchange((volatile long *)(p), (v))
+ #define atomic_fetch_add_long(p, v) \
+    InterlockedExchangeAdd((volatile long *)(p), (v))
+#else
+ #define atomic_load_long(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+ #define atomic_store_long(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+ #define atomic_fetch_add_long(p, v) __atomic_fetch_add((p), (v), __ATOMIC_RELAXED)
+#endif
+
+// mark the endpoint as used; only writes if the expiry has counted it,
+// so busy endpoints don't bounce the cache line between threads.
+static inline void endpoint_touch(t_endpoint *e)
+{
+    if (atomic_load_long(&e->idle) != 0){
+        atomic_store_long(&e->idle, 0);
+    }
+}
+
 t_endpoint * endpoint_new(void *owner, const struct sockaddr_storage *sa, socklen_t len);
 
 void endpoint_free(t_endpoint *e);
@@ -61,3 +90,5 @@ int endpoint_getaddress(const t_endpoint *e, t_symbol **hostname, int *port);
 t_endpoint * endpoint_find(t_endpoint *e, const struct sockaddr_storage *sa);
 
 int endpoint_match(t_endpoint *e, const struct sockaddr_storage *sa);
+
+uint32_t endpoint_hash(const struct sockaddr_storage *sa);
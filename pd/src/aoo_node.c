@@ -6,6 +6,7 @@
 #include "aoo/aoo_net.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
@@ -14,13 +15,52 @@
  #define AOO_NODE_POLL 0
 #endif
 
-#if AOO_NODE_POLL
- #ifdef _WIN32
-  #include <winsock2.h>
- #else
-  #include <sys/poll.h>
+// the poll thread needs to wait on the socket and the wakeup event
+// at the same time, which we can't do with poll() on Windows.
+#if AOO_NODE_POLL && defined(_WIN32)
+ #undef AOO_NODE_POLL
+ #define AOO_NODE_POLL 0
+#endif
+
+// run the network threads with real-time scheduling and the given
+// priority (0 = lower the thread priority instead)
+#ifndef AOO_NODE_RT_PRIORITY
+ #define AOO_NODE_RT_PRIORITY 0
+#endif
+
+#ifdef _WIN32
+ #include <winsock2.h>
+ #include <windows.h>
+#else
+ #include <sys/poll.h>
+ #include <unistd.h>
+ #include <fcntl.h>
+ #ifdef __linux__
+  #include <sys/eventfd.h>
  #endif
-#endif // AOO_NODE_POLL
+#endif
+
+// number of buckets in the endpoint hash table (power of 2)
+#ifndef AOO_NODE_ENDPOINT_BUCKETS
+ #define AOO_NODE_ENDPOINT_BUCKETS 256
+#endif
+
+// interval (in seconds) for expiring idle endpoints
+#ifndef AOO_NODE_ENDPOINT_EXPIRE
+ #define AOO_NODE_ENDPOINT_EXPIRE 30
+#endif
+
+// Endpoint lookups don't take a lock, so we need
+// atomic pointer loads/stores for the hash chains.
+#ifdef _MSC_VER
+ #define atomic_load_ptr(p) \
+    InterlockedCompareExchangePointer((void * volatile *)(p), 0, 0)
+ #define atomic_store_ptr(p, v) \
+    InterlockedExchangePointer((void * volatile *)(p), (v))
+#else
+ #define atomic_load_ptr(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+ #define atomic_store_ptr(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#endif
 
 // aoo_receive
 
@@ -69,6 +109,35 @@ static void lower_thread_priority(void)
 #endif
 }
 
+static void set_thread_priority(void)
+{
+#if AOO_NODE_RT_PRIORITY > 0
+    // real-time scheduling, so that outgoing packets don't have to
+    // wait for other threads once the DSP thread has woken us up.
+ #ifdef _WIN32
+    if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL)){
+        fprintf(stderr, "aoo_node: couldn't set thread priority (%d)\n",
+                (int)GetLastError());
+        fflush(stderr);
+    }
+ #else
+    struct sched_param param;
+    int max = sched_get_priority_max(SCHED_FIFO);
+    param.sched_priority = AOO_NODE_RT_PRIORITY > max ? max : AOO_NODE_RT_PRIORITY;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0){
+        // typically EPERM if we don't have real-time privileges
+        fprintf(stderr, "aoo_node: couldn't set real-time priority: %s\n",
+                strerror(err));
+        fflush(stderr);
+        lower_thread_priority();
+    }
+ #endif
+#else
+    lower_thread_priority();
+#endif
+}
+
 /*////////////////////// aoo node //////////////////*/
 
 static t_class *aoo_node_class;
@@ -79,6 +148,13 @@ typedef struct _client
     int32_t c_id;
 } t_client;
 
+// routing table entry
+typedef struct _route
+{
+    int32_t r_id;
+    t_pd *r_obj;
+} t_route;
+
 typedef struct _peer
 {
     t_symbol *group;
@@ -94,13 +170,23 @@ typedef struct _aoo_node
     t_client *x_clients;
     int x_numclients; // doubles as refcount
     aoo_lock x_clientlock;
+    // routing tables (sorted by ID), rebuilt whenever a client is added or removed
+    t_route *x_receivers;
+    int x_numreceivers;
+    t_route *x_senders;
+    int x_numsenders;
+    t_aoo_client *x_client;
     // peers
     t_peer *x_peers;
     int x_numpeers;
     // socket
     int x_socket;
     int x_port;
-    t_endpoint *x_endpoints;
+    // endpoint hash table; lookups are lock-free, insertion
+    // and expiry are synchronized with x_endpointlock.
+    t_endpoint *x_endpoints[AOO_NODE_ENDPOINT_BUCKETS];
+    t_endpoint *x_retired;
+    uint64_t x_lastexpire;
     pthread_mutex_t x_endpointlock;
     // threading
 #if AOO_NODE_POLL
@@ -108,27 +194,183 @@ typedef struct _aoo_node
 #else
     pthread_t x_sendthread;
     pthread_t x_receivethread;
-    pthread_mutex_t x_mutex;
-    pthread_cond_t x_condition;
+#endif
+    // send thread wakeup: unlike a condition variable, it can't
+    // lose a notification while the send thread is busy.
+#ifdef _WIN32
+    HANDLE x_event;
+#else
+    int x_eventfd[2]; // eventfd (Linux) or pipe
 #endif
     int x_quit; // should be atomic, but works anyway
 } t_aoo_node;
 
+static t_endpoint * aoo_node_lookup_endpoint(t_aoo_node *x, int index,
+                                             const struct sockaddr_storage *sa)
+{
+    t_endpoint *e = (t_endpoint *)atomic_load_ptr(&x->x_endpoints[index]);
+    for (; e; e = (t_endpoint *)atomic_load_ptr(&e->next)){
+        if (endpoint_match(e, sa)){
+            return e;
+        }
+    }
+    return 0;
+}
+
+// find or add an endpoint (threadsafe)
 t_endpoint * aoo_node_endpoint(t_aoo_node *x,
                                const struct sockaddr_storage *sa, socklen_t len)
 {
-    pthread_mutex_lock(&x->x_endpointlock);
-    t_endpoint *ep = endpoint_find(x->x_endpoints, sa);
+    int index = endpoint_hash(sa) & (AOO_NODE_ENDPOINT_BUCKETS - 1);
+    t_endpoint *ep = aoo_node_lookup_endpoint(x, index, sa);
     if (!ep){
-        // add endpoint
-        ep = endpoint_new(&x->x_socket, sa, len);
-        ep->next = x->x_endpoints;
-        x->x_endpoints = ep;
+        pthread_mutex_lock(&x->x_endpointlock);
+        // check again, another thread might have added it in the meantime
+        ep = aoo_node_lookup_endpoint(x, index, sa);
+        if (!ep){
+            // Objects (and the AOO library) might still refer to an expired
+            // endpoint, so we bring it back instead of creating a new one.
+            t_endpoint **link = &x->x_retired;
+            for (; *link; link = &(*link)->retired){
+                if (endpoint_match(*link, sa)){
+                    ep = *link;
+                    *link = ep->retired;
+                    ep->retired = 0;
+                    break;
+                }
+            }
+            if (!ep){
+                ep = endpoint_new(&x->x_socket, sa, len);
+            }
+            // publish
+            ep->next = x->x_endpoints[index];
+            atomic_store_ptr(&x->x_endpoints[index], ep);
+        }
+        pthread_mutex_unlock(&x->x_endpointlock);
     }
-    pthread_mutex_unlock(&x->x_endpointlock);
+    endpoint_touch(ep);
     return ep;
 }
 
+// Remove endpoints which haven't been used for a while from the
+// hash table. They are kept on the retired list until the node is
+// freed, because a concurrent lookup might still traverse them.
+static void aoo_node_expire_endpoints(t_aoo_node *x)
+{
+    uint64_t now = aoo_osctime_get();
+    if (aoo_osctime_duration(x->x_lastexpire, now) < AOO_NODE_ENDPOINT_EXPIRE){
+        return;
+    }
+    x->x_lastexpire = now;
+
+    pthread_mutex_lock(&x->x_endpointlock);
+    for (int i = 0; i < AOO_NODE_ENDPOINT_BUCKETS; ++i){
+        t_endpoint **link = &x->x_endpoints[i];
+        while (*link){
+            t_endpoint *e = *link;
+            // idle for at least one full interval?
+            if (atomic_fetch_add_long(&e->idle, 1) > 0){
+                // unlink, but leave e->next intact for concurrent readers
+                atomic_store_ptr(link, e->next);
+                e->retired = x->x_retired;
+                x->x_retired = e;
+            } else {
+                link = &e->next;
+            }
+        }
+    }
+    pthread_mutex_unlock(&x->x_endpointlock);
+}
+
+static void aoo_node_free_endpoints(t_aoo_node *x)
+{
+    for (int i = 0; i < AOO_NODE_ENDPOINT_BUCKETS; ++i){
+        t_endpoint *e = x->x_endpoints[i];
+        while (e){
+            t_endpoint *next = e->next;
+            endpoint_free(e);
+            e = next;
+        }
+    }
+    t_endpoint *e = x->x_retired;
+    while (e){
+        t_endpoint *next = e->retired;
+        endpoint_free(e);
+        e = next;
+    }
+}
+
+static int route_compare(const void *a, const void *b)
+{
+    int32_t id1 = ((const t_route *)a)->r_id;
+    int32_t id2 = ((const t_route *)b)->r_id;
+    return (id1 > id2) - (id1 < id2);
+}
+
+// binary search; returns the matching entry or NULL
+static t_route * route_find(t_route *table, int n, int32_t id)
+{
+    int lo = 0, hi = n - 1;
+    while (lo <= hi){
+        int mid = (lo + hi) / 2;
+        if (table[mid].r_id < id){
+            lo = mid + 1;
+        } else if (table[mid].r_id > id){
+            hi = mid - 1;
+        } else {
+            return &table[mid];
+        }
+    }
+    return 0;
+}
+
+// rebuild the routing tables; must be called with the client lock held exclusively.
+static void aoo_node_update_routes(t_aoo_node *x)
+{
+    if (x->x_receivers){
+        freebytes(x->x_receivers, x->x_numreceivers * sizeof(t_route));
+    }
+    if (x->x_senders){
+        freebytes(x->x_senders, x->x_numsenders * sizeof(t_route));
+    }
+    x->x_receivers = x->x_senders = 0;
+    x->x_numreceivers = x->x_numsenders = 0;
+    x->x_client = 0;
+
+    int nrcv = 0, nsnd = 0;
+    for (int i = 0; i < x->x_numclients; ++i){
+        t_class *c = pd_class(x->x_clients[i].c_obj);
+        if (c == aoo_receive_class){
+            nrcv++;
+        } else if (c == aoo_send_class){
+            nsnd++;
+        }
+    }
+    if (nrcv > 0){
+        x->x_receivers = (t_route *)getbytes(nrcv * sizeof(t_route));
+    }
+    if (nsnd > 0){
+        x->x_senders = (t_route *)getbytes(nsnd * sizeof(t_route));
+    }
+    for (int i = 0; i < x->x_numclients; ++i){
+        t_client *c = &x->x_clients[i];
+        t_route r = { c->c_id, c->c_obj };
+        if (pd_class(c->c_obj) == aoo_receive_class){
+            x->x_receivers[x->x_numreceivers++] = r;
+        } else if (pd_class(c->c_obj) == aoo_send_class){
+            x->x_senders[x->x_numsenders++] = r;
+        } else if (pd_class(c->c_obj) == aoo_client_class){
+            x->x_client = (t_aoo_client *)c->c_obj;
+        }
+    }
+    if (x->x_numreceivers > 1){
+        qsort(x->x_receivers, x->x_numreceivers, sizeof(t_route), route_compare);
+    }
+    if (x->x_numsenders > 1){
+        qsort(x->x_senders, x->x_numsenders, sizeof(t_route), route_compare);
+    }
+}
+
 static t_peer * aoo_node_dofind_peer(t_aoo_node *x, t_symbol *group, t_symbol *user)
 {
     for (int i = 0; i < x->x_numpeers; ++i){
@@ -232,10 +474,80 @@ int aoo_node_port(t_aoo_node *x)
     return x->x_port;
 }
 
-void aoo_node_notify(t_aoo_node *x)
+static int aoo_node_event_init(t_aoo_node *x)
+{
+#if defined(_WIN32)
+    x->x_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    return x->x_event != NULL;
+#elif defined(__linux__)
+    x->x_eventfd[0] = x->x_eventfd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return x->x_eventfd[0] >= 0;
+#else
+    if (pipe(x->x_eventfd) != 0){
+        return 0;
+    }
+    // never block in aoo_node_notify()
+    fcntl(x->x_eventfd[0], F_SETFL, O_NONBLOCK);
+    fcntl(x->x_eventfd[1], F_SETFL, O_NONBLOCK);
+    return 1;
+#endif
+}
+
+static void aoo_node_event_free(t_aoo_node *x)
 {
+#if defined(_WIN32)
+    CloseHandle(x->x_event);
+#elif defined(__linux__)
+    close(x->x_eventfd[0]);
+#else
+    close(x->x_eventfd[0]);
+    close(x->x_eventfd[1]);
+#endif
+}
+
+#ifndef _WIN32
+// reset the event after it has been polled
+static void aoo_node_event_clear(t_aoo_node *x)
+{
+#ifdef __linux__
+    uint64_t count;
+    read(x->x_eventfd[0], &count, sizeof(count));
+#else
+    char buf[64];
+    while (read(x->x_eventfd[0], buf, sizeof(buf)) > 0) ;
+#endif
+}
+#endif
+
 #if !AOO_NODE_POLL
-    pthread_cond_signal(&x->x_condition);
+static void aoo_node_event_wait(t_aoo_node *x)
+{
+#ifdef _WIN32
+    WaitForSingleObject(x->x_event, INFINITE);
+#else
+    struct pollfd p;
+    p.fd = x->x_eventfd[0];
+    p.events = POLLIN;
+    p.revents = 0;
+    if (poll(&p, 1, -1) > 0){
+        aoo_node_event_clear(x);
+    }
+#endif
+}
+#endif
+
+// wake up the send thread; called by the objects, e.g. right after
+// aoo_source_process() has produced a new block. This is RT-safe.
+void aoo_node_notify(t_aoo_node *x)
+{
+#if defined(_WIN32)
+    SetEvent(x->x_event);
+#elif defined(__linux__)
+    uint64_t one = 1;
+    write(x->x_eventfd[1], &one, sizeof(one));
+#else
+    // if the pipe is full, there's a pending wakeup anyway
+    write(x->x_eventfd[1], "", 1);
 #endif
 }
 
@@ -274,58 +586,50 @@ void aoo_node_doreceive(t_aoo_node *x)
     char buf[AOO_MAXPACKETSIZE];
     int nbytes = socket_receive(x->x_socket, buf, AOO_MAXPACKETSIZE, &sa, &len, 0);
     if (nbytes > 0){
-        // try to find endpoint
-        pthread_mutex_lock(&x->x_endpointlock);
-        t_endpoint *ep = endpoint_find(x->x_endpoints, &sa);
-        if (!ep){
-            // add endpoint
-            ep = endpoint_new(&x->x_socket, &sa, len);
-            ep->next = x->x_endpoints;
-            x->x_endpoints = ep;
-        }
-        pthread_mutex_unlock(&x->x_endpointlock);
         // get sink ID
         int32_t type, id;
         if ((aoo_parse_pattern(buf, nbytes, &type, &id) > 0)
             || (aoonet_parse_pattern(buf, nbytes, &type) > 0))
         {
+            // find or add endpoint
+            t_endpoint *ep = aoo_node_endpoint(x, &sa, len);
+
             aoo_lock_lock_shared(&x->x_clientlock);
             if (type == AOO_TYPE_SINK){
-                // forward OSC packet to matching receiver(s)
-                for (int i = 0; i < x->x_numclients; ++i){
-                    if ((pd_class(x->x_clients[i].c_obj) == aoo_receive_class) &&
-                        ((id == AOO_ID_WILDCARD) || (id == x->x_clients[i].c_id)))
-                    {
-                        t_aoo_receive *rcv = (t_aoo_receive *)x->x_clients[i].c_obj;
-                        aoo_receive_handle_message(rcv, buf, nbytes,
-                            ep, (aoo_replyfn)endpoint_send);
-                        if (id != AOO_ID_WILDCARD)
-                            break;
+                // forward OSC packet to matching receiver(s).
+                // compact data messages don't contain a sink ID,
+                // the receivers filter them by the stream salt.
+                if (id == AOO_ID_WILDCARD || id == AOO_ID_NONE){
+                    for (int i = 0; i < x->x_numreceivers; ++i){
+                        aoo_receive_handle_message((t_aoo_receive *)x->x_receivers[i].r_obj,
+                            buf, nbytes, ep, (aoo_replyfn)endpoint_send);
+                    }
+                } else {
+                    t_route *r = route_find(x->x_receivers, x->x_numreceivers, id);
+                    if (r){
+                        aoo_receive_handle_message((t_aoo_receive *)r->r_obj,
+                            buf, nbytes, ep, (aoo_replyfn)endpoint_send);
                     }
                 }
             } else if (type == AOO_TYPE_SOURCE){
                 // forward OSC packet to matching senders(s)
-                for (int i = 0; i < x->x_numclients; ++i){
-                    if ((pd_class(x->x_clients[i].c_obj) == aoo_send_class) &&
-                        ((id == AOO_ID_WILDCARD) || (id == x->x_clients[i].c_id)))
-                    {
-                        t_aoo_send *snd = (t_aoo_send *)x->x_clients[i].c_obj;
-                        aoo_send_handle_message(snd, buf, nbytes,
-                            ep, (aoo_replyfn)endpoint_send);
-                        if (id != AOO_ID_WILDCARD)
-                            break;
+                if (id == AOO_ID_WILDCARD){
+                    for (int i = 0; i < x->x_numsenders; ++i){
+                        aoo_send_handle_message((t_aoo_send *)x->x_senders[i].r_obj,
+                            buf, nbytes, ep, (aoo_replyfn)endpoint_send);
+                    }
+                } else {
+                    t_route *r = route_find(x->x_senders, x->x_numsenders, id);
+                    if (r){
+                        aoo_send_handle_message((t_aoo_send *)r->r_obj,
+                            buf, nbytes, ep, (aoo_replyfn)endpoint_send);
                     }
                 }
             } else if (type == AOO_TYPE_CLIENT || type == AOO_TYPE_PEER){
-                // forward OSC packet to matching client
-                for (int i = 0; i < x->x_numclients; ++i){
-                    if (pd_class(x->x_clients[i].c_obj) == aoo_client_class)
-                    {
-                        t_aoo_client *c = (t_aoo_client *)x->x_clients[i].c_obj;
-                        aoo_client_handle_message(c, buf, nbytes,
-                            ep, (aoo_replyfn)endpoint_send);
-                        break;
-                    }
+                // forward OSC packet to client
+                if (x->x_client){
+                    aoo_client_handle_message(x->x_client, buf, nbytes,
+                        ep, (aoo_replyfn)endpoint_send);
                 }
             } else if (type == AOO_TYPE_SERVER){
                 // ignore
@@ -336,7 +640,7 @@ void aoo_node_doreceive(t_aoo_node *x)
             aoo_lock_unlock_shared(&x->x_clientlock);
         #if !AOO_NODE_POLL
             // notify send thread
-            pthread_cond_signal(&x->x_condition);
+            aoo_node_notify(x);
         #endif
         } else {
             // not a valid AoO OSC message
@@ -357,24 +661,36 @@ static void* aoo_node_thread(void *y)
 {
     t_aoo_node *x = (t_aoo_node *)y;
 
-    lower_thread_priority();
+    set_thread_priority();
 
+    // wait for incoming packets or a notification, so we send
+    // as soon as there is something to send, without idle wakeups.
     while (!x->x_quit){
-        struct pollfd p;
-        p.fd = x->x_socket;
-        p.revents = 0;
-        p.events = POLLIN;
-
-        int result = poll(&p, 1, 1); // 1 ms timeout
+        struct pollfd p[2];
+        p[0].fd = x->x_socket;
+        p[0].revents = 0;
+        p[0].events = POLLIN;
+        p[1].fd = x->x_eventfd[0];
+        p[1].revents = 0;
+        p[1].events = POLLIN;
+
+        int result = poll(p, 2, -1);
         if (result < 0){
             int err = errno;
+            if (err == EINTR){
+                continue;
+            }
             fprintf(stderr, "poll() failed: %s\n", strerror(err));
             break;
         }
-        if (result > 0 && (p.revents & POLLIN)){
+        if (p[1].revents & POLLIN){
+            aoo_node_event_clear(x);
+        }
+        if (p[0].revents & POLLIN){
             aoo_node_doreceive(x);
         }
         aoo_node_dosend(x);
+        aoo_node_expire_endpoints(x);
     }
 
     return 0;
@@ -385,15 +701,14 @@ static void* aoo_node_send(void *y)
 {
     t_aoo_node *x = (t_aoo_node *)y;
 
-    lower_thread_priority();
+    set_thread_priority();
 
-    pthread_mutex_lock(&x->x_mutex);
     while (!x->x_quit){
-        pthread_cond_wait(&x->x_condition, &x->x_mutex);
+        aoo_node_event_wait(x);
 
         aoo_node_dosend(x);
+        aoo_node_expire_endpoints(x);
     }
-    pthread_mutex_unlock(&x->x_mutex);
 
     return 0;
 }
@@ -402,7 +717,7 @@ static void* aoo_node_receive(void *y)
 {
     t_aoo_node *x = (t_aoo_node *)y;
 
-    lower_thread_priority();
+    set_thread_priority();
 
     while (!x->x_quit){
         aoo_node_doreceive(x);
@@ -448,6 +763,7 @@ t_aoo_node* aoo_node_add(int port, t_pd *obj, int32_t id)
                                                 sizeof(t_client) * (x->x_numclients + 1));
         x->x_clients[x->x_numclients] = client;
         x->x_numclients++;
+        aoo_node_update_routes(x);
         aoo_lock_unlock(&x->x_clientlock);
     } else {
         // make new aoo node
@@ -473,6 +789,12 @@ t_aoo_node* aoo_node_add(int port, t_pd *obj, int32_t id)
 
         // now create aoo node instance
         x = (t_aoo_node *)getbytes(sizeof(t_aoo_node));
+        if (!aoo_node_event_init(x)){
+            pd_error(obj, "%s: couldn't create wakeup event", classname(obj));
+            freebytes(x, sizeof(t_aoo_node));
+            socket_close(sock);
+            return 0;
+        }
         x->x_pd = aoo_node_class;
         x->x_sym = s;
         pd_bind(&x->x_pd, s);
@@ -487,7 +809,14 @@ t_aoo_node* aoo_node_add(int port, t_pd *obj, int32_t id)
 
         x->x_socket = sock;
         x->x_port = port;
-        x->x_endpoints = 0;
+        memset(x->x_endpoints, 0, sizeof(x->x_endpoints));
+        x->x_retired = 0;
+        x->x_lastexpire = aoo_osctime_get();
+        pthread_mutex_init(&x->x_endpointlock, 0);
+
+        x->x_receivers = x->x_senders = 0;
+        x->x_numreceivers = x->x_numsenders = 0;
+        aoo_node_update_routes(x);
 
         // start threads
         x->x_quit = 0;
@@ -495,9 +824,6 @@ t_aoo_node* aoo_node_add(int port, t_pd *obj, int32_t id)
     #if AOO_NODE_POLL
         pthread_create(&x->x_thread, 0, aoo_node_thread, x);
     #else
-        pthread_mutex_init(&x->x_mutex, 0);
-        pthread_cond_init(&x->x_condition, 0);
-
         pthread_create(&x->x_sendthread, 0, aoo_node_send, x);
         pthread_create(&x->x_receivethread, 0, aoo_node_receive, x);
     #endif
@@ -524,6 +850,7 @@ void aoo_node_release(t_aoo_node *x, t_pd *obj, int32_t id)
                 x->x_clients = (t_client *)resizebytes(x->x_clients, n * sizeof(t_client),
                                                         (n - 1) * sizeof(t_client));
                 x->x_numclients--;
+                aoo_node_update_routes(x);
                 aoo_lock_unlock(&x->x_clientlock);
                 return;
             }
@@ -536,19 +863,16 @@ void aoo_node_release(t_aoo_node *x, t_pd *obj, int32_t id)
 
         // tell the threads that we're done
     #if AOO_NODE_POLL
-        // don't bother waking up the thread...
-        // just set the flag and wait
         x->x_quit = 1;
+        aoo_node_notify(x);
         pthread_join(x->x_thread, 0);
 
         socket_close(x->x_socket);
     #else
-        pthread_mutex_lock(&x->x_mutex);
         x->x_quit = 1;
-        pthread_mutex_unlock(&x->x_mutex);
 
         // notify send thread
-        pthread_cond_signal(&x->x_condition);
+        aoo_node_notify(x);
 
         // try to wake up receive thread
         aoo_lock_lock(&x->x_clientlock);
@@ -570,22 +894,19 @@ void aoo_node_release(t_aoo_node *x, t_pd *obj, int32_t id)
         }
     #endif
         // free memory
-        t_endpoint *e = x->x_endpoints;
-        while (e){
-            t_endpoint *next = e->next;
-            endpoint_free(e);
-            e = next;
-        }
+        aoo_node_free_endpoints(x);
+        pthread_mutex_destroy(&x->x_endpointlock);
+        if (x->x_receivers)
+            freebytes(x->x_receivers, sizeof(t_route) * x->x_numreceivers);
+        if (x->x_senders)
+            freebytes(x->x_senders, sizeof(t_route) * x->x_numsenders);
         if (x->x_clients)
             freebytes(x->x_clients, sizeof(t_client) * x->x_numclients);
         if (x->x_peers)
             freebytes(x->x_peers, sizeof(t_peer) * x->x_numpeers);
 
         aoo_lock_destroy(&x->x_clientlock);
-    #if !AOO_NODE_POLL
-        pthread_mutex_destroy(&x->x_mutex);
-        pthread_cond_destroy(&x->x_condition);
-    #endif
+        aoo_node_event_free(x);
         verbose(0, "released aoo node on port %d", x->x_port);
 
         freebytes(x, sizeof(*x));
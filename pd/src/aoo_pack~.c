@@ -36,10 +36,18 @@ typedef struct _aoo_pack
     int32_t x_sink_id;
     int32_t x_sink_chn;
     int x_accept;
+    int x_packed;
 } t_aoo_pack;
 
 static int32_t aoo_pack_reply(t_aoo_pack *x, const char *data, int32_t n)
 {
+    if (x->x_packed){
+        int argc = AOO_BLOB_NUMATOMS(n);
+        t_atom *a = (t_atom *)alloca(argc * sizeof(t_atom));
+        aoo_blob_pack(data, n, a);
+        outlet_anything(x->x_out, gensym("blob"), argc, a);
+        return 1;
+    }
     t_atom *a = (t_atom *)alloca(n * sizeof(t_atom));
     for (int i = 0; i < n; ++i){
         SETFLOAT(&a[i], (unsigned char)data[i]);
@@ -124,6 +132,22 @@ static void aoo_pack_list(t_aoo_pack *x, t_symbol *s, int argc, t_atom *argv)
     aoo_source_handle_message(x->x_aoo_source, msg, argc, x, (aoo_replyfn)aoo_pack_reply);
 }
 
+static void aoo_pack_blob(t_aoo_pack *x, t_symbol *s, int argc, t_atom *argv)
+{
+    char msg[AOO_MAXPACKETSIZE];
+    int32_t n = aoo_blob_unpack(argc, argv, msg, sizeof(msg));
+    if (n < 0){
+        pd_error(x, "%s: bad blob", classname(x));
+        return;
+    }
+    aoo_source_handle_message(x->x_aoo_source, msg, n, x, (aoo_replyfn)aoo_pack_reply);
+}
+
+static void aoo_pack_packed(t_aoo_pack *x, t_floatarg f)
+{
+    x->x_packed = f != 0;
+}
+
 static void aoo_pack_format(t_aoo_pack *x, t_symbol *s, int argc, t_atom *argv)
 {
     aoo_format_storage f;
@@ -277,6 +301,7 @@ static void * aoo_pack_new(t_symbol *s, int argc, t_atom *argv)
     x->x_f = 0;
     x->x_clock = clock_new(x, (t_method)aoo_pack_tick);
     x->x_accept = 1;
+    x->x_packed = 0;
 
     // arg #1: ID
     int src = atom_getfloatarg(0, argc, argv);
@@ -342,6 +367,8 @@ void aoo_pack_tilde_setup(void)
     class_addmethod(aoo_pack_class, (t_method)aoo_pack_dsp, gensym("dsp"), A_CANT, A_NULL);
     class_addmethod(aoo_pack_class, (t_method)aoo_pack_loadbang, gensym("loadbang"), A_FLOAT, A_NULL);
     class_addlist(aoo_pack_class, (t_method)aoo_pack_list);
+    class_addmethod(aoo_pack_class, (t_method)aoo_pack_blob, gensym("blob"), A_GIMME, A_NULL);
+    class_addmethod(aoo_pack_class, (t_method)aoo_pack_packed, gensym("packed"), A_FLOAT, A_NULL);
     class_addmethod(aoo_pack_class, (t_method)aoo_pack_set, gensym("set"), A_GIMME, A_NULL);
     class_addmethod(aoo_pack_class, (t_method)aoo_pack_clear, gensym("clear"), A_NULL);
     class_addmethod(aoo_pack_class, (t_method)aoo_pack_start, gensym("start"), A_NULL);
@@ -160,6 +160,14 @@ static void aoo_receive_packetsize(t_aoo_receive *x, t_floatarg f)
     aoo_sink_set_packetsize(x->x_aoo_sink, f);
 }
 
+static void aoo_receive_capture(t_aoo_receive *x, t_symbol *s)
+{
+    // no argument: stop recording
+    if (!aoo_sink_set_capture(x->x_aoo_sink, *s->s_name ? s->s_name : 0)){
+        pd_error(x, "%s: couldn't open capture file %s", classname(x), s->s_name);
+    }
+}
+
 static void aoo_receive_reset(t_aoo_receive *x, t_symbol *s, int argc, t_atom *argv)
 {
     if (argc){
@@ -353,6 +361,12 @@ static t_int * aoo_receive_perform(t_int *w)
         }
     }
 
+    // notify send thread; blocks from the local transport
+    // are only read in aoo_sink_send().
+    if (x->x_node){
+        aoo_node_notify(x->x_node);
+    }
+
     // handle events
     if (aoo_sink_events_available(x->x_aoo_sink) > 0){
         clock_delay(x->x_clock, 0);
@@ -525,4 +539,6 @@ void aoo_receive_tilde_setup(void)
                     gensym("list_sources"), A_NULL);
     class_addmethod(aoo_receive_class, (t_method)aoo_receive_reset,
                     gensym("reset"), A_GIMME, A_NULL);
+    class_addmethod(aoo_receive_class, (t_method)aoo_receive_capture,
+                    gensym("capture"), A_DEFSYM, A_NULL);
 }
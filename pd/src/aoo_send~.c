@@ -353,6 +353,14 @@ static void aoo_send_packetsize(t_aoo_send *x, t_floatarg f)
     aoo_source_set_packetsize(x->x_aoo_source, f);
 }
 
+static void aoo_send_capture(t_aoo_send *x, t_symbol *s)
+{
+    // no argument: stop recording
+    if (!aoo_source_set_capture(x->x_aoo_source, *s->s_name ? s->s_name : 0)){
+        pd_error(x, "%s: couldn't open capture file %s", classname(x), s->s_name);
+    }
+}
+
 static void aoo_send_ping(t_aoo_send *x, t_floatarg f)
 {
     aoo_source_set_ping_interval(x->x_aoo_source, f);
@@ -726,4 +734,6 @@ void aoo_send_tilde_setup(void)
                     gensym("timefilter"), A_FLOAT, A_NULL);
     class_addmethod(aoo_send_class, (t_method)aoo_send_listsinks,
                     gensym("list_sinks"), A_NULL);
+    class_addmethod(aoo_send_class, (t_method)aoo_send_capture,
+                    gensym("capture"), A_DEFSYM, A_NULL);
 }
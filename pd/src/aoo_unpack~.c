@@ -34,10 +34,18 @@ typedef struct _aoo_unpack
     t_outlet *x_dataout;
     t_outlet *x_msgout;
     t_clock *x_clock;
+    int x_packed;
 } t_aoo_unpack;
 
 static int32_t aoo_pack_reply(t_aoo_unpack *x, const char *data, int32_t n)
 {
+    if (x->x_packed){
+        int argc = AOO_BLOB_NUMATOMS(n);
+        t_atom *a = (t_atom *)alloca(argc * sizeof(t_atom));
+        aoo_blob_pack(data, n, a);
+        outlet_anything(x->x_dataout, gensym("blob"), argc, a);
+        return 1;
+    }
     t_atom *a = (t_atom *)alloca(n * sizeof(t_atom));
     for (int i = 0; i < n; ++i){
         SETFLOAT(&a[i], (unsigned char)data[i]);
@@ -58,6 +66,25 @@ static void aoo_unpack_list(t_aoo_unpack *x, t_symbol *s, int argc, t_atom *argv
     while (aoo_sink_send(x->x_aoo_sink)) ;
 }
 
+static void aoo_unpack_blob(t_aoo_unpack *x, t_symbol *s, int argc, t_atom *argv)
+{
+    char msg[AOO_MAXPACKETSIZE];
+    int32_t n = aoo_blob_unpack(argc, argv, msg, sizeof(msg));
+    if (n < 0){
+        pd_error(x, "%s: bad blob", classname(x));
+        return;
+    }
+    // handle incoming message
+    aoo_sink_handle_message(x->x_aoo_sink, msg, n, x, (aoo_replyfn)aoo_pack_reply);
+    // send outgoing messages
+    while (aoo_sink_send(x->x_aoo_sink)) ;
+}
+
+static void aoo_unpack_packed(t_aoo_unpack *x, t_floatarg f)
+{
+    x->x_packed = f != 0;
+}
+
 static void aoo_unpack_invite(t_aoo_unpack *x, t_floatarg f)
 {
     aoo_sink_invite_source(x->x_aoo_sink, x, (int32_t)f, (aoo_replyfn)aoo_pack_reply);
@@ -248,6 +275,7 @@ static void * aoo_unpack_new(t_symbol *s, int argc, t_atom *argv)
 {
     t_aoo_unpack *x = (t_aoo_unpack *)pd_new(aoo_unpack_class);
     x->x_clock = clock_new(x, (t_method)aoo_unpack_tick);
+    x->x_packed = 0;
 
     // arg #1: ID
     int id = atom_getfloatarg(0, argc, argv);
@@ -292,6 +320,8 @@ void aoo_unpack_tilde_setup(void)
         (t_method)aoo_unpack_free, sizeof(t_aoo_unpack), 0, A_GIMME, A_NULL);
     class_addmethod(aoo_unpack_class, (t_method)aoo_unpack_dsp, gensym("dsp"), A_CANT, A_NULL);
     class_addlist(aoo_unpack_class, (t_method)aoo_unpack_list);
+    class_addmethod(aoo_unpack_class, (t_method)aoo_unpack_blob, gensym("blob"), A_GIMME, A_NULL);
+    class_addmethod(aoo_unpack_class, (t_method)aoo_unpack_packed, gensym("packed"), A_FLOAT, A_NULL);
     class_addmethod(aoo_unpack_class, (t_method)aoo_unpack_invite,
                     gensym("invite"), A_FLOAT, A_NULL);
     class_addmethod(aoo_unpack_class, (t_method)aoo_unpack_uninvite,
@@ -0,0 +1,407 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Server-side mixing service (MCU) for AOO (POSIX only).
+//
+// The mixer has a fixed number of slots. Participant k sends its stream to
+// sink k of the mixer and invites source k; in return, it receives the mix
+// of all *other* participants. This way, every client only has to send one
+// stream and receive/decode one stream, no matter how large the group is.
+//
+// The mix for participant k is computed as (sum of all inputs) - input k,
+// so mixing is O(N) instead of O(N^2). The expensive parts (decoding in
+// aoo_sink_handle_message() and encoding in aoo_source_send()) run on a
+// pool of worker threads, each owning a fixed subset of the slots.
+// The audio thread only mixes the decoded signals.
+//
+// build:
+//   c++ -std=c++14 -O2 -DAOO_STATIC -I../lib -I../deps aoo_mixer.cpp
+//       ../lib/src/common.cpp ../lib/src/sink.cpp ../lib/src/source.cpp
+//       ../lib/src/codec_pcm.cpp ../lib/src/memory.cpp ../lib/src/sync.cpp
+//       ../lib/src/time.cpp ../lib/src/shm.cpp ../lib/src/trace.cpp
+//       ../lib/src/capture.cpp ../deps/oscpack/osc/*.cpp -o aoo_mixer -lpthread -lrt
+//
+// usage:
+//   aoo_mixer <port> [numslots] [nchannels] [samplerate] [blocksize] [numthreads]
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_pcm.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+static std::atomic<bool> g_quit{false};
+
+static void handle_signal(int){
+    g_quit = true;
+}
+
+// a remote participant; endpoints are never removed
+struct endpoint {
+    int socket;
+    struct sockaddr_in address;
+    // the slot this endpoint sends to (for compact data messages,
+    // which don't contain the sink ID)
+    std::atomic<int32_t> slot{-1};
+};
+
+static int32_t endpoint_send(endpoint *e, const char *data, int32_t n){
+    sendto(e->socket, data, n, 0,
+           (const struct sockaddr *)&e->address, sizeof(e->address));
+    return 1;
+}
+
+struct packet {
+    std::vector<char> data;
+    endpoint *ep;
+    int32_t type;
+    int32_t slot;
+};
+
+struct slot {
+    aoo_sink *sink = nullptr;
+    aoo_source *source = nullptr;
+    std::vector<aoo_sample> input; // decoded stream
+    std::vector<aoo_sample> output; // mix
+    bool active = false;
+};
+
+// owns every n-th slot
+struct worker {
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::vector<packet> inbox;
+    bool signaled = false;
+
+    void signal(){
+        std::lock_guard<std::mutex> lock(mutex);
+        signaled = true;
+        cond.notify_one();
+    }
+};
+
+class mixer {
+public:
+    mixer(int socket, int numslots, int nchannels, int samplerate,
+          int blocksize, int numthreads);
+    ~mixer();
+
+    void run();
+private:
+    int socket_;
+    int nchannels_;
+    int samplerate_;
+    int blocksize_;
+    std::vector<slot> slots_;
+    std::vector<std::unique_ptr<worker>> workers_;
+    std::unordered_map<uint64_t, std::unique_ptr<endpoint>> endpoints_;
+    std::vector<aoo_sample> sum_;
+    std::vector<aoo_sample *> channels_;
+    std::thread audio_thread_;
+
+    endpoint * get_endpoint(const struct sockaddr_in& addr);
+
+    void dispatch(const char *data, int32_t size, endpoint *ep);
+
+    void process(uint64_t t);
+
+    void audio_thread();
+
+    void worker_thread(worker& w, int index);
+};
+
+static int32_t handle_source_events(aoo_source *src, const aoo_event **events, int32_t n){
+    for (int i = 0; i < n; ++i){
+        if (events[i]->type == AOO_INVITE_EVENT){
+            auto e = (const aoo_sink_event *)events[i];
+            aoo_source_add_sink(src, e->endpoint, e->id, (aoo_replyfn)endpoint_send);
+            auto ep = (endpoint *)e->endpoint;
+            printf("added sink %d (%s:%d)\n", e->id,
+                   inet_ntoa(ep->address.sin_addr), ntohs(ep->address.sin_port));
+        } else if (events[i]->type == AOO_UNINVITE_EVENT){
+            auto e = (const aoo_sink_event *)events[i];
+            aoo_source_remove_sink(src, e->endpoint, e->id);
+            printf("removed sink %d\n", e->id);
+        }
+    }
+    return 1;
+}
+
+mixer::mixer(int socket, int numslots, int nchannels, int samplerate,
+             int blocksize, int numthreads)
+    : socket_(socket), nchannels_(nchannels), samplerate_(samplerate),
+      blocksize_(blocksize), slots_(numslots)
+{
+    aoo_format_pcm fmt;
+    fmt.header.codec = AOO_CODEC_PCM;
+    fmt.header.nchannels = nchannels;
+    fmt.header.samplerate = samplerate;
+    fmt.header.blocksize = blocksize;
+    fmt.bitdepth = AOO_PCM_INT16;
+
+    for (int i = 0; i < numslots; ++i){
+        auto& s = slots_[i];
+        s.sink = aoo_sink_new(i);
+        aoo_sink_setup(s.sink, samplerate, blocksize, nchannels);
+        s.source = aoo_source_new(i);
+        aoo_source_setup(s.source, samplerate, blocksize, nchannels);
+        aoo_source_set_format(s.source, &fmt.header);
+        aoo_source_start(s.source);
+        s.input.resize(nchannels * blocksize);
+        s.output.resize(nchannels * blocksize);
+    }
+    sum_.resize(nchannels * blocksize);
+    channels_.resize(nchannels);
+
+    for (int i = 0; i < numthreads; ++i){
+        workers_.push_back(std::make_unique<worker>());
+    }
+}
+
+mixer::~mixer(){
+    for (auto& s : slots_){
+        aoo_sink_free(s.sink);
+        aoo_source_free(s.source);
+    }
+}
+
+endpoint * mixer::get_endpoint(const struct sockaddr_in& addr){
+    uint64_t key = ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+    auto it = endpoints_.find(key);
+    if (it != endpoints_.end()){
+        return it->second.get();
+    }
+    auto ep = std::make_unique<endpoint>();
+    ep->socket = socket_;
+    ep->address = addr;
+    auto result = ep.get();
+    endpoints_.emplace(key, std::move(ep));
+    return result;
+}
+
+// route a message to the worker which owns the slot
+void mixer::dispatch(const char *data, int32_t size, endpoint *ep){
+    int32_t type, id;
+    if (!aoo_parse_pattern(data, size, &type, &id)){
+        return; // not an AoO message
+    }
+    if (id == AOO_ID_NONE){
+        // compact data message
+        id = ep->slot.load();
+    } else if (type == AOO_TYPE_SINK){
+        ep->slot.store(id);
+    }
+    if (id < 0 || id >= (int32_t)slots_.size()){
+        fprintf(stderr, "no slot for %s message with ID %d\n",
+                type == AOO_TYPE_SINK ? "sink" : "source", id);
+        return;
+    }
+    auto& w = *workers_[id % workers_.size()];
+    {
+        std::lock_guard<std::mutex> lock(w.mutex);
+        w.inbox.push_back(packet { std::vector<char>(data, data + size), ep, type, id });
+        w.signaled = true;
+    }
+    w.cond.notify_one();
+}
+
+void mixer::run(){
+    for (size_t i = 0; i < workers_.size(); ++i){
+        auto& w = *workers_[i];
+        w.thread = std::thread([this, &w, i](){ worker_thread(w, (int)i); });
+    }
+    audio_thread_ = std::thread([this](){ audio_thread(); });
+
+    // receive messages and forward them to the workers
+    char buf[AOO_MAXPACKETSIZE];
+    struct pollfd fd;
+    fd.fd = socket_;
+    fd.events = POLLIN;
+    while (!g_quit){
+        if (poll(&fd, 1, 100) <= 0){
+            continue;
+        }
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        auto result = recvfrom(socket_, buf, sizeof(buf), 0,
+                               (struct sockaddr *)&addr, &len);
+        if (result > 0){
+            dispatch(buf, (int32_t)result, get_endpoint(addr));
+        } else if (result < 0 && errno != EINTR){
+            perror("recvfrom");
+            break;
+        }
+    }
+
+    g_quit = true;
+    audio_thread_.join();
+    for (auto& w : workers_){
+        w->signal();
+        w->thread.join();
+    }
+}
+
+void mixer::worker_thread(worker& w, int index){
+    std::vector<packet> packets;
+    int nworkers = (int)workers_.size();
+    while (!g_quit){
+        {
+            std::unique_lock<std::mutex> lock(w.mutex);
+            // wake up periodically for pings and resend requests
+            w.cond.wait_for(lock, std::chrono::milliseconds(10),
+                            [&](){ return w.signaled; });
+            w.signaled = false;
+            packets.swap(w.inbox);
+        }
+        // handle (and decode) incoming messages
+        for (auto& p : packets){
+            auto& s = slots_[p.slot];
+            if (p.type == AOO_TYPE_SINK){
+                aoo_sink_handle_message(s.sink, p.data.data(), (int32_t)p.data.size(),
+                                        p.ep, (aoo_replyfn)endpoint_send);
+            } else {
+                aoo_source_handle_message(s.source, p.data.data(), (int32_t)p.data.size(),
+                                          p.ep, (aoo_replyfn)endpoint_send);
+            }
+        }
+        packets.clear();
+        // encode and send the mixes
+        for (int i = index; i < (int)slots_.size(); i += nworkers){
+            auto& s = slots_[i];
+            while (aoo_sink_send(s.sink)) ;
+            while (aoo_source_send(s.source)) ;
+            aoo_source_handle_events(s.source, (aoo_eventhandler)handle_source_events, s.source);
+        }
+    }
+}
+
+void mixer::process(uint64_t t){
+    auto nsamples = nchannels_ * blocksize_;
+    auto channels = channels_.data();
+
+    // get all decoded inputs and sum them
+    std::fill(sum_.begin(), sum_.end(), 0);
+    for (auto& s : slots_){
+        for (int i = 0; i < nchannels_; ++i){
+            channels[i] = &s.input[i * blocksize_];
+        }
+        s.active = aoo_sink_process(s.sink, channels, blocksize_, t);
+        if (s.active){
+            for (int i = 0; i < nsamples; ++i){
+                sum_[i] += s.input[i];
+            }
+        }
+    }
+    // send everyone the mix without themselves
+    for (auto& s : slots_){
+        if (s.active){
+            for (int i = 0; i < nsamples; ++i){
+                s.output[i] = sum_[i] - s.input[i];
+            }
+        } else {
+            std::copy(sum_.begin(), sum_.end(), s.output.begin());
+        }
+        for (int i = 0; i < nchannels_; ++i){
+            channels[i] = &s.output[i * blocksize_];
+        }
+        aoo_source_process(s.source, (const aoo_sample **)channels, blocksize_, t);
+    }
+}
+
+void mixer::audio_thread(){
+    auto period = std::chrono::duration_cast<clock_type::duration>(
+                std::chrono::duration<double>((double)blocksize_ / samplerate_));
+    auto next = clock_type::now();
+    while (!g_quit){
+        next += period;
+        auto now = clock_type::now();
+        if (next < now - period * 4){
+            fprintf(stderr, "audio thread fell behind\n");
+            next = now;
+        }
+        std::this_thread::sleep_until(next);
+
+        process(aoo_osctime_get());
+
+        // wake up the workers to encode and send the mixes
+        for (auto& w : workers_){
+            w->signal();
+        }
+    }
+}
+
+int main(int argc, const char *argv[]){
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <port> [numslots] [nchannels] [samplerate] "
+                "[blocksize] [numthreads]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[1]);
+    int numslots = argc > 2 ? atoi(argv[2]) : 16;
+    int nchannels = argc > 3 ? atoi(argv[3]) : 1;
+    int samplerate = argc > 4 ? atoi(argv[4]) : 48000;
+    int blocksize = argc > 5 ? atoi(argv[5]) : 256;
+    int numthreads = argc > 6 ? atoi(argv[6]) :
+                std::max<int>(1, std::thread::hardware_concurrency());
+    if (port <= 0 || numslots <= 0 || nchannels <= 0 || samplerate <= 0
+            || blocksize <= 0 || numthreads <= 0){
+        fprintf(stderr, "bad arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0){
+        perror("socket");
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_ANY);
+    sa.sin_port = htons(port);
+    if (bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+        perror("bind");
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    aoo_initialize();
+
+    printf("mixing %d slots (%d channels, %d Hz, blocksize %d) on port %d "
+           "with %d threads\n", numslots, nchannels, samplerate, blocksize,
+           port, numthreads);
+
+    {
+        mixer m(sock, numslots, nchannels, samplerate, blocksize, numthreads);
+        m.run();
+    }
+
+    aoo_terminate();
+    close(sock);
+
+    return EXIT_SUCCESS;
+}
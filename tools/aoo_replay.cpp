@@ -0,0 +1,447 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Replay and conversion of capture files (see aoo_opt_capture).
+//
+// info:   print the capture header and a summary of the recorded messages.
+// play:   feed a sink capture into a new sink with the original settings.
+//         The datagrams and process() calls are replayed in their original
+//         order and with their original time stamps, so a session can be
+//         reproduced deterministically. 'speed' is the playback speed
+//         (1: original timing, 2: twice as fast, 0: as fast as possible).
+//         Replies of the sink (e.g. resend requests) are counted, but not
+//         sent anywhere.
+//         Optionally, the output is written to a file (raw interleaved
+//         32-bit float), e.g. to compare the output of different versions.
+// pcapng: convert a capture to pcapng, e.g. for Wireshark. Every datagram
+//         is wrapped in a synthetic IPv4/UDP header: the capturing object
+//         has the address 10.0.0.1 and peer k has the address 10.0.0.(k+2);
+//         all use port AOO_REPLAY_PORT. Use "Decode As... OSC" to dissect
+//         the messages.
+//
+// build:
+//   c++ -std=c++14 -O2 -DAOO_STATIC -I../lib -I../deps aoo_replay.cpp
+//       ../lib/src/common.cpp ../lib/src/sink.cpp ../lib/src/source.cpp
+//       ../lib/src/codec_pcm.cpp ../lib/src/memory.cpp ../lib/src/sync.cpp
+//       ../lib/src/time.cpp ../lib/src/shm.cpp ../lib/src/trace.cpp
+//       ../lib/src/capture.cpp ../deps/oscpack/osc/*.cpp -o aoo_replay -lpthread -lrt
+//
+// usage:
+//   aoo_replay info <capture>
+//   aoo_replay play <capture> [speed] [outfile]
+//   aoo_replay pcapng <capture> <outfile>
+
+#include "aoo/aoo.h"
+#include "src/capture.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#define AOO_REPLAY_PORT 9998
+
+using clock_type = std::chrono::steady_clock;
+
+// seconds between 1900 (NTP) and 1970 (Unix)
+#define NTP_UNIX_OFFSET 2208988800ULL
+
+static const char *type_name(int32_t type){
+    return type == AOO_TYPE_SINK ? "sink" : "source";
+}
+
+/*//////////////////////// info ////////////////////////*/
+
+static int capture_info(aoo::capture_reader& reader){
+    auto& h = reader.header();
+    printf("type:        %s\n", type_name(h.type));
+    printf("id:          %d\n", h.id);
+    printf("samplerate:  %d\n", h.samplerate);
+    printf("blocksize:   %d\n", h.blocksize);
+    printf("channels:    %d\n", h.nchannels);
+    if (h.type == AOO_TYPE_SINK){
+        printf("buffersize:  %d ms\n", h.buffersize);
+    }
+
+    // count messages per address pattern
+    std::map<std::string, std::pair<uint64_t, uint64_t>> messages;
+    uint64_t count = 0, bytes = 0, first = 0, last = 0;
+    uint32_t numpeers = 0;
+    aoo::capture_record r;
+    const char *data;
+    uint64_t nblocks = 0;
+    while ((data = reader.read(r))){
+        if (count + nblocks == 0){
+            first = r.time;
+        }
+        last = r.time;
+        if (r.is_process()){
+            nblocks++;
+            continue;
+        }
+        count++;
+        bytes += r.size;
+        numpeers = std::max<uint32_t>(numpeers, r.endpoint + 1);
+        auto len = strnlen(data, r.size);
+        auto& m = messages[std::string(data, len)];
+        m.first++;
+        m.second += r.size;
+    }
+    printf("duration:    %.3f s\n", aoo_osctime_duration(first, last));
+    printf("peers:       %u\n", numpeers);
+    printf("blocks:      %llu\n", (unsigned long long)nblocks);
+    printf("messages:    %llu (%llu bytes)\n",
+           (unsigned long long)count, (unsigned long long)bytes);
+    for (auto& m : messages){
+        printf("  %-32s %10llu %12llu bytes\n", m.first.c_str(),
+               (unsigned long long)m.second.first, (unsigned long long)m.second.second);
+    }
+    return EXIT_SUCCESS;
+}
+
+/*//////////////////////// play ////////////////////////*/
+
+static uint64_t g_time = 0;
+
+static uint64_t virtual_clock(void *user){
+    return g_time;
+}
+
+struct reply_stats {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+static int32_t count_reply(void *user, const char *data, int32_t n){
+    // 'user' is the endpoint; all endpoints share the same stats
+    auto stats = *(reply_stats **)user;
+    stats->count++;
+    stats->bytes += n;
+    return n;
+}
+
+struct event_stats {
+    uint64_t lost = 0;
+    uint64_t reordered = 0;
+    uint64_t resent = 0;
+    uint64_t gap = 0;
+    uint64_t state = 0;
+};
+
+static int32_t count_events(void *user, const aoo_event **events, int32_t n){
+    auto stats = (event_stats *)user;
+    for (int i = 0; i < n; ++i){
+        auto e = events[i];
+        switch (e->type){
+        case AOO_BLOCK_LOST_EVENT:
+            stats->lost += ((const aoo_block_lost_event *)e)->count;
+            break;
+        case AOO_BLOCK_REORDERED_EVENT:
+            stats->reordered += ((const aoo_block_reordered_event *)e)->count;
+            break;
+        case AOO_BLOCK_RESENT_EVENT:
+            stats->resent += ((const aoo_block_resent_event *)e)->count;
+            break;
+        case AOO_BLOCK_GAP_EVENT:
+            stats->gap += ((const aoo_block_gap_event *)e)->count;
+            break;
+        case AOO_SOURCE_STATE_EVENT:
+            stats->state++;
+            break;
+        default:
+            break;
+        }
+    }
+    return 1;
+}
+
+static int capture_play(aoo::capture_reader& reader, double speed, const char *outfile){
+    auto& h = reader.header();
+    if (h.type != AOO_TYPE_SINK){
+        fprintf(stderr, "can only play sink captures\n");
+        return EXIT_FAILURE;
+    }
+    if (h.samplerate <= 0 || h.blocksize <= 0 || h.nchannels <= 0){
+        fprintf(stderr, "capture was started before the sink has been set up\n");
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = nullptr;
+    if (outfile){
+        fp = fopen(outfile, "wb");
+        if (!fp){
+            fprintf(stderr, "couldn't open %s\n", outfile);
+            return EXIT_FAILURE;
+        }
+    }
+
+    auto sink = aoo_sink_new(h.id);
+    aoo_sink_set_clock(sink, virtual_clock, nullptr);
+    aoo_sink_setup(sink, h.samplerate, h.blocksize, h.nchannels);
+    aoo_sink_set_buffersize(sink, h.buffersize);
+
+    // the endpoint pointers only need to be unique and stable
+    reply_stats replies;
+    std::deque<reply_stats *> endpoints;
+
+    std::vector<aoo_sample> buffer(h.blocksize * h.nchannels);
+    std::vector<aoo_sample *> channels(h.nchannels);
+    for (int i = 0; i < h.nchannels; ++i){
+        channels[i] = &buffer[i * h.blocksize];
+    }
+    std::vector<float> interleaved(h.blocksize * h.nchannels);
+
+    event_stats events;
+    clock_type::duration handle_time{0};
+    clock_type::duration process_time{0};
+    uint64_t nmessages = 0;
+    uint64_t nblocks = 0;
+    uint64_t first = 0, last = 0;
+
+    // replay all messages and process() calls in their original order.
+    auto start = clock_type::now();
+    aoo::capture_record r;
+    const char *data;
+    while ((data = reader.read(r))){
+        if (nmessages + nblocks == 0){
+            first = r.time;
+        }
+        last = r.time;
+        g_time = r.time;
+
+        if (speed > 0){
+            // the capture might have been started long before (or with
+            // a different clock), so we start with the first record.
+            auto elapsed = aoo_osctime_duration(first, r.time) / speed;
+            std::this_thread::sleep_until(start + std::chrono::duration_cast<clock_type::duration>(
+                                              std::chrono::duration<double>(elapsed)));
+        }
+
+        if (r.is_process()){
+            auto nframes = std::min<int32_t>(r.size, h.blocksize);
+            auto t1 = clock_type::now();
+            aoo_sink_process(sink, channels.data(), nframes, r.time);
+            process_time += clock_type::now() - t1;
+            nblocks++;
+
+            aoo_sink_send(sink);
+            aoo_sink_handle_events(sink, count_events, &events);
+
+            if (fp){
+                for (int i = 0; i < nframes; ++i){
+                    for (int j = 0; j < h.nchannels; ++j){
+                        interleaved[i * h.nchannels + j] = channels[j][i];
+                    }
+                }
+                fwrite(interleaved.data(), sizeof(float), nframes * h.nchannels, fp);
+            }
+        } else {
+            while (r.endpoint >= endpoints.size()){
+                // store a pointer to the stats, see count_reply()
+                endpoints.push_back(&replies);
+            }
+            auto t1 = clock_type::now();
+            aoo_sink_handle_message(sink, data, r.size, &endpoints[r.endpoint], count_reply);
+            handle_time += clock_type::now() - t1;
+            nmessages++;
+        }
+    }
+    auto elapsed = std::chrono::duration<double>(clock_type::now() - start).count();
+
+    aoo_sink_free(sink);
+    if (fp){
+        fclose(fp);
+    }
+
+    auto duration = aoo_osctime_duration(first, last);
+    printf("played %.3f s in %.3f s (%.1fx)\n", duration, elapsed, duration / elapsed);
+    printf("messages:         %llu (%.2f us per message)\n", (unsigned long long)nmessages,
+           nmessages ? std::chrono::duration<double>(handle_time).count() * 1e6 / nmessages : 0.0);
+    printf("blocks:           %llu (%.2f us per block)\n", (unsigned long long)nblocks,
+           nblocks ? std::chrono::duration<double>(process_time).count() * 1e6 / nblocks : 0.0);
+    printf("lost blocks:      %llu\n", (unsigned long long)events.lost);
+    printf("reordered blocks: %llu\n", (unsigned long long)events.reordered);
+    printf("resent blocks:    %llu\n", (unsigned long long)events.resent);
+    printf("gaps:             %llu\n", (unsigned long long)events.gap);
+    printf("state changes:    %llu\n", (unsigned long long)events.state);
+    printf("replies:          %llu (%llu bytes)\n",
+           (unsigned long long)replies.count, (unsigned long long)replies.bytes);
+    if (nblocks == 0){
+        fprintf(stderr, "warning: the capture doesn't contain any process() calls\n");
+    }
+    return EXIT_SUCCESS;
+}
+
+/*//////////////////////// pcapng ////////////////////////*/
+
+class pcapng_writer {
+public:
+    // pcapng files are written in host byte order (see the byte order magic)
+    pcapng_writer(FILE *fp) : fp_(fp) {
+        // section header block (version 1.0, unknown section length)
+        put<uint32_t>(0x0A0D0D0A);
+        put<uint32_t>(28);
+        put<uint32_t>(0x1A2B3C4D);
+        put<uint16_t>(1);
+        put<uint16_t>(0);
+        put<int64_t>(-1);
+        put<uint32_t>(28);
+        // interface description block (LINKTYPE_IPV4, microsecond resolution)
+        put<uint32_t>(1);
+        put<uint32_t>(20);
+        put<uint16_t>(228);
+        put<uint16_t>(0);
+        put<uint32_t>(0);
+        put<uint32_t>(20);
+    }
+
+    void write(uint64_t time, uint32_t src, uint32_t dst,
+               const char *data, int32_t size)
+    {
+        uint32_t len = 28 + size;
+        if (len > 0xffff){
+            return; // can't be represented in IPv4
+        }
+        uint8_t hdr[28] = { 0 };
+        // IPv4 header
+        hdr[0] = 0x45;
+        hdr[2] = len >> 8;
+        hdr[3] = len & 0xff;
+        hdr[6] = 0x40; // don't fragment
+        hdr[8] = 64; // TTL
+        hdr[9] = 17; // UDP
+        put32(hdr + 12, src);
+        put32(hdr + 16, dst);
+        uint32_t sum = 0;
+        for (int i = 0; i < 20; i += 2){
+            sum += (hdr[i] << 8) | hdr[i + 1];
+        }
+        while (sum >> 16){
+            sum = (sum & 0xffff) + (sum >> 16);
+        }
+        sum = ~sum & 0xffff;
+        hdr[10] = sum >> 8;
+        hdr[11] = sum & 0xff;
+        // UDP header; the checksum is optional in IPv4
+        hdr[20] = hdr[22] = AOO_REPLAY_PORT >> 8;
+        hdr[21] = hdr[23] = AOO_REPLAY_PORT & 0xff;
+        hdr[24] = (len - 20) >> 8;
+        hdr[25] = (len - 20) & 0xff;
+
+        // enhanced packet block
+        uint32_t padded = (len + 3) & ~3;
+        uint32_t total = 32 + padded;
+        put<uint32_t>(6);
+        put<uint32_t>(total);
+        put<uint32_t>(0); // interface
+        put<uint32_t>(time >> 32);
+        put<uint32_t>(time & 0xffffffff);
+        put<uint32_t>(len); // captured length
+        put<uint32_t>(len); // original length
+        fwrite(hdr, sizeof(hdr), 1, fp_);
+        fwrite(data, size, 1, fp_);
+        uint8_t zero[4] = { 0 };
+        fwrite(zero, padded - len, 1, fp_);
+        put<uint32_t>(total);
+    }
+private:
+    template<typename T>
+    void put(T value){
+        fwrite(&value, sizeof(value), 1, fp_);
+    }
+
+    static void put32(uint8_t *p, uint32_t i){
+        p[0] = i >> 24;
+        p[1] = (i >> 16) & 0xff;
+        p[2] = (i >> 8) & 0xff;
+        p[3] = i & 0xff;
+    }
+
+    FILE *fp_;
+};
+
+// NTP time -> microseconds since the Unix epoch. Virtual clocks
+// (see aoo_opt_clock) might start at 0; such times are used as they are.
+static uint64_t ntp_to_unix_usec(uint64_t t){
+    if ((t >> 32) >= NTP_UNIX_OFFSET){
+        t -= NTP_UNIX_OFFSET << 32;
+    }
+    return (t >> 32) * 1000000 + (((t & 0xffffffff) * 1000000) >> 32);
+}
+
+static int capture_pcapng(aoo::capture_reader& reader, const char *outfile){
+    auto fp = fopen(outfile, "wb");
+    if (!fp){
+        fprintf(stderr, "couldn't open %s\n", outfile);
+        return EXIT_FAILURE;
+    }
+    pcapng_writer writer(fp);
+
+    const uint32_t local = 0x0A000001; // 10.0.0.1
+    uint64_t count = 0;
+    aoo::capture_record r;
+    const char *data;
+    while ((data = reader.read(r))){
+        if (r.is_process()){
+            continue;
+        }
+        writer.write(ntp_to_unix_usec(r.time),
+                     local + 1 + r.endpoint, local, data, r.size);
+        count++;
+    }
+    fclose(fp);
+
+    printf("wrote %llu packets to %s\n", (unsigned long long)count, outfile);
+    return EXIT_SUCCESS;
+}
+
+/*//////////////////////// main ////////////////////////*/
+
+static void usage(const char *name){
+    fprintf(stderr, "usage:\n"
+            "  %s info <capture>\n"
+            "  %s play <capture> [speed] [outfile]\n"
+            "  %s pcapng <capture> <outfile>\n", name, name, name);
+}
+
+int main(int argc, const char *argv[]){
+    if (argc < 3){
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *cmd = argv[1];
+
+    aoo_initialize();
+
+    auto reader = aoo::capture_reader::open(argv[2]);
+    if (!reader){
+        fprintf(stderr, "couldn't open capture %s\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    int result;
+    if (!strcmp(cmd, "info")){
+        result = capture_info(*reader);
+    } else if (!strcmp(cmd, "play")){
+        double speed = argc > 3 ? atof(argv[3]) : 0;
+        const char *outfile = argc > 4 ? argv[4] : nullptr;
+        result = capture_play(*reader, speed, outfile);
+    } else if (!strcmp(cmd, "pcapng") && argc > 3){
+        result = capture_pcapng(*reader, argv[3]);
+    } else {
+        usage(argv[0]);
+        result = EXIT_FAILURE;
+    }
+
+    reader.reset();
+    aoo_terminate();
+
+    return result;
+}
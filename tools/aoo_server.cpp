@@ -0,0 +1,159 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Standalone AOO connection server (POSIX only).
+//
+// Several instances can form a cluster: pass the address of this node
+// followed by the addresses of all other nodes, e.g. for three nodes
+// on the local machine:
+//
+//   aoo_server 9001 1 127.0.0.1:9001 127.0.0.1:9002 127.0.0.1:9003
+//   aoo_server 9002 1 127.0.0.1:9002 127.0.0.1:9001 127.0.0.1:9003
+//   aoo_server 9003 1 127.0.0.1:9003 127.0.0.1:9001 127.0.0.1:9002
+//
+// Clients can connect to any node; they are redirected to the node
+// which owns their user name.
+// The nodes authenticate each other with a shared secret, which is taken
+// from the AOO_CLUSTER_SECRET environment variable.
+//
+// build:
+//   c++ -std=c++14 -O2 -DAOO_STATIC -I../lib -I../lib/src -I../deps aoo_server.cpp
+//       ../lib/src/server.cpp ../lib/src/client.cpp ../lib/src/cluster.cpp
+//       ../lib/src/net_utils.cpp ../lib/src/common.cpp ../lib/src/codec_pcm.cpp
+//       ../lib/src/memory.cpp ../lib/src/sync.cpp ../lib/src/time.cpp
+//       ../deps/oscpack/osc/*.cpp ../deps/md5/md5.c -o aoo_server -lpthread
+//
+// usage:
+//   aoo_server <port> [numthreads] [self host:port] [other host:port...]
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_net.h"
+
+#include <unistd.h>
+#include <signal.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <thread>
+#include <atomic>
+
+static std::atomic<bool> quit{false};
+
+static void handle_signal(int){
+    quit = true;
+}
+
+static int32_t handle_events(void *, const aoo_event **events, int32_t n){
+    for (int i = 0; i < n; ++i){
+        switch (events[i]->type){
+        case AOONET_SERVER_USER_JOIN_EVENT:
+        case AOONET_SERVER_USER_LEAVE_EVENT:
+        {
+            auto e = (const aoonet_server_user_event *)events[i];
+            printf("user %s %s\n", e->name,
+                   e->type == AOONET_SERVER_USER_JOIN_EVENT ? "joined" : "left");
+            break;
+        }
+        case AOONET_SERVER_GROUP_JOIN_EVENT:
+        case AOONET_SERVER_GROUP_LEAVE_EVENT:
+        {
+            auto e = (const aoonet_server_group_event *)events[i];
+            printf("user %s %s group %s\n", e->user,
+                   e->type == AOONET_SERVER_GROUP_JOIN_EVENT ? "joined" : "left",
+                   e->group);
+            break;
+        }
+        case AOONET_SERVER_ERROR_EVENT:
+        {
+            auto e = (const aoonet_server_event *)events[i];
+            fprintf(stderr, "error: %s\n", e->errormsg);
+            break;
+        }
+        default:
+            break;
+        }
+    }
+    fflush(stdout);
+    return 1;
+}
+
+static bool parse_address(const char *s, std::string& host, int& port){
+    auto colon = strrchr(s, ':');
+    if (!colon){
+        return false;
+    }
+    host.assign(s, colon - s);
+    port = atoi(colon + 1);
+    return !host.empty() && port > 0;
+}
+
+int main(int argc, const char *argv[]){
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <port> [numthreads] [self host:port] "
+                "[other host:port...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[1]);
+    int numthreads = argc > 2 ? atoi(argv[2]) : 1;
+    if (port <= 0 || numthreads < 0){
+        fprintf(stderr, "bad arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    int32_t err;
+    auto server = aoonet_server_new(port, &err);
+    if (!server){
+        fprintf(stderr, "couldn't create server on port %d (%d)\n", port, err);
+        return EXIT_FAILURE;
+    }
+    aoonet_server_set_num_threads(server, numthreads);
+
+    if (argc > 4){
+        auto secret = getenv("AOO_CLUSTER_SECRET");
+        if (!secret || !*secret){
+            fprintf(stderr, "AOO_CLUSTER_SECRET must be set\n");
+            aoonet_server_free(server);
+            return EXIT_FAILURE;
+        }
+        aoonet_server_set_cluster_secret(server, secret);
+    }
+
+    for (int i = 3; i < argc; ++i){
+        std::string host;
+        int nodeport;
+        if (!parse_address(argv[i], host, nodeport)){
+            fprintf(stderr, "bad node address '%s'\n", argv[i]);
+            aoonet_server_free(server);
+            return EXIT_FAILURE;
+        }
+        // the first node is ourselves
+        aoonet_server_add_node(server, host.c_str(), nodeport, i == 3);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    printf("AOO server listening on port %d", port);
+    if (argc > 3){
+        printf(" (cluster of %d nodes)", argc - 3);
+    }
+    printf("\n");
+    fflush(stdout);
+
+    std::thread thread([&](){ aoonet_server_run(server); });
+
+    while (!quit){
+        aoonet_server_handle_events(server, handle_events, nullptr);
+        usleep(10000);
+    }
+
+    aoonet_server_quit(server);
+    thread.join();
+    aoonet_server_free(server);
+
+    return EXIT_SUCCESS;
+}
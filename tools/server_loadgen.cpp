@@ -0,0 +1,744 @@
+/* Copyright (c) 2010-Now Christof Ressi, Winfried Ritsch and others.
+ * For information on usage and redistribution, and for a DISCLAIMER OF ALL
+ * WARRANTIES, see the file, "LICENSE.txt," in this distribution.  */
+
+// Load generator for the AOO connection server (POSIX only).
+//
+// Opens many TCP clients to a running server on the local machine and
+// measures the login and group join throughput and the event loop latency
+// (= ping round trip time while all clients are connected).
+// Finally, the first member of each group sends a stream through the
+// server's relay and all other group members subscribe to it; this
+// measures the relay throughput in forwarded packets per second.
+//
+// To test a server cluster, pass the node addresses exactly like they are
+// passed to aoo_server, e.g. for the three node example in aoo_server.cpp:
+//
+//   server_loadgen 9001 300 10 10 1000 127.0.0.1:9001 127.0.0.1:9002 127.0.0.1:9003
+//
+// The clients connect to all nodes in turn and follow the login redirect to
+// the node which owns their user name. The load generator uses the same hash
+// ring as the servers and checks that every user ends up on its owning node,
+// that all group members see each other (= the group joins have been handled
+// by the group owner) and that relayed packets come from the group owner.
+// NOTE: relaying only works between users of the same node, so only the group
+// members which live on the group owner take part in the relay test.
+//
+// build:
+//   c++ -std=c++14 -O2 -DAOO_STATIC -I../lib -I../lib/src -I../deps
+//       server_loadgen.cpp ../lib/src/cluster.cpp ../lib/src/net_utils.cpp
+//       ../deps/oscpack/osc/*.cpp ../deps/md5/md5.c -o server_loadgen -lpthread
+//
+// usage:
+//   server_loadgen <port> [numclients] [numpings] [groupsize] [numpackets] [node host:port...]
+//
+// NOTE: you might have to increase the max. number of open files (ulimit -n).
+
+#include "aoo/aoo.h"
+#include "aoo/aoo_net.h"
+#include "SLIP.hpp"
+#include "cluster.hpp"
+
+#include "oscpack/osc/OscOutboundPacketStream.h"
+#include "oscpack/osc/OscReceivedElements.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#define MSG_SERVER_LOGIN \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_LOGIN
+
+#define MSG_SERVER_PING \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_PING
+
+#define MSG_CLIENT_LOGIN \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_LOGIN
+
+#define MSG_CLIENT_PING \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PING
+
+#define MSG_SERVER_GROUP_JOIN \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_GROUP AOONET_MSG_JOIN
+
+#define MSG_CLIENT_GROUP_JOIN \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_GROUP AOONET_MSG_JOIN
+
+#define MSG_CLIENT_PEER_JOIN \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_PEER AOONET_MSG_JOIN
+
+#define MSG_SERVER_RELAY_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_SERVER AOONET_MSG_RELAY AOONET_MSG_ADD
+
+#define MSG_CLIENT_RELAY_ADD \
+    AOO_MSG_DOMAIN AOONET_MSG_CLIENT AOONET_MSG_RELAY AOONET_MSG_ADD
+
+// the data message which is sent to the relay and the one we expect back
+#define MSG_RELAY_DATA \
+    AOO_MSG_DOMAIN AOO_MSG_SINK AOO_MSG_WILDCARD AOO_MSG_DATA
+
+#define MSG_RELAY_DATA_RECV \
+    AOO_MSG_DOMAIN AOO_MSG_SINK "/1" AOO_MSG_DATA
+
+// size of the (fake) audio data in each relay packet
+#define RELAY_DATA_SIZE 512
+
+// packets per publisher per round; larger bursts can
+// overflow the receive buffer of the server's UDP socket.
+#define RELAY_BURST 1
+
+using clock_type = std::chrono::steady_clock;
+
+static double elapsed_ms(clock_type::time_point t){
+    return std::chrono::duration<double, std::milli>(clock_type::now() - t).count();
+}
+
+struct node {
+    std::string host;
+    int port;
+    struct sockaddr_in address;
+};
+
+struct client {
+    int socket = -1;
+    int udpsocket = -1;
+    int udpport = 0;
+    int node = -1; // the node we're connected to
+    int home = -1; // the node which owns our user name
+    int peers = 0; // number of peer join notifications
+    std::string redirect_host;
+    int redirect_port = 0;
+    aoo::SLIP recvbuffer;
+    clock_type::time_point sendtime;
+    bool waiting = false;
+};
+
+static std::vector<node> nodes;
+static aoo::net::hash_ring ring;
+static int numredirects = 0;
+
+static int find_node(const std::string& host, int port){
+    for (size_t i = 0; i < nodes.size(); ++i){
+        if (nodes[i].host == host && nodes[i].port == port){
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static bool connect_node(client& c, int index, int node){
+    c.socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (c.socket < 0){
+        perror("socket");
+        return false;
+    }
+    int val = 1;
+    setsockopt(c.socket, IPPROTO_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
+    auto& sa = nodes[node].address;
+    if (connect(c.socket, (struct sockaddr *)&sa, sizeof(sa)) < 0){
+        fprintf(stderr, "client %d: connect to %s:%d failed (%s)\n", index,
+                nodes[node].host.c_str(), nodes[node].port, strerror(errno));
+        return false;
+    }
+    c.node = node;
+    c.recvbuffer.reset();
+    return true;
+}
+
+static bool send_packet(client& c, const char *data, int32_t size){
+    aoo::SLIP buf;
+    buf.setup(size * 2 + 2);
+    buf.write_packet((const uint8_t *)data, size);
+    uint8_t out[AOO_MAXPACKETSIZE * 2 + 2];
+    auto n = buf.read_bytes(out, sizeof(out));
+    int32_t sent = 0;
+    while (sent < n){
+        auto result = send(c.socket, out + sent, n - sent, 0);
+        if (result < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            return false;
+        }
+        sent += result;
+    }
+    c.sendtime = clock_type::now();
+    c.waiting = true;
+    return true;
+}
+
+static bool send_login(client& c, int index){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    std::string name = "loadgen_" + std::to_string(index);
+    msg << osc::BeginMessage(MSG_SERVER_LOGIN)
+        << name.c_str() << "loadgen" << "127.0.0.1" << (osc::int32)c.udpport
+        << "127.0.0.1" << (osc::int32)c.udpport << osc::EndMessage;
+    return send_packet(c, msg.Data(), (int32_t)msg.Size());
+}
+
+static bool send_group_join(client& c, int index){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    std::string name = "loadgen_group_" + std::to_string(index);
+    msg << osc::BeginMessage(MSG_SERVER_GROUP_JOIN)
+        << name.c_str() << "loadgen" << osc::EndMessage;
+    return send_packet(c, msg.Data(), (int32_t)msg.Size());
+}
+
+static bool send_relay_add(client& c, int group, int publisher){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    std::string groupname = "loadgen_group_" + std::to_string(group);
+    std::string username = "loadgen_" + std::to_string(publisher);
+    msg << osc::BeginMessage(MSG_SERVER_RELAY_ADD)
+        << groupname.c_str() << username.c_str() << (osc::int32)1 << osc::EndMessage;
+    return send_packet(c, msg.Data(), (int32_t)msg.Size());
+}
+
+static bool send_ping(client& c){
+    char buf[AOO_MAXPACKETSIZE];
+    osc::OutboundPacketStream msg(buf, sizeof(buf));
+    msg << osc::BeginMessage(MSG_SERVER_PING) << osc::EndMessage;
+    return send_packet(c, msg.Data(), (int32_t)msg.Size());
+}
+
+// receive data and return the round trip time when the expected
+// reply has arrived; -1: still waiting, -2: error
+static double receive_reply(client& c, const char *pattern){
+    uint8_t buf[AOO_MAXPACKETSIZE];
+    auto result = recv(c.socket, buf, sizeof(buf), 0);
+    if (result <= 0){
+        return -2;
+    }
+    c.recvbuffer.write_bytes(buf, (int32_t)result);
+    double rtt = -1;
+    while (true){
+        auto size = c.recvbuffer.read_packet(buf, sizeof(buf));
+        if (size <= 0){
+            break;
+        }
+        try {
+            osc::ReceivedPacket packet((const char *)buf, size);
+            osc::ReceivedMessage msg(packet);
+            if (!strcmp(msg.AddressPattern(), MSG_CLIENT_PEER_JOIN)){
+                c.peers++;
+                continue;
+            }
+            if (c.waiting && !strcmp(msg.AddressPattern(), pattern)){
+                if (!strcmp(pattern, MSG_CLIENT_LOGIN)
+                        && msg.ArgumentsBegin()->AsInt32() == 0){
+                    auto it = ++msg.ArgumentsBegin();
+                    auto errmsg = (it++)->AsString();
+                    if (msg.ArgumentCount() > 3){
+                        // redirected to another node of the cluster
+                        c.redirect_host = (it++)->AsString();
+                        c.redirect_port = (it++)->AsInt32();
+                        c.waiting = false;
+                        return -3;
+                    }
+                    fprintf(stderr, "login failed: %s\n", errmsg);
+                    return -2;
+                }
+                if (!strcmp(pattern, MSG_CLIENT_GROUP_JOIN)){
+                    auto it = ++msg.ArgumentsBegin();
+                    if ((it++)->AsInt32() == 0){
+                        fprintf(stderr, "group join failed: %s\n", it->AsString());
+                        return -2;
+                    }
+                }
+                if (!strcmp(pattern, MSG_CLIENT_RELAY_ADD)){
+                    auto it = msg.ArgumentsBegin();
+                    it++; it++; it++; // group, user, sink
+                    if ((it++)->AsInt32() == 0){
+                        fprintf(stderr, "relay subscription failed: %s\n", it->AsString());
+                        return -2;
+                    }
+                }
+                rtt = elapsed_ms(c.sendtime);
+                c.waiting = false;
+            }
+        } catch (const osc::Exception& e){
+            fprintf(stderr, "bad message: %s\n", e.what());
+        }
+    }
+    return rtt;
+}
+
+// reconnect to the node we've been redirected to and login again
+static bool follow_redirect(client& c, int index){
+    int node = find_node(c.redirect_host, c.redirect_port);
+    if (node < 0){
+        fprintf(stderr, "client %d: redirected to unknown node %s:%d\n",
+                index, c.redirect_host.c_str(), c.redirect_port);
+        return false;
+    }
+    if (node != c.home){
+        fprintf(stderr, "client %d: redirected to %s:%d, but the owner is %s:%d\n",
+                index, c.redirect_host.c_str(), c.redirect_port,
+                nodes[c.home].host.c_str(), nodes[c.home].port);
+        return false;
+    }
+    close(c.socket);
+    if (!connect_node(c, index, node) || !send_login(c, index)){
+        fprintf(stderr, "client %d: couldn't follow redirect\n", index);
+        return false;
+    }
+    numredirects++;
+    return true;
+}
+
+// wait until all clients got their reply
+static bool wait_for_replies(std::vector<client>& clients,
+                             std::vector<struct pollfd>& fds,
+                             const char *pattern, std::vector<double>& times)
+{
+    auto remaining = clients.size();
+    while (remaining > 0){
+        int result = poll(fds.data(), fds.size(), 5000);
+        if (result < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            return false;
+        } else if (result == 0){
+            fprintf(stderr, "timeout: %d replies missing\n", (int)remaining);
+            return false;
+        }
+        for (size_t i = 0; i < fds.size(); ++i){
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)){
+                auto rtt = receive_reply(clients[i], pattern);
+                if (rtt == -2){
+                    fprintf(stderr, "client %d: connection lost\n", (int)i);
+                    return false;
+                } else if (rtt == -3){
+                    if (!follow_redirect(clients[i], (int)i)){
+                        return false;
+                    }
+                    fds[i].fd = clients[i].socket;
+                } else if (rtt >= 0){
+                    times.push_back(rtt);
+                    remaining--;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+// wait until all clients have been introduced to the other group members
+static bool wait_for_peers(std::vector<client>& clients,
+                           std::vector<struct pollfd>& fds, int groupsize)
+{
+    int numclients = (int)clients.size();
+    auto expected = [&](int i){
+        int first = i - i % groupsize;
+        return std::min(groupsize, numclients - first) - 1;
+    };
+    while (true){
+        int missing = 0;
+        for (int i = 0; i < numclients; ++i){
+            if (clients[i].peers > expected(i)){
+                fprintf(stderr, "client %d: got %d peers, expected %d\n",
+                        i, clients[i].peers, expected(i));
+                return false;
+            }
+            missing += expected(i) - clients[i].peers;
+        }
+        if (missing == 0){
+            return true;
+        }
+        int result = poll(fds.data(), fds.size(), 5000);
+        if (result < 0){
+            if (errno == EINTR){
+                continue;
+            }
+            perror("poll");
+            return false;
+        } else if (result == 0){
+            fprintf(stderr, "timeout: %d peer notifications missing\n", missing);
+            return false;
+        }
+        for (size_t i = 0; i < fds.size(); ++i){
+            if (fds[i].revents & (POLLIN | POLLERR | POLLHUP)){
+                if (receive_reply(clients[i], "") == -2){
+                    fprintf(stderr, "client %d: connection lost\n", (int)i);
+                    return false;
+                }
+            }
+        }
+    }
+}
+
+// receive all pending relay packets; returns the number of valid packets
+// or -1 if a packet didn't come from the node which owns the group.
+static int receive_relay(client& c, int owner){
+    int count = 0;
+    char buf[AOO_MAXPACKETSIZE];
+    while (true){
+        struct sockaddr_in from;
+        socklen_t len = sizeof(from);
+        auto result = recvfrom(c.udpsocket, buf, sizeof(buf), 0,
+                               (struct sockaddr *)&from, &len);
+        if (result <= 0){
+            break;
+        }
+        auto& sa = nodes[owner].address;
+        if (from.sin_addr.s_addr != sa.sin_addr.s_addr || from.sin_port != sa.sin_port){
+            fprintf(stderr, "relay packet from %s:%d, but the group owner is %s:%d\n",
+                    inet_ntoa(from.sin_addr), ntohs(from.sin_port),
+                    nodes[owner].host.c_str(), nodes[owner].port);
+            return -1;
+        }
+        try {
+            osc::ReceivedPacket packet(buf, (osc::osc_bundle_element_size_t)result);
+            osc::ReceivedMessage msg(packet);
+            if (!strcmp(msg.AddressPattern(), MSG_RELAY_DATA_RECV)){
+                count++;
+            } else {
+                fprintf(stderr, "unexpected relay message %s\n", msg.AddressPattern());
+            }
+        } catch (const osc::Exception& e){
+            fprintf(stderr, "bad relay message: %s\n", e.what());
+        }
+    }
+    return count;
+}
+
+static void print_stats(const char *name, std::vector<double>& times){
+    if (times.empty()){
+        return;
+    }
+    std::sort(times.begin(), times.end());
+    double sum = 0;
+    for (auto& t : times){
+        sum += t;
+    }
+    auto percentile = [&](double p){
+        return times[std::min<size_t>(times.size() - 1, times.size() * p)];
+    };
+    printf("%s: avg %.3f ms, median %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           name, sum / times.size(), percentile(0.5), percentile(0.99), times.back());
+}
+
+int main(int argc, const char *argv[]){
+    if (argc < 2){
+        fprintf(stderr, "usage: %s <port> [numclients] [numpings] [groupsize] "
+                "[numpackets] [node host:port...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int port = atoi(argv[1]);
+    int numclients = argc > 2 ? atoi(argv[2]) : 1000;
+    int numpings = argc > 3 ? atoi(argv[3]) : 10;
+    int groupsize = argc > 4 ? atoi(argv[4]) : 10;
+    int numpackets = argc > 5 ? atoi(argv[5]) : 1000;
+    if (port <= 0 || numclients <= 0 || numpings < 0 || groupsize <= 0 || numpackets < 0){
+        fprintf(stderr, "bad arguments\n");
+        return EXIT_FAILURE;
+    }
+
+    if (argc > 6){
+        // server cluster
+        for (int i = 6; i < argc; ++i){
+            node n;
+            auto colon = strrchr(argv[i], ':');
+            if (colon){
+                n.host.assign(argv[i], colon - argv[i]);
+                n.port = atoi(colon + 1);
+            }
+            memset(&n.address, 0, sizeof(n.address));
+            n.address.sin_family = AF_INET;
+            n.address.sin_port = htons(colon ? n.port : 0);
+            if (!colon || n.port <= 0
+                    || inet_pton(AF_INET, n.host.c_str(), &n.address.sin_addr) != 1){
+                fprintf(stderr, "bad node address '%s' (must be IPv4 host:port)\n", argv[i]);
+                return EXIT_FAILURE;
+            }
+            // must be the same as in server::add_node()!
+            ring.add_node((int32_t)nodes.size(), n.host + ":" + std::to_string(n.port));
+            nodes.push_back(std::move(n));
+        }
+        if (find_node("127.0.0.1", port) < 0){
+            fprintf(stderr, "port %d is not in the node list\n", port);
+            return EXIT_FAILURE;
+        }
+    } else {
+        node n;
+        n.host = "127.0.0.1";
+        n.port = port;
+        memset(&n.address, 0, sizeof(n.address));
+        n.address.sin_family = AF_INET;
+        n.address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        n.address.sin_port = htons(port);
+        ring.add_node(0, n.host + ":" + std::to_string(n.port));
+        nodes.push_back(std::move(n));
+    }
+
+    // print results immediately, even when redirected
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    std::vector<client> clients(numclients);
+    std::vector<struct pollfd> fds(numclients);
+
+    // 1) connect; in a cluster, the clients are spread over all nodes
+    // and most of them will be redirected at login.
+    auto t0 = clock_type::now();
+    for (int i = 0; i < numclients; ++i){
+        auto& c = clients[i];
+        c.recvbuffer.setup(AOO_MAXPACKETSIZE * 4);
+        if (!connect_node(c, i, i % nodes.size())){
+            return EXIT_FAILURE;
+        }
+        c.home = ring.find("loadgen_" + std::to_string(i));
+        fds[i].fd = c.socket;
+        fds[i].events = POLLIN;
+        // UDP socket for relayed streams
+        c.udpsocket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (c.udpsocket < 0){
+            perror("socket");
+            return EXIT_FAILURE;
+        }
+        struct sockaddr_in local;
+        memset(&local, 0, sizeof(local));
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(local);
+        if (bind(c.udpsocket, (struct sockaddr *)&local, len) < 0
+                || getsockname(c.udpsocket, (struct sockaddr *)&local, &len) < 0){
+            perror("bind");
+            return EXIT_FAILURE;
+        }
+        c.udpport = ntohs(local.sin_port);
+        fcntl(c.udpsocket, F_SETFL, O_NONBLOCK);
+        int val = 1 << 20;
+        setsockopt(c.udpsocket, SOL_SOCKET, SO_RCVBUF, (char *)&val, sizeof(val));
+    }
+    double connecttime = elapsed_ms(t0);
+    printf("connected %d clients in %.3f ms (%.1f/s)\n",
+           numclients, connecttime, numclients * 1000.0 / connecttime);
+
+    // 2) login
+    std::vector<double> times;
+    t0 = clock_type::now();
+    for (int i = 0; i < numclients; ++i){
+        if (!send_login(clients[i], i)){
+            fprintf(stderr, "client %d: couldn't send login\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!wait_for_replies(clients, fds, MSG_CLIENT_LOGIN, times)){
+        return EXIT_FAILURE;
+    }
+    double logintime = elapsed_ms(t0);
+    printf("logged in %d clients in %.3f ms (%.1f/s)\n",
+           numclients, logintime, numclients * 1000.0 / logintime);
+    print_stats("login latency", times);
+    // every user must live on the node which owns its name
+    for (int i = 0; i < numclients; ++i){
+        auto& c = clients[i];
+        if (c.node != c.home){
+            fprintf(stderr, "client %d: logged in on %s:%d, but the owner is %s:%d\n",
+                    i, nodes[c.node].host.c_str(), nodes[c.node].port,
+                    nodes[c.home].host.c_str(), nodes[c.home].port);
+            return EXIT_FAILURE;
+        }
+    }
+    if (nodes.size() > 1){
+        printf("%d clients redirected to their owning node\n", numredirects);
+    }
+
+    // 3) group join
+    times.clear();
+    t0 = clock_type::now();
+    for (int i = 0; i < numclients; ++i){
+        if (!send_group_join(clients[i], i / groupsize)){
+            fprintf(stderr, "client %d: couldn't send group join\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!wait_for_replies(clients, fds, MSG_CLIENT_GROUP_JOIN, times)){
+        return EXIT_FAILURE;
+    }
+    double jointime = elapsed_ms(t0);
+    printf("%d clients joined %d groups in %.3f ms (%.1f/s)\n",
+           numclients, (numclients + groupsize - 1) / groupsize,
+           jointime, numclients * 1000.0 / jointime);
+    print_stats("group join latency", times);
+    // all group members must be introduced to each other; this only
+    // works if the group joins have been handled by the group owner.
+    if (!wait_for_peers(clients, fds, groupsize)){
+        return EXIT_FAILURE;
+    }
+    printf("all group members have met\n");
+
+    // 4) ping: all clients send at the same time, so the server
+    // has to go through the whole client list for each round.
+    times.clear();
+    for (int k = 0; k < numpings; ++k){
+        for (auto& c : clients){
+            if (!send_ping(c)){
+                fprintf(stderr, "couldn't send ping\n");
+                return EXIT_FAILURE;
+            }
+        }
+        if (!wait_for_replies(clients, fds, MSG_CLIENT_PING, times)){
+            return EXIT_FAILURE;
+        }
+    }
+    print_stats("ping latency (all clients)", times);
+
+    // a single client while all the others are idle
+    times.clear();
+    for (int k = 0; k < numpings * 10; ++k){
+        if (!send_ping(clients[k % numclients])){
+            fprintf(stderr, "couldn't send ping\n");
+            return EXIT_FAILURE;
+        }
+        auto& c = clients[k % numclients];
+        auto fd = fds[k % numclients];
+        while (c.waiting){
+            if (poll(&fd, 1, 5000) <= 0){
+                fprintf(stderr, "timeout\n");
+                return EXIT_FAILURE;
+            }
+            auto rtt = receive_reply(c, MSG_CLIENT_PING);
+            if (rtt == -2){
+                fprintf(stderr, "connection lost\n");
+                return EXIT_FAILURE;
+            } else if (rtt >= 0){
+                times.push_back(rtt);
+            }
+        }
+    }
+    print_stats("ping latency (single client)", times);
+
+    // 5) relay: the first member of each group publishes a stream,
+    // all other members subscribe to it. In a cluster, only the members
+    // which live on the group owner take part (see above).
+    int numgroups = (numclients + groupsize - 1) / groupsize;
+    std::vector<int> publishers(numgroups, -1);
+    std::vector<int> numsubscribers(numgroups, 0);
+    std::vector<int> subscriberindex;
+    for (int i = 0; i < numclients; ++i){
+        int g = i / groupsize;
+        if (clients[i].home != ring.find("loadgen_group_" + std::to_string(g))){
+            continue;
+        }
+        if (publishers[g] < 0){
+            publishers[g] = i;
+        } else {
+            if (!send_relay_add(clients[i], g, publishers[g])){
+                fprintf(stderr, "client %d: couldn't send relay subscription\n", i);
+                return EXIT_FAILURE;
+            }
+            subscriberindex.push_back(i);
+            numsubscribers[g]++;
+        }
+    }
+    if (subscriberindex.empty() || numpackets == 0){
+        printf("no relay subscribers\n");
+    } else {
+        // wait for the subscription replies
+        for (auto i : subscriberindex){
+            auto& c = clients[i];
+            auto fd = fds[i];
+            while (c.waiting){
+                if (poll(&fd, 1, 5000) <= 0){
+                    fprintf(stderr, "timeout\n");
+                    return EXIT_FAILURE;
+                }
+                if (receive_reply(c, MSG_CLIENT_RELAY_ADD) == -2){
+                    fprintf(stderr, "connection lost\n");
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        printf("%d clients subscribed to %d publishers\n", (int)subscriberindex.size(),
+               (int)std::count_if(numsubscribers.begin(), numsubscribers.end(),
+                                  [](int n){ return n > 0; }));
+
+        std::vector<struct pollfd> udpfds;
+        for (auto i : subscriberindex){
+            struct pollfd fd;
+            fd.fd = clients[i].udpsocket;
+            fd.events = POLLIN;
+            udpfds.push_back(fd);
+        }
+
+        // fake data packet
+        char data[RELAY_DATA_SIZE];
+        memset(data, 0, sizeof(data));
+        char buf[AOO_MAXPACKETSIZE];
+
+        int64_t expected = 0;
+        int64_t received = 0;
+        t0 = clock_type::now();
+        for (int seq = 0; seq < numpackets; ){
+            // each publisher sends a burst of packets
+            int n = std::min(RELAY_BURST, numpackets - seq);
+            for (int k = 0; k < n; ++k, ++seq){
+                for (int g = 0; g < numgroups; ++g){
+                    if (numsubscribers[g] == 0){
+                        continue;
+                    }
+                    auto& pub = clients[publishers[g]];
+                    osc::OutboundPacketStream msg(buf, sizeof(buf));
+                    // <src> <salt> <seq> <sr> <channel> <totalsize> <nframes> <frame> <data>
+                    msg << osc::BeginMessage(MSG_RELAY_DATA)
+                        << (osc::int32)1 << (osc::int32)0 << (osc::int32)seq
+                        << (double)48000 << (osc::int32)0 << (osc::int32)sizeof(data)
+                        << (osc::int32)1 << (osc::int32)0
+                        << osc::Blob(data, sizeof(data)) << osc::EndMessage;
+                    // the publisher and the group owner live on the same node
+                    auto& sa = nodes[pub.home].address;
+                    sendto(pub.udpsocket, msg.Data(), msg.Size(), 0,
+                           (struct sockaddr *)&sa, sizeof(sa));
+                    expected += numsubscribers[g];
+                }
+            }
+            // receive until we got everything or the relay stalls
+            while (received < expected){
+                int result = poll(udpfds.data(), udpfds.size(), 100);
+                if (result <= 0){
+                    break; // lost packets
+                }
+                for (size_t j = 0; j < udpfds.size(); ++j){
+                    if (udpfds[j].revents & POLLIN){
+                        auto& c = clients[subscriberindex[j]];
+                        auto count = receive_relay(c, c.home);
+                        if (count < 0){
+                            return EXIT_FAILURE;
+                        }
+                        received += count;
+                    }
+                }
+            }
+        }
+        double relaytime = elapsed_ms(t0);
+        printf("relayed %lld of %lld packets in %.3f ms (%.1f packets/s, %.2f%% lost)\n",
+               (long long)received, (long long)expected, relaytime,
+               received * 1000.0 / relaytime,
+               expected > 0 ? (expected - received) * 100.0 / expected : 0.0);
+    }
+
+    for (auto& c : clients){
+        close(c.socket);
+        close(c.udpsocket);
+    }
+
+    return EXIT_SUCCESS;
+}